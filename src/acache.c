@@ -3,6 +3,10 @@
  * acache takes two arguments, the fd of a pipe from AD and of a pipe to AD
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE   /* for mremap */
+#endif /* __linux__ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,6 +17,7 @@
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "lib/packet.h"
 #include "lib/mgmt.h"
@@ -38,6 +43,15 @@ static struct ack_entry * acks = NULL;
 static int ack_space = 0;
 static int save_ack_pos = 0;  /* save the next ack at this index */
 
+/* open-addressing hash index into acks, by message_ack.
+ * each slot holds an index into acks plus one, or 0 if the slot is empty.
+ * the index is not saved, but rebuilt when the acks are read */
+static int * acks_by_ack = NULL;
+static unsigned int ack_index_mask = 0;  /* index size is a power of two */
+/* acks are chosen by whoever sends them, so they are hashed with a
+ * random key, and cannot be chosen to all land in the same slots */
+static char ack_hash_key [SIPHASH_KEY_SIZE];
+
 struct hash_entry {
   struct hash_entry * next_by_hash;  /* this one also used for free list */
   struct hash_entry * next_by_source;
@@ -180,6 +194,88 @@ static void read_ack_data (int fd)
   read_at_pos (fd, (char *) acks, sizeof (struct ack_entry) * ack_space, 0);
 }
 
+static unsigned int ack_hash (const char * ack)
+{
+  return ((unsigned int) siphash24 (ack_hash_key, ack, MESSAGE_ID_SIZE)) &
+         ack_index_mask;
+}
+
+static int ack_is_zero (const char * ack)
+{
+  static const char zero [MESSAGE_ID_SIZE];   /* all zeros */
+  return (memcmp (ack, zero, MESSAGE_ID_SIZE) == 0);
+}
+
+static void ack_index_add (int index)
+{
+  unsigned int slot = ack_hash (acks [index].message_ack);
+  while (acks_by_ack [slot] != 0)
+    slot = (slot + 1) & ack_index_mask;
+  acks_by_ack [slot] = index + 1;
+}
+
+/* returns the index plus one of the ack, or 0 if not found */
+static int ack_index_find (const char * ack)
+{
+  if ((acks_by_ack == NULL) || (ack_is_zero (ack)))
+    return 0;
+  unsigned int slot = ack_hash (ack);
+  while (acks_by_ack [slot] != 0) {
+    int index = acks_by_ack [slot] - 1;
+    if (memcmp (acks [index].message_ack, ack, MESSAGE_ID_SIZE) == 0)
+      return index + 1;
+    slot = (slot + 1) & ack_index_mask;
+  }
+  return 0;
+}
+
+/* must be called before acks [index] is overwritten */
+static void ack_index_remove (int index)
+{
+  unsigned int slot = ack_hash (acks [index].message_ack);
+  while (acks_by_ack [slot] != index + 1) {
+    if (acks_by_ack [slot] == 0)
+      return;   /* not in the index */
+    slot = (slot + 1) & ack_index_mask;
+  }
+  /* shift back any later entries that can no longer be reached */
+  unsigned int hole = slot;
+  slot = (slot + 1) & ack_index_mask;
+  while (acks_by_ack [slot] != 0) {
+    unsigned int home = ack_hash (acks [acks_by_ack [slot] - 1].message_ack);
+    if (((slot - home) & ack_index_mask) >= ((slot - hole) & ack_index_mask)) {
+      acks_by_ack [hole] = acks_by_ack [slot];
+      hole = slot;
+    }
+    slot = (slot + 1) & ack_index_mask;
+  }
+  acks_by_ack [hole] = 0;
+}
+
+static void ack_index_update (int index, int add)
+{
+  if (ack_is_zero (acks [index].message_ack))
+    return;   /* empty entries are not in the index */
+  if (add)
+    ack_index_add (index);
+  else
+    ack_index_remove (index);
+}
+
+static void init_ack_index (unsigned int max_acks)
+{
+  random_bytes (ack_hash_key, sizeof (ack_hash_key));
+  unsigned int size = 16;
+  while (size < 2 * max_acks)   /* keep the index at most half full */
+    size *= 2;
+  ack_index_mask = size - 1;
+  acks_by_ack = malloc_or_fail (size * sizeof (int), "acache acks_by_ack");
+  memset (acks_by_ack, 0, size * sizeof (int));
+  unsigned int i;
+  for (i = 0; i < max_acks; i++)
+    ack_index_update (i, 1);
+}
+
 static void init_acks (int fd, unsigned int max_acks)
 {
   unsigned int ack_size = sizeof (struct ack_entry);
@@ -203,27 +299,26 @@ static void init_acks (int fd, unsigned int max_acks)
     if (memcmp (acks [i].message_id, empty.message_id, MESSAGE_ID_SIZE) == 0)
       save_ack_pos = i;  /* lowest-numbered (so far) empty ack position */
   }
+  init_ack_index (max_acks);
 }
 
+/* returns the index plus one of the ack, or 0 if not found */
 static int ack_found (char * ack)
 {
-  int i;
-  for (i = 0; i < ack_space; i++) {
-    if (memcmp (acks [i].message_ack, ack, MESSAGE_ID_SIZE) == 0) {
-      return i + 1;
-    }
-  }
-  return 0;
+  return ack_index_find (ack);
 }
 
 static int ack_add (char * ack, char * id, int ack_fd)
 {
   if (ack_found (ack))
     return 0;  /* not new */
+  ack_index_update (save_ack_pos, 0);
   memcpy (acks [save_ack_pos].message_ack, ack, MESSAGE_ID_SIZE);
   memcpy (acks [save_ack_pos].message_id , id , MESSAGE_ID_SIZE);
+  ack_index_update (save_ack_pos, 1);
   /* clear the next location, to mark it in the file */
   int next_ack = (save_ack_pos + 1) % ack_space;
+  ack_index_update (next_ack, 0);
   memset (&(acks [next_ack]), 0, sizeof (struct ack_entry));
   save_ack_data (ack_fd, 0);
   save_ack_pos = next_ack;
@@ -253,6 +348,144 @@ struct message_entry_do_not_use {
 
 #define MAX_MESSAGE_ENTRY_SIZE	(MESSAGE_ENTRY_HEADER_SIZE + ALLNET_MTU)
 
+/* the message file is normally mapped into memory, so that messages
+ * are accessed in place rather than with lseek and read or write.
+ * if mmap fails, the msg_ functions use read_at_pos and write_at_pos.
+ * the mapping may extend past the end of the file, but only the part
+ * up to msg_file_size is ever accessed */
+static char * msg_map = NULL;        /* NULL if not mapped */
+static int msg_map_fd = -1;          /* the file that is mapped */
+static uint64_t msg_map_length = 0;  /* number of bytes mapped */
+static uint64_t msg_file_size = 0;   /* size of the file, if mapped */
+
+static uint64_t round_to_pages (uint64_t size)
+{
+  uint64_t page = (uint64_t) sysconf (_SC_PAGESIZE);
+  return ((size + page - 1) / page) * page;
+}
+
+static void msg_unmap ()
+{
+  if (msg_map != NULL)
+    munmap (msg_map, msg_map_length);
+  msg_map = NULL;
+  msg_map_fd = -1;
+  msg_map_length = 0;
+  msg_file_size = 0;
+}
+
+/* map enough of the file that it should not have to be remapped
+ * as long as it stays near max_size */
+static void msg_map_init (int fd, unsigned int max_size)
+{
+  msg_unmap ();
+  uint64_t size = fd_size_or_zero (fd);
+  uint64_t length = ((size > max_size) ? size : max_size);
+  length = round_to_pages (length + MAX_MESSAGE_ENTRY_SIZE);
+  void * map = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    snprintf (alog->b, alog->s, "unable to map %" PRIu64 " bytes of fd %d\n",
+              length, fd);
+    log_error (alog, "acache mmap");
+    return;   /* use read and write instead */
+  }
+  msg_map = map;
+  msg_map_fd = fd;
+  msg_map_length = length;
+  msg_file_size = size;
+}
+
+/* make sure at least size bytes are mapped.  Returns 1 for success,
+ * 0 if the file is no longer mapped */
+static int msg_map_ensure (uint64_t size)
+{
+  if (size <= msg_map_length)
+    return 1;
+  uint64_t length = round_to_pages (size + size / 2);
+  void * map;
+#ifdef __linux__
+  map = mremap (msg_map, msg_map_length, length, MREMAP_MAYMOVE);
+#else /* __linux__ */
+  munmap (msg_map, msg_map_length);
+  map = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, msg_map_fd, 0);
+#endif /* __linux__ */
+  if (map == MAP_FAILED) {
+    snprintf (alog->b, alog->s, "unable to remap %" PRIu64 " bytes\n", length);
+    log_error (alog, "acache mremap");
+#ifdef __linux__
+    munmap (msg_map, msg_map_length);  /* mremap leaves the old mapping */
+#endif /* __linux__ */
+    msg_map = NULL;
+    msg_map_fd = -1;
+    msg_map_length = 0;
+    return 0;
+  }
+  msg_map = map;
+  msg_map_length = length;
+  return 1;
+}
+
+static long long int msg_size (int fd)
+{
+  if ((msg_map != NULL) && (fd == msg_map_fd))
+    return (long long int) msg_file_size;
+  return (long long int) fd_size_or_zero (fd);
+}
+
+/* sets *data to point to up to max bytes of the file at position, and
+ * returns the number of bytes available there.  If the file is mapped,
+ * *data points into the mapping, otherwise the bytes are read into buffer */
+static int msg_read (int fd, char * buffer, int64_t max, int64_t position,
+                     char ** data)
+{
+  if ((msg_map != NULL) && (fd == msg_map_fd)) {
+    if ((position < 0) || ((uint64_t) position >= msg_file_size))
+      return 0;
+    if ((uint64_t) (position + max) > msg_file_size)
+      max = msg_file_size - position;
+    *data = msg_map + position;
+    return (int)max;
+  }
+  *data = buffer;
+  return read_at_pos (fd, buffer, max, position);
+}
+
+static void msg_write (int fd, char * data, int dsize, int64_t position)
+{
+  if ((msg_map != NULL) && (fd == msg_map_fd)) {
+    uint64_t end = position + dsize;
+    if (end > msg_file_size) {   /* grow the file */
+      if (ftruncate (fd, end) != 0) {
+        snprintf (alog->b, alog->s,
+                  "acache unable to grow file to %" PRIu64 "\n", end);
+        log_error (alog, "acache msg_write ftruncate");
+        return;
+      }
+      msg_file_size = end;
+    }
+    if (msg_map_ensure (end)) {
+      memcpy (msg_map + position, data, dsize);
+      return;
+    }  /* else no longer mapped, write instead */
+  }
+  write_at_pos (fd, data, dsize, position);
+}
+
+static void msg_truncate (int fd, uint64_t max_size, char * caller)
+{
+  truncate_to_size (fd, max_size, caller);
+  if ((msg_map != NULL) && (fd == msg_map_fd) && (msg_file_size > max_size))
+    msg_file_size = max_size;
+}
+
+/* save to disk any changes to the message file */
+static void msg_sync (int fd)
+{
+  if ((msg_map != NULL) && (fd == msg_map_fd) && (msg_file_size > 0))
+    msync (msg_map, msg_file_size, MS_SYNC);
+  fsync (fd);
+}
+
 struct request_details {
   int src_nbits; /* limited to at most 16 */
   unsigned char source [ADDRESS_SIZE];
@@ -490,11 +723,12 @@ static int64_t get_next_message (int fd, unsigned int max_size,
   if (position < 0)
     return -1;
   unsigned int original_max_size = max_size;
-  if (max_size > fd_size (fd))
-    max_size = (unsigned int)fd_size (fd);
+  if (max_size > msg_size (fd))
+    max_size = (unsigned int)msg_size (fd);
   while (position < max_size) {
-    static char buffer [MAX_MESSAGE_ENTRY_SIZE];
-    memset (buffer, 0, sizeof (buffer));
+    /* static makes it OK to set message to point into here */
+    static char read_buffer [MAX_MESSAGE_ENTRY_SIZE];
+    char * buffer = read_buffer;
     unsigned int rsize = MAX_MESSAGE_ENTRY_SIZE;
     if (rsize > (max_size - (unsigned int)position)) /* position < max_size */
       rsize = max_size - (unsigned int)position;
@@ -503,10 +737,10 @@ static int64_t get_next_message (int fd, unsigned int max_size,
               MESSAGE_ENTRY_HEADER_SIZE);
       return -1;
     }
-    int r = read_at_pos (fd, buffer, rsize, position);
+    int r = msg_read (fd, read_buffer, rsize, position, &buffer);
     if (r <= MESSAGE_ENTRY_HEADER_SIZE) { /* unable to read */
       printf ("get_next_message r %d rsize %d pos %" PRId64 " max %u fd %lld\n",
-              r, rsize, position, max_size, fd_size (fd));
+              r, rsize, position, max_size, msg_size (fd));
 #ifdef DEBUG_PRINT
       snprintf (alog->b, alog->s, "get_next_message r %d\n", r);
       log_print (alog);
@@ -518,13 +752,13 @@ static int64_t get_next_message (int fd, unsigned int max_size,
         (found_size > (int)rsize - MESSAGE_ENTRY_HEADER_SIZE)) {
       /* unknown size */
       printf ("get_next_message found %d at %" PRId64 " (%d/%lld/%d/%u/%u)\n",
-              found_size, position, r, fd_size (fd), rsize, max_size,
+              found_size, position, r, msg_size (fd), rsize, max_size,
               original_max_size);
       print_buffer (buffer, r, "data", 60, 1);
 #ifdef DEBUG_PRINT
       snprintf (alog->b, alog->s,
                 "get_next_message found %d at %" PRId64 " (%d/%lld/%d/%u/%u)\n",
-                found_size, position, r, fd_size (fd), rsize, max_size,
+                found_size, position, r, msg_size (fd), rsize, max_size,
                 original_max_size);
       log_print (alog);
       buffer_to_string (buffer, r, "data", 16, 0, alog->b, alog->s);
@@ -695,10 +929,12 @@ static uint32_t hash_index (char * id)
   return (id_value / hash_div);
 }
 
+static long long int gc_live_size (int fd);
+
 static int hash_has_space (unsigned int max_size, unsigned int new_size, int fd)
 {
   return ((message_hash_free != NULL) &&
-          (fd_size_or_zero (fd) + new_size <= max_size));
+          (gc_live_size (fd) + new_size <= max_size));
 }
 
 static void hash_add_message (char * message, unsigned int msize, char * id,
@@ -849,13 +1085,14 @@ static int64_t assign_matching (struct hash_entry * matching, int fd, int fsize,
   if (matching == NULL)
     return -1;
   /* static makes it OK to set message to point into here */
-  static char data [MAX_MESSAGE_ENTRY_SIZE];
+  static char read_buffer [MAX_MESSAGE_ENTRY_SIZE];
+  char * data = read_buffer;
   if (matching->file_position >= fsize)
     return -1;
-  int64_t rsize = sizeof (data);
+  int64_t rsize = sizeof (read_buffer);
   if (matching->file_position + rsize > fsize)
     rsize = fsize - matching->file_position;
-  int r = read_at_pos (fd, data, rsize, matching->file_position);
+  int r = msg_read (fd, read_buffer, rsize, matching->file_position, &data);
   if (r <= MESSAGE_ENTRY_HEADER_SIZE)
     return -1;
   int found_msize = readb16 (data + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET);
@@ -900,9 +1137,27 @@ static int64_t hash_get_next (int fd, int max, int64_t pos, char * hash,
                           id_off, priority, time);
 }
 
+/* the position of a scan through the hash table.  Only the index and the
+ * number of entries already seen in that chain are saved, so a scan may
+ * be resumed safely after entries are added or removed, though some
+ * entries may then be skipped or returned twice */
+struct hash_cursor {
+  int first_index;   /* the scan ends when it gets back here */
+  int index;         /* -1 when the scan is done */
+  int skip;          /* entries already seen in the chain at index */
+};
+
+static void hash_cursor_start (struct hash_cursor * cursor)
+{
+  cursor->first_index = (int)random_int (0, hash_size - 1);
+  cursor->index = cursor->first_index;
+  cursor->skip = 0;
+}
+
 /* returns 1 if successful, 0 if we already returned all matching entries. */
-/* first_call should only be set on the first call in a loop */
-static int hash_next_match (int fd, unsigned int max_size, int first_call,
+/* the cursor must be initialized by hash_cursor_start */
+static int hash_next_match (int fd, unsigned int max_size,
+                            struct hash_cursor * cursor,
                             struct request_details * rd,
                             char ** message, int * msize)
 {
@@ -910,53 +1165,26 @@ static int hash_next_match (int fd, unsigned int max_size, int first_call,
     debug_message_is_null ("hash_next_match", "");
     return 0;  /* not initialized */
   }
-  static int persistent_index = -1;
-  static struct hash_entry * persistent_entry = NULL;
-  static int first_index = -1;
-#ifdef ALLNET_USE_THREADS  /* synchronize, otherwise persistent_entry sometimes
-                              becomes NULL when we expect it not to be */
-  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  pthread_mutex_lock (&mutex);
-#endif /* ALLNET_USE_THREADS */
-  if (first_call) {
-    persistent_index = (int)random_int (0, hash_size - 1);
-    persistent_entry = message_hash_table [persistent_index];
-    first_index = persistent_index;
-  } else if (persistent_index < 0) { /* already done */
-#ifdef ALLNET_USE_THREADS
-    pthread_mutex_unlock (&mutex);
-#endif /* ALLNET_USE_THREADS */
-    return 0;
-  }
+  if ((cursor->index < 0) || (cursor->index >= hash_size))
+    return 0;  /* already done, or the hash table has changed */
   while (1) {
-    if (persistent_entry == NULL) { /* find the next available entry, if any */
-      persistent_index = (persistent_index + 1) % hash_size;
-      while ((persistent_index != first_index) &&
-             (message_hash_table [persistent_index] == NULL))
-        persistent_index = (persistent_index + 1) % hash_size;
-      if (persistent_index == first_index) {  /* nothing found */
-        persistent_index = -1;
-        persistent_entry = NULL;
-#ifdef ALLNET_USE_THREADS
-        pthread_mutex_unlock (&mutex);
-#endif /* ALLNET_USE_THREADS */
+    struct hash_entry * entry = message_hash_table [cursor->index];
+    int i;
+    for (i = 0; (entry != NULL) && (i < cursor->skip); i++)
+      entry = entry->next_by_hash;
+    if (entry == NULL) { /* find the next available entry, if any */
+      cursor->skip = 0;
+      cursor->index = (cursor->index + 1) % hash_size;
+      while ((cursor->index != cursor->first_index) &&
+             (message_hash_table [cursor->index] == NULL))
+        cursor->index = (cursor->index + 1) % hash_size;
+      if (cursor->index == cursor->first_index) {  /* nothing found */
+        cursor->index = -1;
         return 0;
       }
-      persistent_entry = message_hash_table [persistent_index];
+      continue;
     }
-    if (persistent_entry == NULL) { /* this is an error! */
-      snprintf (alog->b, alog->s,
-                "error: persistent_entry is NULL, %d %d %p\n",
-                persistent_index, first_index, persistent_entry);
-      printf ("%s", alog->b);
-      log_print (alog);
-#ifdef ALLNET_USE_THREADS
-      pthread_mutex_unlock (&mutex);
-#endif /* ALLNET_USE_THREADS */
-      return 0;
-    }
-    struct hash_entry * entry = persistent_entry;
-    persistent_entry = entry->next_by_hash;   /* may be null */
+    cursor->skip++;
     char ptime [ALLNET_TIME_SIZE];
     int64_t found = assign_matching (entry, fd, max_size, message, msize,
                                      NULL, NULL, ptime);
@@ -967,18 +1195,8 @@ static int hash_next_match (int fd, unsigned int max_size, int first_call,
       continue;   /* try again with the next entry */
     if (! is_valid_message (*message, *msize, NULL))
       continue;   /* message may have expired, try again with the next entry */
-#ifdef ALLNET_USE_THREADS
-    pthread_mutex_unlock (&mutex);
-#endif /* ALLNET_USE_THREADS */
     return 1;  /* found */
   }
-#if 0  /* after infinite loop, so, never executed */
-#ifdef ALLNET_USE_THREADS
-  pthread_mutex_unlock (&mutex);
-#endif /* ALLNET_USE_THREADS */
-  printf ("control flow error in acache\n");
-  return 0;  /* should never be executed */
-#endif /* 0 */
 }
 
 /* returns 1 if this message is ready to be deleted, 0 otherwise */
@@ -1032,63 +1250,157 @@ static int delete_gc_message (char * message, unsigned int msize,
   return 0;
 }
 
-static void gc (int fd, unsigned int max_size)
+/* gc is incremental: a gc pass moves each message that is kept to
+ * gc_write_position, starting from the beginning of the file, and
+ * each call to gc_step only reads up to GC_EXTENT_SIZE bytes of the file
+ * starting at gc_read_position.  Between steps, the hole between the
+ * two positions is covered by deleted entries, so the file stays valid,
+ * and new messages are appended to the end of the file as usual.
+ * When the pass reaches the end of the file, the file is truncated */
+#define GC_EXTENT_SIZE		(64 * 1024)
+/* start a gc pass when the file is within 1/GC_START_FRACTION of max_size */
+#define GC_START_FRACTION	8
+/* at most this many gc steps when saving a single message */
+#define GC_MAX_SAVE_STEPS	4
+
+static int64_t gc_read_position = -1;   /* -1 if no gc pass in progress */
+static int64_t gc_write_position = 0;
+static unsigned int gc_size = 0;       /* for delete_gc_message */
+static int gc_copied = 0;
+static int gc_deleted = 0;
+
+static int gc_in_progress ()
 {
-  unsigned int gc_size = max_size;
-  unsigned int actual_size = (unsigned int)fd_size_or_zero (fd);
+  return (gc_read_position >= 0);
+}
+
+/* the number of bytes in the file, not counting the gc hole */
+static long long int gc_live_size (int fd)
+{
+  long long int result = msg_size (fd);
+  if (gc_in_progress ())
+    result -= (gc_read_position - gc_write_position);
+  return result;
+}
+
+/* mark everything between the write and the read positions as deleted */
+static void gc_cover_hole (int fd)
+{
+  int64_t position = gc_write_position;
+  while (position < gc_read_position) {
+    int64_t hole = gc_read_position - position;
+    int64_t entry = hole;
+    if (entry > MAX_MESSAGE_ENTRY_SIZE)
+      entry = MAX_MESSAGE_ENTRY_SIZE;
+    /* the next entry must hold at least a header and one byte */
+    if ((hole > entry) && (hole - entry <= MESSAGE_ENTRY_HEADER_SIZE))
+      entry = hole - (MESSAGE_ENTRY_HEADER_SIZE + 1);
+    char header [MESSAGE_ENTRY_HEADER_SIZE];
+    memset (header, 0, sizeof (header));   /* id_off 0 means deleted */
+    writeb16 (header + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET,
+              (uint16_t) (entry - MESSAGE_ENTRY_HEADER_SIZE));
+    msg_write (fd, header, MESSAGE_ENTRY_HEADER_SIZE, position);
+    position += entry;
+  }
+}
+
+static void gc_start (int fd, unsigned int max_size)
+{
+  if (gc_in_progress ())
+    return;
+  unsigned int actual_size = (unsigned int)msg_size (fd);
+  gc_size = max_size;
   if (gc_size > actual_size)
     gc_size = actual_size;
-  int copied = 0, deleted = 0;
-  int64_t read_position = 0;
-  int64_t write_position = 0;
+  gc_read_position = 0;
+  gc_write_position = 0;
+  gc_copied = 0;
+  gc_deleted = 0;
+}
+
+static void gc_finish (int fd)
+{
+  msg_truncate (fd, gc_write_position, "gc");
+  msg_sync (fd);
+  gc_read_position = -1;
+#ifdef DEBUG_PRINT
+  printf ("end of gc, %d copied, %d deleted\n", gc_copied, gc_deleted);
+  snprintf (alog->b, alog->s, "%d copied, %d deleted, ",
+            gc_copied, gc_deleted);
+  log_print (alog);
+#endif /* DEBUG_PRINT */
+  /* messages may have been removed after being copied, so the count
+   * need not match */
+  print_stats (0, -1, "gc");
+}
+
+/* one step of gc, starting a new pass if none is in progress */
+static void gc_step (int fd, unsigned int max_size)
+{
+  gc_start (fd, max_size);
+  int64_t extent_end = gc_read_position + GC_EXTENT_SIZE;
   char * message;
   int msize;
   int id_off;
   int priority;
   char time [ALLNET_TIME_SIZE];
-  while ((read_position =
-            get_next_message (fd, max_size, read_position, NULL, &message,
-                              &msize, &id_off, &priority, time)) > 0) {
+  while (gc_read_position < extent_end) {
+    /* the file may be larger than max_size while gc is in progress */
+    unsigned int file_size = (unsigned int)msg_size (fd);
+    int64_t next = get_next_message (fd, file_size, gc_read_position, NULL,
+                                     &message, &msize, &id_off, &priority,
+                                     time);
+    if (next <= 0) {   /* reached the end of the file */
+      gc_finish (fd);
+      return;
+    }
     int delete = 1;
     if ((msize > 0) && (id_off >= 0))
       delete = delete_gc_message (message, (unsigned int) msize,
                                   (unsigned int) id_off, priority, time,
-                                  read_position, gc_size);
+                                  next, gc_size);
+#ifdef DEBUG_PRINT
     snprintf (alog->b, alog->s,
               "read %" PRId64 ", write %" PRId64 ", hash %d ==> delete %d\n",
-              read_position, write_position, hash_index (message + id_off),
-              delete);
+              next, gc_write_position, hash_index (message + id_off), delete);
     log_print (alog);
-#ifdef DEBUG_PRINT
 #endif /* DEBUG_PRINT */
     if (! delete) {
-      char buffer [MAX_MESSAGE_ENTRY_SIZE];
-      writeb16 (buffer + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET, msize);
-      writeb16 (buffer + MESSAGE_ENTRY_HEADER_IDOFF_OFFSET, id_off);
-      writeb32 (buffer + MESSAGE_ENTRY_HEADER_PRIORITY_OFFSET, priority);
-      memcpy (buffer + MESSAGE_ENTRY_HEADER_TIME_OFFSET, time,
-              ALLNET_TIME_SIZE);
-      memcpy (buffer + MESSAGE_ENTRY_HEADER_SIZE, message, msize);
       int write_size = MESSAGE_ENTRY_HEADER_SIZE + msize;
-      write_at_pos (fd, buffer, write_size, write_position);
-      update_hash_position (message + id_off, write_position);
-      write_position += write_size;
-      copied++;
+      int64_t position = next - write_size;
+      if (position != gc_write_position) {  /* move it */
+        char buffer [MAX_MESSAGE_ENTRY_SIZE];
+        writeb16 (buffer + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET, msize);
+        writeb16 (buffer + MESSAGE_ENTRY_HEADER_IDOFF_OFFSET, id_off);
+        writeb32 (buffer + MESSAGE_ENTRY_HEADER_PRIORITY_OFFSET, priority);
+        memcpy (buffer + MESSAGE_ENTRY_HEADER_TIME_OFFSET, time,
+                ALLNET_TIME_SIZE);
+        memcpy (buffer + MESSAGE_ENTRY_HEADER_SIZE, message, msize);
+        msg_write (fd, buffer, write_size, gc_write_position);
+        /* if mapped, the write may have overwritten the original message */
+        update_hash_position (buffer + MESSAGE_ENTRY_HEADER_SIZE + id_off,
+                              gc_write_position);
+      }
+      gc_write_position += write_size;
+      gc_copied++;
     } else {
       remove_from_hash_table (message + id_off);
-      deleted++;
+      gc_deleted++;
     }
+    gc_read_position = next;
   }
-  truncate_to_size (fd, write_position, "gc");
-  fsync (fd);
-#ifdef DEBUG_PRINT
-  printf ("end of gc, %d copied, %d deleted\n", copied, deleted);
-  snprintf (alog->b, alog->s, "%d copied, %d deleted, ", copied, deleted);
-  log_print (alog);
-#endif /* DEBUG_PRINT */
-  print_stats (1, copied, "gc");
+  gc_cover_hole (fd);
 }
 
+/* complete gc pass, used at startup and when saving data */
+static void gc (int fd, unsigned int max_size)
+{
+  gc_start (fd, max_size);
+  while (gc_in_progress ())
+    gc_step (fd, max_size);
+}
+
+
 static int debug_message_sig_size (char * message, int msize,
                                     const char * action)
 {
@@ -1140,29 +1452,32 @@ return;   }
   int count = 0;
   while (! hash_has_space (max_size, fsize, fd)) {
     /* we are out of hash descriptors or file space, delete some
-     * entries in the hash table */
+     * entries in the hash table, but only do a bounded amount of work */
+    if (++count > GC_MAX_SAVE_STEPS) {
+      snprintf (alog->b, alog->s, "acache full, not saving message\n");
+      log_print (alog);
+      return;
+    }
     snprintf (alog->b, alog->s, "gc'ing to make space for hash: %d\n",
-              ++count);
+              count);
     log_print (alog);
-    if (count > 10) {
-      printf ("count is 10 in acache.c cache_message, aborting\n");
-      exit (1);
-    }
-    gc (fd, max_size);
+    gc_step (fd, max_size);
   }
-  int64_t write_position = (int64_t)fd_size_or_zero (fd);
-  write_at_pos (fd, mbuffer, fsize, write_position);
+  int64_t write_position = (int64_t)msg_size (fd);
+  msg_write (fd, mbuffer, fsize, write_position);
   if (time_to_save (&last_msg_time, &num_msg_saves, 0))
-    fsync (fd);   /* only fsync once in a while, lessen the disk traffic */
+    msg_sync (fd);   /* only sync once in a while, lessen the disk traffic */
   hash_add_message (message, msize, message + id_off, write_position,
                     mbuffer + MESSAGE_ENTRY_HEADER_TIME_OFFSET);
 snprintf (alog->b, alog->s, "saved message at position %d, hash index %d, ", (int) write_position, hash_index (message + id_off)); log_print (alog); print_stats (0, -1, "cache_message");
-  count = 0;
-  while (fd_size (fd) > max_size) {
-    snprintf (alog->b, alog->s, "gc'ing to reduce space from %d to %d: %d\n",
-              (int)fd_size (fd), max_size, ++count);
+  /* start gc before we run out of space.  main_loop does the rest */
+  if ((! gc_in_progress ()) &&
+      ((message_hash_free == NULL) ||
+       (gc_live_size (fd) > max_size - max_size / GC_START_FRACTION))) {
+    snprintf (alog->b, alog->s, "starting gc, size %lld, max %u\n",
+              gc_live_size (fd), max_size);
     log_print (alog);
-    gc (fd, max_size);
+    gc_step (fd, max_size);
   }
 }
 
@@ -1184,7 +1499,7 @@ static void remove_cached_message (int fd, unsigned int max_size, char * id,
   if ((next != 0) && (next - position != fsize)) {
     snprintf (alog->b, alog->s,
               "warning in acache: next %d - pos %d != fsize %d (%d)\n",
-              (int)next, (int)position, fsize, (int)fd_size (fd));
+              (int)next, (int)position, fsize, (int)msg_size (fd));
     log_print (alog);
     buffer_to_string (id, MESSAGE_ID_SIZE, "id", MESSAGE_ID_SIZE, 1,
                       alog->b, alog->s);
@@ -1197,9 +1512,9 @@ static void remove_cached_message (int fd, unsigned int max_size, char * id,
   /* mark it as erased, but keep the size so we can later skip */
   memset (buffer, 0, fsize);
   writeb16 (buffer + MESSAGE_ENTRY_HEADER_MSIZE_OFFSET, msize);
-  write_at_pos (fd, buffer, fsize, position);
+  msg_write (fd, buffer, fsize, position);
   if (time_to_save (&last_msg_time, &num_msg_saves, 0))
-    fsync (fd);   /* only fsync once in a while, lessen the disk traffic */
+    msg_sync (fd);   /* only sync once in a while, lessen the disk traffic */
   remove_from_hash_table (id);
 }
 
@@ -1247,21 +1562,154 @@ static int save_packet (int fd, unsigned int max_size, char * message,
   return 1;
 }
 
-/* to limit resource consumption, only respond to requests that are
- * local, or to at most 1 outside request per second */
+/* responses to outside requests are limited by a token bucket for
+ * each requester, identified by the source address of the request.
+ * the source address is claimed by the requester and may be forged, so a
+ * bucket only delays responses, never refuses them.  acache only sees the
+ * packets forwarded by ad, so it cannot tell requesters apart by their
+ * connection.  Requests without a source address (src_nbits == 0) all
+ * share one bucket.
+ * each bucket holds up to limit_burst_seconds worth of bytes and packets,
+ * and refills at limit_bytes_per_second and limit_packets_per_second.
+ * a new bucket starts with only one second's worth, so a requester
+ * gains nothing by changing its source address.  In addition, all the
+ * outside requests together are limited by one more bucket that is
+ * ALL_REQUESTS_FACTOR times as large and refills as many times faster.
+ * the limits may be set in ~/.allnet/acache/limits, which has the
+ * bytes per second, packets per second, and burst seconds, one per line */
+static unsigned int limit_bytes_per_second = 20000;
+static unsigned int limit_packets_per_second = 20;
+static unsigned int limit_burst_seconds = 5;
+
+struct request_bucket {
+  unsigned char source [ADDRESS_SIZE];
+  int src_nbits;
+  double bytes;                     /* bytes we may still send */
+  double packets;                   /* packets we may still send */
+  unsigned long long int last_ms;   /* last refill, or 0 if not in use */
+};
+
+#define NUM_REQUEST_BUCKETS	64
+static struct request_bucket request_buckets [NUM_REQUEST_BUCKETS];
+static struct request_bucket anonymous_bucket;  /* for src_nbits == 0 */
+
+#define ALL_REQUESTS_FACTOR	4
+static struct request_bucket all_requests_bucket;
+
+static void read_limits ()
+{
+  int fd = open_read_config ("acache", "limits", 0);
+  if (fd < 0)   /* no limits file, use the defaults */
+    return;
+  char buffer [1000];
+  ssize_t n = read (fd, buffer, sizeof (buffer) - 1);
+  close (fd);
+  unsigned int bps, pps, burst;
+  if (n > 0) {
+    buffer [n] = '\0';
+    if ((sscanf (buffer, "%u\n%u\n%u", &bps, &pps, &burst) == 3) &&
+        (bps > 0) && (pps > 0) && (burst > 0)) {
+      limit_bytes_per_second = bps;
+      limit_packets_per_second = pps;
+      limit_burst_seconds = burst;
+    }
+  }
+  snprintf (alog->b, alog->s,
+            "acache limits %u bytes/s, %u packets/s, %u s burst\n",
+            limit_bytes_per_second, limit_packets_per_second,
+            limit_burst_seconds);
+  log_print (alog);
+}
+
+/* adds to the bucket what it has earned since it was last refilled.
+ * factor is 1 for a single requester, more for a shared bucket */
+static void refill_bucket (struct request_bucket * b,
+                           unsigned long long int now, int factor)
+{
+  double max_bytes =
+    ((double) limit_bytes_per_second) * limit_burst_seconds * factor;
+  double max_packets =
+    ((double) limit_packets_per_second) * limit_burst_seconds * factor;
+  if (b->last_ms == 0) {   /* new bucket, start with one second's worth */
+    b->bytes = ((double) limit_bytes_per_second) * factor;
+    b->packets = ((double) limit_packets_per_second) * factor;
+  } else if (now > b->last_ms) {
+    double seconds = (now - b->last_ms) / 1000.0;
+    b->bytes += seconds * limit_bytes_per_second * factor;
+    b->packets += seconds * limit_packets_per_second * factor;
+  }
+  if (b->bytes > max_bytes)
+    b->bytes = max_bytes;
+  if (b->packets > max_packets)
+    b->packets = max_packets;
+  b->last_ms = now;
+}
+
+/* returns the bucket for this source, refilled up to the current time.
+ * if the source has no bucket, reuses the least recently used bucket.
+ * requests with no source address share anonymous_bucket.
+ * also refills all_requests_bucket */
+static struct request_bucket * find_bucket (const unsigned char * source,
+                                            int src_nbits)
+{
+  unsigned long long int now = allnet_time_ms ();
+  refill_bucket (&all_requests_bucket, now, ALL_REQUESTS_FACTOR);
+  if (src_nbits > ADDRESS_BITS)
+    src_nbits = ADDRESS_BITS;
+  if (src_nbits <= 0) {
+    refill_bucket (&anonymous_bucket, now, 1);
+    return &anonymous_bucket;
+  }
+  struct request_bucket * found = NULL;
+  struct request_bucket * oldest = request_buckets;
+  int i;
+  for (i = 0; i < NUM_REQUEST_BUCKETS; i++) {
+    struct request_bucket * b = request_buckets + i;
+    if ((b->last_ms != 0) && (b->src_nbits == src_nbits) &&
+        (matches (b->source, src_nbits, source, src_nbits) >= src_nbits)) {
+      found = b;
+      break;
+    }
+    if (b->last_ms < oldest->last_ms)
+      oldest = b;
+  }
+  if (found == NULL) {   /* new requester */
+    found = oldest;
+    memset (found->source, 0, sizeof (found->source));
+    memcpy (found->source, source, (src_nbits + 7) / 8);
+    found->src_nbits = src_nbits;
+    found->last_ms = 0;
+  }
+  refill_bucket (found, now, 1);
+  return found;
+}
+
+/* returns 1 if the bucket, and the bucket for all requests, allow sending
+ * another packet, 0 otherwise.
+ * a packet may be sent as long as the byte count is positive, so
+ * the byte count may become negative */
+static int bucket_allows (struct request_bucket * b)
+{
+  return ((b->packets >= 1.0) && (b->bytes > 0.0) &&
+          (all_requests_bucket.packets >= 1.0) &&
+          (all_requests_bucket.bytes > 0.0));
+}
+
+static void bucket_charge (struct request_bucket * b, int bytes)
+{
+  b->packets -= 1.0;
+  b->bytes -= bytes;
+  all_requests_bucket.packets -= 1.0;
+  all_requests_bucket.bytes -= bytes;
+}
+
+/* to limit the time spent on each request, give time limits for sending
+ * acks and for sending messages.  Local requests get much more time */
 static void limit_resources (int local_request,
                              unsigned long long int * overall,
                              unsigned long long int * ack_limit) 
 {
-  static unsigned long long int next_external = 0;
   unsigned long long int start = allnet_time_ms ();
-  if (overall   != NULL) *overall   = start - 1;
-  if (ack_limit != NULL) *ack_limit = start - 1;
-  if ((! local_request) && (next_external != 0) &&
-      (start <= next_external))
-    return;               /* responded to another request in the past 10s */
-  next_external = start + 10000; /* respond to external requests
-                                    once every 10s*/
   unsigned long long int first = start + 10;     /* allow 10ms for acks */
   unsigned long long int final = start + 100;    /* allow 90 more ms for msgs */
   if (local_request) {                  /* allow much more time */
@@ -1307,9 +1755,11 @@ static int requested_ack (char * message_id, char * bits, int nbits)
   return get_bit ((unsigned char *) bits, pos);
 }
 
+/* if bucket is not NULL, only sends as many acks as the bucket allows */
 static int send_outstanding_acks (struct allnet_header * hp, int sock,
                                   unsigned long long int time_limit,
-                                  char * ack_bitset, int ack_bits)
+                                  char * ack_bitset, int ack_bits,
+                                  struct request_bucket * bucket)
 {
   if (ack_space <= 0)
     return 0;
@@ -1335,7 +1785,8 @@ static int send_outstanding_acks (struct allnet_header * hp, int sock,
   int msg_index = 0;                             /* index into ack message */
   int priority = ALLNET_PRIORITY_CACHE_RESPONSE;
   /* finished means we ran out of time or sent all available acks */
-  int finished = (allnet_time_ms () >= time_limit);
+  int finished = ((allnet_time_ms () >= time_limit) ||
+                  ((bucket != NULL) && (! bucket_allows (bucket))));
   while (! finished) {
     /* if the ack was requested (or all were requested), return this ack
      * as long as it is nonzero */
@@ -1359,6 +1810,11 @@ static int send_outstanding_acks (struct allnet_header * hp, int sock,
         printf ("acache error 3, transport %d\n", hp->transport);
       count += msg_index;
       msg_index = 0;
+      if (bucket != NULL) {
+        bucket_charge (bucket, send_size);
+        if (! bucket_allows (bucket))
+          finished = 1;
+      }
     }
   }
   return count;
@@ -1406,7 +1862,85 @@ return;   }
     *priorityp = priority - 1;
 }
 
+/* a response to an outside request that is sent a few packets at a time,
+ * as the requester's bucket allows */
+struct pending_response {
+  char * request;              /* a copy of the request, rd points into it */
+  struct request_details rd;
+  unsigned char source [ADDRESS_SIZE];  /* the requester, for its bucket */
+  int src_nbits;
+  struct hash_cursor cursor;
+  int count;                   /* number of messages sent so far */
+};
+
+#define MAX_PENDING_RESPONSES	16
+static struct pending_response pending [MAX_PENDING_RESPONSES];
+static int num_pending = 0;
+
+static void remove_pending (int index)
+{
+  free (pending [index].request);
+  num_pending--;
+  if (index < num_pending)
+    pending [index] = pending [num_pending];
+}
+
+/* sends matching messages until the time limit, the end of the cache,
+ * or (if bucket is not NULL) the limit of the bucket.
+ * returns the number of messages sent, and sets *done if there are no
+ * more matching messages */
+static int send_matches (int fd, unsigned int max_size, int sock,
+                         struct request_details * rd,
+                         struct hash_cursor * cursor, int * count,
+                         int local_request, struct request_bucket * bucket,
+                         unsigned long long int time_limit, int * done)
+{
+  int sent = 0;
+  *done = 0;
+  while ((allnet_time_ms () < time_limit) &&
+         ((bucket == NULL) || (bucket_allows (bucket)))) {
+    char * message = NULL;
+    int msize = 0;
+    if (! hash_next_match (fd, max_size, cursor, rd, &message, &msize)) {
+      *done = 1;  /* sequential search, none left, so done */
+      break;
+    }
+    sent++;
+    *count = *count + 1;
+    int priority = ALLNET_PRIORITY_EPSILON;
+    if (ALLNET_PRIORITY_CACHE_RESPONSE > ALLNET_PRIORITY_EPSILON + *count)
+      priority = ALLNET_PRIORITY_CACHE_RESPONSE - *count;
+    resend_message (message, msize, 0, &priority, local_request, sock);
+    if (bucket != NULL)
+      bucket_charge (bucket, msize);
+  }
+  return sent;
+}
+
+/* continue sending the responses that were paced by the token buckets.
+ * returns the number of pending responses left */
+static int send_pending_responses (int fd, unsigned int max_size, int sock)
+{
+  unsigned long long int limit;
+  limit_resources (0, &limit, NULL);
+  int i = 0;
+  while (i < num_pending) {
+    struct pending_response * pr = pending + i;
+    struct request_bucket * bucket = find_bucket (pr->source, pr->src_nbits);
+    int done = 0;
+    send_matches (fd, max_size, sock, &(pr->rd), &(pr->cursor), &(pr->count),
+                  0, bucket, limit, &done);
+    if (done)
+      remove_pending (i);  /* moves the last pending response to i */
+    else
+      i++;
+  }
+  return num_pending;
+}
+
 /* returns the number of responses sent, or 0 */
+/* responses to outside requests that exceed the requester's token bucket
+ * are sent later, by send_pending_responses */
 static int respond_to_request (int fd, unsigned int max_size, char * in_message,
                                int in_msize, int sock)
 {
@@ -1418,33 +1952,52 @@ static int respond_to_request (int fd, unsigned int max_size, char * in_message,
   /* limit responses as specified by limit_resources */
   unsigned long long int overall_limit, ack_limit;
   limit_resources (local_request, &overall_limit, &ack_limit);
+  struct request_bucket * bucket = NULL;
+  if (! local_request)
+    bucket = find_bucket (hp->source, hp->src_nbits);
   struct request_details rd;
   char * ack_bitset = NULL;
   int ack_bits = 0;
   build_request_details (in_message, in_msize, &rd, &ack_bitset, &ack_bits);
 
   int num_acks =
-    send_outstanding_acks (hp, sock, ack_limit, ack_bitset, ack_bits);
+    send_outstanding_acks (hp, sock, ack_limit, ack_bitset, ack_bits, bucket);
 
-  int sent = 0;
+  struct hash_cursor cursor;
+  hash_cursor_start (&cursor);
   int count = 0;
-  while (allnet_time_ms () < overall_limit) {
-    char * message = NULL;
-    int msize = 0;
-    int first_call = (count++ == 0);
-    if (hash_next_match (fd, max_size, first_call, &rd, &message, &msize))
-    {
-      sent++;
-      int priority = ALLNET_PRIORITY_EPSILON;
-      if (ALLNET_PRIORITY_CACHE_RESPONSE > ALLNET_PRIORITY_EPSILON + count)
-        priority = ALLNET_PRIORITY_CACHE_RESPONSE - count;
-      resend_message (message, msize, 0, &priority, local_request, sock);
-    } else {
-      break;  /* sequential search, none left, so done */
+  int done = 0;
+  int sent = send_matches (fd, max_size, sock, &rd, &cursor, &count,
+                           local_request, bucket, overall_limit, &done);
+  int paced = 0;
+  if ((! done) && (bucket != NULL)) {  /* send the rest later */
+    int i;
+    /* a new request replaces any earlier one from the same source */
+    for (i = 0; i < num_pending; i++) {
+      if ((pending [i].src_nbits == hp->src_nbits) &&
+          (matches (pending [i].source, hp->src_nbits,
+                    hp->source, hp->src_nbits) >= hp->src_nbits)) {
+        remove_pending (i);
+        break;
+      }
     }
+    if (num_pending >= MAX_PENDING_RESPONSES)
+      remove_pending (0);   /* too many, drop one */
+    struct pending_response * pr = pending + num_pending;
+    num_pending++;
+    pr->request = memcpy_malloc (in_message, in_msize, "respond_to_request");
+    /* rd points into in_message, so rebuild it from the copy */
+    build_request_details (pr->request, in_msize, &(pr->rd),
+                           &ack_bitset, &ack_bits);
+    memcpy (pr->source, hp->source, ADDRESS_SIZE);
+    pr->src_nbits = hp->src_nbits;
+    pr->cursor = cursor;
+    pr->count = count;
+    paced = 1;
   }
-  snprintf (alog->b, alog->s, "respond_to_request: sent %d packets, %d acks\n",
-            sent, num_acks);
+  snprintf (alog->b, alog->s,
+            "respond_to_request: sent %d packets, %d acks%s\n",
+            sent, num_acks, ((paced) ? ", more later" : ""));
   log_print (alog);
 /* printf ("sent %d messages, %d acks\n", sent, num_acks); */
   return sent;
@@ -1477,6 +2030,9 @@ static int respond_to_id_request (int fd, unsigned int max_size,
   }
   unsigned long long int limit;
   limit_resources (local_request, &limit, NULL);
+  struct request_bucket * bucket = NULL;
+  if (! local_request)
+    bucket = find_bucket (in_hp->source, in_hp->src_nbits);
 
   int forward_missing = (! local_request) || sent_locally;
   int nmissing = 0;
@@ -1490,9 +2046,12 @@ static int respond_to_id_request (int fd, unsigned int max_size,
     int msize = 0;
     int64_t position = 0;
     if ((! local_request) && (allnet_time_ms () < limit) &&
+        ((bucket == NULL) || (bucket_allows (bucket))) &&
         ((position = hash_get_next (fd, max_size, 0, id, &message, &msize,
                                     NULL, NULL, NULL)) >= 0)) {
       resend_message (message, msize, position, &priority, local_request, sock);
+      if (bucket != NULL)
+        bucket_charge (bucket, msize);
       nsent++;
     } else if (forward_missing) {
       /* copy the id to the left, so we can send it as a shorter packet */
@@ -1554,6 +2113,7 @@ static void ack_packets (int msg_fd, unsigned int msg_size, int ack_fd,
 static void init_msgs (int msg_fd, int max_msg_size)
 {
   init_hash_table (max_msg_size);
+  msg_map_init (msg_fd, max_msg_size);
   int64_t read_position = 0;
   int count = 0;
   char * message;
@@ -1574,12 +2134,12 @@ static void init_msgs (int msg_fd, int max_msg_size)
     }
   }
   snprintf (alog->b, alog->s, "init almost done, %d %d %d, ",
-            msg_fd, (int)fd_size (msg_fd), max_msg_size);
+            msg_fd, (int)msg_size (msg_fd), max_msg_size);
   log_print (alog);
   print_stats (0, count, "init_msgs");
-  while (fd_size (msg_fd) > max_msg_size) {
+  while (msg_size (msg_fd) > max_msg_size) {
     snprintf (alog->b, alog->s, "message file %d, max %d, gc'ing",
-              (int)fd_size (msg_fd), max_msg_size);
+              (int)msg_size (msg_fd), max_msg_size);
     log_print (alog);
     gc (msg_fd, max_msg_size);
   }
@@ -1655,18 +2215,29 @@ static void init_acache (int * msg_fd, int * max_msg_size,
 static int msg_fd = -1;
 static int ack_fd = -1;
 
-/* may be called externally, e.g. when the process is terminated */
+/* may be called externally, e.g. from a signal handler when the process
+ * is terminated, possibly while main_loop is still running in another
+ * thread.  So it only writes what is in memory to the files, and leaves
+ * the mapping and the files open.  Between gc steps the gc hole is covered
+ * by deleted entries, so the message file is valid without finishing gc */
 void acache_save_data ()
 {
+  if (msg_fd != -1)
+    msg_sync (msg_fd);  /* save all the messages that are in memory */
+  if (ack_fd != -1)
+    save_ack_data (ack_fd, 1);
+}
+
+/* called at the end of main_loop to save the data and close the files */
+static void close_data ()
+{
+  acache_save_data ();
   if (msg_fd != -1) {
-    fsync (msg_fd);  /* save all the messages that are in memory */
+    msg_unmap ();
     close (msg_fd);
     msg_fd = -1;
   }
-  if (ack_fd != -1) {
-    save_ack_data (ack_fd, 1);
-    ack_fd = -1;
-  }
+  ack_fd = -1;
 }
 
 static void main_loop (int rsock, int wsock, pd p)
@@ -1678,6 +2249,7 @@ static void main_loop (int rsock, int wsock, pd p)
   unsigned int max_msg_size = 0;
   if (signed_max > 0)
     max_msg_size = signed_max;
+  read_limits ();
   snprintf (alog->b, alog->s, "acache main_loop fds %d, %d, max %u\n",
             rsock, wsock, max_msg_size);
   log_print (alog);
@@ -1687,12 +2259,24 @@ static void main_loop (int rsock, int wsock, pd p)
   while (1) {
     char * message = NULL;
     unsigned int priority;
-    int result = receive_pipe_message (p, rsock, &message, &priority);
+    /* while responses are pending, wake up to send more of them */
+    int timeout = PIPE_MESSAGE_WAIT_FOREVER;
+    if (send_pending_responses (msg_fd, max_msg_size, wsock) > 0)
+      timeout = 100;
+    if (gc_in_progress ()) {  /* one gc step each time through the loop */
+      gc_step (msg_fd, max_msg_size);
+      if (gc_in_progress ())
+        timeout = PIPE_MESSAGE_NO_WAIT;
+    }
+    int result = receive_pipe_message_any (p, timeout, &message, NULL,
+                                           &priority);
+    if (result == 0)  /* timed out */
+      continue;
     unsigned int uresult = result;  /* only used if result > 0 */
     struct allnet_header * hp = (struct allnet_header *) message;
     /* unless we save it, free the message */
     int mfree = 1;
-    if (result <= 0) {
+    if (result < 0) {
       snprintf (alog->b, alog->s, "alocal pipe %d closed, result %d\n",
                 rsock, result);
       log_print (alog);
@@ -1760,7 +2344,9 @@ static void main_loop (int rsock, int wsock, pd p)
     if (mfree)
       free (message);
   }
-  acache_save_data ();
+  while (num_pending > 0)   /* wsock is no longer valid */
+    remove_pending (num_pending - 1);
+  close_data ();
 }
 
 static void print_message (int fd, unsigned int max_size,
@@ -1907,6 +2493,7 @@ void print_caches (int print_msgs, int print_acks)
     printf ("found %d acks out of %d entries\n", count, ack_space);
   }
   /* print_stats (0, 0, "print_caches"); */
+  msg_unmap ();
   close (print_msg_fd);
   close (print_ack_fd);
 }
@@ -1916,6 +2503,7 @@ void acache_thread (char * pname, int rpipe, int wpipe)
 {
   alog = init_log ("acache_thread");
   pd p = init_pipe_descriptor (alog);
+  add_pipe (p, rpipe, "acache_thread");
   main_loop (rpipe, wpipe, p);
 }
 
@@ -1954,3 +2542,70 @@ int main (int argc, char ** argv)
 }
 
 #endif /* DAEMON_MAIN_FUNCTION */
+
+#ifdef ACACHE_UNIT_TEST
+/* gcc -DACACHE_UNIT_TEST -I. -o acache_test acache.c \
+ *     lib/.libs/liballnet-*.a -lpthread
+ * ./acache_test [max_size] fills a temporary cache to several times
+ * max_size, and reports the average and worst-case latency of save_packet
+ * and, for comparison, the time taken by a complete gc */
+
+#define ACACHE_TEST_MAX_LATENCY_US	50000
+
+int main (int argc, char ** argv)
+{
+  unsigned int max_size = 1000000;
+  if (argc > 1)
+    max_size = (unsigned int) atoi (argv [1]);
+  alog = init_log ("acache_test");
+  char fname [] = "/tmp/acache_testXXXXXX";
+  int fd = mkstemp (fname);
+  if (fd < 0) {
+    perror ("mkstemp");
+    return 1;
+  }
+  unlink (fname);
+  init_msgs (fd, max_size);
+  unsigned long long int worst = 0;
+  unsigned long long int total = 0;
+  int count = 0;
+  int saved = 0;
+  unsigned long long int filled = 0;
+  while (filled < 4 * (unsigned long long int) max_size) {
+    char packet [ALLNET_MTU];
+    unsigned int psize = 100 + (unsigned int) (random_int (0, 1400));
+    struct allnet_header * hp =
+      init_packet (packet, psize, ALLNET_TYPE_DATA, 3, ALLNET_SIGTYPE_NONE,
+                   NULL, 0, NULL, 0, NULL, NULL);
+    int hsize = ALLNET_SIZE (hp->transport);
+    random_bytes (packet + hsize, psize - hsize);
+    int priority = (int) random_int (1, ALLNET_PRIORITY_MAX);
+    unsigned long long int start = allnet_time_us ();
+    saved += save_packet (fd, max_size, packet, psize, priority);
+    unsigned long long int delta = allnet_time_us () - start;
+    if (delta > worst)
+      worst = delta;
+    total += delta;
+    count++;
+    filled += psize;
+    if (gc_in_progress ())   /* what main_loop does between packets */
+      gc_step (fd, max_size);
+  }
+  long long int final_size = msg_size (fd);
+  unsigned long long int start = allnet_time_us ();
+  gc (fd, max_size);
+  unsigned long long int full_gc = allnet_time_us () - start;
+  printf ("%d packets, %d saved, file size %lld, max %u\n",
+          count, saved, final_size, max_size);
+  printf ("save_packet average %lluus, worst %lluus, full gc %lluus\n",
+          total / count, worst, full_gc);
+  msg_unmap ();
+  close (fd);
+  if ((final_size > (long long int) max_size + GC_EXTENT_SIZE) ||
+      (worst > ACACHE_TEST_MAX_LATENCY_US)) {
+    printf ("error: file size or latency too large\n");
+    return 1;
+  }
+  return 0;
+}
+#endif /* ACACHE_UNIT_TEST */
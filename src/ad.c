@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "lib/packet.h"
 #include "lib/mgmt.h"
@@ -12,6 +14,7 @@
 #include "track.h"
 #include "record.h"
 #include "lib/pipemsg.h"
+#include "lib/allnet_pbuf.h"
 #include "lib/priority.h"
 #include "lib/allnet_log.h"
 #include "lib/util.h"
@@ -195,11 +198,13 @@ static int process_packet (char * packet, int size, int is_local,
   return PROCESS_PACKET_ALL;
 }
 
-static void send_all (char * packet, int psize, int priority,
+/* the pbuf is shared by reference with any queues it is sent to */
+static void send_all (struct allnet_pbuf * pbuf, int priority,
                       int * write_pipes, int nwrite, char * desc)
 {
   int i;
 #ifdef LOG_PACKETS
+  int psize = pbuf->len;
   int n = snprintf (alog->b, alog->s,
                     "send_all (%s) sending %d bytes priority %d to %d pipes: ",
                     desc, psize, priority, nwrite);
@@ -212,7 +217,7 @@ static void send_all (char * packet, int psize, int priority,
   log_print (alog);
 #endif /* LOG_PACKETS */
   for (i = 0; i < nwrite; i++) {
-    if (! send_pipe_message (write_pipes [i], packet, psize, priority, alog)) {
+    if (! send_pipe_pbuf (write_pipes [i], pbuf, priority, alog)) {
       snprintf (alog->b, alog->s, "write_pipes [%d] = %d is no longer valid\n",
                 i, write_pipes [i]);
       log_print (alog);
@@ -220,6 +225,85 @@ static void send_all (char * packet, int psize, int priority,
   }
 }
 
+/* logs how many packets ad forwarded and delivered locally since the
+ * last call.  The buffer counters are for the whole process, which may
+ * include other daemons (in threaded builds) and ad's local deliveries,
+ * so they are logged separately rather than per forwarded packet */
+static void log_pbuf_stats (struct allnet_pbuf_stats * last,
+                            unsigned long long int * forwarded,
+                            unsigned long long int * delivered)
+{
+  struct allnet_pbuf_stats now;
+  allnet_pbuf_get_stats (&now);
+  if ((*forwarded > 0) || (*delivered > 0)) {
+    unsigned long long int allocs =
+      (now.pool_allocs - last->pool_allocs) +
+      (now.malloc_allocs - last->malloc_allocs);
+    snprintf (alog->b, alog->s,
+              "ad forwarded %llu packets, delivered %llu locally; "
+              "process-wide %llu buffers (%llu malloc), "
+              "%llu copies, %llu bytes copied\n",
+              *forwarded, *delivered, allocs,
+              now.malloc_allocs - last->malloc_allocs,
+              now.copies - last->copies, now.copy_bytes - last->copy_bytes);
+    log_print (alog);
+  }
+  *last = now;
+  *forwarded = 0;
+  *delivered = 0;
+}
+
+/* save the record of recent packets this often, so little is lost
+ * if ad is killed without a chance to save */
+#define RECORD_SAVE_SECONDS	600
+
+/* how often, in ms, the main loop checks for terminating signals */
+#define STOP_CHECK_MS		100
+
+#ifdef ALLNET_USE_FORK  /* with threads, signals belong to the application */
+static sigset_t stop_signals;
+#endif /* ALLNET_USE_FORK */
+
+/* ad usually runs in its own process, forked by astart before astart
+ * sets up its own signal handlers.  Saving the record table is not safe
+ * from a signal handler, so instead the terminating signals are blocked,
+ * and the main loop checks for them and saves the table before stopping */
+static void block_stop_signals ()
+{
+#ifdef ALLNET_USE_FORK
+  sigemptyset (&stop_signals);
+  sigaddset (&stop_signals, SIGINT);
+  sigaddset (&stop_signals, SIGTERM);
+  sigaddset (&stop_signals, SIGHUP);
+  if (pthread_sigmask (SIG_BLOCK, &stop_signals, NULL) != 0)
+    perror ("ad pthread_sigmask");
+#endif /* ALLNET_USE_FORK */
+}
+
+/* if a terminating signal is pending, saves the record table and
+ * lets the signal terminate the process */
+static void check_stop_signals ()
+{
+#ifdef ALLNET_USE_FORK
+  sigset_t pending;
+  if (sigpending (&pending) != 0)
+    return;
+  int signals [] = { SIGINT, SIGTERM, SIGHUP };
+  unsigned int i;
+  for (i = 0; i < sizeof (signals) / sizeof (int); i++) {
+    if (sigismember (&pending, signals [i]) == 1) {
+      record_save_data ();
+      snprintf (alog->b, alog->s, "ad saved record table, signal %d\n",
+                signals [i]);
+      log_print (alog);
+      signal (signals [i], SIG_DFL);
+      pthread_sigmask (SIG_UNBLOCK, &stop_signals, NULL);  /* terminates */
+      exit (0);  /* in case the signal did not terminate the process */
+    }
+  }
+#endif /* ALLNET_USE_FORK */
+}
+
 /* runs forever, and only returns in case of error. */
 /* the first read_pipe and the first write_pipe are from/to alocal.
  * the second read_pipe and write_pipe are from/to aip
@@ -241,15 +325,23 @@ static void main_loop (int npipes, int * read_pipes, int * write_pipes,
 /*snprintf (alog->b, alog->s, "ad calling update_social\n"); log_print (alog);*/
   time_t next_update = update_social (soc, update_seconds);
 /*snprintf (alog->b, alog->s, "ad finished update_social\n");log_print (alog);*/
+  struct allnet_pbuf_stats last_stats;
+  allnet_pbuf_get_stats (&last_stats);
+  unsigned long long int forwarded = 0;
+  unsigned long long int delivered = 0;
+  time_t next_record_save = time (NULL) + RECORD_SAVE_SECONDS;
 
   while (1) {
     /* read messages from each of the pipes */
-    char * packet = NULL;
+    struct allnet_pbuf * pbuf = NULL;
     int from_pipe;
  /* incoming priorities ignored unless from local */
     unsigned int priority = ALLNET_PRIORITY_EPSILON;
-    int psize = receive_pipe_message_any (p, PIPE_MESSAGE_WAIT_FOREVER,
-                                          &packet, &from_pipe, &priority);
+    int psize = receive_pipe_pbuf_any (p, STOP_CHECK_MS,
+                                       &pbuf, &from_pipe, &priority);
+    check_stop_signals ();   /* drops any packet just received */
+    if (psize == 0)   /* timed out */
+      continue;
 #ifdef LOG_PACKETS
     snprintf (alog->b, alog->s, "ad received %d, fd %d\n", psize, from_pipe);
 #ifdef DEBUG_PRINT
@@ -259,7 +351,7 @@ static void main_loop (int npipes, int * read_pipes, int * write_pipes,
 #endif /* LOG_PACKETS */
     if (psize <= 0) { /* for now exit */
       snprintf (alog->b, alog->s,
-                "error: received %d from receive_pipe_message_any, pipe %d",
+                "error: received %d from receive_pipe_pbuf_any, pipe %d",
                 psize, from_pipe);
       log_print (alog);
       int abc_pipe = 0;
@@ -293,6 +385,8 @@ static void main_loop (int npipes, int * read_pipes, int * write_pipes,
         return;
       }
     }
+    /* we hold the only reference, so the packet may be modified in place */
+    char * packet = pbuf->data;
     /* packets generated by alocal are local */
     int is_local = (from_pipe == read_pipes [0]);
     int result = process_packet (packet, psize, is_local, soc, &priority);
@@ -304,7 +398,8 @@ static void main_loop (int npipes, int * read_pipes, int * write_pipes,
 #ifdef LOG_PACKETS
       log_packet (alog, "sending to all", packet, psize);
 #endif /* LOG_PACKETS */
-      send_all (packet, psize, priority, write_pipes, npipes, "all");
+      send_all (pbuf, priority, write_pipes, npipes, "all");
+      forwarded++;
       break;
     case PROCESS_PACKET_OUT:
 #ifdef DEBUG_PRINT
@@ -314,7 +409,8 @@ static void main_loop (int npipes, int * read_pipes, int * write_pipes,
       log_packet (alog, "sending out", packet, psize);
 #endif /* LOG_PACKETS */
 /* alocal should be the first pipe, so just skip it */
-      send_all (packet, psize, priority, write_pipes + 1, npipes - 1, "out");
+      send_all (pbuf, priority, write_pipes + 1, npipes - 1, "out");
+      forwarded++;
       break;
     /* all the rest are not forwarded, so priority does not matter */
     case PROCESS_PACKET_LOCAL:   /* send only to alocal */ 
@@ -325,7 +421,8 @@ static void main_loop (int npipes, int * read_pipes, int * write_pipes,
       log_packet (alog, "sending to alocal", packet, psize);
 #endif /* LOG_PACKETS */
 /* alocal should be the first pipe, so only write to that */
-      send_all (packet, psize, 0, write_pipes, 1, "local");
+      send_all (pbuf, 0, write_pipes, 1, "local");
+      delivered++;
       break;
     case PROCESS_PACKET_DROP:    /* do not forward */
 #ifdef DEBUG_PRINT
@@ -337,11 +434,17 @@ static void main_loop (int npipes, int * read_pipes, int * write_pipes,
       /* do nothing */
       break;
     }
-    free (packet);  /* was allocated by receive_pipe_message_any */
+    allnet_pbuf_release (pbuf);  /* from receive_pipe_pbuf_any */
 
     /* about once every next_update seconds, re-read social connections */
-    if (time (NULL) >= next_update)
+    if (time (NULL) >= next_update) {
       next_update = update_social (soc, update_seconds);
+      log_pbuf_stats (&last_stats, &forwarded, &delivered);
+    }
+    if (time (NULL) >= next_record_save) {
+      record_save_data ();
+      next_record_save = time (NULL) + RECORD_SAVE_SECONDS;
+    }
   }
 }
 
@@ -365,6 +468,8 @@ void ad_main (int npipes, int * rpipes, int * wpipes)
               i, rpipes [i], i, wpipes [i]);
     log_print (alog);
   }
+  record_set_size (RECORD_DEFAULT_ENTRIES);
+  block_stop_signals ();
   main_loop (npipes, rpipes, wpipes, 30, 30000, 5);
   snprintf (alog->b, alog->s, "ad error: main loop returned, exiting\n");
   log_print (alog);
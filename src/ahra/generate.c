@@ -2,11 +2,14 @@
 /* parameters: a personal phrase (in quotes)
      optional: a minimum number of pairs of words (default is 2)
      optional: a language for the encoding (default is en)
+     optional: -t followed by the number of threads searching in parallel
+               (default is the number of processors)
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 
@@ -34,6 +37,8 @@ static void usage (char * pname, char * reason)
   printf ("             more is better, default is 2\n");
   printf ("     option: the language for encoding the word pairs\n");
   printf ("             default is en (English)\n");
+  printf ("     option: -t n, to search with n threads in parallel\n");
+  printf ("             default is the number of processors\n");
   printf ("your command %s\n", reason);
   exit (1);
 }
@@ -46,8 +51,20 @@ int main (int argc, char ** argv)
   char * phrase = argv [1];
   char * language = "en";
   int numpairs = 2;
+  int nthreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1)
+    nthreads = 1;
   int i;
   for (i = 2; i < argc; i++) {
+    if (strcmp (argv [i], "-t") == 0) {
+      char * check = NULL;
+      if (i + 1 < argc)
+        nthreads = strtol (argv [i + 1], &check, 10);
+      if ((check == NULL) || (check == argv [i + 1]) || (nthreads < 1))
+        usage (argv [0], "-t must be followed by a positive number");
+      i++;
+      continue;
+    }
     char * check;
     int n = strtol (argv [i], &check, 10);
     if (check != argv [i])     /* number of word pairs */
@@ -59,6 +76,7 @@ int main (int argc, char ** argv)
   /* bitstring_bits = 20; */
   printf ("searching for key for '%s', language %s, minimum %d word pairs\n",
           phrase, language, numpairs);
+  printf ("  using %d thread%s\n", nthreads, (nthreads == 1) ? "" : "s");
   int numpos = KEY_LENGTH - bitstring_bits + 1;
   unsigned long long int estimate = power (power (2, bitstring_bits) /
                                            numpos, numpairs);
@@ -69,7 +87,8 @@ int main (int argc, char ** argv)
   while (1) {
     fflush (stdout);
     char * result =
-      generate_key (KEY_LENGTH, phrase, language, bitstring_bits, numpairs, 1);
+      generate_key_parallel (KEY_LENGTH, phrase, language, bitstring_bits,
+                             numpairs, nthreads, 1, 60);
     printf ("\nfound key '%s'\n", result);
     free (result);
   }
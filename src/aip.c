@@ -19,6 +19,10 @@
  * not currently implemented
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE   /* for sendmmsg */
+#endif /* __linux__ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -50,6 +54,11 @@
 #endif /* CONVERT_IPV4_TO_IPV6 */
 #endif /* _WIN32 || _WIN64 || __CYGWIN__ || __IPHONE_OS_VERSION_MIN_REQUIRED */
 
+#ifdef __linux__
+/* send a message to many UDP destinations with a single call to sendmmsg */
+#define USE_SENDMMSG
+#endif /* __linux__ */
+
 struct udp_cache_record {
   struct sockaddr_storage sas;
   socklen_t salen;
@@ -271,32 +280,49 @@ static void add_sockaddr_to_cache (void * cache, struct sockaddr * addr,
 #endif /* DEBUG_PRINT */
 }
 
-static int send_udp (int udp, char * message, unsigned int msize,
-                     struct sockaddr * sa, const char * caller)
+/* returns the length of the address to give to sendto for sa.
+ * if necessary, converts sa to a form the UDP socket can send to,
+ * saved in *converted, and changes *sa to point to it */
+static socklen_t udp_dest_addr (struct sockaddr ** sa,
+                                struct sockaddr_storage * converted)
 {
   socklen_t addr_len = sizeof (struct sockaddr_storage);
-  if (sa->sa_family == AF_INET)
+  if ((*sa)->sa_family == AF_INET)
     addr_len = sizeof (struct sockaddr_in);
   else
     addr_len = sizeof (struct sockaddr_in6);
 #ifdef CONVERT_IPV4_TO_IPV6
-  struct sockaddr_in6 sin6;  /* used only within send_udp */
-  if (sa->sa_family == AF_INET) {
+  if ((*sa)->sa_family == AF_INET) {
+    struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *) converted;
 /* IPv4 addresses represented as IPv6 addresses are preceded by xffff */
-    addr_len = sizeof (sin6);
+    addr_len = sizeof (struct sockaddr_in6);
     /* clear the parts of the address that we don't set */
-    memset (&sin6, 0, addr_len);
-    sin6.sin6_family = AF_INET6;
-    unsigned char * ap = sin6.sin6_addr.s6_addr;  /* IPv6 address goes here */
+    memset (sin6, 0, addr_len);
+    sin6->sin6_family = AF_INET6;
+    unsigned char * ap = sin6->sin6_addr.s6_addr;  /* IPv6 address goes here */
     ap [10] = 0xff;
     ap [11] = 0xff;
-    struct sockaddr_in * sinp = (struct sockaddr_in *) sa;
+    struct sockaddr_in * sinp = (struct sockaddr_in *) (*sa);
     memcpy (ap + 12, &(sinp->sin_addr), 4);
-    sin6.sin6_port = sinp->sin_port;
-/* use the new IPv6 address.  Again, sa is only used within send_udp */
-    sa = (struct sockaddr *) (&sin6);
+    sin6->sin6_port = sinp->sin_port;
+    *sa = (struct sockaddr *) sin6;  /* use the new IPv6 address */
   }
 #endif /* CONVERT_IPV4_TO_IPV6 */
+  return addr_len;
+}
+
+#ifndef MSG_NOSIGNAL  /* some OSs don't define MSG_NOSIGNAL.  To handle this,
+                       * astart requests ignoring SIGPIPE.  But using
+                       * MSG_NOSIGNAL, where available, is more
+                       * fine-grained and therefore better in principle */
+#define MSG_NOSIGNAL	0		/* no flag */
+#endif /* MSG_NOSIGNAL */
+
+static int send_udp (int udp, char * message, unsigned int msize,
+                     struct sockaddr * sa, const char * caller)
+{
+  struct sockaddr_storage converted;  /* used only within send_udp */
+  socklen_t addr_len = udp_dest_addr (&sa, &converted);
   char description [1000];
   snprintf (description, sizeof (description),
             "send_udp %s sending to address", caller);
@@ -306,12 +332,6 @@ static int send_udp (int udp, char * message, unsigned int msize,
   snprintf (alog->b, alog->s, "sendto (%d, %p, %d, 0, %p, %d)\n",
             udp, message, msize, sa, (int) addr_len);
   log_print (alog);
-#ifndef MSG_NOSIGNAL  /* some OSs don't define MSG_NOSIGNAL.  To handle this,
-                       * astart requests ignoring SIGPIPE.  But using
-                       * MSG_NOSIGNAL, where available, is more
-                       * fine-grained and therefore better in principle */
-#define MSG_NOSIGNAL	0		/* no flag */
-#endif /* MSG_NOSIGNAL */
   int flags = MSG_NOSIGNAL;
   size_t s = sendto (udp, message, msize, flags, sa, addr_len);
   int saved_errno = errno;
@@ -335,6 +355,77 @@ static int send_udp (int udp, char * message, unsigned int msize,
   return 1;
 }
 
+/* sends the same message to each of the n addresses.
+ * returns the number of addresses the message was sent to */
+static int send_udp_many (int udp, char * message, unsigned int msize,
+                          struct sockaddr_storage * addrs, int n,
+                          const char * caller)
+{
+#ifdef USE_SENDMMSG
+#define UDP_SEND_BATCH	32
+  struct mmsghdr msgs [UDP_SEND_BATCH];
+  struct sockaddr_storage converted [UDP_SEND_BATCH];
+  struct iovec iov;
+  iov.iov_base = message;
+  iov.iov_len = msize;
+  int sent = 0;
+  int errors = 0;
+  int first = 0;
+  while (first < n) {
+    int count = n - first;
+    if (count > UDP_SEND_BATCH)
+      count = UDP_SEND_BATCH;
+    memset (msgs, 0, sizeof (msgs));
+    int i;
+    for (i = 0; i < count; i++) {
+      struct sockaddr * sa = (struct sockaddr *) (addrs + first + i);
+      socklen_t alen = udp_dest_addr (&sa, converted + i);
+      msgs [i].msg_hdr.msg_name = sa;
+      msgs [i].msg_hdr.msg_namelen = alen;
+      msgs [i].msg_hdr.msg_iov = &iov;
+      msgs [i].msg_hdr.msg_iovlen = 1;
+    }
+    int next = 0;
+    while (next < count) {
+      int s = sendmmsg (udp, msgs + next, count - next, MSG_NOSIGNAL);
+      if (s > 0) {
+        sent += s;
+        next += s;
+      } else {  /* the message at next could not be sent, skip it */
+        int saved_errno = errno;
+        int off = snprintf (alog->b, alog->s,
+                            "error sending %d (error %d) on udp %d to ",
+                            msize, saved_errno, udp);
+        print_sockaddr_str ((struct sockaddr *) (msgs [next].msg_hdr.msg_name),
+                            0, 0, alog->b + off, alog->s - off);
+        errno = saved_errno;
+        log_error (alog, "sendmmsg");
+        errors++;
+        next++;
+      }
+    }
+    first += count;
+  }
+#undef UDP_SEND_BATCH
+  if (sent > 0)
+    last_successful_udp = time (NULL);
+  if (n > 0) {
+    snprintf (alog->b, alog->s,
+              "send_udp_many %s sent %d bytes to %d addresses, %d errors\n",
+              caller, msize, sent, errors);
+    log_print (alog);
+  }
+  return sent;
+#else /* ! USE_SENDMMSG */
+  int sent = 0;
+  int i;
+  for (i = 0; i < n; i++)
+    sent += send_udp (udp, message, msize, (struct sockaddr *) (addrs + i),
+                      caller);
+  return sent;
+#endif /* USE_SENDMMSG */
+}
+
 /* returns 1 for success, 0 for failure */
 static int send_udp_addr (int udp, char * message, unsigned int msize,
                           struct internet_addr * addr)
@@ -470,12 +561,14 @@ static void forward_message (int * fds, int num_fds, int udp, void * udp_cache,
     return;   /* sent to exact match, done */
   }
 
+/* the UDP destinations are collected in udp_dests, and sent to at the end */
+#define DHT_SENDS	4
+#define FORWARDING_UDPS	100
+  struct sockaddr_storage udp_dests [DHT_SENDS + FORWARDING_UDPS];
 /* send to at most 4 closer DHT nodes */
   int i;
-#define DHT_SENDS	4
-  struct sockaddr_storage dht_storage [DHT_SENDS];
   int dht_sends = routing_top_dht_matches (hp->destination, hp->dst_nbits,
-                                           dht_storage, DHT_SENDS);
+                                           udp_dests, DHT_SENDS);
   if (dht_sends > max_send)
     dht_sends = max_send;
 #undef DHT_SENDS
@@ -483,9 +576,7 @@ static void forward_message (int * fds, int num_fds, int udp, void * udp_cache,
   snprintf (alog->b, alog->s, "routing_top_dht_matches: %d\n", dht_sends);
   log_print (alog);
 #endif /* LOG_PACKETS */
-  for (i = 0; i < dht_sends; i++)
-    send_udp (udp, message, msize, ((struct sockaddr *) (&(dht_storage [i]))),
-              "forward_message dht_storage");
+  int num_dests = dht_sends;
   max_send -= dht_sends;
 
   int max_listen = max_send / 2 + 1;
@@ -508,7 +599,6 @@ static void forward_message (int * fds, int num_fds, int udp, void * udp_cache,
   }
 
   /* now send to a random subset of recently received-from addresses */
-#define FORWARDING_UDPS	100
   void * udps [FORWARDING_UDPS];
   int num_udps = cache_random (udp_cache, FORWARDING_UDPS, udps);
   struct udp_cache_record * * ucrs = (struct udp_cache_record * *) udps;
@@ -520,13 +610,14 @@ static void forward_message (int * fds, int num_fds, int udp, void * udp_cache,
     int * random_selection = random_permute (num_udps);
     for (i = 0; i < num_send_udps; i++) {
       struct udp_cache_record * ucr = ucrs [random_selection [i]];
-      send_udp (udp, message, msize, (struct sockaddr *) (&(ucr->sas)),
-              "forward_message udp_cache");
+      udp_dests [num_dests++] = ucr->sas;
     }
     if ((num_udps > 0) && (random_selection != NULL))
       free (random_selection);
   }
   max_send -= num_send_udps;  /* useful if we want to add code below this */
+  send_udp_many (udp, message, msize, udp_dests, num_dests,
+                 "forward_message");
 #ifdef LOG_PACKETS
   snprintf (alog->b, alog->s, "forwarded to %d+%d TCP and %d UDP\n",
             dht_sends, num_send_fds, num_send_udps);
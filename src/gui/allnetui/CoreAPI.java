@@ -77,6 +77,13 @@ public interface CoreAPI {
     //         a negative value of max requests all messages
     Message[] getMessages(String contact, int max);
 
+    // @return up to max (> 0) saved messages to/from this contact that
+    //         are older than last, latest first, or the latest if last
+    //         is null.  Use the last message returned to get the next page.
+    //         messages sent at the same time with the same sequence number
+    //         as the last one are all returned, even if more than max
+    Message[] getMessagesBefore(String contact, int max, Message last);
+
     // set that the contact was read now
     void setReadTime(String contact);
 
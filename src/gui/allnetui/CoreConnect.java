@@ -55,6 +55,7 @@ public class CoreConnect extends Thread implements CoreAPI {
     static final byte guiGetMessages = 40;
     static final byte guiSendMessage = 41;
     static final byte guiSendBroadcast = 42;
+    static final byte guiGetMessagesBefore = 43;
 
     static final byte guiKeyExchange = 50;
     static final byte guiSubscribe = 51;
@@ -570,6 +571,28 @@ public class CoreConnect extends Thread implements CoreAPI {
         return result;
     }
 
+    public Message[] getMessagesBefore(String contact, int max, Message last) {
+        Message[] result = null;
+        if ((! isValid(contact)) || (max <= 0))
+            return result;
+        long time = 0;   /* 0 and 0 request the latest messages */
+        long seq = 0;
+        if (last != null) {
+            time = last.sentTime / 1000 - allnetY2kSecondsInUnix;
+            seq = last.sequence;
+        }
+        byte[] request = new byte[25 + SocketUtils.numBytes(contact) + 1];
+        request[0] = guiGetMessagesBefore;
+        SocketUtils.w64(request, 1, max);
+        SocketUtils.w64(request, 9, time);
+        SocketUtils.w64(request, 17, seq);
+        SocketUtils.wString(request, 25, contact);
+        byte[] response = doRPC(request);
+        long count = SocketUtils.b64(response, 1);
+        result = SocketUtils.bMessages(response, 9, count, contact, false);
+        return result;
+    }
+
     // set that the contact was read now
     public void setReadTime(String contact) {
         if (isValid(contact)) {
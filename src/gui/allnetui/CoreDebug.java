@@ -123,6 +123,10 @@ public class CoreDebug implements CoreAPI {
         return (new Message[0]);
     }
 
+    public Message[] getMessagesBefore(String contact, int max, Message last) {
+        return (new Message[0]);
+    }
+
     // set that the contact was read now
     public void setReadTime(String contact) {
     }
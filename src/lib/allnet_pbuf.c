@@ -0,0 +1,176 @@
+/* allnet_pbuf.c: reference-counted packet buffers */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "packet.h"
+#include "util.h"
+#include "allnet_pbuf.h"
+
+/* the pool grows by this many buffers at a time */
+#define PBUF_CHUNK	16
+/* never keep more than this many buffers (about 12MB) in the pool.
+ * Beyond this, buffers are malloc'd and freed individually */
+#define PBUF_MAX_POOLED	1024
+
+/* reference counts and statistics are updated with atomic operations,
+ * so the mutex is only needed to take buffers from and return them to
+ * the free list, which happens once per buffer rather than once per use */
+static pthread_mutex_t pbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct allnet_pbuf * free_list = NULL;
+static unsigned int num_pooled = 0;
+static struct allnet_pbuf_stats stats = { 0, 0, 0, 0 };
+
+static void count (unsigned long long int * counter,
+                   unsigned long long int amount)
+{
+  __atomic_fetch_add (counter, amount, __ATOMIC_RELAXED);
+}
+
+/* must be called with pbuf_mutex held.  returns 1 if it was able
+ * to add buffers to the free list, 0 otherwise */
+static int grow_pool ()
+{
+  if (num_pooled + PBUF_CHUNK > PBUF_MAX_POOLED)
+    return 0;
+  struct allnet_pbuf * headers =
+    malloc (PBUF_CHUNK * sizeof (struct allnet_pbuf));
+  char * slabs = malloc (PBUF_CHUNK * ALLNET_MTU);
+  if ((headers == NULL) || (slabs == NULL)) {
+    if (headers != NULL) free (headers);
+    if (slabs != NULL) free (slabs);
+    return 0;
+  }
+  count (&(stats.malloc_allocs), 2);
+  int i;
+  for (i = 0; i < PBUF_CHUNK; i++) {
+    headers [i].slab = slabs + i * ALLNET_MTU;
+    headers [i].data = headers [i].slab;
+    headers [i].len = 0;
+    headers [i].refs = 0;
+    headers [i].adopted = 0;
+    headers [i].next_free = free_list;
+    free_list = headers + i;
+  }
+  num_pooled += PBUF_CHUNK;
+  return 1;
+}
+
+/* returns a pooled buffer, or NULL if the pool is exhausted */
+static struct allnet_pbuf * from_pool ()
+{
+  struct allnet_pbuf * result = NULL;
+  pthread_mutex_lock (&pbuf_mutex);
+  if ((free_list != NULL) || (grow_pool ())) {
+    result = free_list;
+    free_list = result->next_free;
+    result->next_free = NULL;
+    result->refs = 1;
+  }
+  pthread_mutex_unlock (&pbuf_mutex);
+  if (result != NULL)
+    count (&(stats.pool_allocs), 1);
+  return result;
+}
+
+/* returns a buffer with room for len bytes and a single reference.
+ * if len <= ALLNET_MTU, the buffer comes from the pool.
+ * never returns NULL */
+struct allnet_pbuf * allnet_pbuf_new (unsigned int len)
+{
+  struct allnet_pbuf * result = NULL;
+  if (len <= ALLNET_MTU)
+    result = from_pool ();
+  if (result == NULL) {   /* large buffer, or pool exhausted */
+    result = malloc_or_fail (sizeof (struct allnet_pbuf) + len,
+                             "allnet_pbuf_new");
+    result->data = ((char *) result) + sizeof (struct allnet_pbuf);
+    result->slab = NULL;
+    result->adopted = 0;
+    result->next_free = NULL;
+    result->refs = 1;
+    count (&(stats.malloc_allocs), 1);
+  }
+  result->len = len;
+  return result;
+}
+
+/* same, but copies len bytes of data into the new buffer */
+struct allnet_pbuf * allnet_pbuf_copy (const char * data, unsigned int len)
+{
+  struct allnet_pbuf * result = allnet_pbuf_new (len);
+  memcpy (result->data, data, len);
+  allnet_pbuf_count_copy (len);
+  return result;
+}
+
+/* takes ownership of malloc'd data, which is freed when the last
+ * reference is released.  Nothing is copied */
+struct allnet_pbuf * allnet_pbuf_adopt (char * data, unsigned int len)
+{
+  struct allnet_pbuf * result = from_pool ();
+  if (result == NULL) {
+    result = malloc_or_fail (sizeof (struct allnet_pbuf), "allnet_pbuf_adopt");
+    result->slab = NULL;
+    result->next_free = NULL;
+    result->refs = 1;
+    count (&(stats.malloc_allocs), 1);
+  }
+  result->data = data;
+  result->len = len;
+  result->adopted = 1;
+  return result;
+}
+
+/* adds a reference, to be released with allnet_pbuf_release */
+void allnet_pbuf_ref (struct allnet_pbuf * pbuf)
+{
+  __atomic_fetch_add (&(pbuf->refs), 1, __ATOMIC_RELAXED);
+}
+
+/* releases a reference, and if it was the last, recycles the buffer */
+void allnet_pbuf_release (struct allnet_pbuf * pbuf)
+{
+  int refs = __atomic_sub_fetch (&(pbuf->refs), 1, __ATOMIC_ACQ_REL);
+  if (refs > 0)
+    return;
+  if (refs < 0) {
+    printf ("allnet_pbuf_release error: %p had %d references\n",
+            pbuf, refs + 1);
+    __atomic_fetch_add (&(pbuf->refs), 1, __ATOMIC_RELAXED);
+    return;
+  }
+  /* this was the last reference, nobody else is using the buffer */
+  if (pbuf->adopted)
+    free (pbuf->data);
+  if (pbuf->slab == NULL) {  /* malloc'd by allnet_pbuf_new or _adopt */
+    free (pbuf);
+    return;
+  }
+  pbuf->data = pbuf->slab;   /* return it to the pool */
+  pbuf->adopted = 0;
+  pthread_mutex_lock (&pbuf_mutex);
+  pbuf->next_free = free_list;
+  free_list = pbuf;
+  pthread_mutex_unlock (&pbuf_mutex);
+}
+
+/* code that copies packet data (including pipemsg and allnet_queue)
+ * calls this so the copies show up in the statistics */
+void allnet_pbuf_count_copy (unsigned int bytes)
+{
+  count (&(stats.copies), 1);
+  count (&(stats.copy_bytes), bytes);
+}
+
+void allnet_pbuf_get_stats (struct allnet_pbuf_stats * result)
+{
+  result->pool_allocs =
+    __atomic_load_n (&(stats.pool_allocs), __ATOMIC_RELAXED);
+  result->malloc_allocs =
+    __atomic_load_n (&(stats.malloc_allocs), __ATOMIC_RELAXED);
+  result->copies = __atomic_load_n (&(stats.copies), __ATOMIC_RELAXED);
+  result->copy_bytes = __atomic_load_n (&(stats.copy_bytes), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,56 @@
+/* allnet_pbuf.h: reference-counted packet buffers */
+/* a packet buffer holds one packet, and can be shared (without copying)
+ * by several queues or other users.  Each user holds a reference, and
+ * the buffer is returned to its pool when the last reference is released.
+ * buffers of up to ALLNET_MTU bytes come from a pool of preallocated
+ * ALLNET_MTU-sized slabs, so receiving and forwarding a packet normally
+ * does not call malloc */
+
+#ifndef ALLNET_PBUF_H
+#define ALLNET_PBUF_H
+
+struct allnet_pbuf {
+  char * data;          /* the packet, do not modify while shared */
+  unsigned int len;     /* number of bytes of data used */
+  /* the rest is private to allnet_pbuf.c */
+  int refs;             /* number of references, 0 when free */
+  char * slab;          /* this buffer's pool slab, or NULL if not pooled */
+  int adopted;          /* data was malloc'd by the caller, free it */
+  struct allnet_pbuf * next_free;
+};
+
+/* returns a buffer with room for len bytes and a single reference.
+ * if len <= ALLNET_MTU, the buffer comes from the pool.
+ * never returns NULL */
+extern struct allnet_pbuf * allnet_pbuf_new (unsigned int len);
+
+/* same, but copies len bytes of data into the new buffer */
+extern struct allnet_pbuf * allnet_pbuf_copy (const char * data,
+                                              unsigned int len);
+
+/* takes ownership of malloc'd data, which is freed when the last
+ * reference is released.  Nothing is copied */
+extern struct allnet_pbuf * allnet_pbuf_adopt (char * data, unsigned int len);
+
+/* adds a reference, to be released with allnet_pbuf_release */
+extern void allnet_pbuf_ref (struct allnet_pbuf * pbuf);
+
+/* releases a reference, and if it was the last, recycles the buffer */
+extern void allnet_pbuf_release (struct allnet_pbuf * pbuf);
+
+/* counters for the packet buffers and for copies of packet data,
+ * since the start of the process */
+struct allnet_pbuf_stats {
+  unsigned long long int pool_allocs;    /* buffers taken from the pool */
+  unsigned long long int malloc_allocs;  /* buffers or slabs malloc'd */
+  unsigned long long int copies;         /* copies of packet data */
+  unsigned long long int copy_bytes;     /* bytes copied */
+};
+
+/* code that copies packet data (including pipemsg and allnet_queue)
+ * calls this so the copies show up in the statistics */
+extern void allnet_pbuf_count_copy (unsigned int bytes);
+
+extern void allnet_pbuf_get_stats (struct allnet_pbuf_stats * stats);
+
+#endif /* ALLNET_PBUF_H */
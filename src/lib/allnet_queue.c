@@ -1,42 +1,89 @@
 /* queue.c: used to transmit messages between allnet blocks */
 /* each queue of messages has limited size.  If a message
  * is added to a queue that is already full, the lowest priority
- * message in the queue is discarded to make room for the new message */
+ * message in the queue is discarded to make room for the new message.
+ * messages are dequeued highest priority first */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #include "allnet_queue.h"
+#include "allnet_pbuf.h"
 
 /* global, but not used in this code */
 struct allnet_queue * * allnet_queues = NULL;
 
+/* the filled entries are kept in two heaps: the high heap gives the
+ * highest priority (and, among equal priorities, the oldest) entry,
+ * which is the next to be dequeued.  The low heap gives the lowest
+ * priority (and oldest) entry, which is the first to be discarded when
+ * the queue is full.  The packet bytes are stored one after the other
+ * in a circular buffer in order of arrival.  Removing a packet other
+ * than the oldest leaves a hole, and the buffer is only compacted when
+ * there is enough free space, but not after the newest packet.
+ * A packet added with allnet_enqueue_pbuf is not copied into the buffer,
+ * instead the entry holds a reference to the packet buffer */
 struct queue_entry {
   unsigned int start_offset;  /* allnet_queue_buf + start_offset */
   unsigned int length;
+  unsigned int stored;        /* bytes in the buffer: length, or 0 if pbuf */
+  struct allnet_pbuf * pbuf;  /* if not NULL, the packet is in pbuf */
   unsigned int priority;
+  unsigned long long int seq; /* order of arrival, to break ties */
+  int prev;                   /* previous entry in the buffer, or -1 */
+  int next;                   /* next entry in the buffer or free list, or -1 */
+  unsigned int high_pos;      /* index of this entry in the high heap */
+  unsigned int low_pos;       /* index of this entry in the low heap */
 };
 
+/* a thread blocked in allnet_dequeue registers one of these with each
+ * of the queues it is waiting on.  allnet_enqueue signals every waiter
+ * registered with the queue, so the waiter wakes up as soon as there is
+ * a packet, rather than polling */
+struct queue_waiter {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int signaled;
+};
+
+/* more than a handful of threads waiting on the same queue would be
+ * unusual.  Any additional waiters fall back to polling every ms */
+#define MAX_QUEUE_WAITERS	8
+
 struct allnet_queue {
   int valid;
   char * debug_info;
   pthread_mutex_t mutex;
+  struct queue_waiter * waiters [MAX_QUEUE_WAITERS]; /* protected by mutex */
   unsigned int count;      /* number of filled queue entries */
-  unsigned int first;      /* number of first filled queue entry, if any */
+  unsigned int used_bytes; /* bytes stored by the filled entries */
+  unsigned int span;       /* bytes from the start of first to the end
+                              of last, including any holes */
+  int first;               /* oldest filled entry, or -1 */
+  int last;                /* newest filled entry, or -1 */
+  int free;                /* first unused entry, or -1 */
+  unsigned long long int seq;  /* sequence number for the next packet */
   unsigned int max_packets;
   unsigned int max_bytes;
   struct queue_entry packets [1];  /* actually, max_packets entries */
-  /* max_packets queue_entries followed by max_bytes bytes */
-  /* address of the bytes buffer is available from allnet_queue_buf */
+  /* max_packets queue_entries followed by the high and low heaps, each
+   * max_packets unsigned ints, followed by max_bytes bytes */
+  /* the addresses are available from allnet_queue_high, allnet_queue_low,
+   * and allnet_queue_buf */
 };
 
-#define allnet_queue_buf(q)	((unsigned char *)(q) +            \
-                                 sizeof(struct allnet_queue) +     \
-                                 (((q)->max_packets - 1) *         \
-                                  sizeof (struct queue_entry)))
+#define allnet_queue_high(q)	((unsigned int *)                  \
+                                 ((q)->packets + (q)->max_packets))
+#define allnet_queue_low(q)	(allnet_queue_high (q) + (q)->max_packets)
+#define allnet_queue_buf(q)	((unsigned char *)                 \
+                                 (allnet_queue_low (q) + (q)->max_packets))
+/* the entry that will be dequeued next, if count > 0 */
+#define allnet_queue_next(q)	((q)->packets + allnet_queue_high (q) [0])
 
 /* queue may be malloc'd, should be free'd with queue_recycle */
 struct allnet_queue * allnet_queue_new (const char * debug_name,
@@ -48,7 +95,8 @@ struct allnet_queue * allnet_queue_new (const char * debug_name,
   if (max_bytes == 0)
     printf ("allnet_queue_new %s warning: max_bytes is 0\n", debug_name);
   size_t size = strlen (debug_name) + 1 + sizeof (struct allnet_queue) +
-                max_packets * sizeof (struct queue_entry) + max_bytes;
+                max_packets * sizeof (struct queue_entry) +
+                2 * max_packets * sizeof (unsigned int) + max_bytes;
   struct allnet_queue * result = malloc (size);
   if (result == NULL) {
     printf ("%s: unable to allocate queue, size %ld, %d packets, %d bytes\n",
@@ -57,16 +105,27 @@ struct allnet_queue * allnet_queue_new (const char * debug_name,
   }
   result->valid = 0;
   pthread_mutex_init (&(result->mutex), NULL);
+  memset (result->waiters, 0, sizeof (result->waiters));
   result->debug_info = ((char *)(result)) + size - (strlen (debug_name) + 1);
   strcpy (result->debug_info, debug_name);
   result->count = 0;
-  result->first = 0;
+  result->used_bytes = 0;
+  result->span = 0;
+  result->first = -1;
+  result->last = -1;
+  result->seq = 0;
   result->max_packets = max_packets;
   result->max_bytes = max_bytes;
+  unsigned int i;
+  for (i = 0; i < max_packets; i++)  /* all entries are in the free list */
+    result->packets [i].next = ((i + 1 < max_packets) ? (int) (i + 1) : -1);
+  result->free = ((max_packets > 0) ? 0 : -1);
   result->valid = 1;
   return result;
 }
 
+static void remove_entry (struct allnet_queue * queue, int index);
+
 void allnet_queue_recycle (struct allnet_queue * queue)
 {
   if (! queue->valid) {
@@ -77,63 +136,247 @@ printf ("freeing %s: %d, %d, %d, %d %d\n", queue->debug_info,
         queue->valid, queue->count, queue->first,
         queue->max_packets, queue->max_bytes);
   queue->valid = 0;
+  while (queue->count > 0)   /* release any packet buffers */
+    remove_entry (queue, queue->first);
   pthread_mutex_destroy (&(queue->mutex));
   free (queue);
 }
 
-static unsigned int used_space (struct allnet_queue * queue)
+/* returns 1 if entry a belongs closer to the top of the heap than b */
+static int heap_before (struct allnet_queue * queue, int high,
+                        unsigned int a, unsigned int b)
 {
-  unsigned int i;
-  unsigned int result = 0;
-  int index = queue->first;
-  for (i = 0; i < queue->count; i++) {
-    result += queue->packets [index].length;
-    index = (index + 1) % queue->max_packets;
+  struct queue_entry * ea = queue->packets + a;
+  struct queue_entry * eb = queue->packets + b;
+  if (ea->priority != eb->priority)
+    return ((high) ? (ea->priority > eb->priority)
+                   : (ea->priority < eb->priority));
+  return (ea->seq < eb->seq);   /* older first in both heaps */
+}
+
+static unsigned int * heap_array (struct allnet_queue * queue, int high)
+{
+  return ((high) ? (allnet_queue_high (queue)) : (allnet_queue_low (queue)));
+}
+
+/* records in the entry its position pos in the heap */
+static void heap_set (struct allnet_queue * queue, int high,
+                      unsigned int pos, unsigned int entry)
+{
+  heap_array (queue, high) [pos] = entry;
+  if (high)
+    queue->packets [entry].high_pos = pos;
+  else
+    queue->packets [entry].low_pos = pos;
+}
+
+/* restores the heap property for the element at pos, in a heap of size n */
+static void heap_fix (struct allnet_queue * queue, int high,
+                      unsigned int pos, unsigned int n)
+{
+  unsigned int * heap = heap_array (queue, high);
+  unsigned int entry = heap [pos];
+  while ((pos > 0) &&
+         (heap_before (queue, high, entry, heap [(pos - 1) / 2]))) {
+    heap_set (queue, high, pos, heap [(pos - 1) / 2]);
+    pos = (pos - 1) / 2;
   }
-  return result;
+  while (2 * pos + 1 < n) {
+    unsigned int child = 2 * pos + 1;
+    if ((child + 1 < n) &&
+        (heap_before (queue, high, heap [child + 1], heap [child])))
+      child = child + 1;
+    if (! heap_before (queue, high, heap [child], entry))
+      break;
+    heap_set (queue, high, pos, heap [child]);
+    pos = child;
+  }
+  heap_set (queue, high, pos, entry);
+}
+
+/* removes the element at pos from a heap of size n */
+static void heap_remove (struct allnet_queue * queue, int high,
+                         unsigned int pos, unsigned int n)
+{
+  if (pos + 1 < n) {
+    heap_set (queue, high, pos, heap_array (queue, high) [n - 1]);
+    heap_fix (queue, high, pos, n - 1);
+  }
+}
+
+/* number of bytes from offset from to offset to in the circular buffer */
+static unsigned int ring_distance (struct allnet_queue * queue,
+                                   unsigned int from, unsigned int to)
+{
+  return (to + queue->max_bytes - from) % queue->max_bytes;
+}
+
+/* must be called with the queue mutex held.  Removes the filled entry */
+static void remove_entry (struct allnet_queue * queue, int index)
+{
+  struct queue_entry * e = queue->packets + index;
+  heap_remove (queue, 1, e->high_pos, queue->count);
+  heap_remove (queue, 0, e->low_pos, queue->count);
+  if (e->prev < 0) {   /* the oldest, so the span now starts later */
+    queue->first = e->next;
+    if (e->next >= 0)
+      queue->span -= ring_distance (queue, e->start_offset,
+                                    queue->packets [e->next].start_offset);
+  } else {
+    queue->packets [e->prev].next = e->next;
+  }
+  if (e->next < 0) {   /* the newest, so the span now ends earlier */
+    queue->last = e->prev;
+    if (e->prev >= 0) {
+      struct queue_entry * prev = queue->packets + e->prev;
+      queue->span -= ring_distance (queue, prev->start_offset + prev->stored,
+                                    e->start_offset + e->stored);
+    }
+  } else {
+    queue->packets [e->next].prev = e->prev;
+  }
+  if (queue->first < 0)
+    queue->span = 0;
+  e->next = queue->free;
+  queue->free = index;
+  queue->used_bytes -= e->stored;
+  if (e->pbuf != NULL) {
+    allnet_pbuf_release (e->pbuf);
+    e->pbuf = NULL;
+  }
+  queue->count = queue->count - 1;
+}
+
+/* copies length bytes from offset from to the earlier offset to, where
+ * both may wrap around the end of the circular buffer */
+static void ring_move (struct allnet_queue * queue, unsigned int to,
+                       unsigned int from, unsigned int length)
+{
+  unsigned char * storage = allnet_queue_buf (queue);
+  while (length > 0) {
+    unsigned int chunk = length;
+    if (chunk > queue->max_bytes - to)
+      chunk = queue->max_bytes - to;
+    if (chunk > queue->max_bytes - from)
+      chunk = queue->max_bytes - from;
+    memmove (storage + to, storage + from, chunk);
+    to = (to + chunk) % queue->max_bytes;
+    from = (from + chunk) % queue->max_bytes;
+    length -= chunk;
+  }
+}
+
+/* must be called with the queue mutex held and count > 0.  Moves each
+ * packet to follow the previous one, removing any holes.  Since packets
+ * only move to earlier positions and are moved oldest first, no packet
+ * is overwritten before it is moved */
+static void compact (struct allnet_queue * queue)
+{
+  unsigned int offset = queue->packets [queue->first].start_offset;
+  int index;
+  for (index = queue->first; index >= 0; index = queue->packets [index].next) {
+    struct queue_entry * e = queue->packets + index;
+    if (e->start_offset != offset)
+      ring_move (queue, offset, e->start_offset, e->stored);
+    e->start_offset = offset;
+    offset = (offset + e->stored) % queue->max_bytes;
+  }
+  queue->span = queue->used_bytes;
 }
 
+/* must be called with the queue mutex held, and stored < max_bytes.
+ * stored is the number of bytes that will be copied into the buffer, and
+ * is either length, or 0 if the packet stays in a packet buffer.
+ * if the queue is full, discards the lowest priority packets to make room.
+ * returns NULL if the new packet itself has lower priority than the
+ * packets that would have to be discarded, in which case the new packet
+ * should be discarded */
 static struct queue_entry * find_entry_and_space (struct allnet_queue * queue,
-                                                  unsigned int length)
+                                                  unsigned int length,
+                                                  unsigned int stored,
+                                                  unsigned int priority)
 {
-  if (queue->count == 0) {
-    queue->first = 0;
-    queue->packets [0].length = length;
-    queue->packets [0].start_offset = 0;
-    queue->count = 1;
-    return queue->packets;  /* return the first entry */
-  }
-  /* find the index of the last valid packet, use it to compute start */
-  int last = (queue->first + queue->count - 1) % queue->max_packets;
-  int start = (queue->packets [last].start_offset +
-               queue->packets [last].length) % queue->max_bytes;
-  int result;   /* index of new packet. Initialize entry before we return */
-  if (queue->count < queue->max_packets) {
-    result = (last + 1) % queue->max_packets;    /* index for new packet */
-    queue->count = queue->count + 1;       /* count including new packet */
-  } else {   /* discard the first packet */
-    result = queue->first;
-    queue->first = (queue->first + 1) % queue->max_packets;
-  }
-  queue->packets [result].length = 0;     /* don't count as used_space */
-  while ((used_space (queue) + length > queue->max_bytes) &&
-         (queue->count > 0)) { 
-    queue->packets [queue->first].length = 0;   /* discard one more packet */
-    queue->first = (queue->first + 1) % queue->max_packets;
-    queue->count = queue->count - 1;       /* count including new packet */
-  }
-  if ((used_space (queue) + length > queue->max_bytes)) { /* error */
-    printf ("error: queue count %d, total %d bytes, unable to handle %d/%d\n",
-            queue->count, used_space (queue), length, queue->max_bytes);
-    queue->count = 0;   /* remove all packets from the queue */
-    return find_entry_and_space (queue, length);
-  }
-  queue->packets [result].start_offset = start;
-  queue->packets [result].length = length;
-  return queue->packets + result;
-}
-
-/* succeeds and returns 1 as long as the queue is valid and plen <= max_bytes.
+  while ((queue->count > 0) &&
+         ((queue->count >= queue->max_packets) ||
+          (queue->used_bytes + stored > queue->max_bytes))) {
+    unsigned int lowest = allnet_queue_low (queue) [0];
+    if (queue->packets [lowest].priority > priority)
+      return NULL;
+    remove_entry (queue, lowest);
+  }
+  if ((queue->free < 0) || (queue->used_bytes + stored > queue->max_bytes))
+    return NULL;   /* max_packets or max_bytes is 0 */
+  unsigned int start = 0;
+  if (queue->count > 0) {
+    if (queue->span + stored > queue->max_bytes)
+      compact (queue);
+    start = (queue->packets [queue->first].start_offset + queue->span) %
+            queue->max_bytes;
+  }
+  int index = queue->free;
+  struct queue_entry * e = queue->packets + index;
+  queue->free = e->next;
+  e->start_offset = start;
+  e->length = length;
+  e->stored = stored;
+  e->pbuf = NULL;
+  e->priority = priority;
+  e->seq = queue->seq++;
+  e->prev = queue->last;
+  e->next = -1;
+  if (queue->last >= 0)
+    queue->packets [queue->last].next = index;
+  else
+    queue->first = index;
+  queue->last = index;
+  queue->span += stored;
+  queue->used_bytes += stored;
+  queue->count = queue->count + 1;
+  heap_set (queue, 1, queue->count - 1, index);
+  heap_fix (queue, 1, queue->count - 1, queue->count);
+  heap_set (queue, 0, queue->count - 1, index);
+  heap_fix (queue, 0, queue->count - 1, queue->count);
+  return e;
+}
+
+/* must be called with the queue mutex held */
+static void wake_waiters (struct allnet_queue * queue)
+{
+  int i;
+  for (i = 0; i < MAX_QUEUE_WAITERS; i++) {
+    struct queue_waiter * w = queue->waiters [i];
+    if (w != NULL) {
+      pthread_mutex_lock (&(w->mutex));
+      w->signaled = 1;
+      pthread_cond_signal (&(w->cond));
+      pthread_mutex_unlock (&(w->mutex));
+    }
+  }
+}
+
+/* must be called with the queue mutex held, and plen < max_bytes */
+static void copy_in (struct allnet_queue * queue,
+                     const unsigned char * packet, unsigned int plen,
+                     unsigned int priority)
+{
+  struct queue_entry * free = find_entry_and_space (queue, plen, plen,
+                                                    priority);
+  if (free == NULL)   /* discarded */
+    return;
+  allnet_pbuf_count_copy (plen);
+  unsigned char * storage = allnet_queue_buf (queue);
+  unsigned char * start = storage + free->start_offset;
+  if (free->start_offset + plen <= queue->max_bytes) {
+    memcpy (start, packet, plen);
+  } else {   /* copy to the start of the storage */
+    int initial = queue->max_bytes - free->start_offset;
+    memcpy (start, packet, initial);
+    memcpy (storage, packet + initial, plen - initial);
+  }
+}
+
+/* succeeds and returns 1 as long as the queue is valid and plen <= max_bytes,
+ * even if the packet is immediately discarded because of its low priority.
  * returns 0 otherwise */
 int allnet_enqueue (struct allnet_queue * queue,
                     const unsigned char * packet, unsigned int plen,
@@ -150,18 +393,9 @@ int allnet_enqueue (struct allnet_queue * queue,
     return 0;
   pthread_mutex_lock (&(queue->mutex));
   if (queue->valid) {
-    struct queue_entry * free = find_entry_and_space (queue, plen);
-    unsigned char * storage = allnet_queue_buf (queue);
-    unsigned char * start = storage + free->start_offset;
-    if (free->start_offset + plen <= queue->max_bytes) {
-      memcpy (start, packet, plen);
-    } else {   /* copy to the start of the storage */
-      int initial = queue->max_bytes - free->start_offset;
-      memcpy (start, packet, initial);
-      memcpy (storage, packet + initial, plen - initial);
-    }
-    free->priority = priority;
+    copy_in (queue, packet, plen, priority);
 /* printf ("added %d-byte message, queue has %d messages\n", plen, queue->count); */
+    wake_waiters (queue);
     pthread_mutex_unlock (&(queue->mutex));
     return 1;
   }  /* else invalid queue, no need to unlock */
@@ -169,6 +403,63 @@ int allnet_enqueue (struct allnet_queue * queue,
   return 0;
 }
 
+/* adds n packets to the queue while acquiring the lock only once.
+ * packets that are too large for the queue are skipped.
+ * returns the number of packets added, or 0 if the queue is not valid */
+int allnet_enqueue_many (struct allnet_queue * queue, unsigned int n,
+                         const unsigned char ** packets,
+                         const unsigned int * plens,
+                         const unsigned int * priorities)
+{
+  if (! queue->valid) {
+    printf ("error %s: invalid queue in allnet_enqueue_many\n",
+            queue->debug_info);
+    return 0;
+  }
+  int result = 0;
+  pthread_mutex_lock (&(queue->mutex));
+  if (queue->valid) {
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+      if (plens [i] < queue->max_bytes) {
+        copy_in (queue, packets [i], plens [i], priorities [i]);
+        result++;
+      } else {
+        printf ("%s: allnet_enqueue_many skipping %d-byte packet (max %d)\n",
+                queue->debug_info, plens [i], queue->max_bytes);
+      }
+    }
+    if (result > 0)
+      wake_waiters (queue);
+  }
+  pthread_mutex_unlock (&(queue->mutex));
+  return result;
+}
+
+/* adds a reference to the packet buffer to the queue, without copying
+ * the data.  Returns 1 if the queue is valid, 0 otherwise */
+int allnet_enqueue_pbuf (struct allnet_queue * queue,
+                         struct allnet_pbuf * pbuf, unsigned int priority)
+{
+  int result = 0;
+  pthread_mutex_lock (&(queue->mutex));
+  if (queue->valid) {
+    struct queue_entry * e =
+      find_entry_and_space (queue, pbuf->len, 0, priority);
+    if (e != NULL) {
+      allnet_pbuf_ref (pbuf);
+      e->pbuf = pbuf;
+    }
+    wake_waiters (queue);
+    result = 1;
+  } else {
+    printf ("error %s: invalid queue in allnet_enqueue_pbuf\n",
+            queue->debug_info);
+  }
+  pthread_mutex_unlock (&(queue->mutex));
+  return result;
+}
+
 static void sleep_ms (unsigned long ms)
 {
   if (ms > 0) {
@@ -181,36 +472,103 @@ static void sleep_ms (unsigned long ms)
 
 /* returns the index of a queue that has a packet, while holding the
  * lock for that queue.
- * if someone else is holding the lock for a queue, may incorrectly
- * report that the queue has no packets 
  * if no queue has a packet, returns -1 (and no lock is held) */
 static int queue_has (struct allnet_queue ** queues, unsigned int n)
 {
-  int restart = 1;
-  int loop_count = 0;
   int start = random () % n;
-  while ((restart) && (loop_count++ < 3)) {
-    restart = 0;
-    unsigned int counter;
-    for (counter = 0; counter < n; counter++) {
-      int i = (((int)counter) + start) % n;
-      if ((queues [i]->valid) && (queues [i]->count > 0)) {
-        if (pthread_mutex_trylock (&(queues [i]->mutex)) == 0) {
-          /* we have the lock */
-          if ((queues [i]->valid) && (queues [i]->count > 0))
-             /* count is still nonzero, we found one */
-            return i;   /* returning with lock held */
-          /* count became zero while trying the lock, release the lock */
-          pthread_mutex_unlock (&(queues [i]->mutex));
-        } else { /* mutex is locked by someone else, allow searching again */
-          restart = 1;
-        }
-      }
+  unsigned int counter;
+  for (counter = 0; counter < n; counter++) {
+    int i = (((int)counter) + start) % n;
+    if ((queues [i]->valid) && (queues [i]->count > 0)) {
+      /* the lock is only held briefly, so it is better to wait for it
+       * than to miss a packet and go to sleep */
+      pthread_mutex_lock (&(queues [i]->mutex));
+      if ((queues [i]->valid) && (queues [i]->count > 0))
+         /* count is still nonzero, we found one */
+        return i;   /* returning with lock held */
+      /* count became zero while waiting for the lock, release the lock */
+      pthread_mutex_unlock (&(queues [i]->mutex));
     }
   }
   return -1;
 }
 
+/* returns the number of queues the waiter was registered with, which may
+ * be less than n if some queue already has MAX_QUEUE_WAITERS waiters */
+static unsigned int add_waiter (struct allnet_queue ** queues, unsigned int n,
+                                struct queue_waiter * w)
+{
+  unsigned int result = 0;
+  unsigned int q;
+  for (q = 0; q < n; q++) {
+    pthread_mutex_lock (&(queues [q]->mutex));
+    int i;
+    for (i = 0; i < MAX_QUEUE_WAITERS; i++) {
+      if (queues [q]->waiters [i] == NULL) {
+        queues [q]->waiters [i] = w;
+        result++;
+        break;
+      }
+    }
+    pthread_mutex_unlock (&(queues [q]->mutex));
+  }
+  return result;
+}
+
+static void remove_waiter (struct allnet_queue ** queues, unsigned int n,
+                           struct queue_waiter * w)
+{
+  unsigned int q;
+  for (q = 0; q < n; q++) {
+    pthread_mutex_lock (&(queues [q]->mutex));
+    int i;
+    for (i = 0; i < MAX_QUEUE_WAITERS; i++)
+      if (queues [q]->waiters [i] == w)
+        queues [q]->waiters [i] = NULL;
+    pthread_mutex_unlock (&(queues [q]->mutex));
+  }
+}
+
+/* sets *ts to the current time plus ms */
+static void deadline_ms (struct timespec * ts, unsigned long ms)
+{
+  struct timeval now;
+  gettimeofday (&now, NULL);
+  unsigned long long int ns = now.tv_usec * 1000ULL + (ms % 1000) * 1000000ULL;
+  ts->tv_sec = now.tv_sec + ms / 1000 + ns / 1000000000ULL;
+  ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static int timespec_before (struct timespec * t1, struct timespec * t2)
+{
+  if (t1->tv_sec != t2->tv_sec)
+    return (t1->tv_sec < t2->tv_sec);
+  return (t1->tv_nsec < t2->tv_nsec);
+}
+
+/* must be called with the queue mutex held and queue->count > 0.
+ * copies the highest priority packet (which must fit) and removes it
+ * from the queue */
+static void copy_out (struct allnet_queue * queue, unsigned char * packet,
+                      unsigned int * priority)
+{
+  struct queue_entry * e = allnet_queue_next (queue);
+  allnet_pbuf_count_copy (e->length);
+  if (e->pbuf != NULL) {
+    memcpy (packet, e->pbuf->data, e->length);
+  } else {
+    unsigned int copy_length = e->length;
+    unsigned char * storage = allnet_queue_buf (queue);
+    if (e->start_offset + copy_length > queue->max_bytes)
+      copy_length = queue->max_bytes - e->start_offset;
+    memcpy (packet, storage + e->start_offset, copy_length);
+    if (copy_length < e->length)    /* data wraps around in storage */
+      memcpy (packet + copy_length, storage, e->length - copy_length);
+  }
+  *priority = e->priority;
+  remove_entry (queue, (int) (e - queue->packets));
+}
+
 /* returns 1 and fills in *plen if it returns a packet
  * returns -2 and fills in *plen if the first packet is larger than *plen
  * returns -1 for any other errors (e.g. if the queue is empty) */
@@ -221,30 +579,87 @@ static int dequeue_unlock (struct allnet_queue * queue, unsigned char * packet,
     pthread_mutex_unlock (&(queue->mutex));
     return -1;
   }
-  struct queue_entry * e = queue->packets + queue->first;
-  int buffer_length = *plen;
-  int packet_length = e->length;
-  *plen = packet_length;
-  if (buffer_length < packet_length) {
+  unsigned int buffer_length = *plen;
+  *plen = allnet_queue_next (queue)->length;
+  if (buffer_length < *plen) {
     pthread_mutex_unlock (&(queue->mutex));
     return -2;   /* we set *plen, so record the size */
   }
-  int copy_length = packet_length;
-  unsigned char * storage = allnet_queue_buf (queue);
-  unsigned char * start_ptr = storage + e->start_offset;
-  if (e->start_offset + copy_length > queue->max_bytes)
-    copy_length = queue->max_bytes - e->start_offset;
-  memcpy (packet, start_ptr, copy_length);
-  if (copy_length < packet_length)    /* data wraps around in storage */
-    memcpy (packet + copy_length, storage, packet_length - copy_length);
-  *priority = e->priority;
-    
-  queue->first = (queue->first + 1) % queue->max_packets;
-  queue->count = queue->count - 1;
+  copy_out (queue, packet, priority);
   pthread_mutex_unlock (&(queue->mutex));
   return 1;
 }
 
+/* returns 1 if any of the queues seems to have a packet, 0 otherwise.
+ * does not acquire any locks, so the result is only a hint */
+static int any_has (struct allnet_queue ** queues, unsigned int n)
+{
+  unsigned int i;
+  for (i = 0; i < n; i++)
+    if ((queues [i]->valid) && (queues [i]->count > 0))
+      return 1;
+  return 0;
+}
+
+/* waits until one of the n > 0 queues has a packet, or until the timeout.
+ * returns the index of a queue that has a packet, while holding the
+ * lock for that queue, or -1 (with no lock held) if the timeout expired */
+static int wait_for_packet (struct allnet_queue ** queues, unsigned int n,
+                            unsigned int timeout_ms)
+{
+  int index = queue_has (queues, n);
+  if ((index >= 0) || (timeout_ms == 0))
+    return index;
+  struct queue_waiter w;
+  pthread_mutex_init (&(w.mutex), NULL);
+  pthread_cond_init (&(w.cond), NULL);
+  int forever = (timeout_ms == (unsigned int) -1);
+  struct timespec finish = { 0, 0 };
+  if (! forever)
+    deadline_ms (&finish, timeout_ms);
+  while (1) {
+    /* register with every queue, then sleep until an enqueue wakes us.
+     * Since we register before checking again, no enqueue can be missed */
+    w.signaled = 0;
+    int must_poll = (add_waiter (queues, n, &w) < n);
+    int expired = 0;
+    while ((! expired) && (! any_has (queues, n))) {
+      struct timespec wake = finish;
+      if (must_poll) {   /* wait at most 1ms */
+        deadline_ms (&wake, 1);
+        if ((! forever) && (timespec_before (&finish, &wake)))
+          wake = finish;
+      }
+      int timed_out = 0;
+      pthread_mutex_lock (&(w.mutex));
+      while ((! w.signaled) && (! timed_out)) {
+        if ((forever) && (! must_poll))
+          pthread_cond_wait (&(w.cond), &(w.mutex));
+        else
+          timed_out = (pthread_cond_timedwait (&(w.cond), &(w.mutex), &wake)
+                       == ETIMEDOUT);
+      }
+      w.signaled = 0;
+      pthread_mutex_unlock (&(w.mutex));
+      if ((timed_out) && (! forever)) {
+        struct timespec now;
+        deadline_ms (&now, 0);
+        expired = (! timespec_before (&now, &finish));
+      }
+    }
+    /* remove the waiter before acquiring a queue lock, since holding
+     * two queue locks at once could deadlock with another consumer */
+    remove_waiter (queues, n, &w);
+    index = queue_has (queues, n);
+    /* if another consumer got the packet first, wait again */
+    if ((index >= 0) || (expired))
+      break;
+  }
+  pthread_cond_destroy (&(w.cond));
+  pthread_mutex_destroy (&(w.mutex));
+  return index;
+}
+
 /* the packet must point to plen bytes of available space.
  * when called, *nqueue should be the number of queues that queues points to
  *              on successful return, this call sets *nqueue to the number of
@@ -274,31 +689,113 @@ int allnet_dequeue (struct allnet_queue ** queues, unsigned int * nqueue,
     sleep_ms (timeout_ms);
     return 0;
   }
-  /* simple implementation: loop, checking the queues
-   * and sleeping 1ms until timeout */
-  while (1) {
-    int index = queue_has (queues, n);
-    if (index >= 0) { /* the lock for queues [index] is held */
-      *nqueue = index;
-      return dequeue_unlock (queues [index], packet, plen, priority);
+  int index = wait_for_packet (queues, n, timeout_ms);
+  if (index < 0)
+    return 0;
+  *nqueue = index;   /* the lock for queues [index] is held */
+  return dequeue_unlock (queues [index], packet, plen, priority);
+}
+
+/* same as allnet_dequeue, but removes as many packets as fit (up to
+ * *npackets) from a single queue while acquiring its lock only once.
+ * the packets are copied one after the other into buffer, which must
+ * point to bsize bytes.  plens and priorities must each have room
+ * for *npackets entries.
+ * on successful return, sets *nqueue as for allnet_dequeue, and
+ *              sets *npackets to the number of packets returned
+ * returns 1 if it returns one or more packets
+ * returns 0 if all the queues are empty and the timeout expired
+ * returns -2 and fills in plens [0] and *nqueue if the first packet
+ *            is larger than bsize
+ * returns -1 for any other errors */
+int allnet_dequeue_many (struct allnet_queue ** queues, unsigned int * nqueue,
+                         unsigned int * npackets,
+                         unsigned char * buffer, unsigned int bsize,
+                         unsigned int * plens, unsigned int * priorities,
+                         unsigned int timeout_ms)
+{
+  unsigned int max = *npackets;
+  *npackets = 0;
+  if (max == 0)
+    return -1;
+  if (*nqueue == 0)
+    return allnet_dequeue (queues, nqueue, buffer, plens, priorities,
+                           timeout_ms);  /* sleeps, returns 0 */
+  int index = wait_for_packet (queues, *nqueue, timeout_ms);
+  if (index < 0)
+    return 0;
+  *nqueue = index;   /* the lock for queues [index] is held */
+  struct allnet_queue * queue = queues [index];
+  unsigned int used = 0;
+  unsigned int count = 0;
+  while ((count < max) && (queue->count > 0) &&
+         (used + allnet_queue_next (queue)->length <= bsize)) {
+    plens [count] = allnet_queue_next (queue)->length;
+    copy_out (queue, buffer + used, priorities + count);
+    used += plens [count];
+    count++;
+  }
+  int result = 1;
+  if ((count == 0) && (queue->count > 0)) {
+    plens [0] = allnet_queue_next (queue)->length;
+    result = -2;
+  } else if (count == 0) {   /* should not happen */
+    result = -1;
+  }
+  pthread_mutex_unlock (&(queue->mutex));
+  *npackets = count;
+  return result;
+}
+
+/* same as allnet_dequeue_many, but returns each packet in a packet buffer,
+ * which the caller must release.  Packets that were added with
+ * allnet_enqueue_pbuf are returned without copying */
+int allnet_dequeue_pbufs (struct allnet_queue ** queues, unsigned int * nqueue,
+                          unsigned int * npackets,
+                          struct allnet_pbuf ** pbufs,
+                          unsigned int * priorities, unsigned int timeout_ms)
+{
+  unsigned int max = *npackets;
+  *npackets = 0;
+  if (max == 0)
+    return -1;
+  if (*nqueue == 0) {
+    sleep_ms ((timeout_ms == (unsigned int) -1) ? 1000 : timeout_ms);
+    return 0;
+  }
+  int index = wait_for_packet (queues, *nqueue, timeout_ms);
+  if (index < 0)
+    return 0;
+  *nqueue = index;   /* the lock for queues [index] is held */
+  struct allnet_queue * queue = queues [index];
+  unsigned int count = 0;
+  while ((count < max) && (queue->count > 0)) {
+    struct queue_entry * e = allnet_queue_next (queue);
+    if (e->pbuf != NULL) {   /* hand over our reference */
+      pbufs [count] = e->pbuf;
+      e->pbuf = NULL;
+      priorities [count] = e->priority;
+      remove_entry (queue, (int) (e - queue->packets));
+    } else {
+      pbufs [count] = allnet_pbuf_new (e->length);
+      copy_out (queue, (unsigned char *) (pbufs [count]->data),
+                priorities + count);
     }
-    if (timeout_ms == 0)
-      return 0;
-    if (timeout_ms != (unsigned int) -1)
-      timeout_ms--;
-    sleep_ms (1);
+    count++;
   }
-  return -1;   /* should never get here */
+  pthread_mutex_unlock (&(queue->mutex));
+  *npackets = count;
+  return 1;
 }
 
-/* returns 1 if a packet was discarded, 0 otherwise */
+/* discards the packet that would be dequeued next, if any.
+ * returns 1 if a packet was discarded, 0 otherwise */
 int allnet_queue_discard_first (struct allnet_queue * queue)
 {
   int result = 0;
   pthread_mutex_lock (&(queue->mutex));
   if (queue->count > 0) {
-    queue->first = (queue->first + 1) % queue->max_packets;
-    queue->count = queue->count - 1;
+    remove_entry (queue, (int) (allnet_queue_next (queue) - queue->packets));
     result = 1;
   }
   pthread_mutex_unlock (&(queue->mutex));
@@ -319,6 +816,14 @@ const char * allnet_queue_info (struct allnet_queue * queue)
 }
 
 #ifdef QUEUE_UNIT_TEST
+/* gcc -DQUEUE_UNIT_TEST -o queue_test allnet_queue.c allnet_pbuf.c \
+ *     .libs/liballnet-*.a -lpthread
+ * ./queue_test runs the multithreaded test, ./queue_test -p tests that
+ * packets are discarded and dequeued in priority order, and
+ * ./queue_test -b measures the latency and throughput of the queues */
+
+#include <sched.h>
+#include <time.h>
 
 #define MTU	10000
 
@@ -427,9 +932,314 @@ static void * remove_thread (void * arg)
   return NULL;
 }
 
+static unsigned long long int time_us ()
+{
+  struct timeval now;
+  gettimeofday (&now, NULL);
+  return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+#define BENCH_PACKETS	100000
+#define BENCH_SIZE	100
+#define QUEUE_BENCH_BATCH	64
+
+/* each packet carries the time at which it was enqueued */
+static void * bench_add_thread (void * arg)
+{
+  struct allnet_queue * queue = (struct allnet_queue *) arg;
+  unsigned char buffer [BENCH_SIZE];
+  memset (buffer, 0, sizeof (buffer));
+  int i;
+  for (i = 0; i < BENCH_PACKETS; i++) {
+    unsigned long long int now = time_us ();
+    memcpy (buffer, &now, sizeof (now));
+    while (allnet_queue_size (queue) > 0)  /* measure latency, not drops */
+      sched_yield ();
+    allnet_enqueue (queue, buffer, sizeof (buffer), 1);
+    if (i % 1000 == 0)   /* let the consumer go back to sleep sometimes */
+      usleep (100);
+  }
+  return NULL;
+}
+
+/* measures the time from enqueue to dequeue, with a consumer that blocks
+ * on several queues at once, only one of which gets packets */
+static void latency_benchmark ()
+{
+  struct allnet_queue * queues [4];
+  int i;
+  for (i = 0; i < 4; i++)
+    queues [i] = allnet_queue_new ("benchmark queue", 10, 10 * MTU);
+  pthread_t adder;
+  pthread_create (&adder, NULL, bench_add_thread, (void *) (queues [2]));
+  unsigned long long int total = 0;
+  unsigned long long int max = 0;
+  unsigned long long int start = time_us ();
+  int received = 0;
+  while (received < BENCH_PACKETS) {
+    unsigned char packet [MTU];
+    unsigned int nqueue = 4;
+    unsigned int plen = sizeof (packet);
+    unsigned int priority;
+    int result = allnet_dequeue (queues, &nqueue, packet, &plen, &priority,
+                                 (unsigned int) -1);
+    if (result != 1) {
+      printf ("benchmark error: dequeue returned %d\n", result);
+      break;
+    }
+    unsigned long long int sent;
+    memcpy (&sent, packet, sizeof (sent));
+    unsigned long long int delta = time_us () - sent;
+    total += delta;
+    if (delta > max)
+      max = delta;
+    received++;
+  }
+  unsigned long long int elapsed = time_us () - start;
+  pthread_join (adder, NULL);
+  if (elapsed == 0)
+    elapsed = 1;
+  printf ("%d packets in %lluus, %llu packets/s, latency avg %lluus max %lluus\n",
+          received, elapsed, received * 1000000ULL / elapsed,
+          total / ((received > 0) ? received : 1), max);
+  for (i = 0; i < 4; i++)
+    allnet_queue_recycle (queues [i]);
+}
+
+static unsigned long long int thread_cpu_ns ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* time to add packets of varying sizes to a queue that is always full,
+ * so every enqueue has to discard one or more packets */
+static void full_queue_benchmark (unsigned int max_packets)
+{
+  struct allnet_queue * queue =
+    allnet_queue_new ("full queue", max_packets, max_packets * 500);
+  unsigned char buffer [1000];
+  memset (buffer, 0, sizeof (buffer));
+  int i;
+  for (i = 0; i < 2 * (int) max_packets; i++)  /* fill the queue */
+    allnet_enqueue (queue, buffer, 500, 1);
+  int loops = 100000;
+  unsigned long long int start = thread_cpu_ns ();
+  for (i = 0; i < loops; i++)
+    allnet_enqueue (queue, buffer, 100 + (i * 37) % 900, 1);
+  unsigned long long int ns = thread_cpu_ns () - start;
+  printf ("enqueue on full %u-packet queue: %lluns/packet\n",
+          max_packets, ns / loops);
+  allnet_queue_recycle (queue);
+}
+
+struct rate_arg {
+  struct allnet_queue * queue;
+  unsigned int rate;    /* packets per second */
+  int batch;            /* if nonzero, use allnet_enqueue_many */
+  unsigned long long int cpu_ns;
+};
+
+/* for one second, adds rate / 1000 packets every millisecond */
+static void * rate_add_thread (void * arg)
+{
+  struct rate_arg * ra = (struct rate_arg *) arg;
+  unsigned char buffer [BENCH_SIZE];
+  memset (buffer, 0, sizeof (buffer));
+  unsigned int burst = ra->rate / 1000;
+  const unsigned char * packets [1000];
+  unsigned int plens [1000];
+  unsigned int priorities [1000];
+  unsigned int i;
+  for (i = 0; i < burst; i++) {
+    packets [i] = buffer;
+    plens [i] = sizeof (buffer);
+    priorities [i] = 1;
+  }
+  ra->cpu_ns = 0;
+  int ms;
+  for (ms = 0; ms < 1000; ms++) {
+    unsigned long long int start = thread_cpu_ns ();
+    if (ra->batch) {
+      allnet_enqueue_many (ra->queue, burst, packets, plens, priorities);
+    } else {
+      for (i = 0; i < burst; i++)
+        allnet_enqueue (ra->queue, buffer, sizeof (buffer), 1);
+    }
+    ra->cpu_ns += thread_cpu_ns () - start;
+    usleep (1000);
+  }
+  return NULL;
+}
+
+/* compares one-at-a-time and batched enqueue and dequeue at the given rate */
+static void rate_benchmark (unsigned int rate, int batch)
+{
+  struct allnet_queue * queue =
+    allnet_queue_new ("rate queue", 1000, 1000 * BENCH_SIZE * 2);
+  struct rate_arg ra = { queue, rate, batch, 0 };
+  pthread_t adder;
+  pthread_create (&adder, NULL, rate_add_thread, (void *) &ra);
+  unsigned long long int start = thread_cpu_ns ();
+  unsigned int received = 0;
+  unsigned int calls = 0;
+  while (1) {
+    unsigned char packets [QUEUE_BENCH_BATCH * BENCH_SIZE];
+    unsigned int plens [QUEUE_BENCH_BATCH];
+    unsigned int priorities [QUEUE_BENCH_BATCH];
+    unsigned int nqueue = 1;
+    unsigned int npackets = 1;
+    int result;
+    if (batch) {
+      npackets = QUEUE_BENCH_BATCH;
+      result = allnet_dequeue_many (&queue, &nqueue, &npackets, packets,
+                                    sizeof (packets), plens, priorities, 100);
+    } else {
+      plens [0] = sizeof (packets);
+      result = allnet_dequeue (&queue, &nqueue, packets, plens, priorities,
+                               100);
+    }
+    if (result != 1)
+      break;
+    received += npackets;
+    calls++;
+  }
+  unsigned long long int cpu = thread_cpu_ns () - start;
+  pthread_join (adder, NULL);
+  if (received == 0)
+    received = 1;
+  printf ("%s at %u/s: %u packets in %u dequeues, cpu/packet %lluns enqueue, %lluns dequeue\n",
+          (batch ? "batched" : "single "), rate, received, calls,
+          ra.cpu_ns / received, cpu / received);
+  allnet_queue_recycle (queue);
+}
+
+#define PRIO_QUEUE_PACKETS	10
+#define PRIO_FLOOD		200
+
+/* floods a queue with packets of mixed priorities and sizes, and checks
+ * that the survivors are the highest priority (and, among equal
+ * priorities, the most recent) packets, and that they are dequeued
+ * highest priority first.  Returns the number of errors */
+static int priority_test ()
+{
+  struct allnet_queue * queue =
+    allnet_queue_new ("priority queue", PRIO_QUEUE_PACKETS,
+                      PRIO_QUEUE_PACKETS * 100);
+  unsigned int priorities [PRIO_FLOOD];
+  int survives [PRIO_FLOOD];
+  int i;
+  for (i = 0; i < PRIO_FLOOD; i++) {
+    unsigned char buffer [300];
+    memset (buffer, i, sizeof (buffer));
+    priorities [i] = (i * 7) % 13;
+    /* mostly small packets, occasionally one large enough that
+     * several packets must be discarded to make room for it */
+    unsigned int size = ((i % 17 == 0) ? 300 : 50);
+    allnet_enqueue (queue, buffer, size, priorities [i]);
+    /* compute the expected survivors: discard lower priority packets
+     * (oldest first) until the new packet fits */
+    survives [i] = 1;
+    int count = 0;
+    unsigned int bytes = 0;
+    int j;
+    for (j = 0; j < i; j++) {
+      if (survives [j]) {
+        count++;
+        bytes += ((j % 17 == 0) ? 300 : 50);
+      }
+    }
+    while ((count >= PRIO_QUEUE_PACKETS) ||
+           (bytes + size > PRIO_QUEUE_PACKETS * 100)) {
+      int lowest = -1;
+      for (j = 0; j < i; j++)
+        if ((survives [j]) &&
+            ((lowest < 0) || (priorities [j] < priorities [lowest])))
+          lowest = j;
+      if ((lowest < 0) || (priorities [lowest] > priorities [i])) {
+        survives [i] = 0;   /* the new packet is discarded */
+        break;
+      }
+      survives [lowest] = 0;
+      count--;
+      bytes -= ((lowest % 17 == 0) ? 300 : 50);
+    }
+  }
+  int errors = 0;
+  int expected = 0;
+  for (i = 0; i < PRIO_FLOOD; i++)
+    if (survives [i])
+      expected++;
+  if (allnet_queue_size (queue) != expected) {
+    printf ("priority test error: %d packets in queue, expected %d\n",
+            allnet_queue_size (queue), expected);
+    errors++;
+  }
+  unsigned int last_priority = (unsigned int) -1;
+  int last_index = -1;
+  while (1) {
+    unsigned char packet [1000];
+    unsigned int nqueue = 1;
+    unsigned int plen = sizeof (packet);
+    unsigned int priority;
+    if (allnet_dequeue (&queue, &nqueue, packet, &plen, &priority, 0) != 1)
+      break;
+    /* the queue only stores the low byte of the index */
+    int index = -1;
+    for (i = 0; i < PRIO_FLOOD; i++)
+      if ((survives [i]) && ((i & 0xff) == packet [0]) &&
+          (priorities [i] == priority))
+        index = i;
+    if (index < 0) {
+      printf ("priority test error: packet %d/%d should not have survived\n",
+              packet [0], priority);
+      errors++;
+    } else if ((plen != ((index % 17 == 0) ? 300 : 50)) ||
+               (packet [plen - 1] != packet [0])) {
+      printf ("priority test error: packet %d has length %d, last byte %d\n",
+              index, plen, packet [plen - 1]);
+      errors++;
+    } else {
+      survives [index] = 0;
+      if ((priority > last_priority) ||
+          ((priority == last_priority) && (index < last_index))) {
+        printf ("priority test error: dequeued %d/%d after %d/%d\n",
+                index, priority, last_index, last_priority);
+        errors++;
+      }
+    }
+    last_priority = priority;
+    last_index = index;
+  }
+  for (i = 0; i < PRIO_FLOOD; i++) {
+    if (survives [i]) {
+      printf ("priority test error: packet %d/%d was discarded\n",
+              i, priorities [i]);
+      errors++;
+    }
+  }
+  printf ("priority test: %d packets survived, %d errors\n",
+          expected, errors);
+  allnet_queue_recycle (queue);
+  return errors;
+}
+
 int main (int argc, char ** argv)
 {
   int i;
+  if ((argc > 1) && (strcmp (argv [1], "-p") == 0))
+    return priority_test ();
+  if ((argc > 1) && (strcmp (argv [1], "-b") == 0)) {
+    latency_benchmark ();
+    full_queue_benchmark (100);
+    full_queue_benchmark (1000);
+    rate_benchmark (10000, 0);
+    rate_benchmark (10000, 1);
+    rate_benchmark (100000, 0);
+    rate_benchmark (100000, 1);
+    return 0;
+  }
   q = malloc (count * sizeof (struct allnet_queue *));
   thread_args = malloc (count * sizeof (int));
   pthread_t * a = malloc (count * sizeof (pthread_t));
@@ -1,12 +1,17 @@
 /* allnet_queue.h: used to transmit messages between allnet blocks */
 /* each queue of messages has limited size.  If a message
  * is added to a queue that is already full, the lowest priority
- * message in the queue is discarded to make room for the new message */
+ * message in the queue is discarded to make room for the new message,
+ * or the new message is discarded if it has the lowest priority.
+ * Among messages of equal priority, the oldest is discarded first.
+ * messages are dequeued highest priority first, and in order of arrival
+ * among messages of equal priority */
 
 #ifndef ALLNET_QUEUE_H
 #define ALLNET_QUEUE_H
 
 struct allnet_queue;  /* defined internally, opaque type */
+struct allnet_pbuf;   /* defined in allnet_pbuf.h */
 
 /* this is a global.  It is not used by allnet_queue.c, but may be used
  * by code that uses allnet_queue.c.  It is declared in allnet_queue.c
@@ -21,12 +26,28 @@ extern struct allnet_queue * allnet_queue_new (const char * debug_name,
                                                unsigned int max_bytes);
 extern void allnet_queue_recycle (struct allnet_queue *);
 
-/* succeeds and returns 1 as long as the queue is valid and plen <= max_bytes.
+/* succeeds and returns 1 as long as the queue is valid and plen <= max_bytes,
+ * even if the packet is immediately discarded because of its low priority.
  * returns 0 otherwise */
 extern int allnet_enqueue (struct allnet_queue * queue,
                            const unsigned char * packet, unsigned int plen,
                            unsigned int priority);
 
+/* adds n packets to the queue while acquiring the lock only once.
+ * packets that are too large for the queue are skipped.
+ * returns the number of packets added, or 0 if the queue is not valid */
+extern int allnet_enqueue_many (struct allnet_queue * queue, unsigned int n,
+                                const unsigned char ** packets,
+                                const unsigned int * plens,
+                                const unsigned int * priorities);
+
+/* adds a reference to the packet buffer to the queue, without copying
+ * the data.  The caller keeps its own reference.
+ * returns 1 if the queue is valid, 0 otherwise */
+extern int allnet_enqueue_pbuf (struct allnet_queue * queue,
+                                struct allnet_pbuf * pbuf,
+                                unsigned int priority);
+
 /* the packet must point to plen bytes of available space.
  * when called, *nqueue should be the number of queues that queues points to
  *              on successful return, this call sets *nqueue to the number of
@@ -46,7 +67,38 @@ extern int allnet_dequeue (struct allnet_queue ** queues, unsigned int * nqueue,
                            unsigned char * packet, unsigned int * plen,
                            unsigned int * priority, unsigned int timeout_ms);
 
-/* returns 1 if a packet was discarded, 0 otherwise */
+/* same as allnet_dequeue, but removes as many packets as fit (up to
+ * *npackets) from a single queue while acquiring its lock only once.
+ * the packets are copied one after the other into buffer, which must
+ * point to bsize bytes.  plens and priorities must each have room
+ * for *npackets entries.
+ * on successful return, sets *nqueue as for allnet_dequeue, and
+ *              sets *npackets to the number of packets returned
+ * returns 1 if it returns one or more packets
+ * returns 0 if all the queues are empty and the timeout expired
+ * returns -2 and fills in plens [0] and *nqueue if the first packet
+ *            is larger than bsize
+ * returns -1 for any other errors */
+extern int allnet_dequeue_many (struct allnet_queue ** queues,
+                                unsigned int * nqueue,
+                                unsigned int * npackets,
+                                unsigned char * buffer, unsigned int bsize,
+                                unsigned int * plens,
+                                unsigned int * priorities,
+                                unsigned int timeout_ms);
+
+/* same as allnet_dequeue_many, but returns each packet in a packet buffer,
+ * which the caller must release.  Packets that were added with
+ * allnet_enqueue_pbuf are returned without copying */
+extern int allnet_dequeue_pbufs (struct allnet_queue ** queues,
+                                 unsigned int * nqueue,
+                                 unsigned int * npackets,
+                                 struct allnet_pbuf ** pbufs,
+                                 unsigned int * priorities,
+                                 unsigned int timeout_ms);
+
+/* discards the packet that would be dequeued next, if any.
+ * returns 1 if a packet was discarded, 0 otherwise */
 extern int allnet_queue_discard_first (struct allnet_queue * queue);
 
 /* returns the number of packets in the queue, or -1 if the queue
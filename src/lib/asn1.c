@@ -324,6 +324,16 @@ int debug_dsize = dsize;
           read_key (data + epos [7], dsize - epos [7], nhalf, key->qinv,
                     NULL))))
     return 0;
+  if (num_elements <= 2)  /* no secret key */
+    wp_init (key->nbits, key->d, 0);
+  if (num_elements <= 7) {  /* no p and q, so no chinese remainder theorem */
+    wp_init (nhalf, key->p, 0);
+    wp_init (nhalf, key->q, 0);
+    wp_init (nhalf, key->dp, 0);
+    wp_init (nhalf, key->dq, 0);
+    wp_init (nhalf, key->qinv, 0);
+  }
+  wp_rsa_key_pair_precompute (key);
   if (num_elements > 2)
     return 1;
   return 2;
@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "crypt_sel.h"
 
@@ -14,17 +16,6 @@
 #include "keys.h"
 #include "cipher.h"
 
-static void inc_ctr (char * ctr)
-{
-  int i;
-  int carry = 1;  /* initially add 1 */
-  for (i = AES_BLOCK_SIZE - 1; i >= 0; i--) {
-    int value = (ctr [i] & 0xff) + carry;
-    ctr [i] = value % 256;
-    carry = value / 256;
-  }
-}
-
 /* for CTR mode, encryption and decryption are identical */
 static void aes_ctr_crypt (char * key, char * ctr,
                            const char * data, int dsize, char * result)
@@ -37,18 +28,12 @@ static void aes_ctr_crypt (char * key, char * ctr,
                                ctr [2] & 0xff, ctr [3] & 0xff);
   printf ("data %p, dsize = %d)\n", data, dsize);
 */
-  char in [AES_BLOCK_SIZE];
-  memcpy (in, ctr, AES_BLOCK_SIZE);
-  char out [AES_BLOCK_SIZE];
-  int i;
-  for (i = 0; i < dsize; i++) {
-    if ((i % AES_BLOCK_SIZE) == 0) {   /* compute the next block */
-      if (! allnet_aes_encrypt_block (key, in, out))
-        exit (1);
-      inc_ctr (in);
-    }
-    result [i] = data [i] ^ out [i % AES_BLOCK_SIZE];
-  }
+  allnet_aes_ctx ctx;
+  if (! allnet_aes_init (&ctx, key))
+    exit (1);
+  char counter [AES_BLOCK_SIZE];
+  memcpy (counter, ctr, AES_BLOCK_SIZE);
+  allnet_aes_ctr_xor (&ctx, counter, data, result, dsize);
 #ifdef DEBUG_PRINT
   printf ("AES encryption complete\n");
 #endif /* DEBUG_PRINT */
@@ -247,6 +232,110 @@ int allnet_verify (const char * text, int tsize, const char * sig, int ssize,
 }
 #undef DEBUG_PRINT
 
+/* hash is the SHA512 of the signed text */
+static int verify_hash (const char * hash, const char * sig, int ssize,
+                        allnet_rsa_pubkey key)
+{
+  int hsize = allnet_rsa_pubkey_size (key) - 42;  /* as in allnet_verify */
+  if (hsize > SHA512_SIZE)
+    hsize = SHA512_SIZE;
+  return allnet_rsa_verify (key, hash, hsize, sig, ssize);
+}
+
+/* shared by the threads of allnet_verify_many */
+struct verify_many_state {
+  const char * hash;
+  const char * sig;
+  int ssize;
+  const allnet_rsa_pubkey * keys;
+  const int * candidates;  /* indices into keys, in increasing order */
+  int ncandidates;
+  int next;                /* index into candidates of the next to verify */
+  int found;               /* lowest index that verifies, or -1 */
+  pthread_mutex_t mutex;
+};
+
+/* verifies candidates in order until one verifies.  Candidates after
+ * a verified one need not be verified, but candidates already taken
+ * by other threads may still verify with a lower index */
+static void * verify_many_thread (void * arg)
+{
+  struct verify_many_state * state = (struct verify_many_state *) arg;
+  while (1) {
+    pthread_mutex_lock (&(state->mutex));
+    int next = state->next;
+    int done = ((next >= state->ncandidates) || (state->found >= 0));
+    if (! done)
+      state->next = next + 1;
+    pthread_mutex_unlock (&(state->mutex));
+    if (done)
+      return NULL;
+    int index = state->candidates [next];
+    if (verify_hash (state->hash, state->sig, state->ssize,
+                     state->keys [index])) {
+      pthread_mutex_lock (&(state->mutex));
+      if ((state->found < 0) || (index < state->found))
+        state->found = index;
+      pthread_mutex_unlock (&(state->mutex));
+    }
+  }
+}
+
+/* at most this many threads (including the caller) verify at once */
+#define VERIFY_MANY_THREADS	4
+
+/* returns the index of the first of the nkeys keys that verifies the
+ * signature, or -1 if none verifies.
+ * the text is only hashed once, keys whose size does not match the
+ * signature size are skipped, and the remaining keys are verified
+ * in parallel on multiprocessors */
+int allnet_verify_many (const char * text, int tsize,
+                        const char * sig, int ssize,
+                        const allnet_rsa_pubkey * keys, int nkeys)
+{
+  if ((text == NULL) || (sig == NULL) || (tsize < 0) || (ssize <= 0) ||
+      (keys == NULL) || (nkeys <= 0))
+    return -1;
+  int * candidates = malloc_or_fail (nkeys * sizeof (int),
+                                     "allnet_verify_many");
+  int ncandidates = 0;
+  int i;
+  for (i = 0; i < nkeys; i++)  /* signatures are exactly the key size */
+    if (allnet_rsa_pubkey_size (keys [i]) == ssize)
+      candidates [ncandidates++] = i;
+  if (ncandidates == 0) {
+    free (candidates);
+    return -1;
+  }
+  char hash [SHA512_SIZE];
+  sha512 (text, tsize, hash);
+  struct verify_many_state state =
+    { .hash = hash, .sig = sig, .ssize = ssize, .keys = keys,
+      .candidates = candidates, .ncandidates = ncandidates,
+      .next = 0, .found = -1 };
+  pthread_mutex_init (&(state.mutex), NULL);
+  /* threads are created for each call rather than kept in a pool,
+   * because several allnet daemons fork after the library is in use */
+  int nthreads = VERIFY_MANY_THREADS;
+  long int ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if ((ncpus > 0) && (ncpus < nthreads))
+    nthreads = (int) ncpus;
+  if (nthreads > ncandidates)
+    nthreads = ncandidates;
+  pthread_t threads [VERIFY_MANY_THREADS];
+  int created = 0;
+  for (i = 1; i < nthreads; i++)
+    if (pthread_create (threads + created, NULL, verify_many_thread,
+                        &state) == 0)
+      created++;
+  verify_many_thread (&state);
+  for (i = 0; i < created; i++)
+    pthread_join (threads [i], NULL);
+  pthread_mutex_destroy (&(state.mutex));
+  free (candidates);
+  return state.found;
+}
+
 /* returns the size of the signature and mallocs the signature into result */
 int allnet_sign (const char * text, int tsize, allnet_rsa_prvkey key,
                  char ** result)
@@ -275,37 +364,170 @@ int allnet_sign (const char * text, int tsize, allnet_rsa_prvkey key,
   return rsa_size;
 }
 
-static char ** deep_copy (char ** original, int n)
+/* decrypt_verify only tries the keysets whose addresses match those of
+ * the packet.  The index of keysets, with their addresses and public keys,
+ * is rebuilt whenever keys_change_count reports a change.  The private
+ * key is only needed for the keyset that verifies, so it is not indexed */
+struct keyset_entry {
+  keyset k;
+  unsigned char local [ADDRESS_SIZE];
+  int lbits;
+  unsigned char remote [ADDRESS_SIZE];
+  int rbits;
+  int has_pubkey;
+  allnet_rsa_pubkey pub_key;
+  int next;    /* next with the same first remote address byte, or -1 */
+};
+
+/* keysets with at least 8 remote address bits are listed by the first byte */
+#define KEYSET_BUCKETS	256
+
+static struct keyset_entry * keyset_index = NULL;
+static int keyset_index_count = 0;
+static int keyset_buckets [KEYSET_BUCKETS];
+static int keyset_short = -1;   /* first with fewer than 8 remote bits */
+static int keyset_index_built = 0;
+static unsigned long long int keyset_index_changes = 0;
+static pthread_mutex_t keyset_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* must be called with keyset_index_mutex held */
+static void build_keyset_index ()
 {
-  size_t needed = 0;
-  int i;
-  for (i = 0; i < n; i++)
-    needed += strlen (original [i]) + 1 + sizeof (char *);
-  char ** result = malloc_or_fail (needed, "cipher.c deep_copy");
-  char * strings = (char *) (&(result [n]));
-  for (i = 0; i < n; i++) {
-    result [i] = strings;
-    strcpy (result [i], original [i]);
-    strings += strlen (original [i]) + 1;
+  unsigned long long int changes = keys_change_count ();
+  if (keyset_index_built && (changes == keyset_index_changes))
+    return;
+  if (keyset_index != NULL)
+    free (keyset_index);
+  keyset_index = NULL;
+  keyset_index_count = 0;
+  int b;
+  for (b = 0; b < KEYSET_BUCKETS; b++)
+    keyset_buckets [b] = -1;
+  keyset_short = -1;
+  char ** contacts = NULL;
+  int ncontacts = all_individual_contacts (&contacts);
+  int ic;
+  int count = 0;
+  for (ic = 0; ic < ncontacts; ic++) {
+    int nkeys = num_keysets (contacts [ic]);
+    if (nkeys > 0)
+      count += nkeys;
   }
-  return result;
+  if (count > 0)
+    keyset_index = malloc_or_fail (count * sizeof (struct keyset_entry),
+                                   "cipher.c build_keyset_index");
+  for (ic = 0; ic < ncontacts; ic++) {
+    keyset * keys = NULL;
+    int nkeys = all_keys (contacts [ic], &keys);
+    int ik;
+    for (ik = 0; (ik < nkeys) && (keyset_index_count < count); ik++) {
+      struct keyset_entry * e = keyset_index + keyset_index_count;
+      memset (e, 0, sizeof (struct keyset_entry));
+      e->k = keys [ik];
+      e->lbits = get_local (keys [ik], e->local);
+      e->rbits = get_remote (keys [ik], e->remote);
+      e->has_pubkey = (get_contact_pubkey (keys [ik], &(e->pub_key)) > 0);
+      if (e->rbits >= 8) {
+        e->next = keyset_buckets [e->remote [0]];
+        keyset_buckets [e->remote [0]] = keyset_index_count;
+      } else {
+        e->next = keyset_short;
+        keyset_short = keyset_index_count;
+      }
+      keyset_index_count++;
+    }
+    if ((nkeys > 0) && (keys != NULL))
+      free (keys);
+  }
+  if (contacts != NULL)
+    free (contacts);
+  keyset_index_built = 1;
+  keyset_index_changes = changes;
 }
 
-/* deep copy everything, then permute so a random subset is at the front */
-static char ** randomize_contacts (char ** original, int n, int max)
+/* if lbits, dbits, rbits, or sbits is zero, the address matches */
+static int keyset_matches (struct keyset_entry * e,
+                           char * sender, int sbits, char * dest, int dbits)
 {
-  char ** result = deep_copy (original, n);
-  int * permutation = random_permute (n);
-  char ** copy = malloc_or_fail (sizeof (char *) * max, "cipher.c randomize");
+  if ((dest != NULL) && (dbits > 0) && (e->lbits > 0) &&
+      (matches ((unsigned char *) dest, dbits, e->local, e->lbits) <= 0))
+    return 0;
+  if ((sender != NULL) && (sbits > 0) && (e->rbits > 0) &&
+      (matches ((unsigned char *) sender, sbits, e->remote, e->rbits) <= 0))
+    return 0;
+  return 1;
+}
+
+/* finds the keysets whose addresses match the sender and dest.
+ * if there are more than maxcontacts > 0, only uses maxcontacts of them,
+ * starting at a random position.  If need_pubkey, only uses those with
+ * a public key, and copies the public keys to a malloc'd *pub_keys.
+ * returns the number of keysets used, and if > 0, a malloc'd array of
+ * them in *ksets */
+static int matching_keysets (char * sender, int sbits, char * dest, int dbits,
+                             int maxcontacts, int need_pubkey,
+                             keyset ** ksets, allnet_rsa_pubkey ** pub_keys)
+{
+  *ksets = NULL;
+  if (pub_keys != NULL)
+    *pub_keys = NULL;
+  pthread_mutex_lock (&keyset_index_mutex);
+  build_keyset_index ();
+  if (keyset_index_count <= 0) {
+    pthread_mutex_unlock (&keyset_index_mutex);
+    return 0;
+  }
+  /* the positions in keyset_index of all the matching keysets */
+  int * found = malloc_or_fail (keyset_index_count * sizeof (int),
+                                "cipher.c matching_keysets");
+  int nfound = 0;
   int i;
-  for (i = 0; i < max; i++)  /* save the contact pointers we will try */
-    copy [i] = result [permutation [i]];
-  free (permutation);
-  /* now save the pointers back in result */
-  for (i = 0; i < max; i++)
-    result [i] = copy [i];
-  free (copy);
-  return result;
+  if ((sender == NULL) || (sbits < 8)) {  /* could match any remote address */
+    for (i = 0; i < keyset_index_count; i++)
+      if (keyset_matches (keyset_index + i, sender, sbits, dest, dbits))
+        found [nfound++] = i;
+  } else {
+    for (i = keyset_short; i >= 0; i = keyset_index [i].next)
+      if (keyset_matches (keyset_index + i, sender, sbits, dest, dbits))
+        found [nfound++] = i;
+    for (i = keyset_buckets [((unsigned char *) sender) [0]]; i >= 0;
+         i = keyset_index [i].next)
+      if (keyset_matches (keyset_index + i, sender, sbits, dest, dbits))
+        found [nfound++] = i;
+  }
+  int first = 0;
+  if ((maxcontacts > 0) && (maxcontacts < nfound))
+    first = (int) random_int (0, nfound - 1);
+  else
+    maxcontacts = nfound;
+  int count = 0;
+  if (maxcontacts > 0) {
+    *ksets = malloc_or_fail (maxcontacts * sizeof (keyset),
+                             "cipher.c matching_keysets ksets");
+    if (need_pubkey)
+      *pub_keys = malloc_or_fail (maxcontacts * sizeof (allnet_rsa_pubkey),
+                                  "cipher.c matching_keysets pub_keys");
+  }
+  for (i = 0; i < maxcontacts; i++) {
+    struct keyset_entry * e = keyset_index + found [(first + i) % nfound];
+    if (need_pubkey) {
+      if (! e->has_pubkey)
+        continue;
+      (*pub_keys) [count] = e->pub_key;
+    }
+    (*ksets) [count++] = e->k;
+  }
+  pthread_mutex_unlock (&keyset_index_mutex);
+  free (found);
+  if ((count == 0) && (*ksets != NULL)) {
+    free (*ksets);
+    *ksets = NULL;
+    if (need_pubkey && (*pub_keys != NULL)) {
+      free (*pub_keys);
+      *pub_keys = NULL;
+    }
+  }
+  return count;
 }
 
 /* #define DEBUG_PRINT */
@@ -339,87 +561,72 @@ int decrypt_verify (int sig_algo, char * encrypted, int esize,
     return 0;
   int csize = esize - ssize;  /* size of ciphertext to decrypt */
   char * sig = encrypted + csize;  /* only used if ssize != 0 */
-  int i, j;
   int count = 0;
   int decrypt_count = 0;
-  char ** contacts = NULL;
-  int ncontacts = all_individual_contacts (&contacts);
-  if ((maxcontacts > 0) && (maxcontacts < ncontacts)) {
-    contacts = randomize_contacts (contacts, ncontacts, maxcontacts);
-    ncontacts = maxcontacts;
-  }
-  for (i = 0; ((*contact == NULL) && (i < ncontacts)); i++) {
-    keyset * keys = NULL;
-    int nkeys = all_keys (contacts [i], &keys);
-    for (j = 0; ((*contact == NULL) && (j < nkeys)); j++) {
-      int do_decrypt = 1;  /* for now, try to decrypt unsigned messages */
-      if ((dest != NULL) && (dbits > 0)) {
-        char laddr [ADDRESS_SIZE];
-        int lbits = get_local (keys [j], (unsigned char *)laddr);
-        if ((lbits > 0) &&  /* if lbits or dbits is zero, we verify */
-            (matches ((unsigned char *) dest, dbits,
-                      (unsigned char *) laddr, lbits) <= 0))
-          do_decrypt = 0;
-      }
-      if ((sender != NULL) && (sbits > 0)) {
-        char raddr [ADDRESS_SIZE];
-        int rbits = get_remote (keys [j], (unsigned char *)raddr);
-        if ((rbits > 0) &&  /* if lbits or dbits is zero, we verify */
-            (matches ((unsigned char *) sender, sbits,
-                      (unsigned char *) raddr, rbits) <= 0))
-          do_decrypt = 0;
-      }
-      if (do_decrypt && (sig_algo != ALLNET_SIGTYPE_NONE)) {
-        /* verify signature */
-        do_decrypt = 0;
-        allnet_rsa_pubkey pub_key;
-        if (get_contact_pubkey (keys [j], &pub_key)) {
-          do_decrypt =
-            allnet_verify (encrypted, csize, sig, ssize - 2, pub_key);
-          count++;
-        }
+  /* the keysets to try, in order.  For signed messages, only those
+   * with a public key, which is in pub_keys.  For now, try to decrypt
+   * unsigned messages with every keyset */
+  keyset * tries = NULL;
+  allnet_rsa_pubkey * pub_keys = NULL;
+  int ntries = matching_keysets (sender, sbits, dest, dbits, maxcontacts,
+                                 (sig_algo != ALLNET_SIGTYPE_NONE),
+                                 &tries, &pub_keys);
+  int next = 0;
+  while ((*contact == NULL) && (next < ntries)) {
+    if (sig_algo != ALLNET_SIGTYPE_NONE) {
+      /* verify the signature against all the remaining keys at once */
+      int found = allnet_verify_many (encrypted, csize, sig, ssize - 2,
+                                      pub_keys + next, ntries - next);
+      if (found < 0) {
+        count += ntries - next;
+        break;
       }
+      next += found;
+      count += found + 1;
+    }
+    keyset k = tries [next++];
 #ifdef DEBUG_PRINT
-      unsigned long long int time_ver = allnet_time_us () - start;
-#endif /* DEBUG_PRINT */
-      if (do_decrypt) {
-#ifdef DEBUG_PRINT
-        printf ("signature match for contact %s, key %d\n", contacts [i], j);
+    unsigned long long int time_ver = allnet_time_us () - start;
+    printf ("signature match for keyset %d\n", k);
 #endif /* DEBUG_PRINT */
-        allnet_rsa_prvkey prv_key;
-        int priv_ksize = get_my_privkey (keys [j], &prv_key);
-        int res = 0;
-        if (priv_ksize > 0) {
-          res = allnet_decrypt (encrypted, csize, prv_key, text);
-          decrypt_count++;
-        }
-        if (res) {
-          *contact = strcpy_malloc (contacts [i], "verify contact");
-          *kset = keys [j];
+    int res = 0;
+    allnet_rsa_prvkey prv_key;
+    if (get_my_privkey (k, &prv_key) > 0) {
+      res = allnet_decrypt (encrypted, csize, prv_key, text);
+      decrypt_count++;
+    }
+    if (res) {
+      *contact = get_contact_name (k);
+      if (*contact == NULL) {   /* deleted in the meantime */
+        free (*text);
+        *text = NULL;
+        continue;
+      }
+      *kset = k;
 #ifdef DEBUG_PRINT
-          unsigned long long int time_delta = allnet_time_us () - start;
-          printf ("%ssuccess: %d ver (%lld.%06lld s) + %d dec ",
-                  (sig_algo != ALLNET_SIGTYPE_NONE) ? "" : "unsigned ", count,
-                  time_ver / 1000000, time_ver % 1000000, decrypt_count);
-          printf ("%lld.%06lld seconds\n",
-                  time_delta / 1000000, time_delta % 1000000);
+      unsigned long long int time_delta = allnet_time_us () - start;
+      printf ("%ssuccess: %d ver (%lld.%06lld s) + %d dec ",
+              (sig_algo != ALLNET_SIGTYPE_NONE) ? "" : "unsigned ", count,
+              time_ver / 1000000, time_ver % 1000000, decrypt_count);
+      printf ("%lld.%06lld seconds\n",
+              time_delta / 1000000, time_delta % 1000000);
 #endif /* DEBUG_PRINT */
-          free (keys);
-          if (contacts != NULL) free (contacts);
-          if (sig_algo != ALLNET_SIGTYPE_NONE)
-            return res;
-          else
-            return -res;
-        } else if (sig_algo != ALLNET_SIGTYPE_NONE) {
-          printf ("signed msg from %s key %d verifies but does not decrypt\n",
-                  contacts [i], j);
-        }
-      }
+      free (tries);
+      if (pub_keys != NULL)
+        free (pub_keys);
+      if (sig_algo != ALLNET_SIGTYPE_NONE)
+        return res;
+      else
+        return -res;
+    } else if (sig_algo != ALLNET_SIGTYPE_NONE) {
+      printf ("signed msg from keyset %d verifies but does not decrypt\n",
+              k);
     }
-    if ((nkeys > 0) && (keys != NULL))
-      free (keys);
   }
-  if (contacts != NULL) free (contacts);
+  if (tries != NULL)
+    free (tries);
+  if (pub_keys != NULL)
+    free (pub_keys);
 #ifdef DEBUG_PRINT
   printf ("unable to decrypt packet, dropping\n");
   unsigned long long int time_delta = allnet_time_us () - start;
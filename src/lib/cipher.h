@@ -28,6 +28,14 @@ extern int allnet_decrypt (const char * cipher, int csize,
 extern int allnet_verify (const char * text, int tsize, const char * sig,
                           int ssize, allnet_rsa_pubkey key);
 
+/* returns the index of the first of the nkeys keys that verifies the
+ * signature, or -1 if none verifies.  Same as calling allnet_verify for
+ * each key in turn, but hashes the text only once, and on multiprocessors
+ * verifies several keys in parallel */
+extern int allnet_verify_many (const char * text, int tsize,
+                               const char * sig, int ssize,
+                               const allnet_rsa_pubkey * keys, int nkeys);
+
 /* returns the size of the signature and mallocs the signature into result */
 extern int allnet_sign (const char * text, int tsize, allnet_rsa_prvkey key,
                         char ** result);
@@ -42,7 +50,9 @@ extern int allnet_sign (const char * text, int tsize, allnet_rsa_prvkey key,
  * if decryption does not work, returns 0 and sets *contact and *text to NULL
  *
  *
- * if maxcontacts > 0, only tries to match up to maxcontacts
+ * only tries the keysets whose local and remote addresses match dest
+ * and sender (if given), and if maxcontacts > 0, only tries up to
+ * maxcontacts of these keysets
  */
 extern int decrypt_verify (int sig_algo, char * encrypted, int esize,
                            char ** contact, keyset * key, char ** text,
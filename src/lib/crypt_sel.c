@@ -23,6 +23,7 @@ allnet_rsa_pubkey allnet_rsa_private_to_public (allnet_rsa_prvkey key)
   result.nbits = key.nbits;
   wp_copy (key.nbits, result.n, key.n);
   result.e = key.e;
+  result.mont_n = key.mont_n;
   return result;
 #endif /* HAVE_OPENSSL */
 }
@@ -66,6 +67,7 @@ int allnet_get_pubkey (const char * key, int ksize, allnet_rsa_pubkey * rsa)
   rsa->nbits = ksize * 8;
   wp_from_bytes (rsa->nbits, rsa->n, ksize, key);
   rsa->e = 65537;
+  wp_rsa_key_precompute (rsa);
   return ksize;
 #endif /* HAVE_OPENSSL */
 }
@@ -126,6 +128,7 @@ int allnet_pubkey_from_raw (allnet_rsa_pubkey * rsa,
   rsa->nbits = (ksize - 1) * 8;
   wp_from_bytes (rsa->nbits, rsa->n, ksize - 1, key + 1);
   rsa->e = 65537;
+  wp_rsa_key_precompute (rsa);
 #endif /* HAVE_OPENSSL */
   return ksize;
 }
@@ -517,3 +520,43 @@ int allnet_aes_encrypt_block (char * key, char * in, char * out)
 #endif /* HAVE_OPENSSL */
   return 1;
 }
+
+/* expands the key (AES256_SIZE bytes) once, for use with allnet_aes_ctr_xor.
+ * returns 1 for success, 0 for failure */
+int allnet_aes_init (allnet_aes_ctx * ctx, const char * key)
+{
+#ifdef HAVE_OPENSSL
+  if (AES_set_encrypt_key ((const unsigned char *) key, AES256_SIZE * 8,
+                           ctx) < 0) {
+    printf ("unable to set AES encryption key");
+    return 0;
+  }
+#else /* HAVE_OPENSSL */
+  wp_aes_init (ctx, AES256_SIZE, key);
+#endif /* HAVE_OPENSSL */
+  return 1;
+}
+
+/* counter mode encryption or decryption of len bytes, from in to out,
+ * which may be the same buffer.  counter is AES_BLOCK_SIZE bytes, and
+ * is incremented (as a big-endian number) once for each block used */
+void allnet_aes_ctr_xor (const allnet_aes_ctx * ctx, char * counter,
+                         const char * in, char * out, int len)
+{
+#ifdef HAVE_OPENSSL
+  unsigned char stream [AES_BLOCK_SIZE];
+  int i;
+  for (i = 0; i < len; i++) {
+    if ((i % AES_BLOCK_SIZE) == 0) {   /* compute the next block */
+      AES_encrypt ((unsigned char *) counter, stream, ctx);
+      int j;
+      for (j = AES_BLOCK_SIZE - 1; j >= 0; j--)
+        if (++(counter [j]) != 0)
+          break;
+    }
+    out [i] = in [i] ^ stream [i % AES_BLOCK_SIZE];
+  }
+#else /* HAVE_OPENSSL */
+  wp_aes_ctr_xor (ctx, counter, in, out, len);
+#endif /* HAVE_OPENSSL */
+}
@@ -13,6 +13,7 @@
 
 typedef RSA *           allnet_rsa_pubkey;
 typedef RSA *           allnet_rsa_prvkey;
+typedef AES_KEY         allnet_aes_ctx;
 
 #else /* HAVE_OPENSSL */
 
@@ -22,6 +23,7 @@ typedef RSA *           allnet_rsa_prvkey;
 
 typedef wp_rsa_key      allnet_rsa_pubkey;
 typedef wp_rsa_key_pair allnet_rsa_prvkey;
+typedef struct wp_aes_ctx allnet_aes_ctx;
 
 #endif /* HAVE_OPENSSL */
 
@@ -116,4 +118,14 @@ extern void allnet_rsa_seed_rng (char * buffer, int bsize);
  * returns 1 for success, 0 for failure */
 extern int allnet_aes_encrypt_block (char * key, char * in, char * out);
 
+/* expands the key (AES256_SIZE bytes) once, for use with allnet_aes_ctr_xor.
+ * returns 1 for success, 0 for failure */
+extern int allnet_aes_init (allnet_aes_ctx * ctx, const char * key);
+
+/* counter mode encryption or decryption of len bytes, from in to out,
+ * which may be the same buffer.  counter is AES_BLOCK_SIZE bytes, and
+ * is incremented (as a big-endian number) once for each block used */
+extern void allnet_aes_ctr_xor (const allnet_aes_ctx * ctx, char * counter,
+                                const char * in, char * out, int len);
+
 #endif /* ALLNET_CRYPT_SELECTOR_H */
@@ -20,7 +20,10 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include "crypt_sel.h"
 
@@ -31,6 +34,7 @@
 #include "configfiles.h"
 #include "sha.h"
 #include "mapchar.h"
+#include "app_util.h"
 
 /* a key set consists of the contact name, my private and public keys,
  * the contact's public key, and possibly a local address and/or
@@ -77,6 +81,9 @@ static int num_key_infos = 0;
 static char * * cpx = NULL;
 static int cp_used = 0;
 
+/* incremented whenever a contact or keyset changes, see keys_change_count */
+static unsigned long long int keys_changes = 0;
+
 #ifdef DEBUG_PRINT
 static void print_contacts (char * desc, int individual_only)
 {
@@ -111,6 +118,7 @@ static int valid_keyset (keyset k)
 static void generate_contacts ()
 {
   int ki = 0;
+  keys_changes++;
   cp_used = 0;
   for (ki = 0; ki < num_key_infos; ki++) {
     if ((kip [ki].contact_name != NULL) &&
@@ -769,6 +777,7 @@ static void write_member_file (const char * fname, char ** members,
 
 static void save_contact (struct key_info * k)
 {
+  keys_changes++;
   if (k->is_deleted) {
     printf ("not saving deleted contact %s\n", k->contact_name);
     return;
@@ -871,39 +880,94 @@ static int count_spare_key_files ()
   return result;
 }
 
+/* the spare key pool is the directory own_spare_keys, shared by all
+ * processes.  Keys are written under a temporary name and then linked
+ * to their final name, so readers never see a partial key file, and
+ * are claimed by renaming, so no two processes take the same key */
+
+struct spare_key_pool {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;       /* signaled when a key is taken */
+  int keybits;
+  int min_spares;
+  int target;
+  int threads;
+  int generating;            /* keys currently being generated */
+  unsigned long long int names;  /* for unique temporary file names */
+  unsigned long long int generated;
+  unsigned long long int taken;
+  unsigned long long int missed;
+};
+
+static struct spare_key_pool spare_pool =
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+/* returns a malloc'd file name in the own_spare_keys directory that
+ * begins with '.' and so is not counted as a spare key,
+ * or NULL in case of errors */
+static char * spare_key_temp_name (const char * what)
+{
+  pthread_mutex_lock (&spare_pool.mutex);
+  unsigned long long int n = spare_pool.names++;
+  pthread_mutex_unlock (&spare_pool.mutex);
+  char name [100];
+  snprintf (name, sizeof (name), ".%s-%ld-%llu", what, (long int) getpid (), n);
+  char * fname;
+  if (config_file_name ("own_spare_keys", name, &fname) < 0)
+    return NULL;
+  return fname;
+}
+
 static int save_spare_key (allnet_rsa_prvkey key)
 {
   if (allnet_rsa_prvkey_is_null (key))
     return 0;
-  char now_printed [DATE_TIME_LEN + 1];
-  time_t now = time (NULL);
-  struct tm t;
-  gmtime_r (&now, &t);
-  snprintf (now_printed, sizeof (now_printed), "%04d%02d%02d%02d%02d%02d",
-            t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
-            t.tm_hour, t.tm_min, t.tm_sec);
-
-  char * fname;
-  int fnamesize = config_file_name ("own_spare_keys", now_printed, &fname);
-  if (fnamesize < 0) {
+  char * tmp = spare_key_temp_name ("new");
+  if (tmp == NULL) {
     printf ("unable to get config file name for spare");
     return 0;
   }
-  if (! allnet_rsa_write_prvkey (fname, key)) {
-    printf ("unable to write spare private key to file %s\n", fname);
-    free (fname);
+  if (! allnet_rsa_write_prvkey (tmp, key)) {
+    printf ("unable to write spare private key to file %s\n", tmp);
+    unlink (tmp);
+    free (tmp);
     return 0;
   }
-  free (fname);
-  return 1;
+  /* several keys may be saved in the same second, so if the name is
+   * taken, use the next second, and so on */
+  int result = 0;
+  time_t now = time (NULL);
+  int tries;
+  for (tries = 0; (tries < 1000) && (! result); tries++) {
+    char now_printed [DATE_TIME_LEN + 1];
+    time_t when = now + tries;
+    struct tm t;
+    gmtime_r (&when, &t);
+    snprintf (now_printed, sizeof (now_printed), "%04d%02d%02d%02d%02d%02d",
+              t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+              t.tm_hour, t.tm_min, t.tm_sec);
+    char * fname;
+    if (config_file_name ("own_spare_keys", now_printed, &fname) < 0)
+      break;
+    if (link (tmp, fname) == 0)
+      result = 1;
+    else if (errno != EEXIST)
+      tries = 1000;   /* some other error, give up */
+    free (fname);
+  }
+  if (! result)
+    printf ("unable to save spare private key %s\n", tmp);
+  unlink (tmp);
+  free (tmp);
+  return result;
 }
 
+/* returns immediately, with a null key if no key is available */
 static allnet_rsa_prvkey get_spare_key (int keybits)
 {
   allnet_rsa_prvkey result;
   allnet_rsa_null_prvkey (&result);
-  if (count_spare_key_files () <= 0)
-    return result;
   char * dirname;
   int dirnamesize = config_file_name ("own_spare_keys", "", &dirname);
   if (dirnamesize < 0)
@@ -922,12 +986,22 @@ static allnet_rsa_prvkey get_spare_key (int keybits)
       if (fnamesize >= 0) {
         int success = allnet_rsa_read_prvkey (fname, &result);
         if ((success) && (allnet_rsa_prvkey_size (result) == keybits / 8)) {
-          unlink (fname);   /* remove the file, don't reuse it in the future */
-          printf ("found spare key with %d bits\n", keybits);
-          free (fname);
-          closedir (dir);
-          return result;
+          /* claim it.  If the rename fails, somebody else took it */
+          char * claimed = spare_key_temp_name ("taken");
+          if ((claimed != NULL) && (rename (fname, claimed) == 0)) {
+            unlink (claimed);   /* don't reuse it in the future */
+            printf ("found spare key with %d bits\n", keybits);
+            free (claimed);
+            free (fname);
+            closedir (dir);
+            return result;
+          }
+          if (claimed != NULL)
+            free (claimed);
         }
+        if (success)
+          allnet_rsa_free_prvkey (result);
+        allnet_rsa_null_prvkey (&result);
         free (fname);
       }
     }
@@ -937,6 +1011,108 @@ static allnet_rsa_prvkey get_spare_key (int keybits)
   return result;
 }
 
+allnet_rsa_prvkey take_spare_key (int keybits)
+{
+  allnet_rsa_prvkey result = get_spare_key (keybits);
+  pthread_mutex_lock (&spare_pool.mutex);
+  if (allnet_rsa_prvkey_is_null (result))
+    spare_pool.missed++;
+  else
+    spare_pool.taken++;
+  pthread_cond_broadcast (&spare_pool.cond);  /* time to refill the pool */
+  pthread_mutex_unlock (&spare_pool.mutex);
+  return result;
+}
+
+#define SPARE_KEY_POOL_NICE	19
+#define SPARE_KEY_POOL_CHECK	60	/* seconds between checks when full */
+
+/* must be called with spare_pool.mutex held.  Returns after
+ * SPARE_KEY_POOL_CHECK seconds, or sooner if the pool changes */
+static void spare_key_pool_wait ()
+{
+  struct timespec until;
+  clock_gettime (CLOCK_REALTIME, &until);
+  until.tv_sec += SPARE_KEY_POOL_CHECK;
+  pthread_cond_timedwait (&spare_pool.cond, &spare_pool.mutex, &until);
+}
+
+static void * spare_key_pool_thread (void * arg)
+{
+  /* on linux this only affects the calling thread */
+  setpriority (PRIO_PROCESS, 0, SPARE_KEY_POOL_NICE);
+  pthread_mutex_lock (&spare_pool.mutex);
+  while (1) {
+    /* count the files without holding the lock, then read the rest of
+     * the state, which other threads may have changed in the meantime */
+    pthread_mutex_unlock (&spare_pool.mutex);
+    int have = count_spare_key_files ();
+    pthread_mutex_lock (&spare_pool.mutex);
+    int keybits = spare_pool.keybits;
+    int want = spare_pool.min_spares;
+    if (speculative_computation_is_ok ())
+      want = spare_pool.target;
+    if (have + spare_pool.generating < want) {
+      spare_pool.generating++;
+      pthread_mutex_unlock (&spare_pool.mutex);
+      allnet_rsa_prvkey key = allnet_rsa_generate_key (keybits, NULL, 0);
+      int saved = save_spare_key (key);
+      if (! allnet_rsa_prvkey_is_null (key))
+        allnet_rsa_free_prvkey (key);
+      pthread_mutex_lock (&spare_pool.mutex);
+      spare_pool.generating--;
+      if (saved)
+        spare_pool.generated++;
+      else     /* do not retry right away */
+        spare_key_pool_wait ();
+    } else {
+      spare_key_pool_wait ();
+    }
+  }
+  pthread_mutex_unlock (&spare_pool.mutex);
+  return NULL;
+}
+
+int start_spare_key_pool (int keybits, int min_spares, int target,
+                          int nthreads)
+{
+  if ((keybits <= 0) || (min_spares < 0) || (target < min_spares))
+    return 0;
+  pthread_mutex_lock (&spare_pool.mutex);
+  spare_pool.keybits = keybits;
+  spare_pool.min_spares = min_spares;
+  spare_pool.target = target;
+  while (spare_pool.threads < nthreads) {
+    pthread_t t;
+    if (pthread_create (&t, NULL, spare_key_pool_thread, NULL) != 0) {
+      perror ("start_spare_key_pool pthread_create");
+      break;
+    }
+    pthread_detach (t);
+    spare_pool.threads++;
+  }
+  int result = spare_pool.threads;
+  pthread_cond_broadcast (&spare_pool.cond);  /* pick up the new targets */
+  pthread_mutex_unlock (&spare_pool.mutex);
+  return result;
+}
+
+void get_spare_key_pool_stats (struct spare_key_pool_stats * stats)
+{
+  int available = count_spare_key_files ();
+  pthread_mutex_lock (&spare_pool.mutex);
+  stats->available = available;
+  stats->keybits = spare_pool.keybits;
+  stats->min_spares = spare_pool.min_spares;
+  stats->target = spare_pool.target;
+  stats->threads = spare_pool.threads;
+  stats->generating = spare_pool.generating;
+  stats->generated = spare_pool.generated;
+  stats->taken = spare_pool.taken;
+  stats->missed = spare_pool.missed;
+  pthread_mutex_unlock (&spare_pool.mutex);
+}
+
 static int do_set_contact_pubkey (struct key_info * k,
                                   char * contact_key, int ksize)
 {
@@ -1029,8 +1205,8 @@ keyset create_contact (const char * contact, int keybits, int feedback,
     }
   }
 
-  allnet_rsa_prvkey my_key = get_spare_key (keybits);
-  if (allnet_rsa_prvkey_is_null (my_key))
+  allnet_rsa_prvkey my_key = take_spare_key (keybits);
+  if (allnet_rsa_prvkey_is_null (my_key))  /* the pool is empty, must wait */
     my_key = allnet_rsa_generate_key (keybits, NULL, 0);
   if (allnet_rsa_prvkey_is_null (my_key)) {
     printf ("unable to generate RSA key\n");
@@ -1118,6 +1294,7 @@ int rename_contact (const char * old, const char * new)
           kip [key].contact_name = p;
           cpx [key] = p;
           renamed = 1;
+          keys_changes++;
         } else {
           printf ("unable to realloc %s for %s\n", old, new);
         }
@@ -1264,6 +1441,7 @@ int delete_contact (const char * contact)
         rmdir_and_all_files (kip [key].dir_name);
         kip [key].is_deleted = 1;
         result = 1;
+        keys_changes++;
       } else {
         return 0;
       }
@@ -2032,6 +2210,15 @@ unsigned int get_remote (keyset k, unsigned char * address)
   return kip [k].remote.nbits;
 }
 
+/* returns a number that changes whenever contacts or keysets are added,
+ * modified, or deleted, so callers can tell when to refresh anything
+ * they computed from the keys */
+unsigned long long int keys_change_count ()
+{
+  init_from_file ("keys_change_count");
+  return keys_changes;
+}
+
 /* returnes a malloc'd copy of the contact name, or NULL for errors */
 char * get_contact_name (keyset k)
 {
@@ -2070,6 +2257,7 @@ int mark_invalid (const char * contact, keyset k)
   free (new_fname);
   /* delete from data structure */
   allnet_rsa_null_prvkey (&(kip [k].my_key));
+  keys_changes++;
   return result;
 }
 
@@ -2106,8 +2294,10 @@ int mark_valid (const char * contact, keyset k)
   int result = 0;
   if (rename (old_fname, fname) == 0) {
     /* read the key into the kip data structure */
-    if (allnet_rsa_read_prvkey (fname, &(kip [k].my_key)))
+    if (allnet_rsa_read_prvkey (fname, &(kip [k].my_key))) {
       result = 1;
+      keys_changes++;
+    }
     else
       printf ("unable to read private key from %s\n", fname);
   } else {
@@ -2372,7 +2562,10 @@ int save_key_state (const char * contact,
   memcpy (&(kip [ki].state), state,
           sizeof (struct allnet_stream_encryption_state));
   kip [ki].has_state = 1;
-  char print_buffer [sizeof (struct allnet_stream_encryption_state) * 10];
+  /* 3 chars ("xx:" or "xx\n") for each byte of key and secret, then up
+   * to 11 chars for each int, 20 for the counter, 3 spaces, \n, and \0 */
+  char print_buffer [(ALLNET_STREAM_KEY_SIZE + ALLNET_STREAM_SECRET_SIZE) * 3
+                     + 3 * 11 + 20 + 5];
   int psize = sizeof (print_buffer);
   char * next = array_to_buf (state->key, ALLNET_STREAM_KEY_SIZE,
                               print_buffer, &psize);
@@ -2872,6 +3065,102 @@ char * generate_key (int key_bits, char * phrase, char * lang,
   return result;
 }
 
+/* shared by the threads of generate_key_parallel */
+struct key_search {
+  int key_bits;
+  char * phrase;
+  char * lang;
+  int bitstring_bits;
+  int min_bitstrings;
+  pthread_mutex_t mutex;
+  pthread_cond_t found_cond;   /* signaled when result is set */
+  char * result;               /* the first address found, or NULL */
+  unsigned long long int keys_tried;
+};
+
+static void * key_search_thread (void * arg)
+{
+  struct key_search * ks = (struct key_search *) arg;
+  while (1) {
+    pthread_mutex_lock (&(ks->mutex));
+    int found = (ks->result != NULL);
+    pthread_mutex_unlock (&(ks->mutex));
+    if (found)
+      return NULL;
+    char * aaddr = generate_one_key (ks->key_bits, ks->phrase, ks->lang,
+                                     ks->bitstring_bits, ks->min_bitstrings);
+    pthread_mutex_lock (&(ks->mutex));
+    ks->keys_tried++;
+    if ((aaddr != NULL) && (ks->result == NULL)) {
+      ks->result = aaddr;
+      pthread_cond_signal (&(ks->found_cond));
+    } else if (aaddr != NULL) {  /* another thread was first, still saved */
+      printf ("\nalso found key '%s'\n", aaddr);
+      free (aaddr);
+    }
+    pthread_mutex_unlock (&(ks->mutex));
+  }
+}
+
+/* same as generate_key, but nthreads threads search at once.  If
+ * give_feedback, reports the number of keys tried per second every
+ * feedback_seconds */
+char * generate_key_parallel (int key_bits, char * phrase, char * lang,
+                              int bitstring_bits, int min_bitstrings,
+                              int nthreads, int give_feedback,
+                              int feedback_seconds)
+{
+  if (nthreads <= 1)
+    return generate_key (key_bits, phrase, lang, bitstring_bits,
+                         min_bitstrings, give_feedback);
+  struct key_search ks =
+    { .key_bits = key_bits, .phrase = phrase, .lang = lang,
+      .bitstring_bits = bitstring_bits, .min_bitstrings = min_bitstrings,
+      .result = NULL, .keys_tried = 0 };
+  pthread_mutex_init (&(ks.mutex), NULL);
+  pthread_cond_init (&(ks.found_cond), NULL);
+  pthread_t * threads =
+    malloc_or_fail (nthreads * sizeof (pthread_t), "generate_key_parallel");
+  int created = 0;
+  int i;
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create (threads + created, NULL, key_search_thread, &ks) == 0)
+      created++;
+    else
+      printf ("generate_key_parallel: unable to create thread %d\n", i);
+  }
+  if (created == 0) {
+    free (threads);
+    return generate_key (key_bits, phrase, lang, bitstring_bits,
+                         min_bitstrings, give_feedback);
+  }
+  if (feedback_seconds <= 0)
+    feedback_seconds = 10;
+  unsigned long long int start = allnet_time_us ();
+  pthread_mutex_lock (&(ks.mutex));
+  while (ks.result == NULL) {
+    struct timespec deadline;
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += feedback_seconds;
+    pthread_cond_timedwait (&(ks.found_cond), &(ks.mutex), &deadline);
+    if ((ks.result == NULL) && (give_feedback)) {
+      unsigned long long int us = allnet_time_us () - start;
+      printf ("%d threads tried %llu keys in %llus, %.2f keys/s\n",
+              created, ks.keys_tried, us / 1000000,
+              ks.keys_tried * 1000000.0 / ((us > 0) ? us : 1));
+      fflush (stdout);
+    }
+  }
+  pthread_mutex_unlock (&(ks.mutex));
+  /* the other threads stop after finishing their current key */
+  for (i = 0; i < created; i++)
+    pthread_join (threads [i], NULL);
+  free (threads);
+  pthread_cond_destroy (&(ks.found_cond));
+  pthread_mutex_destroy (&(ks.mutex));
+  return ks.result;
+}
+
 /* these give the "normal" version of the broadcast address, without the
  * language, bits, or both.  The existing string is modified in place */
 void delete_lang (char * ahra)
@@ -31,7 +31,8 @@ extern int all_individual_contacts (char *** contacts);
 /* returns the keyset if successful, -1 if the contact already existed
  * creates a new private/public key pair, and if not NULL, also 
  * the contact public key, local and remote addresses
- * if a spare key of the requested size already exists, uses the spare key
+ * if a spare key of the requested size already exists, uses the spare key,
+ * otherwise (if the spare key pool is empty) blocks to generate a new key
  * if feedback is nonzero, gives feedback while creating the key
  * If the contact was already created, but does not have the peer's
  * info, returns as if it were a newly created contact after replacing
@@ -123,6 +124,11 @@ extern int num_keysets (const char * contact);
 /* returns -1 if the contact does not exist */
 extern int all_keys (const char * contact, keyset ** keysets);
 
+/* returns a number that changes whenever contacts or keysets are added,
+ * modified, or deleted, so callers can tell when to refresh anything
+ * they computed from the keys */
+extern unsigned long long int keys_change_count ();
+
 /* returns a pointer to a dynamically allocated (must be free'd).
  * name for the directory corresponding to this key. */
 /* in case of error, returns NULL */
@@ -191,6 +197,33 @@ extern void incomplete_exchange_file (const char * contact, keyset k,
  *    setpriority (PRIO_PROCESS, 0, n), with n >= 15 */
 extern int create_spare_key (int keybits, char * random, int rsize);
 
+/* the spare key pool lets create_contact use a key generated earlier.
+ * returns a spare key of the given size right away, or a null key
+ * (allnet_rsa_prvkey_is_null) if none is ready.  Never generates a key */
+extern allnet_rsa_prvkey take_spare_key (int keybits);
+
+/* starts background threads (at low priority, up to nthreads in all)
+ * that keep at least min_spares keys of keybits bits in the pool,
+ * and up to target keys when speculative_computation_is_ok ().
+ * may be called again to change the sizes.
+ * returns the number of threads running, 0 for errors */
+extern int start_spare_key_pool (int keybits, int min_spares, int target,
+                                 int nthreads);
+
+struct spare_key_pool_stats {
+  int available;      /* spare keys saved, from any process */
+  int keybits;        /* the remaining values only count this process */
+  int min_spares;
+  int target;
+  int threads;
+  int generating;     /* keys being generated right now */
+  unsigned long long int generated;
+  unsigned long long int taken;
+  unsigned long long int missed;  /* take_spare_key found no key */
+};
+
+extern void get_spare_key_pool_stats (struct spare_key_pool_stats * stats);
+
 /*************** operations on symmetric keys ********************/
 
 /* returns the symmetric key size if any, or 0 otherwise */
@@ -253,6 +286,12 @@ extern int revalidate_symmetric_key (const char * contact);
 extern char * generate_key (int key_bits, char * phrase, char * lang,
                             int bitstring_bits, int min_bitstrings,
                             int give_feedback);
+/* same, but searches with nthreads threads at once, and if give_feedback,
+ * prints the number of keys tried per second every feedback_seconds */
+extern char * generate_key_parallel (int key_bits, char * phrase, char * lang,
+                                     int bitstring_bits, int min_bitstrings,
+                                     int nthreads, int give_feedback,
+                                     int feedback_seconds);
 
 /* these give the "normal" version of the broadcast address, without the
  * language, bits, or both.  The existing string is modified in place */
@@ -7,6 +7,10 @@
  * for receive_pipe_message_buffer may be greater than mlen.
  * in case of failure, the receive functions return -1 */
 
+#ifdef __linux__
+#define _GNU_SOURCE   /* for recvmmsg */
+#endif /* __linux__ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,12 +22,25 @@
 #include <pthread.h>
 #include <sys/select.h>
 
+/* on linux, use epoll rather than select for descriptors with many pipes.
+ * define ALLNET_NO_EPOLL to always use select */
+#if defined (__linux__) && ! defined (ALLNET_NO_EPOLL)
+#define ALLNET_USE_EPOLL
+#include <sys/epoll.h>
+#endif /* __linux__ && ! ALLNET_NO_EPOLL */
+
+/* on linux, receive bursts of datagrams with a single call to recvmmsg */
+#ifdef __linux__
+#define ALLNET_USE_RECVMMSG
+#endif /* __linux__ */
+
 #include "packet.h"
 #include "priority.h"
 #include "pipemsg.h"
 #include "util.h"
 #include "allnet_log.h"
 #include "allnet_queue.h"
+#include "allnet_pbuf.h"
 
 #define MAGIC_STRING	"MAGICPIE"  /* magic pipe, squeezed into 8 chars */
 
@@ -46,11 +63,38 @@ struct allnet_pipe_info {
 };
 
 #define MAX_PIPES	100
+#ifdef ALLNET_USE_RECVMMSG
+/* datagrams received at once, then returned one at a time */
+#define DGRAM_BATCH	16
+#endif /* ALLNET_USE_RECVMMSG */
+#ifdef ALLNET_USE_EPOLL
+/* with fewer pipes than this, select is as fast as epoll, and
+ * does not need an extra file descriptor */
+#define EPOLL_MIN_PIPES	8
+/* ready events returned by one call to epoll_wait */
+#define EPOLL_BATCH	32
+#endif /* ALLNET_USE_EPOLL */
 struct pipedesc {
   int num_pipes;
   struct allnet_pipe_info buffers [MAX_PIPES];
   int num_queues;
   int queues [MAX_PIPES];  /* negative integers -x, at index x - 1 */
+#ifdef ALLNET_USE_RECVMMSG
+  int dgram_fd;              /* the socket the batched datagrams came from */
+  unsigned int dgram_count;  /* number of datagrams in the batch */
+  unsigned int dgram_next;   /* index of the next datagram to return */
+  struct allnet_pbuf * dgram [DGRAM_BATCH];
+  struct sockaddr_storage dgram_addrs [DGRAM_BATCH];
+  socklen_t dgram_addr_lens [DGRAM_BATCH];
+#endif /* ALLNET_USE_RECVMMSG */
+#ifdef ALLNET_USE_EPOLL
+  int epoll_fd;            /* -1 if not using epoll */
+  int epoll_disabled;      /* epoll failed, only use select */
+  int epoll_extra;         /* the extra fd registered with epoll, or -1 */
+  int num_ready;           /* number of events from the last epoll_wait */
+  int next_ready;          /* index of the next event to return */
+  struct epoll_event ready [EPOLL_BATCH];
+#endif /* ALLNET_USE_EPOLL */
   struct allnet_log * log;
   pthread_mutex_t receive_mutex;
 #ifdef DEBUG_EBADF
@@ -67,6 +111,18 @@ pd init_pipe_descriptor (struct allnet_log * log)
   memset (result, 0, sizeof (*result));  /* makes debugging easier */
   result->num_pipes = 0;
   result->num_queues = 0;
+#ifdef ALLNET_USE_RECVMMSG
+  result->dgram_fd = -1;
+  result->dgram_count = 0;
+  result->dgram_next = 0;
+#endif /* ALLNET_USE_RECVMMSG */
+#ifdef ALLNET_USE_EPOLL
+  result->epoll_fd = -1;   /* created once there are EPOLL_MIN_PIPES */
+  result->epoll_disabled = 0;
+  result->epoll_extra = -1;
+  result->num_ready = 0;
+  result->next_ready = 0;
+#endif /* ALLNET_USE_EPOLL */
   result->log = log;
   pthread_mutex_init (&(result->receive_mutex), NULL);
 #ifdef DEBUG_EBADF
@@ -203,6 +259,73 @@ static int queue_index (pd p, int queue)
   return -1;
 }
 
+#ifdef ALLNET_USE_EPOLL
+/* returns 1 if the fd is now registered with epoll, 0 otherwise */
+static int epoll_add (pd p, int fd)
+{
+  struct epoll_event event;
+  memset (&event, 0, sizeof (event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl (p->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0)
+    return 1;
+  if ((errno == EEXIST) &&
+      (epoll_ctl (p->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0))
+    return 1;
+  return 0;
+}
+
+/* go back to using select for this pipe descriptor */
+static void epoll_stop (pd p, int fd, const char * op)
+{
+  snprintf (p->log->b, p->log->s,
+            "epoll %s (fd %d) failed (errno %d), using select\n",
+            op, fd, errno);
+  log_print (p->log);
+  close (p->epoll_fd);
+  p->epoll_fd = -1;
+  p->epoll_disabled = 1;
+  p->epoll_extra = -1;
+  p->num_ready = 0;
+  p->next_ready = 0;
+}
+
+/* register all the pipes with a new epoll instance */
+static void epoll_start (pd p)
+{
+  p->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (p->epoll_fd < 0) {
+    perror ("epoll_create1");
+    p->epoll_disabled = 1;
+    return;
+  }
+  p->epoll_extra = -1;
+  p->num_ready = 0;
+  p->next_ready = 0;
+  int i;
+  for (i = 0; i < p->num_pipes; i++) {
+    if (! epoll_add (p, p->buffers [i].pipe_fd)) {
+      epoll_stop (p, p->buffers [i].pipe_fd, "add");
+      return;
+    }
+  }
+}
+
+/* unregisters fd (if it is still open), and drops any of its events
+ * that have not been returned yet */
+static void epoll_forget (pd p, int fd)
+{
+  /* closed fds are removed by the kernel, so errors are expected */
+  epoll_ctl (p->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  int i;
+  int n = p->next_ready;
+  for (i = p->next_ready; i < p->num_ready; i++)
+    if (p->ready [i].data.fd != fd)
+      p->ready [n++] = p->ready [i];
+  p->num_ready = n;
+}
+#endif /* ALLNET_USE_EPOLL */
+
 void add_pipe (pd p, int pipe, const char * description)
 {
   if (pipe >= 0) {
@@ -227,6 +350,14 @@ void add_pipe (pd p, int pipe, const char * description)
     api->bsize = HEADER_SIZE;
     api->filled = 0;
     snprintf (api->description, sizeof (api->description), "%s", description);
+#ifdef ALLNET_USE_EPOLL
+    if (p->epoll_fd >= 0) {
+      if (pipe == p->epoll_extra)  /* extra was closed, fd number reused */
+        p->epoll_extra = -1;
+      if (! epoll_add (p, pipe))
+        epoll_stop (p, pipe, "add");
+    }
+#endif /* ALLNET_USE_EPOLL */
   } else {  /* negative, so it's a queue */
     if (queue_index (p, pipe) != -1) {
       snprintf (p->log->b, p->log->s,
@@ -272,6 +403,10 @@ int remove_pipe (pd p, int pipe)
         p->buffers [index].buffer = p->buffers [index].header;
     }
     p->num_pipes = p->num_pipes - 1;
+#ifdef ALLNET_USE_EPOLL
+    if (p->epoll_fd >= 0)
+      epoll_forget (p, pipe);
+#endif /* ALLNET_USE_EPOLL */
   } else {
     if (index + 1 < p->num_queues)
       p->queues [index] = p->queues [p->num_queues - 1];
@@ -576,6 +711,16 @@ int send_pipe_message (int pipe, const char * message, unsigned int mlen,
   return result;
 }
 
+/* same as send_pipe_message, but if pipe is a queue, adds a reference
+ * to the packet buffer to the queue instead of copying the message */
+int send_pipe_pbuf (int pipe, struct allnet_pbuf * pbuf, unsigned int priority,
+                    struct allnet_log * log)
+{
+  if ((pipe < 0) && (allnet_queues != NULL))
+    return allnet_enqueue_pbuf (allnet_queues [-pipe - 1], pbuf, priority);
+  return send_pipe_message (pipe, pbuf->data, pbuf->len, priority, log);
+}
+
 /* send multiple messages at once, again to avoid the mysterious system
  * delay when sending multiple times in close succession on a socket.
  * (Nagle's delay?).  Each message gets its own header */
@@ -627,20 +772,11 @@ int send_pipe_multiple (int pipe, unsigned int num_messages,
                         struct allnet_log * log)
 {
   if (pipe < 0) {
-    if (allnet_queues != NULL) {
-      unsigned int i;
-      int success = 1;
-      for (i = 0; i < num_messages; i++) {
-        success = success &&
-                  allnet_enqueue (allnet_queues [-pipe - 1],
-                                  (const unsigned char *) (messages [i]),
-                                  (unsigned int) (mlens [i]),
-                                  (unsigned int) (priorities [i]));
-printf ("enqueued message of size %d on pipe %d, success %d (%d/%d)\n",
-mlens [i], pipe, success, i, num_messages);
-      }
-      return success;
-    } else
+    if (allnet_queues != NULL)
+      return (allnet_enqueue_many (allnet_queues [-pipe - 1], num_messages,
+                                   (const unsigned char **) messages,
+                                   mlens, priorities) == (int) num_messages);
+    else
       return 0;
   }
   /* avoid SIGPIPE signals when writing to a closed pipe */
@@ -834,6 +970,53 @@ static fd_set debug_fdset4;
 static unsigned long long int debug_fdtime = 0;
 #endif /* DEBUG_PIPEMSG_SELECT */
 
+#ifdef ALLNET_USE_EPOLL
+/* same as next_available, but using epoll.  The pipes stay registered
+ * from add_pipe to remove_pipe, and each epoll_wait may return many
+ * ready pipes, so the cost per call does not depend on the number of pipes.
+ * returns -2 if epoll fails, in which case the caller should use select */
+static int next_available_epoll (pd p, int extra, int timeout)
+{
+  if (extra != p->epoll_extra) {   /* register the new extra fd */
+    /* if the old extra fd is now a pipe, leave it registered */
+    if ((p->epoll_extra != -1) && (pipe_index (p, p->epoll_extra) == -1))
+      epoll_forget (p, p->epoll_extra);
+    p->epoll_extra = -1;
+    if (extra != -1) {
+      if (! epoll_add (p, extra)) {
+        epoll_stop (p, extra, "add extra");
+        return -2;
+      }
+      p->epoll_extra = extra;
+    }
+  }
+  if (p->next_ready >= p->num_ready) {  /* get more events */
+    p->num_ready = 0;
+    p->next_ready = 0;
+    int ms = ((timeout == PIPE_MESSAGE_WAIT_FOREVER) ? -1 : timeout);
+    int n = epoll_wait (p->epoll_fd, p->ready, EPOLL_BATCH, ms);
+    if (n < 0) {
+      if (errno == EINTR)
+        return -1;
+      perror ("next_available/epoll_wait");
+      epoll_stop (p, p->epoll_fd, "wait");
+      return -2;
+    }
+    p->num_ready = n;
+  }
+  if (p->next_ready >= p->num_ready)   /* timeout */
+    return -1;
+  int found = p->ready [p->next_ready].data.fd;
+  p->next_ready = p->next_ready + 1;
+#ifdef DEBUG_PRINT
+  snprintf (p->log->b, p->log->s, "next_available_epoll returning %d\n",
+            found);
+  log_print (p->log);
+#endif /* DEBUG_PRINT */
+  return found;
+}
+#endif /* ALLNET_USE_EPOLL */
+
 /* returns the first available file descriptor, or -1 in case of timeout */
 /* timeout is in milliseconds, or one of PIPE_MESSAGE_WAIT_FOREVER or
  * PIPE_MESSAGE_NO_WAIT */
@@ -844,6 +1027,16 @@ static int next_available (pd p, int extra, int timeout)
             extra, timeout);
   log_print (p->log);
 #endif /* DEBUG_PRINT */
+#ifdef ALLNET_USE_EPOLL
+  if ((p->epoll_fd < 0) && (! p->epoll_disabled) &&
+      (p->num_pipes >= EPOLL_MIN_PIPES))
+    epoll_start (p);
+  if (p->epoll_fd >= 0) {
+    int found = next_available_epoll (p, extra, timeout);
+    if (found != -2)
+      return found;
+  } /* else, or if epoll failed, use select */
+#endif /* ALLNET_USE_EPOLL */
   /* set up the fdset for receiving */
   fd_set receiving;
   int max_pipe = make_fdset (p, extra, &receiving, p->log);
@@ -1257,6 +1450,103 @@ static int tv_compare (struct timeval * t1, struct timeval * t2)
   return 0;
 }
 
+#ifdef ALLNET_USE_RECVMMSG
+/* must be called with p->receive_mutex held.
+ * receives as many datagrams as are ready on fd (up to DGRAM_BATCH)
+ * with one system call, and saves them in p's datagram batch.
+ * returns the number of datagrams received, 0 if none were ready,
+ * or -1 in case of error */
+static int receive_dgrams (pd p, int fd)
+{
+  struct mmsghdr msgs [DGRAM_BATCH];
+  struct iovec iovs [DGRAM_BATCH];
+  memset (msgs, 0, sizeof (msgs));
+  int i;
+  for (i = 0; i < DGRAM_BATCH; i++) {
+    p->dgram [i] = allnet_pbuf_new (ALLNET_MTU);
+    iovs [i].iov_base = p->dgram [i]->data;
+    iovs [i].iov_len = ALLNET_MTU;
+    msgs [i].msg_hdr.msg_iov = iovs + i;
+    msgs [i].msg_hdr.msg_iovlen = 1;
+    msgs [i].msg_hdr.msg_name = p->dgram_addrs + i;
+    msgs [i].msg_hdr.msg_namelen = sizeof (p->dgram_addrs [i]);
+  }
+  int n = recvmmsg (fd, msgs, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+  int saved_errno = errno;
+  for (i = ((n < 0) ? 0 : n); i < DGRAM_BATCH; i++)  /* unused buffers */
+    allnet_pbuf_release (p->dgram [i]);
+  p->dgram_count = 0;
+  p->dgram_next = 0;
+  if (n < 0) {
+    if ((saved_errno != EAGAIN) && (saved_errno != EWOULDBLOCK)) {
+      errno = saved_errno;
+      perror ("recvmmsg");
+      snprintf (p->log->b, p->log->s, "%s: recvmmsg errno %d, fd %d\n",
+                p->log->debug_info, saved_errno, fd);
+      log_print (p->log);
+      return -1;
+    }
+    return 0;   /* EAGAIN or EWOULDBLOCK, no message ready at this time */
+  }
+  for (i = 0; i < n; i++) {
+    p->dgram [i]->len = msgs [i].msg_len;
+    p->dgram_addr_lens [i] = msgs [i].msg_hdr.msg_namelen;
+  }
+  p->dgram_fd = fd;
+  p->dgram_count = n;
+  return n;
+}
+
+/* must be called with p->receive_mutex held.
+ * returns the next non-empty datagram in the batch, either in *pbuf
+ * (if pbuf is not NULL) or in a newly allocated *message, and its
+ * source address in sa and salen.  returns 0 if there are no more */
+static int next_dgram (pd p, char ** message, struct allnet_pbuf ** pbuf,
+                       struct sockaddr * sa, socklen_t * salen)
+{
+  while (p->dgram_next < p->dgram_count) {
+    unsigned int index = p->dgram_next;
+    struct allnet_pbuf * next = p->dgram [index];
+    p->dgram_next++;
+    int result = (int) (next->len);
+    if (result <= 0) {   /* empty datagram, skip */
+      allnet_pbuf_release (next);
+      continue;
+    }
+    if ((sa != NULL) && (salen != NULL)) {
+      socklen_t alen = p->dgram_addr_lens [index];
+      if (alen > *salen)
+        alen = *salen;
+      memcpy (sa, p->dgram_addrs + index, alen);
+      *salen = p->dgram_addr_lens [index];
+      if ((sa->sa_family != AF_INET) && (sa->sa_family != AF_INET6) &&
+          (sa->sa_family != PF_PACKET)) { /* strange */
+        snprintf (p->log->b, p->log->s, "next_dgram got %d bytes, family %d\n",
+                  result, sa->sa_family);
+        log_print (p->log);
+      }
+    }
+    if (pbuf != NULL) {    /* hand over the reference */
+      *pbuf = next;
+    } else {
+      *message = memcpy_malloc (next->data, result, "next_dgram");
+      allnet_pbuf_count_copy (result);
+      allnet_pbuf_release (next);
+    }
+    return result;
+  }
+  return 0;
+}
+
+/* discards any datagrams remaining in the batch */
+static void discard_dgrams (pd p)
+{
+  while (p->dgram_next < p->dgram_count)
+    allnet_pbuf_release (p->dgram [p->dgram_next++]);
+  p->dgram_count = 0;
+  p->dgram_next = 0;
+}
+#else /* ! ALLNET_USE_RECVMMSG */
 static int receive_dgram (int fd, char ** message, 
                           struct sockaddr * sa, socklen_t * salen,
                           struct allnet_log * log)
@@ -1309,6 +1599,7 @@ static int receive_dgram (int fd, char ** message,
   }
   return result;
 }
+#endif /* ALLNET_USE_RECVMMSG */
 
 /* if returning for a pipe rather than a UDP socket, clear the address */
 static void clear_addr (struct sockaddr * sa, socklen_t * salen)
@@ -1322,18 +1613,40 @@ static void clear_addr (struct sockaddr * sa, socklen_t * salen)
   }
 }
 
-/* same as receive_pipe_message_any, but listens to the given socket as
- * well as the pipes added previously,  The socket is assumed to be a
- * UDP or raw socket.  If the first message is received on this socket,
- * the message is read with recvfrom, assuming the size of the message
- * to be ALLNET_MTU or less (any more will be in the return value of
- * receive_pipe_message_fd, but not in the message)
- * sa and salen are passed directly as the last parameters to recvfrom.
- *
- * in case some other socket is ready first, or if fd is -1,
- * this call is the same as receive_pipe_message_any
- */
-int receive_pipe_message_fd (pd p, int timeout, char ** message, int fd,
+/* returns the packet taken from a queue, either in *pbuf (if pbuf is
+ * not NULL) or in a newly allocated *message */
+static int from_queue (struct allnet_pbuf * next, char ** message,
+                       struct allnet_pbuf ** pbuf)
+{
+  int plen = (int) (next->len);
+  if (pbuf != NULL) {    /* hand over the reference */
+    *pbuf = next;
+  } else {
+    *message = memcpy_malloc (next->data, plen, "receive_pipe_message_fd");
+    allnet_pbuf_count_copy (plen);
+    allnet_pbuf_release (next);
+  }
+  return plen;
+}
+
+/* returns r, and if r > 0, also returns the malloc'd data in r, either
+ * in *message or wrapped (without copying) in *pbuf */
+static int deliver (int r, char * data, char ** message,
+                    struct allnet_pbuf ** pbuf)
+{
+  if (r > 0) {
+    if (pbuf != NULL)
+      *pbuf = allnet_pbuf_adopt (data, (unsigned int) r);
+    else
+      *message = data;
+  }
+  return r;
+}
+
+/* common code for receive_pipe_message_fd and receive_pipe_pbuf_any.
+ * exactly one of message and pbuf should be NULL */
+static int receive_internal (pd p, int timeout, char ** message,
+                             struct allnet_pbuf ** pbuf, int fd,
                              struct sockaddr * sa, socklen_t * salen,
                              int * from_pipe, unsigned int * priority)
 {
@@ -1347,23 +1660,55 @@ int receive_pipe_message_fd (pd p, int timeout, char ** message, int fd,
   if (priority != NULL) *priority = ALLNET_PRIORITY_EPSILON;
   while ((timeout == PIPE_MESSAGE_WAIT_FOREVER) ||
          (tv_compare (&now, &finish) <= 0)) {
-    int pipe;
+    int pipe = -1;
     int effective_timeout = timeout;
+    /* with only queues and no file descriptors, allnet_dequeue can block
+     * until a packet is enqueued, so there is no need to call select */
+    int queues_only = ((p->num_pipes == 0) && (fd == -1) &&
+                       (p->num_queues > 0));
+    unsigned int queue_timeout = 0;   /* by default, just poll the queues */
     if (((timeout == PIPE_MESSAGE_WAIT_FOREVER) || (timeout > 10)) &&
-        (p->num_queues > 0))
+        (p->num_queues > 0) && (! queues_only))
       effective_timeout = 10;    /* look at the queues every 10ms */
 /* receive with the lock held, since otherwise one of the file descriptors
    might be closed while we receive, in which case the behavior of select
    is undefined and apparently sometimes messed up. */ 
     pthread_mutex_lock (&(p->receive_mutex));
+#ifdef ALLNET_USE_RECVMMSG
+    if (p->dgram_next < p->dgram_count) {  /* already have a datagram */
+      if (p->dgram_fd == fd) {
+        int r = next_dgram (p, message, pbuf, sa, salen);
+        if (r > 0) {
+          if (from_pipe != NULL) *from_pipe = fd;
+          pthread_mutex_unlock (&(p->receive_mutex));
+          return r;
+        }
+      } else {  /* the caller has a new socket, the old one is gone */
+        discard_dgrams (p);
+      }
+    }
+#endif /* ALLNET_USE_RECVMMSG */
     if (effective_timeout > 100)
       effective_timeout = 100;    /* release the lock at least every 100ms */
-    pipe = next_available (p, fd, effective_timeout);
+    if (queues_only) {
+      if (timeout == PIPE_MESSAGE_WAIT_FOREVER) {
+        effective_timeout = 100;  /* release the lock at least every 100ms */
+      } else {                    /* only wait until finish */
+        long long int remaining = delta_us (&finish, &now) / 1000LL;
+        if (remaining < effective_timeout)
+          effective_timeout = (int) remaining;
+      }
+      queue_timeout = (unsigned int) effective_timeout;
+    } else {
+      pipe = next_available (p, fd, effective_timeout);
+    }
     if (pipe >= 0) { /* can read pipe */
       if (from_pipe != NULL) *from_pipe = pipe;
       int r;
+      char * data = NULL;
       if (pipe != fd) { /* it is a pipe, not a datagram socket */
-        r = receive_pipe_message_poll (p, pipe, message, priority);
+        r = receive_pipe_message_poll (p, pipe, &data, priority);
+        r = deliver (r, data, message, pbuf);
         if (r != 0) {
 /* if (r < 0) printf ("receive_pipe_message_poll returned %d\n", r); */
           clear_addr (sa, salen); /* clear the address */
@@ -1371,7 +1716,14 @@ int receive_pipe_message_fd (pd p, int timeout, char ** message, int fd,
           return r;
         }
       } else {         /* UDP or raw socket */
-        r = receive_dgram (pipe, message, sa, salen, p->log);
+#ifdef ALLNET_USE_RECVMMSG
+        r = receive_dgrams (p, pipe);
+        if (r > 0)
+          r = next_dgram (p, message, pbuf, sa, salen);
+#else /* ! ALLNET_USE_RECVMMSG */
+        r = receive_dgram (pipe, &data, sa, salen, p->log);
+        r = deliver (r, data, message, pbuf);
+#endif /* ALLNET_USE_RECVMMSG */
 /* if (r < 0) printf ("receive_dgram returned %d\n", r); */
         if (r != 0) {
           pthread_mutex_unlock (&(p->receive_mutex));
@@ -1382,59 +1734,25 @@ int receive_pipe_message_fd (pd p, int timeout, char ** message, int fd,
       if (from_pipe != NULL) *from_pipe = -1;
     }
     if ((allnet_queues != NULL) && (p->num_queues > 0)) {
-/*extern int debug_print_fd;
-int debug_index = ((- p->queues[0]) - 1);
-struct allnet_queue * debug_q = allnet_queues [debug_index];
-if (fd == debug_print_fd)
-printf ("checking %d queues, first @ %d/%d is %s, has %d packets\n", p->num_queues, debug_index, p->queues[0], allnet_queue_info(debug_q), allnet_queue_size(debug_q));*/
-      struct allnet_queue ** queues =
-        malloc (p->num_queues * sizeof (struct allnet_queue *));
-      if (queues != NULL) {
-        int i;
-        for (i = 0; i < p->num_queues; i++)
-          queues [i] = allnet_queues [(- (p->queues [i])) - 1];
-        unsigned char buffer [ALLNET_MTU];
-        unsigned int nqueue = p->num_queues;
-        unsigned int plen = sizeof (buffer); /* timeout 0 to just poll */
-/*
-unsigned int debug_alocal = 0;
-if ((debug_alocal == 0) && (strncmp (p->log->debug_info, "alocal", 6) == 0))
-debug_alocal = (unsigned int) pthread_self ();
-if (debug_alocal == (unsigned int) pthread_self ())
-printf ("receive_pipe_message_fd %3d (%s) looking at %d queues, plen %d\n",
-(unsigned int)pthread_self () % 1000, p->log->debug_info, p->num_queues, plen);
-if (debug_alocal == (unsigned int) pthread_self ())
-for (i = 0; i < p->num_queues; i++) printf ("queue %d is %d\n", i, p->queues [i]);
-*/
-        int result = allnet_dequeue (queues, &nqueue, buffer, &plen,
-                                     (unsigned int *) priority, 0);
-/*
-if (debug_alocal == (unsigned int) pthread_self ())
-printf ("receive_pipe_message_fd %3d (%s) got %d/%d, %d\n",
-(unsigned int)pthread_self () % 1000, p->log->debug_info, result, nqueue, plen);
-*/
-        if ((result == 1) && (plen > 0)) {
-          if (from_pipe != NULL) {  /* find out the fd we got it on */
-            for (i = 0; i < p->num_queues; i++) {
-              if (queues [nqueue] == allnet_queues [(- (p->queues [i])) - 1]) {
-                *from_pipe = p->queues [i];
-/* printf ("receive_pipe_message_fd got %d-byte message on queue %d @ %d\n",
-plen, p->queues [i], i); */
-                /*if (fd == debug_print_fd)
-                  printf ("set from_pipe to %d, p->queues [%d] is %d\n", *from_pipe, i, p->queues [i]);*/
-                break;
-              }
-            }
-          }
-          free (queues);  /* no longer needed */
-          *message = malloc_or_fail (plen, "receive_pipe_message_fd queue");
-          memcpy (*message, buffer, plen);
-          pthread_mutex_unlock (&(p->receive_mutex));
-          return plen;
-        }
-        free (queues);  /* no longer needed */
-        if ((result == -2) && (plen > 0))
-          allnet_queue_discard_first (queues [nqueue]);
+      struct allnet_queue * queues [MAX_PIPES];
+      int i;
+      for (i = 0; i < p->num_queues; i++)
+        queues [i] = allnet_queues [(- (p->queues [i])) - 1];
+      unsigned int nqueue = p->num_queues;
+      /* only take one packet at a time, so packets that stay in the queue
+       * are still dequeued (and discarded) in order of priority */
+      unsigned int npackets = 1;
+      struct allnet_pbuf * next = NULL;
+      unsigned int next_priority = ALLNET_PRIORITY_EPSILON;
+      int result = allnet_dequeue_pbufs (queues, &nqueue, &npackets,
+                                         &next, &next_priority,
+                                         queue_timeout);
+      if ((result == 1) && (npackets > 0)) {
+        int r = from_queue (next, message, pbuf);
+        if (from_pipe != NULL) *from_pipe = p->queues [nqueue];
+        if (priority != NULL) *priority = next_priority;
+        pthread_mutex_unlock (&(p->receive_mutex));
+        return r;
       }
     }
     /* release the lock, acquire it again at the top of the loop */
@@ -1446,6 +1764,26 @@ plen, p->queues [i], i); */
   return 0;    /* timed out */
 }
 
+
+/* same as receive_pipe_message_any, but listens to the given socket as
+ * well as the pipes added previously,  The socket is assumed to be a
+ * UDP or raw socket.  If the first message is received on this socket,
+ * the message is read with recvfrom, assuming the size of the message
+ * to be ALLNET_MTU or less (any more will be in the return value of
+ * receive_pipe_message_fd, but not in the message)
+ * sa and salen are passed directly as the last parameters to recvfrom.
+ *
+ * in case some other socket is ready first, or if fd is -1,
+ * this call is the same as receive_pipe_message_any
+ */
+int receive_pipe_message_fd (pd p, int timeout, char ** message, int fd,
+                             struct sockaddr * sa, socklen_t * salen,
+                             int * from_pipe, unsigned int * priority)
+{
+  return receive_internal (p, timeout, message, NULL, fd, sa, salen,
+                           from_pipe, priority);
+}
+
 /* receive on the first ready pipe, returning the size and message
  * for the first one received, and returning 0 in case of timeout
  * and -1 in case of error, including a closed pipe.
@@ -1462,6 +1800,16 @@ int receive_pipe_message_any (pd p, int timeout, char ** message,
                                   from_pipe, priority);
 }
 
+/* same as receive_pipe_message_any, but returns the message in a packet
+ * buffer, which the caller must release with allnet_pbuf_release.
+ * messages received from queues are usually not copied at all */
+int receive_pipe_pbuf_any (pd p, int timeout, struct allnet_pbuf ** pbuf,
+                           int * from_pipe, unsigned int * priority)
+{
+  return receive_internal (p, timeout, NULL, pbuf, -1, NULL, NULL,
+                           from_pipe, priority);
+}
+
 #ifndef DEBUG_PRINT
 #define DEBUG_PRINT
 #endif /* DEBUG_PRINT */
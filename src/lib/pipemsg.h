@@ -8,6 +8,8 @@
 
 #include "allnet_log.h"
 
+struct allnet_pbuf;   /* defined in allnet_pbuf.h */
+
 /* pipedesc is defined in pipemsg.c, and only used for receiving */
 /* should be initialized to NULL before the first call */
 typedef struct pipedesc * pd;
@@ -33,6 +35,12 @@ extern int send_pipe_message_free (int pipe, char * message, unsigned int mlen,
                                    unsigned int priority,
                                    struct allnet_log * log);
 
+/* same as send_pipe_message, but if pipe is a queue, adds a reference
+ * to the packet buffer to the queue instead of copying the message.
+ * the caller keeps its own reference */
+extern int send_pipe_pbuf (int pipe, struct allnet_pbuf * pbuf,
+                           unsigned int priority, struct allnet_log * log);
+
 /* send multiple messages at once, again to avoid the mysterious system
  * delay when sending multiple times in close succession on a socket.
  * messages are not freed */
@@ -73,6 +81,13 @@ extern int remove_pipe (pd p, int pipe);
 extern int receive_pipe_message_any (pd p, int timeout, char ** message,
                                      int * from_pipe, unsigned int * priority);
 
+/* same as receive_pipe_message_any, but returns the message in a packet
+ * buffer, which the caller must release with allnet_pbuf_release.
+ * messages received from queues are usually not copied at all */
+extern int receive_pipe_pbuf_any (pd p, int timeout,
+                                  struct allnet_pbuf ** pbuf,
+                                  int * from_pipe, unsigned int * priority);
+
 /* same as receive_pipe_message_any, but listens to the given socket as
  * well as the pipes added previously,  The socket is assumed to be a
  * UDP or raw socket.  If the first message is received on this socket,
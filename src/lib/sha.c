@@ -9,24 +9,12 @@
 
 #include "sha.h"
 
-#define SHA512_BLOCK_SIZE	128	/* 1024 bits or 128 bytes */
-#define SHA1_BLOCK_SIZE		64	/*  512 bits or  64 bytes */
 
 static int debugging = 0;
 #ifdef SHA_UNIT_TEST
 #define DEBUG_PRINT
 #endif /* SHA_UNIT_TEST */
 
-typedef union uint512 {
-  unsigned char c [512 / 8];
-  uint64_t i [512 / (8 * sizeof (uint64_t))];
-} uint512;
-
-typedef union uint160 {
-  unsigned char c [160 / 8];   			/* 20 bytes */
-  uint32_t i [160 / (8 * sizeof (uint32_t))];  	/* 5 words */
-} uint160;
-
 static const uint64_t K512 [] = {
 0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc,
 0x3956c25bf348b538, 0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118,
@@ -185,12 +173,12 @@ static inline void init_w (uint64_t * W, const uint64_t * block)
 }
 
 /* do the basic hash of one block. */
-/* block is the 512-bit/64-byte/16-word input block.
- * hash is the 160-bit/20-byte/5-word input and output hash
+/* block is the 1024-bit/128-byte/16-word input block.
+ * hash is the 512-bit/64-byte/8-word input and output hash
  * native_in is 1 if we don't have to revert the bytes of the block on
  * a little-endian machine */
 static void compute_sha512 (const uint64_t * block,
-                            uint512 * hash, int native_in) 
+                            uint64_t * hash, int native_in)
 {
   uint64_t W [80];
   int t;
@@ -206,14 +194,14 @@ static void compute_sha512 (const uint64_t * block,
 #endif /* __BYTE_ORDER == __LITTLE_ENDIAN */
 
   /* step 2 */
-  uint64_t a = hash->i [0];
-  uint64_t b = hash->i [1];
-  uint64_t c = hash->i [2];
-  uint64_t d = hash->i [3];
-  uint64_t e = hash->i [4];
-  uint64_t f = hash->i [5];
-  uint64_t g = hash->i [6];
-  uint64_t h = hash->i [7];
+  uint64_t a = hash [0];
+  uint64_t b = hash [1];
+  uint64_t c = hash [2];
+  uint64_t d = hash [3];
+  uint64_t e = hash [4];
+  uint64_t f = hash [5];
+  uint64_t g = hash [6];
+  uint64_t h = hash [7];
 #ifdef DEBUG_PRINT
   if (debugging)
     printf ("in: %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n",
@@ -243,86 +231,113 @@ static void compute_sha512 (const uint64_t * block,
   }
 
   /* step 4 */
-  hash->i [0] += a;
-  hash->i [1] += b;
-  hash->i [2] += c;
-  hash->i [3] += d;
-  hash->i [4] += e;
-  hash->i [5] += f;
-  hash->i [6] += g;
-  hash->i [7] += h;
+  hash [0] += a;
+  hash [1] += b;
+  hash [2] += c;
+  hash [3] += d;
+  hash [4] += e;
+  hash [5] += f;
+  hash [6] += g;
+  hash [7] += h;
   if (debugging)
     printf ("hash = %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 "\n",
-            hash->i [0], hash->i [1], hash->i [2], hash->i [3],
-            hash->i [4], hash->i [5], hash->i [6], hash->i [7]);
+            hash [0], hash [1], hash [2], hash [3],
+            hash [4], hash [5], hash [6], hash [7]);
 }
 
-/* the result array must have size SHA512_SIZE */
-/* #define SHA512_SIZE	64 */
-void sha512 (const char * input, int bytes, char * result)
+void sha512_init (struct sha512_ctx * ctx)
 {
-  int i;
-  if (bytes < 0) {
+  memcpy (ctx->hash, init_H512, sizeof (init_H512));
+  memcpy (ctx->prev, init_H512, sizeof (init_H512));
+  ctx->count = 0;
+}
+
+static void sha512_block (struct sha512_ctx * ctx, const char * block)
+{
+  memcpy (ctx->prev, ctx->hash, sizeof (ctx->prev));
+  compute_sha512 ((const uint64_t *) block, ctx->hash, 0);
+#ifdef DEBUG_PRINT
+  if (debugging) {
+    printf ("hash is %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n",
+            ctx->hash [0], ctx->hash [1], ctx->hash [2], ctx->hash [3],
+            ctx->hash [4], ctx->hash [5], ctx->hash [6], ctx->hash [7]);
+  }
+#endif /* DEBUG_PRINT */
+}
+
+void sha512_update (struct sha512_ctx * ctx, const char * data, int dsize)
+{
+  if (dsize < 0) {
     printf ("error in sha computation; %d (%x) bytes requested\n",
-            bytes, bytes);
+            dsize, dsize);
     exit (1);
   }
+  int used = ctx->count % SHA512_BLOCK_SIZE;
+  ctx->count += dsize;
+  if (used > 0) {   /* fill the partial block first */
+    int fill = SHA512_BLOCK_SIZE - used;
+    if (fill > dsize)
+      fill = dsize;
+    memcpy (ctx->block + used, data, fill);
+    data += fill;
+    dsize -= fill;
+    if (used + fill < SHA512_BLOCK_SIZE)
+      return;
+    sha512_block (ctx, ctx->block);
+  }
+  while (dsize >= SHA512_BLOCK_SIZE) {  /* hash full blocks in place */
+    sha512_block (ctx, data);
+    data += SHA512_BLOCK_SIZE;
+    dsize -= SHA512_BLOCK_SIZE;
+  }
+  if (dsize > 0)
+    memcpy (ctx->block, data, dsize);
+}
+
+void sha512_final (struct sha512_ctx * ctx, char * result)
+{
+  /* the original one-shot sha512 never hashed the last block of data
+   * whose size is a multiple of 128, though it counted its length.
+   * Hashes and hmacs computed that way are stored and exchanged by
+   * allnet, so we must do the same */
+  if ((ctx->count > 0) && ((ctx->count % SHA512_BLOCK_SIZE) == 0))
+    memcpy (ctx->hash, ctx->prev, sizeof (ctx->hash));
   /* padding */
-  unsigned int bits = bytes * 8;
-  int input_blocks = ((bytes + 127) / 128) - 1;
-
-  char last1 [SHA512_BLOCK_SIZE];  /* next-to-last block, has data from input */
-  char last2 [SHA512_BLOCK_SIZE];  /* last block, may not be needed */
-  memset (last1, 0, SHA512_BLOCK_SIZE);
-  memset (last2, 0, SHA512_BLOCK_SIZE);
-  int last_bytes = bytes % SHA512_BLOCK_SIZE;
-  int padding = SHA512_BLOCK_SIZE - last_bytes;
-  if (last_bytes > 0)
-    memcpy (last1, input + (bytes - last_bytes), last_bytes);
-  if (padding > 0)
-    last1 [last_bytes] = 0x80;
-  else
-    last2 [0] = 0x80;
+  unsigned int bits = (unsigned int) (ctx->count * 8);  /* only 32 bits */
+  int last_bytes = ctx->count % SHA512_BLOCK_SIZE;
+  char last [2 * SHA512_BLOCK_SIZE];  /* last one or two blocks */
+  memset (last, 0, sizeof (last));
+  memcpy (last, ctx->block, last_bytes);
+  last [last_bytes] = 0x80;
   /* sha512 has 16B for 2^128 bytes, my ints are 64 bits/8B long */
+  int padding = SHA512_BLOCK_SIZE - last_bytes;
+  int last_blocks = 1;
   if (padding < 17)  /* so we extend if padding < 17, but only write 8 bytes */
-    write_int (last2 + (SHA512_BLOCK_SIZE - 8), bits);
-  else
-    write_int (last1 + (SHA512_BLOCK_SIZE - 8), bits);
-  uint512 hash;
-  memcpy (hash.c, init_H512, sizeof (init_H512));
-  for (i = 0; i < input_blocks; i++) {
-    compute_sha512 (((uint64_t *) (input + 128 * i)), &hash, 0);
-#ifdef DEBUG_PRINT
-    printf ("hash is %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n",
-            hash.i [0], hash.i [1], hash.i [2], hash.i [3],
-            hash.i [4], hash.i [5], hash.i [6], hash.i [7]);
-    print_data (hash.c, 64);
-#endif /* DEBUG_PRINT */
-  }
-  compute_sha512 (((uint64_t *) last1), &hash, 0);
-  if (padding < 17)
-    compute_sha512 (((uint64_t *) last2), &hash, 0);
+    last_blocks = 2;
+  write_int (last + (last_blocks * SHA512_BLOCK_SIZE - 8), bits);
+  compute_sha512 ((uint64_t *) last, ctx->hash, 0);
+  if (last_blocks > 1)
+    compute_sha512 ((uint64_t *) (last + SHA512_BLOCK_SIZE), ctx->hash, 0);
 #ifdef DEBUG_PRINT
   if (debugging) {
     printf ("final hash is %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 "\n",
-            hash.i [0], hash.i [1], hash.i [2], hash.i [3],
-            hash.i [4], hash.i [5], hash.i [6], hash.i [7]);
-    print_data (hash.c, 64);
+            ctx->hash [0], ctx->hash [1], ctx->hash [2], ctx->hash [3],
+            ctx->hash [4], ctx->hash [5], ctx->hash [6], ctx->hash [7]);
   }
 #endif /* DEBUG_PRINT */
+  int i;
+  for (i = 0; i < SHA512_SIZE / 8; i++)
+    write_int (result + 8 * i, ctx->hash [i]);
+}
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-  write_int (result     , hash.i [0]);
-  write_int (result +  8, hash.i [1]);
-  write_int (result + 16, hash.i [2]);
-  write_int (result + 24, hash.i [3]);
-  write_int (result + 32, hash.i [4]);
-  write_int (result + 40, hash.i [5]);
-  write_int (result + 48, hash.i [6]);
-  write_int (result + 56, hash.i [7]);
-#else /* __BYTE_ORDER != __LITTLE_ENDIAN */
-  memcpy (result, hash.c, SHA512_SIZE);
-#endif /* __BYTE_ORDER == __LITTLE_ENDIAN */
+/* the result array must have size SHA512_SIZE */
+/* #define SHA512_SIZE	64 */
+void sha512 (const char * input, int bytes, char * result)
+{
+  struct sha512_ctx ctx;
+  sha512_init (&ctx);
+  sha512_update (&ctx, input, bytes);
+  sha512_final (&ctx, result);
 }
 
 /* the result array must have size rsize, only the first rsize bytes
@@ -374,11 +389,11 @@ static inline void init_w32 (uint32_t * W, const uint32_t * block)
 
 /* do the basic hash of one block. */
 /* block is the 512-bit/64-byte/16-word input block.
- * hash is the 256-bit/32-byte/8-word input and output hash
+ * hash is the 160-bit/20-byte/5-word input and output hash
  * native_in is 1 if we don't have to revert the bytes of the block on
  * a little-endian machine */
 static void compute_sha1 (const uint32_t * block,
-                          uint160 * hash, int native_in) 
+                          uint32_t * hash, int native_in)
 {
   uint32_t W [80];
   int t;
@@ -394,11 +409,11 @@ static void compute_sha1 (const uint32_t * block,
 #endif /* __BYTE_ORDER == __LITTLE_ENDIAN */
 
   /* step 2 */
-  uint32_t a = hash->i [0];
-  uint32_t b = hash->i [1];
-  uint32_t c = hash->i [2];
-  uint32_t d = hash->i [3];
-  uint32_t e = hash->i [4];
+  uint32_t a = hash [0];
+  uint32_t b = hash [1];
+  uint32_t c = hash [2];
+  uint32_t d = hash [3];
+  uint32_t e = hash [4];
 #ifdef DEBUG_PRINT
   if (debugging)
     printf ("in: %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 "\n",
@@ -438,79 +453,86 @@ static void compute_sha1 (const uint32_t * block,
   }
 
   /* step 4 */
-  hash->i [0] += a;
-  hash->i [1] += b;
-  hash->i [2] += c;
-  hash->i [3] += d;
-  hash->i [4] += e;
+  hash [0] += a;
+  hash [1] += b;
+  hash [2] += c;
+  hash [3] += d;
+  hash [4] += e;
   if (debugging)
     printf ("hash = %8" PRIx32 " %8" PRIx32 " %8" PRIx32 " %8" PRIx32 " %8" PRIx32 "\n",
-            hash->i [0], hash->i [1], hash->i [2], hash->i [3], hash->i [4]);
+            hash [0], hash [1], hash [2], hash [3], hash [4]);
 }
 
-/* the result array must have size SHA1_SIZE */
-void sha1 (const char * data, int dsize, char * result)
+void sha1_init (struct sha1_ctx * ctx)
+{
+  memcpy (ctx->hash, init_H1, sizeof (init_H1));
+  ctx->count = 0;
+}
+
+void sha1_update (struct sha1_ctx * ctx, const char * data, int dsize)
 {
-  int i;
   if (dsize < 0) {
     printf ("error in sha1 computation; %d (%x) bytes requested\n",
             dsize, dsize);
     exit (1);
   }
+  int used = ctx->count % SHA1_BLOCK_SIZE;
+  ctx->count += dsize;
+  if (used > 0) {   /* fill the partial block first */
+    int fill = SHA1_BLOCK_SIZE - used;
+    if (fill > dsize)
+      fill = dsize;
+    memcpy (ctx->block + used, data, fill);
+    data += fill;
+    dsize -= fill;
+    if (used + fill < SHA1_BLOCK_SIZE)
+      return;
+    compute_sha1 ((const uint32_t *) ctx->block, ctx->hash, 0);
+  }
+  while (dsize >= SHA1_BLOCK_SIZE) {  /* hash full blocks in place */
+    compute_sha1 ((const uint32_t *) data, ctx->hash, 0);
+    data += SHA1_BLOCK_SIZE;
+    dsize -= SHA1_BLOCK_SIZE;
+  }
+  if (dsize > 0)
+    memcpy (ctx->block, data, dsize);
+}
+
+void sha1_final (struct sha1_ctx * ctx, char * result)
+{
   /* padding */
-  unsigned int bits = dsize * 8;
-  /* number of full input blocks */
-  /* int input_blocks = ((dsize + SHA1_BLOCK_SIZE - 1) / SHA1_BLOCK_SIZE) - 1;*/
-  int input_blocks = dsize / SHA1_BLOCK_SIZE;
-
-  char last1 [SHA1_BLOCK_SIZE];  /* next-to-last block, has data from input */
-  char last2 [SHA1_BLOCK_SIZE];  /* last block, may not be needed */
-  memset (last1, 0, sizeof (last1));
-  memset (last2, 0, sizeof (last2));
-  /* number of bytes in last1 (< SHA1_BLOCK_SIZE), and also index of byte
-   * of last1 into which to write the 0x80 which ends the data */
-  int last_bytes = dsize % SHA1_BLOCK_SIZE;
-  /* number of bytes left in last1 after writing any odd bytes into last1 */
+  unsigned int bits = (unsigned int) (ctx->count * 8);  /* only 32 bits */
+  /* number of bytes in the last block (< SHA1_BLOCK_SIZE), and also index
+   * of the byte into which to write the 0x80 which ends the data */
+  int last_bytes = ctx->count % SHA1_BLOCK_SIZE;
+  char last [2 * SHA1_BLOCK_SIZE];  /* last one or two blocks */
+  memset (last, 0, sizeof (last));
+  memcpy (last, ctx->block, last_bytes);
+  last [last_bytes] = 0x80;
   int padding = SHA1_BLOCK_SIZE - last_bytes;
-  /* number of bytes processed in the main loop */
-  int full_blocks_bytes = input_blocks * SHA1_BLOCK_SIZE;
-  if (dsize > full_blocks_bytes)
-    memcpy (last1, data + full_blocks_bytes, dsize - full_blocks_bytes);
-  last1 [last_bytes] = 0x80;
+  int last_blocks = 1;
   if (padding < 9)  /* we extend if padding < 9 */
-    write_int (last2 + (SHA1_BLOCK_SIZE - 8), bits);
-  else
-    write_int (last1 + (SHA1_BLOCK_SIZE - 8), bits);
-  uint160 hash;
-  memcpy (hash.c, init_H1, sizeof (init_H1));
-  for (i = 0; i < input_blocks; i++) {
-    compute_sha1 (((uint32_t *) (data + SHA1_BLOCK_SIZE * i)), &hash, 0);
+    last_blocks = 2;
+  write_int (last + (last_blocks * SHA1_BLOCK_SIZE - 8), bits);
+  compute_sha1 ((uint32_t *) last, ctx->hash, 0);
+  if (last_blocks > 1)
+    compute_sha1 ((uint32_t *) (last + SHA1_BLOCK_SIZE), ctx->hash, 0);
 #ifdef DEBUG_PRINT
-    if (debugging) {
-      printf ("sha1 is %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 "\n", hash.i [0], hash.i [1], hash.i [2], hash.i [3], hash.i [4]);
-      print_data (hash.c, 20);
-    }
-#endif /* DEBUG_PRINT */
-  }
-  compute_sha1 (((uint32_t *) last1), &hash, 0);
-  if (padding < 9)
-    compute_sha1 (((uint32_t *) last2), &hash, 0);
-#ifdef DEBUG_PRINT
-    if (debugging) {
-      printf ("final sha1 is %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 "\n", hash.i [0], hash.i [1], hash.i [2], hash.i [3], hash.i [4]);
-      print_data (hash.c, 20);
-    }
+  if (debugging)
+    printf ("final sha1 is %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 "\n", ctx->hash [0], ctx->hash [1], ctx->hash [2], ctx->hash [3], ctx->hash [4]);
 #endif /* DEBUG_PRINT */
+  int i;
+  for (i = 0; i < SHA1_SIZE / 4; i++)
+    write_int32 (result + 4 * i, ctx->hash [i]);
+}
 
-#if __BYTE_ORDER == __LITTLE_ENDIAN
-  write_int32 (result     , hash.i [0]);
-  write_int32 (result +  4, hash.i [1]);
-  write_int32 (result +  8, hash.i [2]);
-  write_int32 (result + 12, hash.i [3]);
-  write_int32 (result + 16, hash.i [4]);
-#else /* __BYTE_ORDER != __LITTLE_ENDIAN */
-  memcpy (result, hash.c, SHA1_SIZE);
-#endif /* __BYTE_ORDER == __LITTLE_ENDIAN */
+/* the result array must have size SHA1_SIZE */
+void sha1 (const char * data, int dsize, char * result)
+{
+  struct sha1_ctx ctx;
+  sha1_init (&ctx);
+  sha1_update (&ctx, data, dsize);
+  sha1_final (&ctx, result);
 }
 
 /* the result array must have size rsize, only the first rsize bytes
@@ -527,23 +549,8 @@ void sha1_bytes (const char * data, int dsize, char * result, int rsize)
   }
 }
 
-static char * malloc_concat (const char * s1, int s1len,
-                             const char * s2, int s2len)
-{
-  char * result = malloc (s1len + s2len);
-  if (result == NULL) {
-    printf ("malloc_concat: unable to allocate %d + %d = %d bytes\n",
-            s1len, s2len, s1len + s2len);
-    exit (1);
-  }
-  memcpy (result, s1, s1len);
-  memcpy (result + s1len, s2, s2len);
-  return result;
-}
-
-/* the result array must have size SHA512_SIZE */
-void sha512hmac (const char * data, int dsize, const char * key, int ksize,
-                 char * result)
+void sha512hmac_init (struct sha512hmac_ctx * ctx,
+                      const char * key, int ksize)
 {
   char key_copy [SHA512_BLOCK_SIZE];
   memset (key_copy, 0, sizeof (key_copy));
@@ -561,15 +568,87 @@ void sha512hmac (const char * data, int dsize, const char * key, int ksize,
     ipad [i] = 0x36 ^ key_copy [i];
     opad [i] = 0x5c ^ key_copy [i];
   }
+  sha512_init (&(ctx->inner));
+  sha512_update (&(ctx->inner), ipad, SHA512_BLOCK_SIZE);
+  sha512_init (&(ctx->outer));
+  sha512_update (&(ctx->outer), opad, SHA512_BLOCK_SIZE);
+}
+
+void sha512hmac_update (struct sha512hmac_ctx * ctx,
+                        const char * data, int dsize)
+{
+  sha512_update (&(ctx->inner), data, dsize);
+}
 
-  char * data1 = malloc_concat (ipad, SHA512_BLOCK_SIZE, data, dsize);
+void sha512hmac_final (struct sha512hmac_ctx * ctx, char * result)
+{
   char hash1 [SHA512_SIZE];
-  sha512 (data1, SHA512_BLOCK_SIZE + dsize, hash1);
-  free (data1);
+  sha512_final (&(ctx->inner), hash1);
+  sha512_update (&(ctx->outer), hash1, SHA512_SIZE);
+  sha512_final (&(ctx->outer), result);
+}
+
+/* the result array must have size SHA512_SIZE */
+void sha512hmac (const char * data, int dsize, const char * key, int ksize,
+                 char * result)
+{
+  struct sha512hmac_ctx ctx;
+  sha512hmac_init (&ctx, key, ksize);
+  sha512hmac_update (&ctx, data, dsize);
+  sha512hmac_final (&ctx, result);
+}
+
+#define SIP_ROTATE(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
 
-  char * data2 = malloc_concat (opad, SHA512_BLOCK_SIZE, hash1, SHA512_SIZE);
-  sha512 (data2, SHA512_BLOCK_SIZE + SHA512_SIZE, result);
-  free (data2);
+#define SIP_ROUND(v0, v1, v2, v3)	\
+  v0 += v1; v1 = SIP_ROTATE (v1, 13); v1 ^= v0; v0 = SIP_ROTATE (v0, 32); \
+  v2 += v3; v3 = SIP_ROTATE (v3, 16); v3 ^= v2;                           \
+  v0 += v3; v3 = SIP_ROTATE (v3, 21); v3 ^= v0;                           \
+  v2 += v1; v1 = SIP_ROTATE (v1, 17); v1 ^= v2; v2 = SIP_ROTATE (v2, 32);
+
+/* read 8 bytes as a little-endian number */
+static uint64_t sip_read64 (const char * p)
+{
+  const unsigned char * u = (const unsigned char *) p;
+  return   ((uint64_t) u [0])        | (((uint64_t) u [1]) <<  8) |
+          (((uint64_t) u [2]) << 16) | (((uint64_t) u [3]) << 24) |
+          (((uint64_t) u [4]) << 32) | (((uint64_t) u [5]) << 40) |
+          (((uint64_t) u [6]) << 48) | (((uint64_t) u [7]) << 56);
+}
+
+uint64_t siphash24 (const char * key, const char * data, int dsize)
+{
+  uint64_t k0 = sip_read64 (key);
+  uint64_t k1 = sip_read64 (key + 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  if (dsize < 0)
+    dsize = 0;
+  int full = dsize - (dsize % 8);
+  int i;
+  for (i = 0; i < full; i += 8) {
+    uint64_t m = sip_read64 (data + i);
+    v3 ^= m;
+    SIP_ROUND (v0, v1, v2, v3);
+    SIP_ROUND (v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  /* the last block has the remaining bytes and the length */
+  uint64_t last = ((uint64_t) (dsize & 0xff)) << 56;
+  for (i = full; i < dsize; i++)
+    last |= ((uint64_t) ((unsigned char) data [i])) << (8 * (i - full));
+  v3 ^= last;
+  SIP_ROUND (v0, v1, v2, v3);
+  SIP_ROUND (v0, v1, v2, v3);
+  v0 ^= last;
+  v2 ^= 0xff;
+  SIP_ROUND (v0, v1, v2, v3);
+  SIP_ROUND (v0, v1, v2, v3);
+  SIP_ROUND (v0, v1, v2, v3);
+  SIP_ROUND (v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
 }
 
 #ifdef SHA_UNIT_TEST
@@ -640,6 +719,47 @@ static void hmac_test (int tlen)
   print_data ((unsigned char *) result, sizeof (result));
 }
 
+/* the incremental interface must give the same results as the one-shot
+ * functions, however the data is split */
+static void incremental_test (int tlen)
+{
+  char * data = malloc (tlen);
+  int i;
+  for (i = 0; i < tlen; i++)
+    data [i] = (char) (i * 7 + 3);
+  char key [] = "foo bar";
+  char expected [SHA512_SIZE];
+  char result [SHA512_SIZE];
+  int step;
+  for (step = 1; step <= 200; step += 13) {
+    struct sha512_ctx ctx;
+    struct sha1_ctx ctx1;
+    struct sha512hmac_ctx hctx;
+    sha512_init (&ctx);
+    sha1_init (&ctx1);
+    sha512hmac_init (&hctx, key, strlen (key));
+    for (i = 0; i < tlen; i += step) {
+      int n = ((tlen - i < step) ? (tlen - i) : step);
+      sha512_update (&ctx, data + i, n);
+      sha1_update (&ctx1, data + i, n);
+      sha512hmac_update (&hctx, data + i, n);
+    }
+    sha512_final (&ctx, result);
+    sha512 (data, tlen, expected);
+    if (memcmp (result, expected, SHA512_SIZE) != 0)
+      printf ("error: incremental sha512 of %d bytes, step %d\n", tlen, step);
+    sha1_final (&ctx1, result);
+    sha1 (data, tlen, expected);
+    if (memcmp (result, expected, SHA1_SIZE) != 0)
+      printf ("error: incremental sha1 of %d bytes, step %d\n", tlen, step);
+    sha512hmac_final (&hctx, result);
+    sha512hmac (data, tlen, key, strlen (key), expected);
+    if (memcmp (result, expected, SHA512_SIZE) != 0)
+      printf ("error: incremental hmac of %d bytes, step %d\n", tlen, step);
+  }
+  free (data);
+}
+
 static void sha_given_array (char * array)
 {
   debugging = 0;
@@ -743,6 +863,10 @@ int main (int argc, char ** argv)
   hmac_test (513);
   hmac_test (514);
   hmac_test (515);
+  incremental_test (0);
+  incremental_test (127);
+  incremental_test (128);
+  incremental_test (1000);
 
   char sha1_r1 [] = { 0xA9, 0x99, 0x3E, 0x36, 0x47, 0x06, 0x81, 0x6A,
                       0xBA, 0x3E, 0x25, 0x71, 0x78, 0x50, 0xC2, 0x6C,
@@ -847,6 +971,21 @@ int main (int argc, char ** argv)
     printf ("size of sha1_t6 is %zd, should be 495\n", sizeof (sha1_t6));
   run_test_sha1 (sha1_t6, 495, sha1_r6);
 
+  /* test vectors from the SipHash paper: key 00..0f, data 00..0e or empty */
+  char sip_key [SIPHASH_KEY_SIZE];
+  char sip_data [15];
+  int i;
+  for (i = 0; i < (int) sizeof (sip_key); i++)
+    sip_key [i] = i;
+  for (i = 0; i < (int) sizeof (sip_data); i++)
+    sip_data [i] = i;
+  if (siphash24 (sip_key, sip_data, sizeof (sip_data)) != 0xa129ca6149be45e5ULL)
+    printf ("siphash24 error: %016" PRIx64 "\n",
+            siphash24 (sip_key, sip_data, sizeof (sip_data)));
+  if (siphash24 (sip_key, sip_data, 0) != 0x726fdb47dd0e0e31ULL)
+    printf ("siphash24 error on empty data: %016" PRIx64 "\n",
+            siphash24 (sip_key, sip_data, 0));
+
   return 0;
 }
 
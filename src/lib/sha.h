@@ -3,9 +3,14 @@
 #ifndef ALLNET_SHA_H
 #define ALLNET_SHA_H
 
+#include <stdint.h>
+
 #define SHA1_SIZE	20
 #define SHA512_SIZE	64
 
+#define SHA512_BLOCK_SIZE	128	/* 1024 bits or 128 bytes */
+#define SHA1_BLOCK_SIZE		64	/*  512 bits or  64 bytes */
+
 /* the result array must have size SHA512_SIZE */
 extern void sha512 (const char * data, int dsize, char * result);
 
@@ -24,4 +29,50 @@ extern void sha1_bytes (const char * data, int dsize,
 extern void sha512hmac (const char * data, int dsize,
                         const char * key, int ksize, char * result);
 
+/* incremental versions of the above, for hashing data that is not
+ * contiguous in memory.  None of these allocate memory, and data is
+ * hashed in place.  Call init, then update any number of times, then
+ * final, which gives the same result as the one-shot function on the
+ * concatenation of the data.  The contexts may be copied */
+struct sha512_ctx {
+  uint64_t hash [SHA512_SIZE / 8];
+  uint64_t prev [SHA512_SIZE / 8];  /* hash before the last full block */
+  char block [SHA512_BLOCK_SIZE];   /* partial block not yet hashed */
+  unsigned long long int count;     /* number of bytes given so far */
+};
+extern void sha512_init (struct sha512_ctx * ctx);
+extern void sha512_update (struct sha512_ctx * ctx,
+                           const char * data, int dsize);
+/* the result array must have size SHA512_SIZE */
+extern void sha512_final (struct sha512_ctx * ctx, char * result);
+
+struct sha1_ctx {
+  uint32_t hash [SHA1_SIZE / 4];
+  char block [SHA1_BLOCK_SIZE];
+  unsigned long long int count;
+};
+extern void sha1_init (struct sha1_ctx * ctx);
+extern void sha1_update (struct sha1_ctx * ctx, const char * data, int dsize);
+/* the result array must have size SHA1_SIZE */
+extern void sha1_final (struct sha1_ctx * ctx, char * result);
+
+/* a context just after sha512hmac_init holds the hashed key pads, and
+ * may be saved and copied to start any number of hmacs with that key */
+struct sha512hmac_ctx {
+  struct sha512_ctx inner;
+  struct sha512_ctx outer;
+};
+extern void sha512hmac_init (struct sha512hmac_ctx * ctx,
+                             const char * key, int ksize);
+extern void sha512hmac_update (struct sha512hmac_ctx * ctx,
+                               const char * data, int dsize);
+/* the result array must have size SHA512_SIZE */
+extern void sha512hmac_final (struct sha512hmac_ctx * ctx, char * result);
+
+/* SipHash-2-4, a fast keyed 64-bit hash for hash tables, so that
+ * an attacker who does not know the key cannot cause collisions.
+ * key must have SIPHASH_KEY_SIZE bytes */
+#define SIPHASH_KEY_SIZE	16
+extern uint64_t siphash24 (const char * key, const char * data, int dsize);
+
 #endif /* ALLNET_SHA_H */
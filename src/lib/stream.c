@@ -42,6 +42,9 @@ void allnet_stream_init (struct allnet_stream_encryption_state * state,
   state->hash_size = hash_size;
   state->counter = 1;  /* start with counter value of 1 */
   state->block_offset = 0;
+  state->has_aes_ctx = 0;
+  state->has_hmac_ctx = 0;
+  state->keystream_blocks = 0;
 }
 
 static void update_counter (char * bytes, uint64_t value)
@@ -51,27 +54,120 @@ static void update_counter (char * bytes, uint64_t value)
   writeb64 (bytes + write_offset, value);
 }
 
-/* serves two purposes: initializing the block, or getting the next aes char */
-static int aes_next_byte (struct allnet_stream_encryption_state * sp,
-                          char * block, int init)
+/* return 1 if sp->aes_ctx is ready for use with sp->key, 0 for failure */
+static int stream_aes_ctx (struct allnet_stream_encryption_state * sp)
 {
-  if ((init) || (((sp->block_offset + 1) % WP_AES_BLOCK_SIZE) == 0)) {
-    if (! init) {
+  if ((sp->has_aes_ctx) &&
+      (memcmp (sp->aes_ctx_key, sp->key, ALLNET_STREAM_KEY_SIZE) == 0))
+    return 1;
+  sp->has_aes_ctx = 0;
+  if (! allnet_aes_init (&(sp->aes_ctx), sp->key)) {
+    printf ("aes unknown error, unable to encrypt\n");
+    return 0;
+  }
+  memcpy (sp->aes_ctx_key, sp->key, ALLNET_STREAM_KEY_SIZE);
+  sp->has_aes_ctx = 1;
+  sp->keystream_blocks = 0;  /* computed with the old key, if any */
+  return 1;
+}
+
+/* computes the hmac of the data into hmac, which must have SHA512_SIZE
+ * bytes, using the key pads for sp->secret computed on first use */
+static void stream_hmac (struct allnet_stream_encryption_state * sp,
+                         const char * data, int dsize, char * hmac)
+{
+  if ((! sp->has_hmac_ctx) ||
+      (memcmp (sp->hmac_ctx_secret, sp->secret,
+               ALLNET_STREAM_SECRET_SIZE) != 0)) {
+    sha512hmac_init (&(sp->hmac_ctx), sp->secret, ALLNET_STREAM_SECRET_SIZE);
+    memcpy (sp->hmac_ctx_secret, sp->secret, ALLNET_STREAM_SECRET_SIZE);
+    sp->has_hmac_ctx = 1;
+  }
+  struct sha512hmac_ctx ctx = sp->hmac_ctx;
+  sha512hmac_update (&ctx, data, dsize);
+  sha512hmac_final (&ctx, hmac);
+}
+
+/* only the first 15 bytes of each encrypted counter block are used,
+ * so that is what the other side expects */
+#define STREAM_BLOCK_BYTES	(WP_AES_BLOCK_SIZE - 1)
+
+/* returns 1 if the look-ahead key stream has the blocks for counters
+ * first ... first + nblocks - 1 */
+static int stream_has_blocks (struct allnet_stream_encryption_state * sp,
+                              uint64_t first, int nblocks)
+{
+  return ((sp->keystream_blocks > 0) &&
+          (sp->keystream_blocks <= ALLNET_STREAM_LOOKAHEAD_BLOCKS) &&
+          (first >= sp->keystream_counter) &&
+          (first - sp->keystream_counter + nblocks <=
+           (uint64_t) (sp->keystream_blocks)));
+}
+
+/* fills the look-ahead key stream starting with the given counter.
+ * sp->aes_ctx must be ready for use */
+static void stream_fill_blocks (struct allnet_stream_encryption_state * sp,
+                                uint64_t first)
+{
+  static const char zeros [ALLNET_STREAM_LOOKAHEAD_BLOCKS * WP_AES_BLOCK_SIZE];
+  char counter [WP_AES_BLOCK_SIZE];
+  update_counter (counter, first);
+  allnet_aes_ctr_xor (&(sp->aes_ctx), counter, zeros, sp->keystream,
+                      sizeof (sp->keystream));
+  sp->keystream_counter = first;
+  sp->keystream_blocks = ALLNET_STREAM_LOOKAHEAD_BLOCKS;
+}
+
+/* xors len bytes of in with the key stream, starting at sp->counter and
+ * sp->block_offset, and advances sp->counter and sp->block_offset.
+ * in and out may be the same buffer.  returns 1 for success, 0 for failure */
+static int stream_xor (struct allnet_stream_encryption_state * sp,
+                       const char * in, char * out, int len)
+{
+  if (! stream_aes_ctx (sp))
+    return 0;
+  int done = 0;
+  while (done < len) {
+    if (sp->block_offset >= STREAM_BLOCK_BYTES) {  /* used up this block */
       (sp->counter)++;
       sp->block_offset = 0;
     }
-    char counter [WP_AES_BLOCK_SIZE];
-    update_counter (counter, sp->counter);
-    if (! allnet_aes_encrypt_block (sp->key, counter, block)) {
-      printf ("aes unknown error, unable to encrypt\n");
-      return -1;
-    }
-    if (init)
-      return 0;
+    if (! stream_has_blocks (sp, sp->counter, 1))
+      stream_fill_blocks (sp, sp->counter);
+    const char * block = sp->keystream +
+      (sp->counter - sp->keystream_counter) * WP_AES_BLOCK_SIZE;
+    int count = STREAM_BLOCK_BYTES - sp->block_offset;
+    if (count > len - done)
+      count = len - done;
+    int i;
+    for (i = 0; i < count; i++)
+      out [done + i] = in [done + i] ^ block [sp->block_offset + i];
+    done += count;
+    sp->block_offset += count;
+  }
+  return 1;
+}
+
+/* computes (if not already computed) the key stream for at least the
+ * next nbytes to be encrypted or decrypted
+ * returns 1 for success, 0 for failure */
+int allnet_stream_precompute (struct allnet_stream_encryption_state * sp,
+                              int nbytes)
+{
+  if (! stream_aes_ctx (sp))
+    return 0;
+  uint64_t first = sp->counter;
+  int offset = sp->block_offset;
+  if (offset >= STREAM_BLOCK_BYTES) {  /* the next call starts a new block */
+    first++;
+    offset = 0;
   }
-  int index = sp->block_offset;
-  (sp->block_offset)++;
-  return block [index];
+  int nblocks = (offset + nbytes + STREAM_BLOCK_BYTES - 1) / STREAM_BLOCK_BYTES;
+  if ((nbytes <= 0) || (nblocks > ALLNET_STREAM_LOOKAHEAD_BLOCKS))
+    return 0;
+  if (! stream_has_blocks (sp, first, nblocks))
+    stream_fill_blocks (sp, first);
+  return 1;
 }
 
 /* allnet_stream_encrypt_buffer encrypts a buffer given an encryption state
@@ -96,11 +192,8 @@ int allnet_stream_encrypt_buffer (struct allnet_stream_encryption_state * sp,
   /* compute the initial counter value, measured in bytes */
   uint64_t send_counter = sp->counter * WP_AES_BLOCK_SIZE + sp->block_offset;
   /* encrypt the data */
-  char crypt_block [WP_AES_BLOCK_SIZE];
-  aes_next_byte (sp, crypt_block, 1);   /* init crypt_block */
-  int i;
-  for (i = 0; i < tsize; i++)
-    result [i] = text [i] ^ aes_next_byte (sp, crypt_block, 0);
+  if (! stream_xor (sp, text, result, tsize))
+    return 0;
   int written = tsize;
   /* write the least significant sp->counter_size bytes of the send
    * counter to the result */
@@ -122,7 +215,7 @@ int allnet_stream_encrypt_buffer (struct allnet_stream_encryption_state * sp,
   if (sp->hash_size > 0) {
     char hmac [SHA512_SIZE];
     /* the hmac covers the ciphertext and the counter bytes */
-    sha512hmac (result, written, sp->secret, ALLNET_STREAM_SECRET_SIZE, hmac);
+    stream_hmac (sp, result, written, hmac);
     int num_bytes = sp->hash_size;
     if (sp->hash_size > SHA512_SIZE) {
       memset (result + written, 0, sp->hash_size - SHA512_SIZE);
@@ -172,8 +265,7 @@ int allnet_stream_decrypt_buffer (struct allnet_stream_encryption_state * sp,
   if (sp->hash_size > 0) {
     char hmac [SHA512_SIZE];
     /* the hmac covers the ciphertext and the counter bytes */
-    sha512hmac (packet, psize - sp->hash_size,
-                sp->secret, ALLNET_STREAM_SECRET_SIZE, hmac);
+    stream_hmac (sp, packet, psize - sp->hash_size, hmac);
     int num_bytes = sp->hash_size;
     if (sp->hash_size > SHA512_SIZE)
       num_bytes = SHA512_SIZE;
@@ -203,12 +295,7 @@ int allnet_stream_decrypt_buffer (struct allnet_stream_encryption_state * sp,
   sp->counter = counter / WP_AES_BLOCK_SIZE;
   /* decrypt and return */
   int rsize = psize - (sp->counter_size + sp->hash_size);
-  char crypt_block [WP_AES_BLOCK_SIZE];
-  aes_next_byte (sp, crypt_block, 1);   /* init crypt_block */
-  int i;
-  for (i = 0; i < rsize; i++)
-    text [i] = packet [i] ^ aes_next_byte (sp, crypt_block, 0);
-  return 1;
+  return stream_xor (sp, packet, text, rsize);
 }
 
 #ifdef ALLNET_STREAM_UNIT_TEST
@@ -249,6 +336,8 @@ print_buffer (secret, sizeof (secret), "secret", 35, 1);
       print_buffer (transmitted, sizeof (transmitted), "transmitted", 35, 1);
       exit (1);
     }
+    if ((i % 2) == 0)  /* results must be the same with or without */
+      allnet_stream_precompute (&receiver, DATA_SIZE);
     if (! allnet_stream_decrypt_buffer (&receiver, transmitted, esize,
                                         decoded, sizeof (decoded))) {
       printf ("unable to decrypt, loop %d\n", i);
@@ -5,9 +5,13 @@
 
 #include <inttypes.h>    /* uint64_t */
 #include "crypt_sel.h"   /* AES256_SIZE */
+#include "sha.h"         /* struct sha512hmac_ctx */
 
 #define ALLNET_STREAM_KEY_SIZE		AES256_SIZE  /* 32 bytes, 256 bits */
 #define ALLNET_STREAM_SECRET_SIZE	64	/* 64 bytes, 512 bits */
+/* number of key stream blocks computed at once, each giving 15 bytes of
+ * key stream -- enough for several 20ms audio frames */
+#define ALLNET_STREAM_LOOKAHEAD_BLOCKS	64
 
 struct allnet_stream_encryption_state {
   char key [ALLNET_STREAM_KEY_SIZE];
@@ -16,6 +20,22 @@ struct allnet_stream_encryption_state {
   int hash_size;
   uint64_t counter;
   int block_offset;   /* how many bytes we are into the block */
+  /* the expanded key, computed on first use and whenever key changes.
+   * the state is sometimes filled in without calling allnet_stream_init,
+   * so aes_ctx is only valid if has_aes_ctx and aes_ctx_key == key */
+  int has_aes_ctx;
+  char aes_ctx_key [ALLNET_STREAM_KEY_SIZE];
+  allnet_aes_ctx aes_ctx;
+  /* the hmac key pads, computed and checked the same way from secret */
+  int has_hmac_ctx;
+  char hmac_ctx_secret [ALLNET_STREAM_SECRET_SIZE];
+  struct sha512hmac_ctx hmac_ctx;
+  /* look-ahead key stream: the encrypted counter blocks for counters
+   * keystream_counter ... keystream_counter + keystream_blocks - 1,
+   * only valid together with aes_ctx */
+  uint64_t keystream_counter;
+  int keystream_blocks;
+  char keystream [ALLNET_STREAM_LOOKAHEAD_BLOCKS * AES_BLOCK_SIZE];
 };
 
 /* allnet_stream_init allocates and initializes state for encrypting and
@@ -62,4 +82,14 @@ extern int
                                 const char * packet, int psize,
                                 char * text, int tsize);
 
+/* computes (if not already computed) the key stream for at least the
+ * next nbytes to be encrypted or decrypted, so a later call to
+ * allnet_stream_encrypt_buffer or allnet_stream_decrypt_buffer for up
+ * to nbytes does no AES.  Useful for real-time media, where it can be
+ * called while waiting for the next frame.
+ * nbytes is limited to ALLNET_STREAM_LOOKAHEAD_BLOCKS * 15 - 14
+ * returns 1 for success, 0 for failure */
+extern int allnet_stream_precompute (struct allnet_stream_encryption_state *
+                                     state, int nbytes);
+
 #endif /* STREAM_ENCRYPTION_H */
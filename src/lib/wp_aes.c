@@ -8,9 +8,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "wp_aes.h"
 
+/* use the AES instructions if the compiler supports them and, at runtime,
+ * the CPU supports them.  Compile with -DWP_AES_NO_NI to never use them */
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__) && \
+    (! defined (WP_AES_NO_NI))
+#define WP_AES_USE_NI
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif /* x86 && __GNUC__ && ! WP_AES_NO_NI */
+
 /* Things common to enciphering and deciphering */
 
 /* GF(256) logarithm      */
@@ -167,6 +177,7 @@ static const int SBI[256] = {
 
 /* uint32_t state[4]; */
 
+#ifdef AES_DECRYPT
 static void AddRoundKey(uint32_t *state, int round, uint32_t *w)
 {
   state[0] ^= w[Nb*round];;
@@ -174,6 +185,7 @@ static void AddRoundKey(uint32_t *state, int round, uint32_t *w)
   state[2] ^= w[Nb*round+2];
   state[3] ^= w[Nb*round+3];
 }
+#endif /* AES_DECRYPT */
 
 static int times(int x, int y)
 {
@@ -332,92 +344,220 @@ static void AESD(unsigned char *C, unsigned char *M,
 
 /* end of Wes's AESD.c */
 
-/* start of Wes's AES.c */
+/* encryption uses tables that combine SubBytes, ShiftRows, and MixColumns,
+ * so each round is 16 table lookups.  Te0 [x] has the MixColumns column
+ * (2, 1, 1, 3) * SB [x], and Te1, Te2, Te3 are Te0 rotated by 8, 16, 24 bits */
+static uint32_t Te0 [256];
+static uint32_t Te1 [256];
+static uint32_t Te2 [256];
+static uint32_t Te3 [256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
 
-static void SubBytes(uint32_t *p)
+static void make_tables ()
 {
   int i;
-  unsigned char *q = (unsigned char *) p;
-  for(i = 0; i<16; i++) *(q+i) = SB[*(q+i)];
+  for (i = 0; i < 256; i++) {
+    uint32_t s = (uint32_t) SB [i];
+    uint32_t t = (((uint32_t) times (0x02, s)) << 24) | (s << 16) | (s << 8) |
+                 ((uint32_t) times (0x03, s));
+    Te0 [i] = t;
+    Te1 [i] = (t >> 8) | (t << 24);
+    Te2 [i] = (t >> 16) | (t << 16);
+    Te3 [i] = (t >> 24) | (t << 8);
+  }
 }
-	
-static void ShiftRows(uint32_t *s)
+
+static void write_word (unsigned char * p, uint32_t w)
 {
-  uint32_t a, b, c, d;
-  a = s[0], b = s[1], c = s[2], d = s[3];
-  s[0] = (a&0xff000000) | (b&0xff0000) | (c&0xff00) | (d&0xff);
-  s[1] = (b&0xff000000) | (c&0xff0000) | (d&0xff00) | (a&0xff);
-  s[2] = (c&0xff000000) | (d&0xff0000) | (a&0xff00) | (b&0xff);
-  s[3] = (d&0xff000000) | (a&0xff0000) | (b&0xff00) | (c&0xff);
+  p [0] = w >> 24;
+  p [1] = (w >> 16) & 0xff;
+  p [2] = (w >> 8) & 0xff;
+  p [3] = w & 0xff;
 }
 
-static uint32_t mcc(uint32_t x)
+static uint32_t final_word (uint32_t a, uint32_t b, uint32_t c, uint32_t d)
 {
-  int a, b, c, d, e, f, g, h;
-  a = x>>24;
-  b = (x>>16)&0xff;
-  c = (x>>8)&0xff;
-  d = x&0xff;
-
-  e = times(0x02,a)^times(0x03,b)^c^d;
-  f = a^times(0x02,b)^times(0x03,c)^d;
-  g = a^b^times(0x02,c)^times(0x03,d);
-  h = times(0x03,a)^b^c^times(0x02,d);
+  return (((uint32_t) SB [a >> 24]) << 24) |
+         (((uint32_t) SB [(b >> 16) & 0xff]) << 16) |
+         (((uint32_t) SB [(c >> 8) & 0xff]) << 8) |
+         ((uint32_t) SB [d & 0xff]);
+}
 
-  return e<<24 | f<<16 | g<<8 | h;
+static void AES(const unsigned char *M, unsigned char *C, const uint32_t *w)
+{
+  uint32_t s0 = makeword (M)      ^ w [0];
+  uint32_t s1 = makeword (M + 4)  ^ w [1];
+  uint32_t s2 = makeword (M + 8)  ^ w [2];
+  uint32_t s3 = makeword (M + 12) ^ w [3];
+  int round;
+  for (round = 1; round < Nr; round++) {
+    const uint32_t * rk = w + Nb * round;
+    uint32_t t0 = Te0 [s0 >> 24] ^ Te1 [(s1 >> 16) & 0xff] ^
+                  Te2 [(s2 >> 8) & 0xff] ^ Te3 [s3 & 0xff] ^ rk [0];
+    uint32_t t1 = Te0 [s1 >> 24] ^ Te1 [(s2 >> 16) & 0xff] ^
+                  Te2 [(s3 >> 8) & 0xff] ^ Te3 [s0 & 0xff] ^ rk [1];
+    uint32_t t2 = Te0 [s2 >> 24] ^ Te1 [(s3 >> 16) & 0xff] ^
+                  Te2 [(s0 >> 8) & 0xff] ^ Te3 [s1 & 0xff] ^ rk [2];
+    uint32_t t3 = Te0 [s3 >> 24] ^ Te1 [(s0 >> 16) & 0xff] ^
+                  Te2 [(s1 >> 8) & 0xff] ^ Te3 [s2 & 0xff] ^ rk [3];
+    s0 = t0;
+    s1 = t1;
+    s2 = t2;
+    s3 = t3;
+  }
+  /* the last round has no MixColumns */
+  const uint32_t * rk = w + Nb * Nr;
+  write_word (C,      final_word (s0, s1, s2, s3) ^ rk [0]);
+  write_word (C + 4,  final_word (s1, s2, s3, s0) ^ rk [1]);
+  write_word (C + 8,  final_word (s2, s3, s0, s1) ^ rk [2]);
+  write_word (C + 12, final_word (s3, s0, s1, s2) ^ rk [3]);
 }
-	
-static void MixColumns(uint32_t *s)
+
+#ifdef WP_AES_USE_NI
+static int cpu_has_aesni ()
 {
-  s[0] = mcc(s[0]);
-  s[1] = mcc(s[1]);
-  s[2] = mcc(s[2]);
-  s[3] = mcc(s[3]);
+  unsigned int eax, ebx, ecx, edx;
+  if (! __get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return ((ecx & bit_AES) != 0);
 }
 
-static void AES(const unsigned char *M, unsigned char *C, uint32_t *w)
+/* with AES-NI, the round keys are the expanded key as bytes */
+__attribute__ ((target ("aes,sse2")))
+static void aesni_encrypt_blocks (const struct wp_aes_ctx * ctx,
+                                  const unsigned char * in, unsigned char * out,
+                                  int nblocks)
 {
-  int round, i;
-  static uint32_t state[4];
+  __m128i rk [Nr + 1];
+  int r;
+  for (r = 0; r <= Nr; r++)
+    rk [r] = _mm_loadu_si128 ((const __m128i *) (ctx->round_keys + 16 * r));
+  /* four blocks at a time, to keep the AES unit busy */
+  while (nblocks >= 4) {
+    __m128i b0 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) in), rk [0]);
+    __m128i b1 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (in + 16)),
+                                rk [0]);
+    __m128i b2 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (in + 32)),
+                                rk [0]);
+    __m128i b3 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (in + 48)),
+                                rk [0]);
+    for (r = 1; r < Nr; r++) {
+      b0 = _mm_aesenc_si128 (b0, rk [r]);
+      b1 = _mm_aesenc_si128 (b1, rk [r]);
+      b2 = _mm_aesenc_si128 (b2, rk [r]);
+      b3 = _mm_aesenc_si128 (b3, rk [r]);
+    }
+    _mm_storeu_si128 ((__m128i *) out, _mm_aesenclast_si128 (b0, rk [Nr]));
+    _mm_storeu_si128 ((__m128i *) (out + 16),
+                      _mm_aesenclast_si128 (b1, rk [Nr]));
+    _mm_storeu_si128 ((__m128i *) (out + 32),
+                      _mm_aesenclast_si128 (b2, rk [Nr]));
+    _mm_storeu_si128 ((__m128i *) (out + 48),
+                      _mm_aesenclast_si128 (b3, rk [Nr]));
+    in += 64;
+    out += 64;
+    nblocks -= 4;
+  }
+  while (nblocks-- > 0) {
+    __m128i b = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) in), rk [0]);
+    for (r = 1; r < Nr; r++)
+      b = _mm_aesenc_si128 (b, rk [r]);
+    _mm_storeu_si128 ((__m128i *) out, _mm_aesenclast_si128 (b, rk [Nr]));
+    in += 16;
+    out += 16;
+  }
+}
+#endif /* WP_AES_USE_NI */
 
-  state[0] = makeword(M);
-  state[1] = makeword(M+4);
-  state[2] = makeword(M+8);
-  state[3] = makeword(M+12);
-  AddRoundKey(state, 0, w);
+/* end of Wes's AES.c */
 
-  for(round = 1; round<Nr; round++) {
-#ifdef DEBUG_PRINT
-    printf("Round %d  ", round);
-    PrintState(state);
-#endif /* DEBUG_PRINT */
-    SubBytes(state);
-    ShiftRows(state);
-    MixColumns(state);
-    AddRoundKey(state, round, w);
+/* expand the key once, so it can be used for many blocks */
+void wp_aes_init (struct wp_aes_ctx * ctx, int ksize, const char * key)
+{
+  if (ksize != 32) {
+    printf ("error: wp_aes_init only supports 32-byte/256-bit key\n");
+    printf ("       %d-byte key specified\n", ksize);
+    exit (1);   /* this is a serious error in the caller */
   }
-#ifdef DEBUG_PRINT
-  printf("Round %d  ", round);
-  PrintState(state);
-#endif /* DEBUG_PRINT */
-  SubBytes(state);
-  ShiftRows(state);
-  AddRoundKey(state, round, w);
-#ifdef DEBUG_PRINT
-  printf("Output  ");
-  PrintState(state);
-#endif /* DEBUG_PRINT */
-	
-  for(i = 0; i<4; i++) {
-    C[4*i] = state[i]>>24;
-    C[4*i+1] = (state[i]>>16)&0xff;
-    C[4*i+2] = (state[i]>>8)&0xff;
-    C[4*i+3] = state[i]&0xff;
+  pthread_once (&tables_once, make_tables);
+  KeyExpansion ((const unsigned char *) key, ctx->w);
+  int i;
+  for (i = 0; i < Nb * (Nr + 1); i++)
+    write_word (ctx->round_keys + 4 * i, ctx->w [i]);
+  ctx->use_aesni = 0;
+#ifdef WP_AES_USE_NI
+  ctx->use_aesni = cpu_has_aesni ();
+#endif /* WP_AES_USE_NI */
+}
+
+static void encrypt_blocks (const struct wp_aes_ctx * ctx,
+                            const unsigned char * in, unsigned char * out,
+                            int nblocks)
+{
+#ifdef WP_AES_USE_NI
+  if (ctx->use_aesni) {
+    aesni_encrypt_blocks (ctx, in, out, nblocks);
+    return;
+  }
+#endif /* WP_AES_USE_NI */
+  while (nblocks-- > 0) {
+    AES (in, out, ctx->w);
+    in += WP_AES_BLOCK_SIZE;
+    out += WP_AES_BLOCK_SIZE;
   }
 }
 
-/* end of Wes's AES.c */
+void wp_aes_encrypt_block_ctx (const struct wp_aes_ctx * ctx,
+                               const char * in, char * out)
+{
+  encrypt_blocks (ctx, (const unsigned char *) in, (unsigned char *) out, 1);
+}
+
+/* add one to the 128-bit big-endian counter */
+static void increment_counter (unsigned char * counter)
+{
+  int i;
+  for (i = WP_AES_BLOCK_SIZE - 1; i >= 0; i--)
+    if (++(counter [i]) != 0)
+      break;
+}
 
+/* number of keystream blocks computed at once */
+#define CTR_BATCH	16
+
+void wp_aes_ctr_xor (const struct wp_aes_ctx * ctx, char * counter,
+                     const char * in, char * out, int len)
+{
+  unsigned char counters [CTR_BATCH * WP_AES_BLOCK_SIZE];
+  unsigned char stream [CTR_BATCH * WP_AES_BLOCK_SIZE];
+  while (len > 0) {
+    int nblocks = (len + WP_AES_BLOCK_SIZE - 1) / WP_AES_BLOCK_SIZE;
+    if (nblocks > CTR_BATCH)
+      nblocks = CTR_BATCH;
+    int b;
+    for (b = 0; b < nblocks; b++) {
+      memcpy (counters + b * WP_AES_BLOCK_SIZE, counter, WP_AES_BLOCK_SIZE);
+      increment_counter ((unsigned char *) counter);
+    }
+    encrypt_blocks (ctx, counters, stream, nblocks);
+    int n = nblocks * WP_AES_BLOCK_SIZE;
+    if (n > len)
+      n = len;
+    int i = 0;
+    for ( ; i + 8 <= n; i += 8) {   /* 8 bytes at a time */
+      uint64_t x, k;
+      memcpy (&x, in + i, 8);
+      memcpy (&k, stream + i, 8);
+      x ^= k;
+      memcpy (out + i, &x, 8);
+    }
+    for ( ; i < n; i++)
+      out [i] = in [i] ^ stream [i];
+    in += n;
+    out += n;
+    len -= n;
+  }
+}
 
 /* for AES in counter mode, only encryption is used
  * in, out may be the same or different buffer, both should
@@ -426,18 +566,14 @@ static void AES(const unsigned char *M, unsigned char *C, uint32_t *w)
 void wp_aes_encrypt_block (int ksize, const char * key,
                            const char * in, char * out)
 {
-  if (ksize != 32) {
-    printf ("error: wp_aes_encrypt_block only supports 32-byte/256-bit key\n");
-    printf ("       %d-byte key specified\n", ksize);
-    exit (1);   /* this is a serious error in the caller */
-  }
-  uint32_t w[60];  /* 60 = Nb*(Nr+1)  */
-  /* uint32_t state[4]; */
-  KeyExpansion((const unsigned char *) key, w);
-  AES ((const unsigned char *) in, (unsigned char *) out, w);
+  struct wp_aes_ctx ctx;
+  wp_aes_init (&ctx, ksize, key);
+  wp_aes_encrypt_block_ctx (&ctx, in, out);
 }
 
 #ifdef AES_UNIT_TEST
+#include <sys/time.h>
+
 int main (int argc, char ** argv)
 {
   char key [] =   /* not random */
@@ -458,6 +594,62 @@ int main (int argc, char ** argv)
     printf ("error: AES did not give the right result\n");
     return 1;
   }
+  /* SP800-38A, F.5.5 CTR-AES256.Encrypt, the first two blocks */
+  unsigned char ctr_key [] =
+    { 0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+      0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+      0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+      0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+  unsigned char counter [] =
+    { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+      0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+  unsigned char plain [] =
+    { 0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+      0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+      0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+      0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51 };
+  unsigned char cipher [] =
+    { 0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5,
+      0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+      0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a,
+      0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5 };
+  struct wp_aes_ctx ctx;
+  wp_aes_init (&ctx, sizeof (ctr_key), (char *) ctr_key);
+  char ctr_result [sizeof (plain)];
+  wp_aes_ctr_xor (&ctx, (char *) counter, (char *) plain, ctr_result,
+                  sizeof (plain));
+  if ((memcmp (cipher, ctr_result, sizeof (cipher)) != 0) ||
+      (counter [15] != 0x01) || (counter [14] != 0xff)) {
+    printf ("error: AES CTR did not give the right result\n");
+    return 1;
+  }
+  /* the table code and AES-NI (if available) must agree on long inputs */
+  static char big_in [100000];
+  static char big_out1 [sizeof (big_in)];
+  static char big_out2 [sizeof (big_in)];
+  char ctr1 [WP_AES_BLOCK_SIZE];
+  char ctr2 [WP_AES_BLOCK_SIZE];
+  memset (ctr1, 0xfe, sizeof (ctr1));
+  memcpy (ctr2, ctr1, sizeof (ctr1));
+  int i;
+  for (i = 0; i < (int) sizeof (big_in); i++)
+    big_in [i] = i * 7;
+  wp_aes_ctr_xor (&ctx, ctr1, big_in, big_out1, sizeof (big_in));
+  int aesni = ctx.use_aesni;
+  ctx.use_aesni = 0;
+  struct timeval start, finish;
+  gettimeofday (&start, NULL);
+  wp_aes_ctr_xor (&ctx, ctr2, big_in, big_out2, sizeof (big_in));
+  gettimeofday (&finish, NULL);
+  if ((memcmp (big_out1, big_out2, sizeof (big_in)) != 0) ||
+      (memcmp (ctr1, ctr2, sizeof (ctr1)) != 0)) {
+    printf ("error: AES CTR results differ (AES-NI %d)\n", aesni);
+    return 1;
+  }
+  printf ("%d bytes in %ldus without AES-NI (AES-NI %savailable)\n",
+          (int) sizeof (big_in),
+          (long) ((finish.tv_sec - start.tv_sec) * 1000000 +
+                  finish.tv_usec - start.tv_usec), (aesni ? "" : "not "));
   printf ("AES test was successful\n");
   return 0;
 }
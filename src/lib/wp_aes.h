@@ -22,4 +22,24 @@
 extern void wp_aes_encrypt_block (int ksize, const char * key,
                                   const char * in, char * out);
 
+/* an expanded key, so the key schedule is only computed once per key */
+struct wp_aes_ctx {
+  uint32_t w [60];                    /* the expanded key, 15 round keys */
+  unsigned char round_keys [60 * 4];  /* the same, as bytes, for AES-NI */
+  int use_aesni;                      /* set at runtime if the CPU has AES-NI */
+};
+
+/* ksize must be 32 */
+extern void wp_aes_init (struct wp_aes_ctx * ctx, int ksize, const char * key);
+
+extern void wp_aes_encrypt_block_ctx (const struct wp_aes_ctx * ctx,
+                                      const char * in, char * out);
+
+/* counter mode: xors len bytes of in with the encryption of successive
+ * values of counter (a WP_AES_BLOCK_SIZE-byte big-endian number), giving out.
+ * in and out may be the same buffer.  counter is incremented once for
+ * each block, including any final partial block */
+extern void wp_aes_ctr_xor (const struct wp_aes_ctx * ctx, char * counter,
+                            const char * in, char * out, int len);
+
 #endif /* WP_AES_H */
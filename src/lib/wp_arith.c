@@ -531,6 +531,12 @@ void wp_sub_mod (int nbits, uint64_t * res,
      res even so res is xxxx xxxx => xxxx xxxx     04 + 00 = 04 >> 02
      res even so res is xxxx xxxx => xxxx xxxx     02 + 00 = 02 >> 01
  */
+static void reverse_words (int nwords, uint64_t * dst, const uint64_t * src);
+static void words_mul (uint64_t * r, const uint64_t * a, const uint64_t * b,
+                       int n, uint64_t * scratch);
+/* number of scratch words needed by words_mul for n-word numbers */
+#define KARATSUBA_SCRATCH(n)	(4 * (n) + 64)
+
 /* rbits must be vbits * 2, and res must be twice the size of v1, v2 */
 void wp_multiply (int rbits, uint64_t * res,
                   int vbits, const uint64_t * v1, const uint64_t * v2)
@@ -544,6 +550,17 @@ void wp_multiply (int rbits, uint64_t * res,
   int vbytes = vbits / 8;
   
   my_assert (rwords == 2 * vwords, "wp_multiply rwords != 2 * vwords");
+  if ((vwords > 0) && (vwords <= 2 * WP_MONT_MAX_WORDS)) {
+    uint64_t a [2 * WP_MONT_MAX_WORDS];
+    uint64_t b [2 * WP_MONT_MAX_WORDS];
+    uint64_t r [4 * WP_MONT_MAX_WORDS];
+    uint64_t scratch [KARATSUBA_SCRATCH (2 * WP_MONT_MAX_WORDS)];
+    reverse_words (vwords, a, v1);
+    reverse_words (vwords, b, v2);
+    words_mul (r, a, ((v1 == v2) ? a : b), vwords, scratch);
+    reverse_words (rwords, res, r);
+    return;
+  }
   memset (res, 0, vbytes);
   memcpy (res + vwords, v1, vbytes);
   int i;
@@ -878,7 +895,7 @@ void wp_div (int nbits, uint64_t * numerator_result,
 /* returns 1 if n is a multiple of possible_factor, 0 otherwise */
 /* for every 32 bits of n (call it nx), computes m = (m<<32 | nx) % mod
  * the final result, in m, is the modulo.  If it is zero, mod divides n */
-int wp_multiple_of_int (int nbits, const uint64_t * n, uint32_t mod)
+uint32_t wp_mod_int (int nbits, const uint64_t * n, uint32_t mod)
 {
   int nwords = NUM_WORDS (nbits);
   uint64_t word = 0;
@@ -890,7 +907,12 @@ int wp_multiple_of_int (int nbits, const uint64_t * n, uint32_t mod)
     word = word % mod;   /* this should clear the top 32 bits of word */
   }
   /* word has n % mod */
-  return (word == 0);
+  return (uint32_t) word;
+}
+
+int wp_multiple_of_int (int nbits, const uint64_t * n, uint32_t mod)
+{
+  return (wp_mod_int (nbits, n, mod) == 0);
 }
 
 /* no argument should be the same pointer as any of the other arguments */
@@ -1236,6 +1258,414 @@ void wp_exp_mod_montgomery (int nbits, uint64_t * res, const uint64_t * base,
 #endif /* DEBUG_PRINT_MONT */
 }
 
+/* word-level arithmetic for the montgomery functions below.
+ * unlike the rest of this file, these use arrays of words with the
+ * least significant word first, which simplifies carry propagation.
+ * the public functions convert to and from the usual representation */
+
+/* the words of src in the opposite order, i.e. from most significant
+ * first to least significant first or vice versa */
+static void reverse_words (int nwords, uint64_t * dst, const uint64_t * src)
+{
+  int i;
+  for (i = 0; i < nwords; i++)
+    dst [i] = src [nwords - 1 - i];
+}
+
+/* returns the low word of a * b + c + d, which always fits in 128 bits,
+ * and puts the high word in *high */
+static inline uint64_t mul_add2 (uint64_t a, uint64_t b, uint64_t c,
+                                 uint64_t d, uint64_t * high)
+{
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 r = ((unsigned __int128) a) * b + c + d;
+  *high = (uint64_t) (r >> 64);
+  return (uint64_t) r;
+#else /* __SIZEOF_INT128__ */
+  uint64_t h, l;
+  multiply128 (&h, &l, a, b);
+  l += c;
+  h += (l < c);
+  l += d;
+  h += (l < d);
+  *high = h;
+  return l;
+#endif /* __SIZEOF_INT128__ */
+}
+
+/* r [0..n-1] += a [0..n-1] * b, returns the carry word */
+static uint64_t words_mul_add (uint64_t * r, const uint64_t * a, int n,
+                               uint64_t b)
+{
+  uint64_t carry = 0;
+  int i;
+  for (i = 0; i < n; i++)
+    r [i] = mul_add2 (a [i], b, r [i], carry, &carry);
+  return carry;
+}
+
+/* r = a + b, returns the carry, r may be the same as a or b */
+static uint64_t words_add (uint64_t * r, const uint64_t * a,
+                           const uint64_t * b, int n)
+{
+  uint64_t carry = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    uint64_t s = a [i] + carry;
+    carry = (s < carry);
+    r [i] = s + b [i];
+    carry += (r [i] < s);
+  }
+  return carry;
+}
+
+/* r = a - b, returns the borrow, r may be the same as a or b */
+static uint64_t words_sub (uint64_t * r, const uint64_t * a,
+                           const uint64_t * b, int n)
+{
+  uint64_t borrow = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    uint64_t d = a [i] - borrow;
+    borrow = (d > a [i]);
+    r [i] = d - b [i];
+    borrow += (r [i] > d);
+  }
+  return borrow;
+}
+
+static int words_compare (const uint64_t * a, const uint64_t * b, int n)
+{
+  int i;
+  for (i = n - 1; i >= 0; i--)
+    if (a [i] != b [i])
+      return ((a [i] > b [i]) ? 1 : -1);
+  return 0;
+}
+
+/* r [0..2n-1] = a * b */
+static void words_mul_schoolbook (uint64_t * r, const uint64_t * a,
+                                  const uint64_t * b, int n)
+{
+  memset (r, 0, n * sizeof (uint64_t));
+  int i;
+  for (i = 0; i < n; i++)
+    r [i + n] = words_mul_add (r + i, a, n, b [i]);
+}
+
+/* r [0..2n-1] = a * a.  each cross product a [i] * a [j] is computed
+ * once and doubled, so this takes a little over half the multiplications */
+static void words_square_schoolbook (uint64_t * r, const uint64_t * a, int n)
+{
+  memset (r, 0, 2 * n * sizeof (uint64_t));
+  int i;
+  for (i = 0; i + 1 < n; i++)
+    r [i + n] = words_mul_add (r + i + i + 1, a + i + 1, n - i - 1, a [i]);
+  /* double the cross products */
+  uint64_t top = 0;
+  for (i = 0; i < 2 * n; i++) {
+    uint64_t w = r [i];
+    r [i] = (w << 1) | top;
+    top = w >> 63;
+  }
+  /* add the squares on the diagonal */
+  uint64_t carry = 0;
+  for (i = 0; i < n; i++) {
+    uint64_t high;
+    uint64_t low = mul_add2 (a [i], a [i], r [2 * i], carry, &high);
+    r [2 * i] = low;
+    uint64_t s = r [2 * i + 1] + high;
+    carry = (s < high);
+    r [2 * i + 1] = s;
+  }
+}
+
+/* below this many words, schoolbook multiplication (and especially
+ * squaring) is as fast as karatsuba, as measured on x86-64 with 128-bit
+ * products.  So 2048-bit numbers (32 words, e.g. the CRT halves of a
+ * 4096-bit key) use schoolbook, and 4096-bit numbers one karatsuba level */
+#define KARATSUBA_THRESHOLD	48
+
+/* r [0..2n-1] = a * b, using karatsuba multiplication for large n.
+ * if a == b, squares.  scratch must have KARATSUBA_SCRATCH (n) words.
+ * r must be different from a and b */
+static void words_mul (uint64_t * r, const uint64_t * a, const uint64_t * b,
+                       int n, uint64_t * scratch)
+{
+  int square = (a == b);
+  if ((n < KARATSUBA_THRESHOLD) || ((n % 2) != 0)) {
+    if (square)
+      words_square_schoolbook (r, a, n);
+    else
+      words_mul_schoolbook (r, a, b, n);
+    return;
+  }
+  /* a = a1 * W + a0, b = b1 * W + b0, where W = 2^(64h).
+   * a * b = a1 * b1 * W^2 + a0 * b0 +
+   *         ((a0 + a1) * (b0 + b1) - a1 * b1 - a0 * b0) * W */
+  int h = n / 2;
+  uint64_t * sa = scratch;               /* a0 + a1, h words + carry */
+  uint64_t * sb = scratch + h;           /* b0 + b1, h words + carry */
+  uint64_t * mid = scratch + 2 * h;      /* 2h + 1 words */
+  uint64_t * next = mid + 2 * h + 2;     /* scratch for the recursive calls */
+  uint64_t ca = words_add (sa, a, a + h, h);
+  uint64_t cb = ca;
+  if (square)
+    sb = sa;
+  else
+    cb = words_add (sb, b, b + h, h);
+  words_mul (mid, sa, sb, h, next);
+  /* add in the carries, (ca W + sa) (cb W + sb) =
+   *                     sa sb + (ca sb + cb sa) W + ca cb W^2 */
+  uint64_t top = ca & cb;
+  if (ca)
+    top += words_add (mid + h, mid + h, sb, h);
+  if (cb)
+    top += words_add (mid + h, mid + h, sa, h);
+  mid [2 * h] = top;
+  words_mul (r, a, b, h, next);                  /* a0 * b0 */
+  words_mul (r + 2 * h, a + h, (square ? a + h : b + h), h, next); /* a1 b1 */
+  mid [2 * h] -= words_sub (mid, mid, r, 2 * h);
+  mid [2 * h] -= words_sub (mid, mid, r + 2 * h, 2 * h);
+  /* r += mid * W */
+  uint64_t carry = words_add (r + h, r + h, mid, 2 * h) + mid [2 * h];
+  int i;
+  for (i = 3 * h; (carry != 0) && (i < 2 * n); i++) {
+    r [i] += carry;
+    carry = (r [i] < carry);
+  }
+}
+
+/* montgomery reduction: res = t * R^-1 % mod, for t < mod * R.
+ * t has 2n words and is modified.  res has n words */
+static void mont_reduce (const wp_montgomery * mont, uint64_t * res,
+                         uint64_t * t)
+{
+  int n = NUM_WORDS (mont->nbits);
+  uint64_t carry = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    /* adding m * mod makes t [i] zero */
+    uint64_t m = t [i] * mont->n0;
+    uint64_t c = words_mul_add (t + i, mont->mod, n, m);
+    uint64_t s = t [i + n] + c;
+    uint64_t new_carry = (s < c);
+    s += carry;
+    new_carry += (s < carry);
+    t [i + n] = s;
+    carry = new_carry;
+  }
+  /* the result, carry:t [n..2n-1], is < 2 * mod */
+  if ((carry != 0) || (words_compare (t + n, mont->mod, n) >= 0))
+    words_sub (res, t + n, mont->mod, n);
+  else
+    memcpy (res, t + n, n * sizeof (uint64_t));
+}
+
+/* number of scratch words needed by mont_mul */
+#define MONT_SCRATCH	(2 * WP_MONT_MAX_WORDS + \
+                         KARATSUBA_SCRATCH (WP_MONT_MAX_WORDS))
+
+/* res = a * b * R^-1 % mod.  res may be the same as a or b */
+static void mont_mul (const wp_montgomery * mont, uint64_t * res,
+                      const uint64_t * a, const uint64_t * b,
+                      uint64_t * scratch)
+{
+  int n = NUM_WORDS (mont->nbits);
+  uint64_t * product = scratch;
+  words_mul (product, a, b, n, scratch + 2 * n);
+  mont_reduce (mont, res, product);
+}
+
+static uint64_t mont_check (const wp_montgomery * mont)
+{
+  int n = NUM_WORDS (mont->nbits);
+  uint64_t check = 0x9e3779b97f4a7c15ULL ^ mont->n0 ^ (uint64_t) mont->nbits;
+  int i;
+  for (i = 0; i < n; i++) {
+    check = (check ^ mont->mod [i]) * 0x100000001b3ULL;
+    check = (check ^ mont->rr [i]) * 0x100000001b3ULL;
+  }
+  return check;
+}
+
+/* mod must be odd, and nbits <= WP_MONT_MAX_BITS.
+ * returns 1 for success, or 0 (and sets mont->nbits to 0) otherwise */
+int wp_montgomery_init (wp_montgomery * mont, int nbits, const uint64_t * mod)
+{
+  memset (mont, 0, sizeof (wp_montgomery));
+  int n = NUM_WORDS (nbits);
+  if ((nbits <= 0) || (nbits > WP_MONT_MAX_BITS) || (n * 64 != nbits) ||
+      (wp_is_even (nbits, mod)))
+    return 0;
+  reverse_words (n, mont->mod, mod);
+  /* newton's method, each iteration doubles the number of correct bits,
+   * and an odd number is its own inverse modulo 8 */
+  uint64_t inv = mont->mod [0];
+  int i;
+  for (i = 0; i < 5; i++)
+    inv *= 2 - mont->mod [0] * inv;
+  mont->n0 = 0 - inv;
+  mont->nbits = nbits;
+  /* compute 2 * R % mod by doubling, then raise it (in montgomery form,
+   * where it represents 2) to the power nbits, giving R * R % mod */
+  uint64_t two [WP_MONT_MAX_WORDS];
+  memset (two, 0, sizeof (two));
+  two [0] = 1;
+  for (i = 0; i <= nbits; i++) {
+    uint64_t top = two [n - 1] >> 63;
+    int j;
+    for (j = n - 1; j > 0; j--)
+      two [j] = (two [j] << 1) | (two [j - 1] >> 63);
+    two [0] <<= 1;
+    if ((top != 0) || (words_compare (two, mont->mod, n) >= 0))
+      words_sub (two, two, mont->mod, n);
+  }
+  uint64_t scratch [MONT_SCRATCH];
+  memcpy (mont->rr, two, n * sizeof (uint64_t));
+  int bit = 30;
+  while ((nbits >> bit) == 0)
+    bit--;
+  for (bit--; bit >= 0; bit--) {   /* the top bit is already in rr */
+    mont_mul (mont, mont->rr, mont->rr, mont->rr, scratch);
+    if ((nbits >> bit) & 1)
+      mont_mul (mont, mont->rr, mont->rr, two, scratch);
+  }
+  mont->check = mont_check (mont);
+  return 1;
+}
+
+/* returns 1 if mont was initialized by wp_montgomery_init for this mod */
+int wp_montgomery_matches (const wp_montgomery * mont, int nbits,
+                           const uint64_t * mod)
+{
+  int n = NUM_WORDS (nbits);
+  if ((mont->nbits != nbits) || (nbits <= 0) || (nbits > WP_MONT_MAX_BITS))
+    return 0;
+  int i;
+  for (i = 0; i < n; i++)
+    if (mont->mod [i] != mod [n - 1 - i])
+      return 0;
+  return (mont->check == mont_check (mont));
+}
+
+/* same as OpenSSL's BN_window_bits_for_exponent_size */
+static int window_bits (int ebits)
+{
+  if (ebits > 671)
+    return 6;
+  if (ebits > 239)
+    return 5;
+  if (ebits > 79)
+    return 4;
+  if (ebits > 23)
+    return 3;
+  return 1;
+}
+
+#define MAX_WINDOW_BITS	6
+
+static int exp_bit (const uint64_t * e, int bit)
+{
+  return (int) ((e [bit / 64] >> (bit % 64)) & 1);
+}
+
+/* res = base ^ exp % mod, using a sliding window.  base must be < 2^nbits.
+ * res may be the same as base or exp */
+void wp_exp_mod_window (const wp_montgomery * mont, uint64_t * res,
+                        const uint64_t * base, const uint64_t * exp)
+{
+  int n = NUM_WORDS (mont->nbits);
+  uint64_t scratch [MONT_SCRATCH];
+  uint64_t e [WP_MONT_MAX_WORDS];
+  reverse_words (n, e, exp);
+  int ebits = mont->nbits;
+  while ((ebits > 0) && (! exp_bit (e, ebits - 1)))
+    ebits--;
+  int window = window_bits (ebits);
+  /* table [i] has base ^ (2i + 1), in montgomery form */
+  static const int table_size = 1 << (MAX_WINDOW_BITS - 1);
+  uint64_t table [table_size][WP_MONT_MAX_WORDS];
+  /* initialized so gcc can tell the words beyond n are never read */
+  uint64_t acc [WP_MONT_MAX_WORDS] = { 0 };
+  reverse_words (n, acc, base);
+  mont_mul (mont, table [0], acc, mont->rr, scratch);
+  if (window > 1) {
+    uint64_t square [WP_MONT_MAX_WORDS];
+    mont_mul (mont, square, table [0], table [0], scratch);
+    int i;
+    for (i = 1; i < (1 << (window - 1)); i++)
+      mont_mul (mont, table [i], table [i - 1], square, scratch);
+  }
+  /* 1 in montgomery form, in case exp is zero */
+  memset (acc, 0, sizeof (acc));
+  acc [0] = 1;
+  mont_mul (mont, acc, acc, mont->rr, scratch);
+  int started = 0;
+  int bit = ebits - 1;
+  while (bit >= 0) {
+    if (! exp_bit (e, bit)) {
+      mont_mul (mont, acc, acc, acc, scratch);
+      bit--;
+      continue;
+    }
+    /* the window is the longest run of up to window bits ending in a 1 */
+    int low = bit - window + 1;
+    if (low < 0)
+      low = 0;
+    while (! exp_bit (e, low))
+      low++;
+    int value = 0;
+    int i;
+    for (i = bit; i >= low; i--)
+      value = (value << 1) | exp_bit (e, i);
+    if (started) {
+      for (i = bit; i >= low; i--)
+        mont_mul (mont, acc, acc, acc, scratch);
+      mont_mul (mont, acc, acc, table [value >> 1], scratch);
+    } else {
+      memcpy (acc, table [value >> 1], n * sizeof (uint64_t));
+      started = 1;
+    }
+    bit = low - 1;
+  }
+  /* convert out of montgomery form */
+  memcpy (scratch, acc, n * sizeof (uint64_t));
+  memset (scratch + n, 0, n * sizeof (uint64_t));
+  mont_reduce (mont, acc, scratch);
+  reverse_words (n, res, acc);
+}
+
+/* res = v1 * v2 % mod.  v1 * v2 must be < mod * 2^nbits, e.g. v1 < mod.
+ * res may be the same as v1 or v2 */
+void wp_multiply_mod_mont (const wp_montgomery * mont, uint64_t * res,
+                           const uint64_t * v1, const uint64_t * v2)
+{
+  int n = NUM_WORDS (mont->nbits);
+  uint64_t scratch [MONT_SCRATCH];
+  uint64_t a [WP_MONT_MAX_WORDS] = { 0 };   /* see wp_exp_mod_window */
+  uint64_t b [WP_MONT_MAX_WORDS] = { 0 };
+  reverse_words (n, a, v1);
+  reverse_words (n, b, v2);
+  mont_mul (mont, a, a, b, scratch);          /* v1 * v2 / R */
+  mont_mul (mont, a, a, mont->rr, scratch);   /* v1 * v2 */
+  reverse_words (n, res, a);
+}
+
+/* res = n % mod, where n has 2 * nbits and must be < mod * 2^nbits */
+void wp_mod_mont (const wp_montgomery * mont, uint64_t * res,
+                  const uint64_t * n)
+{
+  int nwords = NUM_WORDS (mont->nbits);
+  uint64_t scratch [MONT_SCRATCH];
+  uint64_t t [2 * WP_MONT_MAX_WORDS];
+  uint64_t r [WP_MONT_MAX_WORDS];
+  reverse_words (2 * nwords, t, n);
+  mont_reduce (mont, r, t);                   /* n / R */
+  mont_mul (mont, r, r, mont->rr, scratch);   /* n */
+  reverse_words (nwords, res, r);
+}
+
 #ifdef UNIT_TEST
 
 #include <stdio.h>
@@ -45,6 +45,8 @@ extern int wp_compare (int nbits, const uint64_t * n1, const uint64_t * n2);
 /* returns 1 if n is a multiple of mod, 0 otherwise */
 /* temp must have nbits or more */
 extern int wp_multiple_of_int (int nbits, const uint64_t * n, uint32_t mod);
+/* returns n % mod */
+extern uint32_t wp_mod_int (int nbits, const uint64_t * n, uint32_t mod);
 
 /* byte position zero is the least significant.
  * returns -1 in case of error, the byte value (0..255) otherwise */
@@ -75,7 +77,8 @@ extern void wp_sub_mod (int nbits, uint64_t * res,
                         const uint64_t * a, const uint64_t * b,
                         const uint64_t * mod);
 
-/* rbits must be vbits * 2, and res must be twice the size of v1, v2 */
+/* rbits must be vbits * 2, and res must be twice the size of v1, v2
+ * res cannot be the same as v1 or v2 */
 extern void wp_multiply (int rbits, uint64_t * res,
                          int vbits, const uint64_t * v1, const uint64_t * v2);
 
@@ -112,4 +115,42 @@ extern void wp_exp_mod_montgomery (int nbits, uint64_t * res,
                                    const uint64_t * base, const uint64_t * exp,
                                    const uint64_t * mod, uint64_t * temp);
 
+/* montgomery arithmetic with constants that are computed once per modulus,
+ * e.g. once per RSA key, and then used for any number of operations.
+ * all the numbers are mont->nbits long (nbits must be a multiple of 64),
+ * and none of these functions modify mont, so it may be shared */
+#define WP_MONT_MAX_BITS	4096
+#define WP_MONT_MAX_WORDS	(NUM_WORDS (WP_MONT_MAX_BITS))
+
+typedef struct {
+  int nbits;                          /* 0 if not initialized */
+  uint64_t n0;                        /* -(mod ^ -1) modulo 2^64 */
+  uint64_t mod [WP_MONT_MAX_WORDS];   /* least significant word first */
+  uint64_t rr [WP_MONT_MAX_WORDS];    /* R^2 % mod, R = 2^nbits, ditto */
+  uint64_t check;                     /* to detect uninitialized structs */
+} wp_montgomery;
+
+/* mod must be odd, and nbits <= WP_MONT_MAX_BITS.
+ * returns 1 for success, or 0 (and sets mont->nbits to 0) otherwise */
+extern int wp_montgomery_init (wp_montgomery * mont, int nbits,
+                               const uint64_t * mod);
+
+/* returns 1 if mont was initialized by wp_montgomery_init for this mod */
+extern int wp_montgomery_matches (const wp_montgomery * mont, int nbits,
+                                  const uint64_t * mod);
+
+/* res = base ^ exp % mod, using a sliding window.  base must be < 2^nbits.
+ * res may be the same as base or exp */
+extern void wp_exp_mod_window (const wp_montgomery * mont, uint64_t * res,
+                               const uint64_t * base, const uint64_t * exp);
+
+/* res = v1 * v2 % mod.  v1 * v2 must be < mod * 2^nbits, e.g. v1 < mod.
+ * res may be the same as v1 or v2 */
+extern void wp_multiply_mod_mont (const wp_montgomery * mont, uint64_t * res,
+                                  const uint64_t * v1, const uint64_t * v2);
+
+/* res = n % mod, where n has 2 * nbits and must be < mod * 2^nbits */
+extern void wp_mod_mont (const wp_montgomery * mont, uint64_t * res,
+                         const uint64_t * n);
+
 #endif /* WES_ARITH_H */
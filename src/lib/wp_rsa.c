@@ -14,6 +14,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "wp_rsa.h"
 #include "wp_arith.h"
@@ -25,18 +26,35 @@ typedef uint64_t rsa_int    [WP_RSA_MAX_KEY_WORDS ];
 typedef uint64_t rsa_half   [WP_RSA_HALF_KEY_WORDS];
 typedef uint64_t rsa_double [WP_RSA_MAX_KEY_WORDS * 2];
 
-/* #define USE_EXP_MOD64 */
-#define USE_EXP_MOD_MONTGOMERY
-
-#ifdef USE_EXP_MOD_MONTGOMERY
-typedef uint64_t rsa_temp      [(WP_RSA_MAX_KEY_WORDS  + 1) * 70];
-typedef uint64_t rsa_temp_half [(WP_RSA_HALF_KEY_WORDS + 1) * 70];
-#endif /* USE_EXP_MOD_MONTGOMERY */
+/* returns cached if it has the montgomery constants for mod, otherwise
+ * computes them into computed and returns that, or NULL if mod is even */
+static const wp_montgomery * rsa_montgomery (const wp_montgomery * cached,
+                                             int nbits, const uint64_t * mod,
+                                             wp_montgomery * computed)
+{
+  if ((cached != NULL) && (wp_montgomery_matches (cached, nbits, mod)))
+    return cached;
+  if (wp_montgomery_init (computed, nbits, mod))
+    return computed;
+  return NULL;
+}
 
-#ifdef USE_EXP_MOD64
-typedef uint64_t rsa_temp      [WP_RSA_MAX_KEY_WORDS  * 65];
-typedef uint64_t rsa_temp_half [WP_RSA_HALF_KEY_WORDS * 65];
-#endif /* USE_EXP_MOD64 */
+/* res = base ^ exp % mod, using the cached montgomery constants if they
+ * are valid.  cached may be NULL.
+ * no argument should be the same pointer as any of the other arguments */
+static void rsa_exp_mod (int nbits, uint64_t * res, const uint64_t * base,
+                         const uint64_t * exp, const uint64_t * mod,
+                         const wp_montgomery * cached)
+{
+  wp_montgomery computed;
+  const wp_montgomery * mont = rsa_montgomery (cached, nbits, mod, &computed);
+  if (mont != NULL) {
+    wp_exp_mod_window (mont, res, base, exp);
+  } else {   /* even modulus, should never happen for RSA */
+    rsa_int temp;
+    wp_exp_mod (nbits, res, base, exp, mod, temp);
+  }
+}
 
 /* get the public key part of the key pair */
 wp_rsa_key wp_rsa_get_public_key (wp_rsa_key_pair * key)
@@ -45,6 +63,7 @@ wp_rsa_key wp_rsa_get_public_key (wp_rsa_key_pair * key)
   result.nbits = key->nbits;
   wp_copy (key->nbits, result.n, key->n);
   result.e = key->e;
+  result.mont_n = key->mont_n;
   return result;
 }
 
@@ -265,25 +284,14 @@ pure_random = 0;
 
 /* http://en.wikipedia.org/wiki/Fermat_primality_test */
 static int composite_test_fermat (int nbits, const uint64_t * potential_prime,
-                                  const uint64_t * a)
+                                  const uint64_t * a,
+                                  const wp_montgomery * mont)
 {
   rsa_half potential_prime_minus_one;
   wp_copy (nbits, potential_prime_minus_one, potential_prime);
   wp_sub_int (nbits, potential_prime_minus_one, 1);
   rsa_half em;
-#ifdef USE_EXP_MOD_MONTGOMERY
-  rsa_temp_half temp;
-  wp_exp_mod_montgomery (nbits, em, a, potential_prime_minus_one,
-                         potential_prime, temp);
-#else /* USE_EXP_MOD_MONTGOMERY */
-#ifdef USE_EXP_MOD64
-  rsa_temp_half temp;
-  wp_exp_mod64 (nbits, em, a, potential_prime_minus_one, potential_prime, temp);
-#else /* USE_EXP_MOD64 */
-  rsa_half temp;
-  wp_exp_mod (nbits, em, a, potential_prime_minus_one, potential_prime, temp);
-#endif /* USE_EXP_MOD64 */
-#endif /* USE_EXP_MOD_MONTGOMERY */
+  rsa_exp_mod (nbits, em, a, potential_prime_minus_one, potential_prime, mont);
   rsa_half one;
   wp_init (nbits, one, 1);
   if (wp_compare (nbits, one, em) == 0)
@@ -300,7 +308,8 @@ static int composite_test_fermat (int nbits, const uint64_t * potential_prime,
 /* http://en.wikipedia.org/wiki/Miller-Rabin_primality_test */
 static int composite_test_miller_rabin (int nbits,
                                         const uint64_t * potential_prime,
-                                        uint64_t * a)
+                                        uint64_t * a,
+                                        const wp_montgomery * mont)
 {
   rsa_half potential_prime_minus_one;
   wp_copy (nbits, potential_prime_minus_one, potential_prime);
@@ -313,18 +322,7 @@ static int composite_test_miller_rabin (int nbits,
     shift++;
   }
   rsa_half x;
-#ifdef USE_EXP_MOD_MONTGOMERY
-  rsa_temp_half temp;
-  wp_exp_mod_montgomery (nbits, x, a, d, potential_prime, temp);
-#else /* USE_EXP_MOD_MONTGOMERY */
-#ifdef USE_EXP_MOD64
-  rsa_temp_half temp;
-  wp_exp_mod64 (nbits, x, a, d, potential_prime, temp);
-#else /* USE_EXP_MOD64 */
-  rsa_half temp;
-  wp_exp_mod (nbits, x, a, d, potential_prime, temp);
-#endif /* USE_EXP_MOD64 */
-#endif /* USE_EXP_MOD_MONTGOMERY */
+  rsa_exp_mod (nbits, x, a, d, potential_prime, mont);
   rsa_half one;
   wp_init (nbits, one, 1);
   rsa_half p_minus_one;
@@ -335,9 +333,13 @@ static int composite_test_miller_rabin (int nbits,
     return 0;    /* possibly prime */
   int i;
   for (i = 1; i < shift; i++) {
-    rsa_half res;
-    wp_multiply_mod (nbits, res, x, x, potential_prime);
-    wp_copy (nbits, x, res);
+    if (mont != NULL) {
+      wp_multiply_mod_mont (mont, x, x, x);
+    } else {
+      rsa_half res;
+      wp_multiply_mod (nbits, res, x, x, potential_prime);
+      wp_copy (nbits, x, res);
+    }
     if (wp_compare (nbits, x, one) == 0)
       return 1;
     if (wp_compare (nbits, x, p_minus_one) == 0)
@@ -391,50 +393,48 @@ static int composite_test (int nbits, const uint64_t * potential_prime)
   wp_copy (nbits, p_minus_two, potential_prime);
   wp_sub_int (nbits, p_minus_two, 2);
   rsa_mod (nbits, a, p_minus_two);
-  if (composite_test_fermat (nbits, potential_prime, a))
+  /* compute the montgomery constants once for both tests */
+  wp_montgomery computed;
+  const wp_montgomery * mont =
+    rsa_montgomery (NULL, nbits, potential_prime, &computed);
+  if (composite_test_fermat (nbits, potential_prime, a, mont))
     return 1;  /* definitely not prime */
-  if (composite_test_miller_rabin (nbits, potential_prime, a))
+  if (composite_test_miller_rabin (nbits, potential_prime, a, mont))
     return 1;  /* definitely not prime */
   return 0;    /* possibly prime */
 }
 
-static int is_prime (int nbits, const uint64_t * n, int iterations)
+/* the odd primes less than SMALL_PRIMES_LIMIT, used to sieve candidate
+ * primes.  Computed once, by whichever thread first needs them */
+#define SMALL_PRIMES_LIMIT	262144
+static uint32_t * small_primes = NULL;
+static int num_small_primes = 0;
+static pthread_once_t small_primes_once = PTHREAD_ONCE_INIT;
+
+static void init_small_primes (void)
 {
-#ifdef DEBUG_PRINT
-  printf ("is_prime (%s) ", wp_itox (nbits, n));
-#endif /* DEBUG_PRINT */
-  static int sieve_size = 0;
-  static char * sieve = NULL;
-  if ((sieve_size == 0) || (sieve == NULL)) {
-    sieve_size = 262144;
-    sieve = malloc (sieve_size / 8);
-    compute_sieve (sieve_size, sieve, NULL, 0);
+  char * sieve = malloc (SMALL_PRIMES_LIMIT / 8);
+  if (sieve == NULL) {
+    printf ("unable to allocate sieve of %d bits\n", SMALL_PRIMES_LIMIT);
+    exit (1);
   }
-  int i;
-  for (i = 2; i < sieve_size; i++) {
-#define USE_MULTIPLE_FOR_SMALL_PRIMES
-#ifdef USE_MULTIPLE_FOR_SMALL_PRIMES
-    if ((is_set_bit (sieve, i)) &&
-        (wp_multiple_of_int (nbits, n, i)))
-      return 0;
-#else /* USE_MULTIPLE_FOR_SMALL_PRIMES */
-    if (is_set_bit (sieve, i)) {
-      rsa_half divisor;
-      wp_init (nbits, divisor, i);
-      rsa_int dividend;
-      wp_extend (nbits * 2, dividend, nbits, n);
-      uint64_t * quotient;
-      uint64_t * modulo;
-      wp_div (nbits * 2, dividend, nbits, divisor, &quotient, &modulo);
-#ifdef DEBUG_PRINT
-      if (wp_is_zero (nbits, modulo))
-        printf (" ==> 0 (%d)\n", i);
-#endif /* DEBUG_PRINT */
-      if (wp_is_zero (nbits, modulo))
-        return 0;
-    }
-#endif /* USE_MULTIPLE_FOR_SMALL_PRIMES */
+  int count = compute_sieve (SMALL_PRIMES_LIMIT, sieve, NULL, 0);
+  small_primes = malloc (count * sizeof (uint32_t));
+  if (small_primes == NULL) {
+    printf ("unable to allocate %d small primes\n", count);
+    exit (1);
   }
+  int i;
+  for (i = 3; i < SMALL_PRIMES_LIMIT; i++)
+    if (is_set_bit (sieve, i))
+      small_primes [num_small_primes++] = i;
+  free (sieve);
+}
+
+/* n should have no small prime factors */
+static int probably_prime (int nbits, const uint64_t * n, int iterations)
+{
+  int i;
   for (i = 0; i < iterations; i++) {
     if (composite_test (nbits, n)) {
 #ifdef DEBUG_PRINT
@@ -447,7 +447,7 @@ static int is_prime (int nbits, const uint64_t * n, int iterations)
     }
   }
 #ifdef DEBUG_PRINT
-  printf (" ==> 1\n");
+  printf ("probably_prime (%s) ==> 1\n", wp_itox (nbits, n));
 #endif /* DEBUG_PRINT */
   return 1;
 }
@@ -524,8 +524,51 @@ static void generate_prime (int nbits, uint64_t * bits, int init,
 #endif /* DEBUG_PRINT */
   if (wp_is_even (nbits, result))
     wp_add_int (nbits, result, 1);
-  while (! is_prime (nbits, result, security_level))
-    wp_add_int (nbits, result, 2);
+  /* find the first prime result + 2k, k >= 0.  Instead of dividing
+   * each candidate by each small prime, sieve PRIME_SIEVE_SPAN candidates
+   * at a time, using the remainders of result modulo the small primes,
+   * and only test the candidates that have no small factor */
+#define PRIME_SIEVE_SPAN	2048
+  pthread_once (&small_primes_once, init_small_primes);
+  uint32_t * remainders = malloc (num_small_primes * sizeof (uint32_t));
+  if (remainders == NULL) {
+    printf ("unable to allocate %d remainders\n", num_small_primes);
+    exit (1);
+  }
+  int i;
+  for (i = 0; i < num_small_primes; i++)
+    remainders [i] = wp_mod_int (nbits, result, small_primes [i]);
+  char has_factor [PRIME_SIEVE_SPAN];
+  rsa_half candidate;
+  while (1) {
+    memset (has_factor, 0, sizeof (has_factor));
+    for (i = 0; i < num_small_primes; i++) {
+      uint64_t prime = small_primes [i];
+      /* result + 2k is a multiple of prime when 2k = -remainder, i.e.
+       * k = (prime - remainder) * (prime + 1) / 2, all modulo prime */
+      uint64_t k = 0;
+      if (remainders [i] != 0)
+        k = ((prime - remainders [i]) * ((prime + 1) / 2)) % prime;
+      for ( ; k < PRIME_SIEVE_SPAN; k += prime)
+        has_factor [k] = 1;
+    }
+    int k;
+    for (k = 0; k < PRIME_SIEVE_SPAN; k++) {
+      if (has_factor [k])
+        continue;
+      wp_copy (nbits, candidate, result);
+      wp_add_int (nbits, candidate, 2 * k);
+      if (probably_prime (nbits, candidate, security_level)) {
+        wp_copy (nbits, result, candidate);
+        free (remainders);
+        return;
+      }
+    }
+    wp_add_int (nbits, result, 2 * PRIME_SIEVE_SPAN);
+    for (i = 0; i < num_small_primes; i++)
+      remainders [i] = (remainders [i] + 2 * PRIME_SIEVE_SPAN) %
+                       small_primes [i];
+  }
 /* should we check whether it is a strong prime? Can we do it without
  * factoring?  https://en.wikipedia.org/wiki/Strong_prime
  * we can easily check whether x = 2q + 1 where q is prime, and also
@@ -667,6 +710,59 @@ static int mod_is_zero (int nbits, uint64_t * a, int nhalf, uint64_t * b)
   return wp_is_zero (nhalf * 2, remainder);
 }
 
+/* computes dp, dq, and qinv from p, q, and d, returning 1 for success
+ * or 0 if q has no inverse modulo p */
+static int rsa_compute_crt (wp_rsa_key_pair * key)
+{
+  int nbits = key->nbits;
+  int nhalf = nbits / 2;
+  rsa_half pminus1;
+  rsa_half qminus1;
+  wp_copy (nhalf, pminus1, key->p);
+  wp_copy (nhalf, qminus1, key->q);
+  wp_sub_int (nhalf, pminus1, 1);
+  wp_sub_int (nhalf, qminus1, 1);
+  rsa_int dpfull;
+  rsa_int dqfull;
+  uint64_t * dp_value;
+  uint64_t * dq_value;
+  wp_copy (nbits, dpfull, key->d);
+  wp_copy (nbits, dqfull, key->d);
+  wp_div (nbits, dpfull, nhalf, pminus1, NULL, &dp_value);
+  wp_div (nbits, dqfull, nhalf, qminus1, NULL, &dq_value);
+  wp_copy (nhalf, key->dp, dp_value);
+  wp_copy (nhalf, key->dq, dq_value);
+  if (! inverse_mod (nhalf, key->q, key->p, key->qinv)) {
+    printf ("no inverse for q\n");
+    return 0;
+  }
+  return 1;
+}
+
+/* compute the montgomery constants for the key */
+void wp_rsa_key_precompute (wp_rsa_key * key)
+{
+  wp_montgomery_init (&(key->mont_n), key->nbits, key->n);
+}
+
+/* compute the montgomery constants for the key pair, and if the key has
+ * p and q, any missing dp, dq, and qinv, so decryption and signing can use
+ * the chinese remainder theorem */
+void wp_rsa_key_pair_precompute (wp_rsa_key_pair * key)
+{
+  int nbits = key->nbits;
+  int nhalf = nbits / 2;
+  wp_montgomery_init (&(key->mont_n), nbits, key->n);
+  /* wp_montgomery_init clears the constants if p or q is zero (even) */
+  wp_montgomery_init (&(key->mont_p), nhalf, key->p);
+  wp_montgomery_init (&(key->mont_q), nhalf, key->q);
+  if ((key->mont_p.nbits != 0) && (key->mont_q.nbits != 0) &&
+      (! wp_is_zero (nbits, key->d)) &&
+      ((wp_is_zero (nhalf, key->dp)) || (wp_is_zero (nhalf, key->dq)) ||
+       (wp_is_zero (nhalf, key->qinv))))
+    rsa_compute_crt (key);
+}
+
 #ifdef DEBUG_PRINT
 #endif /* DEBUG_PRINT */
 #define E_VALUE 65537                    /* e is 65537 = 2^16 + 1 */
@@ -750,24 +846,7 @@ int wp_rsa_generate_key_pair_e (int nbits, wp_rsa_key_pair * key, long int e,
       do_over = 1;
     }
     if (! do_over) {
-      rsa_half pminus1;
-      rsa_half qminus1;
-      wp_copy (nhalf, pminus1, key->p);
-      wp_copy (nhalf, qminus1, key->q);
-      wp_sub_int (nhalf, pminus1, 1);
-      wp_sub_int (nhalf, qminus1, 1);
-      rsa_int dpfull;
-      rsa_int dqfull;
-      uint64_t * dp_value;
-      uint64_t * dq_value;
-      wp_copy (nbits, dpfull, key->d);
-      wp_copy (nbits, dqfull, key->d);
-      wp_div (nbits, dpfull, nhalf, pminus1, NULL, &dp_value);
-      wp_div (nbits, dqfull, nhalf, qminus1, NULL, &dq_value);
-      wp_copy (nhalf, key->dp, dp_value);
-      wp_copy (nhalf, key->dq, dq_value);
-      if (! inverse_mod (nhalf, key->q, key->p, key->qinv)) {
-        printf ("no inverse for q\n");
+      if (! rsa_compute_crt (key)) {
         do_over = 1;
       } else if (nbits < 256) {
         printf ("dp %s, ", wp_itox (nhalf, key->dp));
@@ -811,6 +890,7 @@ int wp_rsa_generate_key_pair_e (int nbits, wp_rsa_key_pair * key, long int e,
     }
     count++;
   } while (do_over);
+  wp_rsa_key_pair_precompute (key);
   return count;
 }
 
@@ -1165,18 +1245,7 @@ static void rsa_do_encrypt (wp_rsa_key * key, uint64_t * data, char * result)
   print_exp_mod (key->nbits, data, efull, key->n);
 #endif /* TEST_AGAINST_BN_LIBRARY */
   /* compute data^e mod key->n and place the result in result */
-#ifdef USE_EXP_MOD_MONTGOMERY
-  rsa_temp temp;
-  wp_exp_mod_montgomery (key->nbits, ri, data, efull, key->n, temp);
-#else /* USE_EXP_MOD_MONTGOMERY */
-#ifdef USE_EXP_MOD64
-  rsa_temp temp;
-  wp_exp_mod64 (key->nbits, ri, data, efull, key->n, temp);
-#else /* USE_EXP_MOD64 */
-  rsa_int temp;
-  wp_exp_mod (key->nbits, ri, data, efull, key->n, temp);
-#endif /* USE_EXP_MOD64 */
-#endif /* USE_EXP_MOD_MONTGOMERY */
+  rsa_exp_mod (key->nbits, ri, data, efull, key->n, &(key->mont_n));
 #ifdef DEBUG_PRINT
   printf ("  encrypted is %s\n", wp_itox (key->nbits, ri));
 #endif /* DEBUG_PRINT */
@@ -1217,18 +1286,7 @@ static void rsa_decrypt_slow (wp_rsa_key_pair * key, uint64_t * data,
   printf ("%s mod ", wp_itox (key->nbits, key->d));
   printf ("%s = ", wp_itox (key->nbits, key->n));
 #endif /* DEBUG_PRINT */
-#ifdef USE_EXP_MOD_MONTGOMERY
-  rsa_temp temp;
-  wp_exp_mod_montgomery (key->nbits, result, data, key->d, key->n, temp);
-#else /* USE_EXP_MOD_MONTGOMERY */
-#ifdef USE_EXP_MOD64
-  rsa_temp temp;
-  wp_exp_mod64 (key->nbits, result, data, key->d, key->n, temp);
-#else /* USE_EXP_MOD64 */
-  rsa_int temp;
-  wp_exp_mod (key->nbits, result, data, key->d, key->n, temp);
-#endif /* USE_EXP_MOD64 */
-#endif /* USE_EXP_MOD_MONTGOMERY */
+  rsa_exp_mod (key->nbits, result, data, key->d, key->n, &(key->mont_n));
 #ifdef DEBUG_PRINT
   printf ("%s\n", wp_itox (key->nbits, result));
 #endif /* DEBUG_PRINT */
@@ -1237,63 +1295,44 @@ static void rsa_decrypt_slow (wp_rsa_key_pair * key, uint64_t * data,
 /* this faster decryption uses nbits/2 arithmetic to compute:
      int m1 = exp_mod (cipher, dp, p);
      int m2 = exp_mod (cipher, dq, q);
-     int h = 
-       if (m1 >= m2) (qinv * (m1 - m2)) % p;
-       else          (qinv * (m1 + p - m2)) % p
+     int h = (qinv * (m1 - m2)) % p;
      int res = m2 + h * q;
- */
+ * mont_p and mont_q have the montgomery constants for p and q */
 static void rsa_decrypt_fast (wp_rsa_key_pair * key, uint64_t * data,
-                              uint64_t * result)
+                              uint64_t * result,
+                              const wp_montgomery * mont_p,
+                              const wp_montgomery * mont_q)
 {
   int nbits = key->nbits;
   int nhalf = nbits / 2;
-  rsa_int pfull;
-  rsa_int qfull;
-  wp_extend (nbits, pfull, nhalf, key->p);
-  wp_extend (nbits, qfull, nhalf, key->q);
-
-  rsa_int data_copy1;   /* will hold data_mod_p */
-  rsa_int data_copy2;   /* will hold data_mod_q */
-  wp_copy (nbits, data_copy1, data);
-  wp_copy (nbits, data_copy2, data);
-  uint64_t * data_mod_p;
-  uint64_t * data_mod_q;
-  wp_div (nbits, data_copy1, nhalf, key->p, NULL, &data_mod_p);
-  wp_div (nbits, data_copy2, nhalf, key->q, NULL, &data_mod_q);
+
+  /* data < n = p * q, so data < p * 2^nhalf, as needed by wp_mod_mont */
+  rsa_half data_mod_p;
+  rsa_half data_mod_q;
+  wp_mod_mont (mont_p, data_mod_p, data);
+  wp_mod_mont (mont_q, data_mod_q, data);
 
   /* compute m1 and m2 at half size */
   rsa_half m1;
-#ifdef USE_EXP_MOD_MONTGOMERY
-  rsa_temp_half temp;
-  wp_exp_mod_montgomery (nhalf, m1, data_mod_p, key->dp, key->p, temp);
-  rsa_half m2;
-  wp_exp_mod_montgomery (nhalf, m2, data_mod_q, key->dq, key->q, temp);
-#else /* USE_EXP_MOD_MONTGOMERY */
-#ifdef USE_EXP_MOD64
-  rsa_temp_half temp;
-  wp_exp_mod64 (nhalf, m1, data_mod_p, key->dp, key->p, temp);
+  wp_exp_mod_window (mont_p, m1, data_mod_p, key->dp);
   rsa_half m2;
-  wp_exp_mod64 (nhalf, m2, data_mod_q, key->dq, key->q, temp);
-#else /* USE_EXP_MOD64 */
-  rsa_half temp;
-  wp_exp_mod (nhalf, m1, data_mod_p, key->dp, key->p, temp);
-  rsa_half m2;
-  wp_exp_mod (nhalf, m2, data_mod_q, key->dq, key->q, temp);
-#endif /* USE_EXP_MOD64 */
-#endif /* USE_EXP_MOD_MONTGOMERY */
-
-  /* compute at half size h = if (m1 >= m2) (qinv * (m1 - m2)) % p;
-                              else          (qinv * (m1 + p - m2)) % p */
+  wp_exp_mod_window (mont_q, m2, data_mod_q, key->dq);
+
+  /* compute at half size h = (qinv * (m1 - m2)) % p.  m2 < q may be
+   * greater than p, so first reduce it modulo p */
+  rsa_half m2_mod_p;
+  wp_copy (nhalf, m2_mod_p, m2);
+  while (wp_compare (nhalf, m2_mod_p, key->p) >= 0)
+    wp_sub (nhalf, m2_mod_p, m2_mod_p, key->p);
   rsa_half diff;
-  wp_sub (nhalf, diff, m1, m2);
-  if (wp_compare (nhalf, m1, m2) < 0) {
+  if (wp_sub (nhalf, diff, m1, m2_mod_p)) {  /* m1 < m2_mod_p */
 #ifdef DEBUG_PRINT
     printf ("adding p to diff\n");
 #endif /* DEBUG_PRINT */
     wp_add (nhalf, diff, diff, key->p);
   }
   rsa_half h;
-  wp_multiply_mod (nhalf, h, key->qinv, diff, key->p);
+  wp_multiply_mod_mont (mont_p, h, key->qinv, diff);
 #ifdef DEBUG_PRINT
   printf ("m1 is %s/%d\n", wp_itox (nhalf, m1), nhalf);
   printf ("m2 is %s/%d\n", wp_itox (nhalf, m2), nhalf);
@@ -1323,9 +1362,18 @@ static void rsa_choose_decrypt (wp_rsa_key_pair * key,
             wp_is_zero (nhalf, key->qinv));
 #endif /* DEBUG_PRINT */
     rsa_decrypt_slow (key, data, result);
-  } else {
-    rsa_decrypt_fast (key, data, result);
+    return;
   }
+  wp_montgomery computed_p;
+  wp_montgomery computed_q;
+  const wp_montgomery * mont_p =
+    rsa_montgomery (&(key->mont_p), nhalf, key->p, &computed_p);
+  const wp_montgomery * mont_q =
+    rsa_montgomery (&(key->mont_q), nhalf, key->q, &computed_q);
+  if ((mont_p == NULL) || (mont_q == NULL))   /* even p or q, bad key */
+    rsa_decrypt_slow (key, data, result);
+  else
+    rsa_decrypt_fast (key, data, result, mont_p, mont_q);
 }
 
 /* data and result may be the same buffer.
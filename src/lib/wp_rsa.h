@@ -10,6 +10,7 @@
 #include <stdint.h>
 
 #include "sha.h"
+#include "wp_arith.h"
 
 #define WP_RSA_MAX_KEY_BITS	4096
 
@@ -19,16 +20,21 @@
 #define WP_RSA_MAX_KEY_BYTES	(WP_RSA_MAX_KEY_BITS / 8)
 #define WP_RSA_HALF_KEY_BYTES	(WP_RSA_MAX_KEY_BYTES / 2)
 
+/* mont_n, mont_p, and mont_q hold montgomery constants precomputed by
+ * wp_rsa_key_precompute or wp_rsa_key_pair_precompute.  They are only used
+ * if they match the key, so keys filled in by hand still work, just slower */
 typedef struct {
   int nbits;
   uint64_t n [WP_RSA_MAX_KEY_WORDS];
   uint64_t e;
+  wp_montgomery mont_n;
 } wp_rsa_key;
 
 typedef struct {
   int nbits;
   uint64_t n [WP_RSA_MAX_KEY_WORDS];
   uint64_t e;   			/* usually 65537 */
+  wp_montgomery mont_n;   /* same layout as wp_rsa_key up to here */
   uint64_t d [WP_RSA_MAX_KEY_WORDS];
 /* used for faster implementation of decryption and signing */
   uint64_t p [WP_RSA_HALF_KEY_WORDS];
@@ -36,8 +42,16 @@ typedef struct {
   uint64_t dp [WP_RSA_HALF_KEY_WORDS];
   uint64_t dq [WP_RSA_HALF_KEY_WORDS];
   uint64_t qinv [WP_RSA_HALF_KEY_WORDS];
+  wp_montgomery mont_p;
+  wp_montgomery mont_q;
 } wp_rsa_key_pair;
 
+/* compute the montgomery constants for the key, and for a key pair with
+ * p and q, any missing dp, dq, and qinv, so decryption and signing can use
+ * the chinese remainder theorem.  Called by the functions that create keys */
+extern void wp_rsa_key_precompute (wp_rsa_key * key);
+extern void wp_rsa_key_pair_precompute (wp_rsa_key_pair * key);
+
 /* get the public key part of the key pair */
 extern wp_rsa_key wp_rsa_get_public_key (wp_rsa_key_pair * key);
 
@@ -148,62 +148,11 @@ static void handle_packet (int sock, char * message, int msize)
 /* used for debugging the generation of spare keys */
 /* #define DEBUG_PRINT_SPARES */
 
-/* ok to call with bsize == 0, will not gather any random bytes */
-/* only returns after time "until" has been reached */
-/* returns the number of bytes gathered, if any, 0 otherwise */
-/* should never return more than bsize */
-static int gather_random_and_wait (int bsize, char * buffer, time_t until)
-{
-  int fd = -1;
-  int count = 0;
-  if (bsize > 0) {
-    fd = open ("/dev/random", O_RDONLY);
-    while ((fd >= 0) && (count < bsize)) {
-#ifdef DEBUG_PRINT_SPARES
-      if ((count < 4) || (count + 4 >= bsize) || ((count % 128) == 127))
-        printf ("graw, count %d, bsize %d\n", count, bsize);
-#endif /* DEBUG_PRINT_SPARES */
-      char data [1];
-      ssize_t found = read (fd, data, 1);
-      if (found == 1)
-        buffer [count++] = data [0];
-      else if (found < 0) {  /* some kind of error */
-perror ("gather_random_and_wait read /dev/random");
-        close (fd);
-        fd = -1;
-      }
-    }
-    if (fd >= 0)
-      close (fd);
-  }
-#ifdef DEBUG_PRINT_SPARES
-  printf ("at %ld: generated %d bytes, until %ld\n", time (NULL), count, until);
-#endif /* DEBUG_PRINT_SPARES */
-  time_t now;
-  while ((now = time (NULL)) < until) {
-#ifdef DEBUG_PRINT_SPARES
-    printf ("graw, time %ld, until %ld\n", time (NULL), until);
-#endif /* DEBUG_PRINT_SPARES */
-    time_t interval = until - now;
-    if (sleep ((int)interval)) {  /* interrupted */
-#ifdef DEBUG_PRINT_SPARES
-      printf ("graw killed\n");
-#endif /* DEBUG_PRINT_SPARES */
-      exit (1);
-    }
-  }
-  if ((bsize > 0) && ((fd < 0) || (count > bsize)))
-    printf ("gather_random_and_wait error: %d > %d (%d)\n", count, bsize, fd);
-  if (fd >= 0)
-    return count;
-  else
-    return 0;
-}
-
 #define KEY_GEN_BITS	4096
-#define KEY_GEN_BYTES	(KEY_GEN_BITS / 8)
-#define MIN_SPARES	8  /* below this, generate keys without stopping */
+#define MIN_SPARES	8  /* below this, generate keys even on battery */
 #define HEALTHY_SPARES	100  /* do not generate more than this */
+#define MAX_KEY_GEN_THREADS	4
+#define KEY_GEN_REPORT	(60 * 10)  /* report every 10 minutes */
 /* run from astart as a separate process */
 void keyd_generate (char * pname)
 {
@@ -214,59 +163,31 @@ void keyd_generate (char * pname)
               "keyd unable to lower process priority, continuing anyway\n");
     log_print (alog);
   }
-  /* sleep 10 min, or 100 * the time to generate a key, whichever is longer */
-  time_t sleep_time = 60 * 10;  /* 10 minutes, in seconds */
-  int existing_spares = create_spare_key (-1, NULL, 0);
-  if (existing_spares < MIN_SPARES)  /* create keys as fast as possible */
-    sleep_time = 1;
-  char buffer [KEY_GEN_BYTES];
-  int bytes_in_buffer = 0;
-  /* generate up to 100 keys (8 in low-power mode), then generate more
-   * as they are used */
+  int nthreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > MAX_KEY_GEN_THREADS)
+    nthreads = MAX_KEY_GEN_THREADS;
+  /* the pool threads keep 8 spare keys (100 when speculative computation
+   * is ok), and generate more as they are used */
+  if (start_spare_key_pool (KEY_GEN_BITS, MIN_SPARES, HEALTHY_SPARES,
+                            nthreads) <= 0) {
+    snprintf (alog->b, alog->s, "keyd unable to start key generation\n");
+    log_print (alog);
+    exit (1);
+  }
   while (1) {
-    time_t start = time (NULL);
-    time_t finish = start + sleep_time;
-    int min_spares = MIN_SPARES; /* stop generating when we have 8 spare keys */
-    if (speculative_computation_is_ok ())  /* or 100 if plenty of power */
-      min_spares = HEALTHY_SPARES;
-    int gather_bytes = KEY_GEN_BYTES - bytes_in_buffer;
-#ifdef DEBUG_PRINT_SPARES
-    printf ("gathering %d bytes (have %d) and waiting %ld until %ld\n",
-            gather_bytes, bytes_in_buffer, finish - time (NULL), finish);
-#endif /* DEBUG_PRINT_SPARES */
-    bytes_in_buffer +=
-      gather_random_and_wait (gather_bytes, buffer + bytes_in_buffer, finish);
-    existing_spares = create_spare_key (-1, NULL, 0);
-    if (existing_spares < min_spares)  /* for now, report how many we have */
-      printf ("%ld: %d spare keys, min %d\n",
-              start, existing_spares, min_spares);
-#ifdef DEBUG_PRINT_SPARES
-    printf ("%ld: %d spare keys, min %d\n",
-            start, existing_spares, min_spares);
-    printf ("gathered %d bytes, done waiting, now %ld (and %d spares)\n",
-            bytes_in_buffer, time (NULL), create_spare_key (-1, NULL, 0));
-#endif /* DEBUG_PRINT_SPARES */
-    sleep_time = (60 * 10);  /* sleep for 10 minutes, or 100x key gen time */
-    if ((existing_spares < min_spares) && (bytes_in_buffer >= KEY_GEN_BYTES)) {
-      start = time (NULL);
-#ifdef DEBUG_PRINT_SPARES
-      printf ("creating spare key, start time %ld\n", start);
-#endif /* DEBUG_PRINT_SPARES */
-      create_spare_key (KEY_GEN_BITS, buffer, KEY_GEN_BYTES);
-      bytes_in_buffer = 0;   /* used all the bytes */
-      time_t done = time (NULL);
-      time_t delta = done - start;
-      /* sleep time is 100 * generation time or 10min, whichever is more */
-      time_t sleep_time_from_key_gen = delta * 100;
-      if (sleep_time < sleep_time_from_key_gen)
-        sleep_time = sleep_time_from_key_gen;
+    sleep (KEY_GEN_REPORT);
+    struct spare_key_pool_stats s;
+    get_spare_key_pool_stats (&s);
+    snprintf (alog->b, alog->s,
+              "%d spare keys (min %d, target %d), %d threads, "
+              "%d generating, %llu generated\n", s.available, s.min_spares,
+              s.target, s.threads, s.generating, s.generated);
+    log_print (alog);
 #ifdef DEBUG_PRINT_SPARES
-      printf ("%ld: created, sleep %ld (from %ld)\n", done, sleep_time, delta);
+    printf ("%s", alog->b);
 #endif /* DEBUG_PRINT_SPARES */
-    }
-    existing_spares = create_spare_key (-1, NULL, 0);
-    if (existing_spares < MIN_SPARES)  /* create keys as fast as possible */
-      sleep_time = 1;
   }
 }
 
@@ -0,0 +1,148 @@
+/* rsa_bench.c: measure the speed of RSA verify, sign, encrypt, and decrypt */
+/* uses the crypt_sel interface, so the same program measures either
+ * openssl or the wp_rsa library, depending on how allnet was configured */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/crypt_sel.h"
+#include "lib/sha.h"
+#include "lib/util.h"
+
+#define DEFAULT_BITS		4096
+#define DEFAULT_SECONDS		3
+#ifdef HAVE_OPENSSL
+#define MAX_BITS		(DEFAULT_BITS * 2)
+#else /* HAVE_OPENSSL */
+#define MAX_BITS		WP_RSA_MAX_KEY_BITS
+#endif /* HAVE_OPENSSL */
+
+/* runs the operation for about the given number of seconds (at least once),
+ * then prints and returns the number of operations per second */
+static double bench (const char * name, int seconds,
+                     int (* op) (void * arg), void * arg)
+{
+  unsigned long long int start = allnet_time_us ();
+  unsigned long long int limit = seconds * 1000000LL;
+  unsigned long long int elapsed = 0;
+  long int count = 0;
+  do {
+    if (! op (arg)) {
+      printf ("%s failed\n", name);
+      return 0;
+    }
+    count++;
+    elapsed = allnet_time_us () - start;
+  } while (elapsed < limit);
+  double per_second = count * 1000000.0 / elapsed;
+  printf ("%-8s %8.1f ops/s  (%ld in %lluus, %lluus each)\n", name,
+          per_second, count, elapsed, elapsed / count);
+  return per_second;
+}
+
+struct bench_data {
+  allnet_rsa_prvkey prv;
+  allnet_rsa_pubkey pub;
+  int ksize;
+  char hash [SHA512_SIZE];
+  char sig [MAX_BITS / 8];
+  char cipher [MAX_BITS / 8];
+  char plain [MAX_BITS / 8];
+};
+
+static int do_verify (void * arg)
+{
+  struct bench_data * d = (struct bench_data *) arg;
+  return allnet_rsa_verify (d->pub, d->hash, sizeof (d->hash),
+                            d->sig, d->ksize);
+}
+
+static int do_sign (void * arg)
+{
+  struct bench_data * d = (struct bench_data *) arg;
+  return allnet_rsa_sign (d->prv, d->hash, sizeof (d->hash),
+                          d->sig, sizeof (d->sig));
+}
+
+static int do_encrypt (void * arg)
+{
+  struct bench_data * d = (struct bench_data *) arg;
+  return (allnet_rsa_encrypt (d->pub, d->hash, sizeof (d->hash),
+                              d->cipher, sizeof (d->cipher), 1) > 0);
+}
+
+static int do_decrypt (void * arg)
+{
+  struct bench_data * d = (struct bench_data *) arg;
+  return (allnet_rsa_decrypt (d->prv, d->cipher, d->ksize,
+                              d->plain, d->ksize, 1) ==
+          (int) sizeof (d->hash));
+}
+
+static void usage (const char * pname)
+{
+  printf ("usage: %s [-s seconds] [-b bits | private-key-file]\n", pname);
+  printf ("  default is to generate a %d-bit key and run each test %ds\n",
+          DEFAULT_BITS, DEFAULT_SECONDS);
+  printf ("  bits must be a multiple of 64 from 1024 to %d\n", MAX_BITS);
+  exit (1);
+}
+
+int main (int argc, char ** argv)
+{
+  int seconds = DEFAULT_SECONDS;
+  int bits = DEFAULT_BITS;
+  const char * fname = NULL;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp (argv [i], "-s") == 0) && (i + 1 < argc))
+      seconds = atoi (argv [++i]);
+    else if ((strcmp (argv [i], "-b") == 0) && (i + 1 < argc))
+      bits = atoi (argv [++i]);
+    else if (argv [i] [0] == '-')
+      usage (argv [0]);
+    else
+      fname = argv [i];
+  }
+  if ((seconds <= 0) || (bits < 1024) || (bits > MAX_BITS) ||
+      ((bits % 64) != 0))
+    usage (argv [0]);
+  static struct bench_data d;
+  if (fname != NULL) {
+    if (! allnet_rsa_read_prvkey (fname, &(d.prv))) {
+      printf ("unable to read private key from %s\n", fname);
+      return 1;
+    }
+  } else {
+    printf ("generating %d-bit key\n", bits);
+    unsigned long long int start = allnet_time_us ();
+    d.prv = allnet_rsa_generate_key (bits, NULL, 0);
+    if (allnet_rsa_prvkey_is_null (d.prv)) {
+      printf ("unable to generate key\n");
+      return 1;
+    }
+    printf ("generated key in %lluus\n", allnet_time_us () - start);
+  }
+  d.pub = allnet_rsa_private_to_public (d.prv);
+  d.ksize = allnet_rsa_prvkey_size (d.prv);
+  if ((d.ksize <= 0) || (d.ksize > (int) sizeof (d.sig))) {
+    printf ("unsupported key size %d bytes\n", d.ksize);
+    return 1;
+  }
+  printf ("%d-bit key, each test runs about %ds\n", d.ksize * 8, seconds);
+  sha512 ("allnet rsa benchmark", 20, d.hash);
+  /* sign and encrypt once so verify and decrypt have valid inputs */
+  if ((! do_sign (&d)) || (! do_verify (&d)) ||
+      (! do_encrypt (&d)) || (! do_decrypt (&d)) ||
+      (memcmp (d.plain, d.hash, sizeof (d.hash)) != 0)) {
+    printf ("sign/verify or encrypt/decrypt failed\n");
+    return 1;
+  }
+  bench ("verify", seconds, do_verify, &d);
+  bench ("sign", seconds, do_sign, &d);
+  bench ("encrypt", seconds, do_encrypt, &d);
+  bench ("decrypt", seconds, do_decrypt, &d);
+  allnet_rsa_free_prvkey (d.prv);
+  return 0;
+}
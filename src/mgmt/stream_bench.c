@@ -0,0 +1,115 @@
+/* stream_bench.c: measure the speed of stream encryption for audio frames */
+/* voa sends one frame every 20ms, so each frame must be encrypted (and,
+ * on the other side, authenticated and decrypted) in well under 20ms.
+ * this reports the frames per second and the time per frame */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/stream.h"
+#include "lib/util.h"
+
+#define DEFAULT_FRAME		160	/* bytes, 20ms of 64kb/s opus */
+#define DEFAULT_SECONDS		3
+#define MAX_FRAME		900
+/* same as ALLNET_VOA_COUNTER_SIZE and ALLNET_VOA_HMAC_SIZE in voa/voa.h */
+#define VOA_COUNTER_SIZE	2
+#define VOA_HMAC_SIZE		6
+#define FRAME_US		20000	/* 20ms */
+
+struct bench_data {
+  struct allnet_stream_encryption_state enc;
+  struct allnet_stream_encryption_state dec;
+  int fsize;
+  int precompute;
+  char frame [MAX_FRAME];
+  char packet [MAX_FRAME + VOA_COUNTER_SIZE + VOA_HMAC_SIZE];
+  int psize;
+  char decrypted [MAX_FRAME];
+};
+
+static int do_encrypt (struct bench_data * d)
+{
+  d->psize = allnet_stream_encrypt_buffer (&(d->enc), d->frame, d->fsize,
+                                           d->packet, sizeof (d->packet));
+  /* the next frame's key stream, normally computed while waiting */
+  if (d->precompute)
+    allnet_stream_precompute (&(d->enc), d->fsize);
+  return (d->psize > 0);
+}
+
+static int do_decrypt (struct bench_data * d)
+{
+  return allnet_stream_decrypt_buffer (&(d->dec), d->packet, d->psize,
+                                       d->decrypted, sizeof (d->decrypted));
+}
+
+/* runs the operation for about the given number of seconds (at least once),
+ * then prints and returns the number of frames per second */
+static double bench (const char * name, int seconds,
+                     int (* op) (struct bench_data * d), struct bench_data * d)
+{
+  unsigned long long int start = allnet_time_us ();
+  unsigned long long int limit = seconds * 1000000LL;
+  unsigned long long int elapsed = 0;
+  long int count = 0;
+  do {
+    if (! op (d)) {
+      printf ("%s failed\n", name);
+      return 0;
+    }
+    count++;
+    elapsed = allnet_time_us () - start;
+  } while (elapsed < limit);
+  double per_second = count * 1000000.0 / elapsed;
+  double us = ((double) elapsed) / count;
+  printf ("%-20s %10.0f frames/s  %7.2fus/frame  (%.3f%% of %dms)\n",
+          name, per_second, us, us * 100.0 / FRAME_US, FRAME_US / 1000);
+  return per_second;
+}
+
+static void usage (const char * pname)
+{
+  printf ("usage: %s [-s seconds] [-f frame-bytes]\n", pname);
+  printf ("  default is %d-byte frames, each test runs %ds\n",
+          DEFAULT_FRAME, DEFAULT_SECONDS);
+  exit (1);
+}
+
+int main (int argc, char ** argv)
+{
+  int seconds = DEFAULT_SECONDS;
+  int fsize = DEFAULT_FRAME;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if ((strcmp (argv [i], "-s") == 0) && (i + 1 < argc))
+      seconds = atoi (argv [++i]);
+    else if ((strcmp (argv [i], "-f") == 0) && (i + 1 < argc))
+      fsize = atoi (argv [++i]);
+    else
+      usage (argv [0]);
+  }
+  if ((seconds <= 0) || (fsize <= 0) || (fsize > MAX_FRAME))
+    usage (argv [0]);
+  static struct bench_data d;
+  char key [ALLNET_STREAM_KEY_SIZE];
+  char secret [ALLNET_STREAM_SECRET_SIZE];
+  allnet_stream_init (&(d.enc), key, 1, secret, 1,
+                      VOA_COUNTER_SIZE, VOA_HMAC_SIZE);
+  allnet_stream_init (&(d.dec), key, 0, secret, 0,
+                      VOA_COUNTER_SIZE, VOA_HMAC_SIZE);
+  d.fsize = fsize;
+  random_bytes (d.frame, fsize);
+  if ((! do_encrypt (&d)) || (! do_decrypt (&d)) ||
+      (memcmp (d.frame, d.decrypted, fsize) != 0)) {
+    printf ("encrypt/decrypt failed\n");
+    return 1;
+  }
+  printf ("%d-byte frames, each test runs about %ds\n", fsize, seconds);
+  bench ("encrypt", seconds, do_encrypt, &d);
+  d.precompute = 1;
+  bench ("encrypt+precompute", seconds, do_encrypt, &d);
+  bench ("decrypt", seconds, do_decrypt, &d);
+  return 0;
+}
@@ -1,29 +1,52 @@
 /* record.c: keep track of recently received packets */
 
-/* the way we keep track is to use two hash tables.  Each hash table
- * is indexed by two bytes of the hash of the packet, and records
- * the entire hash.  New hashes overwrite old hashes, but presumably
- * in different locations in the two hash tables, so in at least one
- * of the hash tables, the hash is likely to remain for a while.
- * When looking up, a match in either hash table means we have seen
- * the packet recently.
+/* each packet is hashed (skipping the hop count) with SipHash, using a
+ * random key so peers cannot choose packets that collide.  The hash
+ * gives a 32-bit fingerprint and two buckets in a table.  Each bucket
+ * is one 64-byte cache line with the fingerprints and times of up to
+ * 8 packets, so a lookup reads at most two cache lines.  The fingerprint
+ * alone gives the second bucket from the first, as in a cuckoo filter.
+ * Each bucket is kept in order, most recently seen first.  Entries older
+ * than RECORD_EXPIRATION are free.  A new packet replaces the oldest entry
+ * of whichever of its buckets has the older (or a free) last entry.
+ *
+ * the table and the hash key are saved when allnet stops, and reloaded
+ * on the first call after allnet starts, so restarting does not let
+ * peers replay recent traffic.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "record.h"
 #include "lib/packet.h"
+#include "lib/sha.h"
+#include "lib/util.h"
+#include "lib/configfiles.h"
 
-#define ENTRIES_PER_TABLE		(64 * 1024)
+#define RECORD_BUCKET_ENTRIES	8	/* 8 * 8 bytes = one cache line */
+#define RECORD_EXPIRATION	(24 * 60 * 60)	/* forget packets after a day */
+#define RECORD_FILE_MAGIC	"allnet-record-v1"
 
-struct hash_entry {
-  time_t last_seen;
-  unsigned int hash;
+struct record_bucket {
+  uint32_t fingerprint [RECORD_BUCKET_ENTRIES];  /* 0 if not in use */
+  uint32_t last_seen [RECORD_BUCKET_ENTRIES];
 };
 
-static struct hash_entry hash1 [ENTRIES_PER_TABLE];
-static struct hash_entry hash2 [ENTRIES_PER_TABLE];
+struct record_file_header {
+  char magic [sizeof (RECORD_FILE_MAGIC)];
+  char key [SIPHASH_KEY_SIZE];
+  uint32_t num_buckets;
+};
+
+static struct record_bucket * buckets = NULL;
+static uint32_t bucket_mask = 0;   /* number of buckets - 1 */
+static char hash_key [SIPHASH_KEY_SIZE];
+static unsigned int table_entries = RECORD_DEFAULT_ENTRIES;
 
 /* data must have at least ((bits + 7) / 8) bytes, and bits should be > 0 */
 int allnet_record_simple_hash_fn (char * data, unsigned int bits)
@@ -57,46 +80,122 @@ int allnet_record_simple_hash_fn (char * data, unsigned int bits)
   return result;
 }
 
-static void lr_hash_fun (char * data, unsigned int bits, unsigned int * hash,
-                         unsigned int * lindex, unsigned int * rindex)
+/* rounds entries up to a power of two number of buckets */
+static uint32_t buckets_for_entries (unsigned int entries)
 {
-  *hash = allnet_record_simple_hash_fn (data, bits);
-  int left_hash  = (((*hash) >> 16) & 0xff00) | (((*hash) >> 8) & 0xff);
-  *lindex = left_hash % ENTRIES_PER_TABLE;
-  int right_hash = (((*hash) >>  8) & 0xff00) | ( (*hash)       & 0xff);
-  *rindex = right_hash % ENTRIES_PER_TABLE;
-#ifdef DEBUG_PRINT
-  printf ("hash = %x, left %d %x, right = %d %x\n", (*hash),
-          left_hash % ENTRIES_PER_TABLE,
-          hash1 [left_hash  % ENTRIES_PER_TABLE].hash,
-          right_hash % ENTRIES_PER_TABLE,
-          hash2 [right_hash  % ENTRIES_PER_TABLE].hash);
-#endif /* DEBUG_PRINT */
+  uint32_t result = 1;
+  while ((result * RECORD_BUCKET_ENTRIES < entries) && (result < (1 << 24)))
+    result *= 2;
+  return result;
 }
 
-/* returns 0 if not found, 1 or more if found */
-static unsigned int get_hash_time (struct hash_entry * entry,
-                                   unsigned int hash, time_t now)
+/* returns 1 if the table was loaded, 0 otherwise */
+static int load_table (uint32_t num_buckets)
 {
-  if ((entry->hash != hash) || (entry->last_seen == 0))
+  int fd = open_read_config ("ad", "record", 0);
+  if (fd < 0)
     return 0;
-  time_t hash_time = now - entry->last_seen;
-  if (hash_time <= 0)
-    hash_time = 1;
-  return (unsigned int) hash_time;
+  struct record_file_header header;
+  size_t bsize = num_buckets * sizeof (struct record_bucket);
+  int result = 0;
+  if ((read (fd, &header, sizeof (header)) == (ssize_t) (sizeof (header))) &&
+      (memcmp (header.magic, RECORD_FILE_MAGIC, sizeof (header.magic)) == 0) &&
+      (header.num_buckets == num_buckets) &&
+      (read (fd, buckets, bsize) == (ssize_t) bsize)) {
+    memcpy (hash_key, header.key, sizeof (hash_key));
+    result = 1;
+  }
+  close (fd);
+  return result;
 }
 
 static void init ()
 {
-  static int initialized = 0;
-  if (! initialized) {
-    int i;
-    for (i = 0; i < ENTRIES_PER_TABLE; i++) {
-      hash1 [i].hash = 0; hash1 [i].last_seen = 0;
-      hash2 [i].hash = 0; hash2 [i].last_seen = 0;
+  if (buckets != NULL)
+    return;
+  uint32_t num_buckets = buckets_for_entries (table_entries);
+  buckets = malloc_or_fail (num_buckets * sizeof (struct record_bucket),
+                            "record init");
+  bucket_mask = num_buckets - 1;
+  if (! load_table (num_buckets)) {  /* start with an empty table */
+    memset (buckets, 0, num_buckets * sizeof (struct record_bucket));
+    random_bytes (hash_key, sizeof (hash_key));
+  }
+}
+
+void record_set_size (unsigned int entries)
+{
+  if ((buckets != NULL) || (entries <= 0))
+    return;   /* too late, or bad value */
+  table_entries = entries;
+}
+
+void record_save_data ()
+{
+  if (buckets == NULL)
+    return;
+  int fd = open_write_config ("ad", "record", 0);
+  if (fd < 0)
+    return;
+  struct record_file_header header;
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, RECORD_FILE_MAGIC, sizeof (header.magic));
+  memcpy (header.key, hash_key, sizeof (header.key));
+  header.num_buckets = bucket_mask + 1;
+  size_t bsize = (bucket_mask + 1) * sizeof (struct record_bucket);
+  if ((write (fd, &header, sizeof (header)) != (ssize_t) (sizeof (header))) ||
+      (write (fd, buckets, bsize) != (ssize_t) bsize))
+    printf ("record_save_data: unable to save record table\n");
+  close (fd);
+}
+
+static uint32_t other_bucket (uint32_t bucket, uint32_t fingerprint)
+{
+  return (bucket ^ (fingerprint * 0x5bd1e995)) & bucket_mask;
+}
+
+/* returns the number of seconds (at least 1) since the fingerprint was
+ * last seen in the bucket, or 0 if not there.  If found, makes it the
+ * newest entry in the bucket */
+static uint32_t find_in_bucket (struct record_bucket * b, uint32_t fingerprint,
+                                uint32_t now)
+{
+  int i;
+  for (i = 0; i < RECORD_BUCKET_ENTRIES; i++) {
+    uint32_t delta = now - b->last_seen [i];
+    if ((b->fingerprint [i] == 0) || (delta >= RECORD_EXPIRATION))
+      return 0;   /* the rest are older */
+    if (b->fingerprint [i] == fingerprint) {
+      memmove (b->fingerprint + 1, b->fingerprint, i * sizeof (uint32_t));
+      memmove (b->last_seen + 1, b->last_seen, i * sizeof (uint32_t));
+      b->fingerprint [0] = fingerprint;
+      b->last_seen [0] = now;
+      return ((delta > 0) ? delta : 1);
     }
-    initialized = 1;
   }
+  return 0;
+}
+
+/* adds the fingerprint as the newest entry, dropping the oldest */
+static void add_to_bucket (struct record_bucket * b, uint32_t fingerprint,
+                           uint32_t now)
+{
+  int last = RECORD_BUCKET_ENTRIES - 1;
+  memmove (b->fingerprint + 1, b->fingerprint, last * sizeof (uint32_t));
+  memmove (b->last_seen + 1, b->last_seen, last * sizeof (uint32_t));
+  b->fingerprint [0] = fingerprint;
+  b->last_seen [0] = now;
+}
+
+/* returns how long ago the oldest entry was seen, RECORD_EXPIRATION if
+ * the bucket has room */
+static uint32_t oldest_in_bucket (struct record_bucket * b, uint32_t now)
+{
+  int last = RECORD_BUCKET_ENTRIES - 1;
+  uint32_t delta = now - b->last_seen [last];
+  if ((b->fingerprint [last] == 0) || (delta >= RECORD_EXPIRATION))
+    return RECORD_EXPIRATION;
+  return delta;
 }
 
 /* return 0 if this is a new packet, and the number of seconds (at least 1)
@@ -113,25 +212,161 @@ unsigned int record_packet (char * packet, unsigned int psize)
   if (psize < (unsigned int) offset)
     return 1;   /* should never happen */
 
-  unsigned int hash, left_index, right_index;
-  lr_hash_fun (packet + offset, (psize - (unsigned int)offset) * 8,
-               &hash, &left_index, &right_index);
-  time_t now = time (NULL);
-  unsigned int left_time  = get_hash_time (hash1 + left_index , hash, now);
-  unsigned int right_time = get_hash_time (hash2 + right_index, hash, now);
+  uint64_t hash = siphash24 (hash_key, packet + offset,
+                             psize - (unsigned int) offset);
+  uint32_t fingerprint = (uint32_t) (hash >> 32);
+  if (fingerprint == 0)  /* 0 marks free entries */
+    fingerprint = 1;
+  uint32_t first = ((uint32_t) hash) & bucket_mask;
+  struct record_bucket * b1 = buckets + first;
+  struct record_bucket * b2 = buckets + other_bucket (first, fingerprint);
+  uint32_t now = (uint32_t) time (NULL);
+  uint32_t seen = find_in_bucket (b1, fingerprint, now);
+  if ((seen == 0) && (b2 != b1))
+    seen = find_in_bucket (b2, fingerprint, now);
+  if (seen == 0) {   /* not found, add it to the bucket with more room */
+    uint32_t age1 = oldest_in_bucket (b1, now);
+    uint32_t age2 = oldest_in_bucket (b2, now);
+    if ((age1 > age2) || ((age1 == age2) && ((fingerprint & 1) == 0)))
+      add_to_bucket (b1, fingerprint, now);
+    else
+      add_to_bucket (b2, fingerprint, now);
+  }
+  return seen;
+}
 
-  /* store into both hash tables */
-  hash1 [left_index].hash = hash;
-  hash1 [left_index].last_seen = now;
-  hash2 [right_index].hash = hash;
-  hash2 [right_index].last_seen = now;
+#ifdef RECORD_UNIT_TEST
+/* compile with:
+   gcc -DRECORD_UNIT_TEST -I. -o record-test record.c lib/.libs/liballnet-*.a
+ * compares the rate of false "seen before" results and the speed with
+ * the original implementation, which used two 64K-entry tables indexed by
+ * allnet_record_simple_hash_fn */
 
+#include <sys/time.h>
+
+#define OLD_ENTRIES	(64 * 1024)
+
+struct old_hash_entry {
+  time_t last_seen;
+  unsigned int hash;
+};
+
+static struct old_hash_entry old_hash1 [OLD_ENTRIES];
+static struct old_hash_entry old_hash2 [OLD_ENTRIES];
+
+static unsigned int old_get_hash_time (struct old_hash_entry * entry,
+                                       unsigned int hash, time_t now)
+{
+  if ((entry->hash != hash) || (entry->last_seen == 0))
+    return 0;
+  time_t hash_time = now - entry->last_seen;
+  return ((hash_time <= 0) ? 1 : (unsigned int) hash_time);
+}
+
+static unsigned int old_record_packet (char * packet, unsigned int psize)
+{
+  struct allnet_header * hp = (struct allnet_header *) packet;
+  size_t offset = (((char *) (&(hp->hops))) - packet) + 1;
+  unsigned int hash =
+    allnet_record_simple_hash_fn (packet + offset, (psize - offset) * 8);
+  unsigned int left  = ((((hash) >> 16) & 0xff00) | (((hash) >> 8) & 0xff));
+  unsigned int right = ((((hash) >>  8) & 0xff00) | ( (hash)       & 0xff));
+  left %= OLD_ENTRIES;
+  right %= OLD_ENTRIES;
+  time_t now = time (NULL);
+  unsigned int left_time  = old_get_hash_time (old_hash1 + left , hash, now);
+  unsigned int right_time = old_get_hash_time (old_hash2 + right, hash, now);
+  old_hash1 [left].hash = hash;
+  old_hash1 [left].last_seen = now;
+  old_hash2 [right].hash = hash;
+  old_hash2 [right].last_seen = now;
   if (left_time  == 0)
     return right_time;
-  if (right_time == 0)
+  if ((right_time == 0) || (left_time < right_time))
     return left_time;
-  if (left_time > right_time)
-    return right_time;  /* return lesser time */
-  return left_time;
+  return right_time;
 }
 
+/* packets from one source to one destination, differing in the payload:
+ * 0: a sequence number, as for a stream of data
+ * 1: pseudo-random bytes
+ * 2: a sequence number repeated 128 bytes later.  The simple hash rotates
+ *    by one bit per 32-bit word, so the two copies cancel */
+#define TEST_PACKET_SIZE	200
+static void make_packet (char * packet, unsigned long long int n, int mode)
+{
+  memset (packet, 0, TEST_PACKET_SIZE);
+  struct allnet_header * hp = (struct allnet_header *) packet;
+  hp->version = ALLNET_VERSION;
+  hp->message_type = ALLNET_TYPE_DATA;
+  hp->max_hops = 10;
+  hp->src_nbits = 16;
+  hp->source [0] = 0x12;
+  hp->source [1] = 0x34;
+  char * payload = packet + ALLNET_HEADER_SIZE + 4;  /* 32-bit aligned */
+  if (mode == 1) {
+    uint64_t x = n * 0x9e3779b97f4a7c15ULL + 1;
+    int i;
+    for (i = 0; i + 8 <= 64; i += 8) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      writeb64 (payload + i, x);
+    }
+  } else {
+    writeb64 (payload, n);
+    if (mode == 2)
+      writeb64 (payload + 128, n);
+  }
+}
+
+static void run (const char * name,
+                 unsigned int (* record) (char * packet, unsigned int psize),
+                 unsigned long long int count, int mode)
+{
+  char packet [TEST_PACKET_SIZE];
+  unsigned long long int false_positives = 0;
+  unsigned long long int i;
+  unsigned long long int start = allnet_time_us ();
+  for (i = 0; i < count; i++) {   /* every packet is new */
+    make_packet (packet, i, mode);
+    if (record (packet, sizeof (packet)) != 0)
+      false_positives++;
+  }
+  unsigned long long int us = allnet_time_us () - start;
+  unsigned long long int missed = 0;
+  for (i = count - 1000; i < count; i++) {  /* the last 1000 again */
+    make_packet (packet, i, mode);
+    if (record (packet, sizeof (packet)) == 0)
+      missed++;
+  }
+  printf ("%s: %.3f%% of new packets reported as seen before, "
+          "%llu of the last 1000 not recognized on repeat, %.0f lookups/s\n",
+          name, false_positives * 100.0 / count, missed,
+          count * 1000000.0 / us);
+}
+
+int main (int argc, char ** argv)
+{
+  unsigned long long int count = 1000000;
+  if (argc > 1)
+    count = atoll (argv [1]);
+  if (count < 1000)
+    count = 1000;
+  /* the new table, with the same number of entries as the old */
+  record_set_size (2 * OLD_ENTRIES);
+  init ();
+  static const char * modes [] =
+    { "sequence numbers", "random payloads", "repeated sequence numbers" };
+  int mode;
+  for (mode = 0; mode < 3; mode++) {
+    memset (old_hash1, 0, sizeof (old_hash1));
+    memset (old_hash2, 0, sizeof (old_hash2));
+    memset (buckets, 0, (bucket_mask + 1) * sizeof (struct record_bucket));
+    printf ("%llu packets with %s\n", count, modes [mode]);
+    run ("  old", old_record_packet, count, mode);
+    run ("  new", record_packet, count, mode);
+  }
+  return 0;
+}
+#endif /* RECORD_UNIT_TEST */
@@ -3,10 +3,23 @@
 #ifndef RECORD_H
 #define RECORD_H
 
+/* the same number of entries as the two 64K-entry tables used before */
+#define RECORD_DEFAULT_ENTRIES	(128 * 1024)
+
 /* return 0 if this is a new packet, and the number of seconds (at least 1)
  * since it has been seen, if it has been seen before */
 extern unsigned int record_packet (char * packet, unsigned int psize);
 
+/* sets the number of packets remembered.  Only has an effect if called
+ * before the first call to record_packet.  The size is rounded up, and
+ * a saved table is only reloaded if it has the same size */
+extern void record_set_size (unsigned int entries);
+
+/* saves the table of recent packets, to be reloaded on the first call
+ * to record_packet after restarting.  Does nothing if record_packet
+ * has not been called */
+extern void record_save_data ();
+
 /* possibly useful elsewhere. */
 /* data must have at least ((bits + 7) / 8) bytes, and bits should be > 0 */
 extern int allnet_record_simple_hash_fn (char * data, unsigned int bits);
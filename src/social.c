@@ -2,13 +2,15 @@
 /* social level 0 (our own contacts) is tracked independently by keys.c,
  * so here we (a) return the results from key.c for level 0, and
  * (b) keep track of and return the results for social levels 1 and 2 */
-/* to do: lots!!!  Including keeping track by source address and
- * by packet signature.
+/* level 0 signatures are checked against the keys whose addresses match
+ * the source address, and the results are cached by packet signature.
+ * to do: lots!!!
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 
 #include "social.h"
 #include "lib/packet.h"
@@ -19,6 +21,7 @@
 #include "lib/keys.h"
 #include "lib/cipher.h"
 #include "lib/priority.h"
+#include "lib/sha.h"
 
 /* keep track of people up to distance 3, friends of friends of friends */
 #ifndef MAX_SOCIAL_TIER   /* usually defined in priority.h */
@@ -61,11 +64,47 @@ static void print_social_tier (int tier, struct social_one_tier * soc,
  */
 }
 
+/* the same signed packet is often received several times, over different
+ * interfaces or when retransmitted, so the results of verification are
+ * saved in a direct-mapped cache, indexed by a digest of the sender address,
+ * the signed message, and the signature */
+#define SIG_CACHE_SIZE		1024   /* must be a power of two */
+#define SIG_DIGEST_SIZE		32
+
+struct sig_cache_entry {
+  char digest [SIG_DIGEST_SIZE];   /* all zeros if not used */
+  int valid;
+};
+
+/* the remote addresses of all contacts and broadcast keys, so
+ * only the keys matching the sender address need be tried */
+struct sender_key {
+  unsigned char address [ADDRESS_SIZE];
+  int nbits;
+  keyset k;           /* for contacts, or -1 for broadcast keys */
+  int bc_index;       /* for broadcast keys, index into get_other_keys */
+  int next;           /* next with the same first byte, or -1 */
+};
+
+/* senders with at least 8 address bits are listed by their first byte */
+#define SENDER_BUCKETS		256
+/* at most this many keys are tried for each signature */
+#define MAX_SENDER_CANDIDATES	16
+
 struct social_info {
   struct social_one_tier info [MAX_SOCIAL_TIER];
   int max_bytes;    /* should not use more than max_bytes of storage */
   int max_check;    /* should not check more than max_check sigs per call */
   struct allnet_log * log;
+  struct sig_cache_entry * sig_cache;  /* SIG_CACHE_SIZE entries */
+  struct sender_key * senders;
+  int num_senders;
+  int sender_buckets [SENDER_BUCKETS];  /* first index, or -1 */
+  int short_senders;   /* first sender with fewer than 8 bits, or -1 */
+  /* the keys when the senders were listed, to tell when they change */
+  unsigned long long int keys_changes;
+  struct bc_key_info * bc_keys;
+  int num_bc_keys;
 };
 
 struct social_info * init_social (int max_bytes, int max_check,
@@ -81,7 +120,23 @@ struct social_info * init_social (int max_bytes, int max_check,
   }
   result->max_bytes = max_bytes;
   result->max_check = max_check;
+  if (result->max_check > MAX_SENDER_CANDIDATES)
+    result->max_check = MAX_SENDER_CANDIDATES;
+  if (result->max_check < 1)
+    result->max_check = 1;
   result->log = log;
+  size_t cache_size = SIG_CACHE_SIZE * sizeof (struct sig_cache_entry);
+  result->sig_cache = malloc_or_fail (cache_size, "init_social sig cache");
+  memset (result->sig_cache, 0, cache_size);
+  result->senders = NULL;
+  result->num_senders = 0;
+  int b;
+  for (b = 0; b < SENDER_BUCKETS; b++)
+    result->sender_buckets [b] = -1;
+  result->short_senders = -1;
+  result->keys_changes = 0;
+  result->bc_keys = NULL;
+  result->num_bc_keys = -1;   /* list the senders on first use */
   int bytes = ADDRESS_SIZE;
   int i;
   for (i = 0; i < MAX_SOCIAL_TIER; i++) {
@@ -144,64 +199,223 @@ static int update_social_tier (int tier, struct social_one_tier * st,
     return st->connections.storage_size;
 }
 
-time_t update_social (struct social_info * soc, int update_seconds)
+static void add_sender (struct social_info * soc, int index,
+                        const unsigned char * address, int nbits,
+                        keyset k, int bc_index)
 {
-  static int only_print_if_new = 0;
-  int free_bytes = soc->max_bytes;
-  int i;
-  for (i = 1; i < MAX_SOCIAL_TIER; i++) {  /* skip social level 0 */
-    free_bytes -= update_social_tier (i, soc->info + i, free_bytes, soc->log);
-    print_social_tier (i, soc->info + i, only_print_if_new, soc->log);
+  struct sender_key * sk = soc->senders + index;
+  memcpy (sk->address, address, ADDRESS_SIZE);
+  sk->nbits = nbits;
+  sk->k = k;
+  sk->bc_index = bc_index;
+  if (nbits >= 8) {
+    sk->next = soc->sender_buckets [address [0]];
+    soc->sender_buckets [address [0]] = index;
+  } else {
+    sk->next = soc->short_senders;
+    soc->short_senders = index;
   }
-  only_print_if_new = 1;
-  return (time (NULL) + update_seconds);
 }
 
-/* returns 1 if this message is from my contact, and 0 otherwise */
-static int is_my_contact (char * message, int msize,
-                          unsigned char * sender, int bits,
-                          int algo, char * sig, int ssize,
-                          struct allnet_log * log)
+/* rebuild the index of sender addresses from the contacts and broadcast
+ * keys, and clear the verification results, which may no longer be valid */
+static void update_senders (struct social_info * soc)
 {
+  memset (soc->sig_cache, 0, SIG_CACHE_SIZE * sizeof (struct sig_cache_entry));
+  soc->keys_changes = keys_change_count ();
+  if (soc->senders != NULL)
+    free (soc->senders);
+  soc->senders = NULL;
+  soc->num_senders = 0;
+  int b;
+  for (b = 0; b < SENDER_BUCKETS; b++)
+    soc->sender_buckets [b] = -1;
+  soc->short_senders = -1;
   char ** contacts = NULL;
   int nc = all_contacts (&contacts);
+  struct bc_key_info * bc = NULL;
+  int nbc = get_other_keys (&bc);
+  soc->bc_keys = bc;
+  soc->num_bc_keys = nbc;
+  /* count the keysets so we know how much space to allocate */
+  int count = nbc;
   int ic;
+  for (ic = 0; ic < nc; ic++) {
+    keyset * keysets = NULL;
+    int nk = all_keys (contacts [ic], &keysets);
+    if (nk > 0) {
+      count += nk;
+      free (keysets);
+    }
+  }
+  if (count > 0)
+    soc->senders = malloc_or_fail (count * sizeof (struct sender_key),
+                                   "social update_senders");
+  int index = 0;
   for (ic = 0; ic < nc; ic++) {
     keyset * keysets = NULL;
     int nk = all_keys (contacts [ic], &keysets);
     int ink;
-    for (ink = 0; ink < nk; ink++) {
+    for (ink = 0; (ink < nk) && (index < count); ink++) {
       unsigned char address [ADDRESS_SIZE];
+      memset (address, 0, sizeof (address));
       int na_bits = get_remote (keysets [ink], address);
       allnet_rsa_pubkey key;
-      int ksize = get_contact_pubkey (keysets [ink], &key);
-      if ((ksize > 0) && (matches (sender, bits, address, na_bits) > 0) &&
-          (allnet_verify (message, msize, sig, ssize, key))) {
-        snprintf (log->b, LOG_SIZE, "verified from contact %d %d\n", ic, ink);
-        log_print (log);
-        free (keysets);
-        return 1;
-      }
+      if (get_contact_pubkey (keysets [ink], &key) > 0)
+        add_sender (soc, index++, address, na_bits, keysets [ink], -1);
     }
     if ((nk > 0) && (keysets != NULL))
       free (keysets);
   }
   if ((nc > 0) && (contacts != NULL))
     free (contacts);
+  int ibc;
+  for (ibc = 0; (ibc < nbc) && (index < count); ibc++)
+    add_sender (soc, index++, (unsigned char *) (bc [ibc].address),
+                ADDRESS_BITS, -1, ibc);
+  soc->num_senders = index;
+}
 
-  struct bc_key_info * bc;
+/* contacts and keys may be added at any time, and packets from a new
+ * contact should be accepted right away, not after the next update_social */
+static void update_senders_if_changed (struct social_info * soc)
+{
+  struct bc_key_info * bc = NULL;
   int nbc = get_other_keys (&bc);
-  int ibc;
-  for (ibc = 0; ibc < nbc; ibc++) {
-    if ((matches (sender, bits,
-                  (unsigned char *) (bc [ibc].address), ADDRESS_BITS) > 0) &&
-        (allnet_verify (message, msize, sig, ssize, bc [ibc].pub_key))) {
-      snprintf (log->b, LOG_SIZE, "verified from bc contact %d\n", ibc);
-      log_print (log);
-      return 1;
+  if ((soc->keys_changes != keys_change_count ()) ||
+      (soc->num_bc_keys != nbc) || (soc->bc_keys != bc))
+    update_senders (soc);
+}
+
+time_t update_social (struct social_info * soc, int update_seconds)
+{
+  static int only_print_if_new = 0;
+  int free_bytes = soc->max_bytes;
+  int i;
+  for (i = 1; i < MAX_SOCIAL_TIER; i++) {  /* skip social level 0 */
+    free_bytes -= update_social_tier (i, soc->info + i, free_bytes, soc->log);
+    print_social_tier (i, soc->info + i, only_print_if_new, soc->log);
+  }
+  only_print_if_new = 1;
+  update_senders (soc);
+  return (time (NULL) + update_seconds);
+}
+
+/* adds index to candidates if it is among the max best matches so far,
+ * keeping candidates sorted by decreasing match_bits */
+static void add_candidate (int index, int m, int * candidates,
+                           int * match_bits, int * count, int max)
+{
+  if ((m <= 0) || ((*count >= max) && (m <= match_bits [max - 1])))
+    return;
+  int pos = ((*count < max) ? (*count)++ : max - 1);
+  while ((pos > 0) && (match_bits [pos - 1] < m)) {
+    match_bits [pos] = match_bits [pos - 1];
+    candidates [pos] = candidates [pos - 1];
+    pos--;
+  }
+  match_bits [pos] = m;
+  candidates [pos] = index;
+}
+
+/* fills in candidates with the indices of up to max senders that match
+ * the given address, with the longest matches first.
+ * returns the number of candidates */
+static int find_senders (struct social_info * soc,
+                         unsigned char * sender, int bits,
+                         int * candidates, int max)
+{
+  int match_bits [MAX_SENDER_CANDIDATES];
+  int count = 0;
+  int index;
+  if (bits < 8) {   /* sender could match any address */
+    for (index = 0; index < soc->num_senders; index++)
+      add_candidate (index, matches (sender, bits, soc->senders [index].address,
+                                     soc->senders [index].nbits),
+                     candidates, match_bits, &count, max);
+    return count;
+  }
+  for (index = soc->short_senders; index >= 0;
+       index = soc->senders [index].next)
+    add_candidate (index, matches (sender, bits, soc->senders [index].address,
+                                   soc->senders [index].nbits),
+                   candidates, match_bits, &count, max);
+  for (index = soc->sender_buckets [sender [0]]; index >= 0;
+       index = soc->senders [index].next)
+    add_candidate (index, matches (sender, bits, soc->senders [index].address,
+                                   soc->senders [index].nbits),
+                   candidates, match_bits, &count, max);
+  return count;
+}
+
+static void sig_digest (char * message, int msize,
+                        unsigned char * sender, int bits,
+                        char * sig, int ssize, char * digest)
+{
+  char buffer [SIG_DIGEST_SIZE * 2 + ADDRESS_SIZE + 1];
+  sha512_bytes (message, msize, buffer, SIG_DIGEST_SIZE);
+  sha512_bytes (sig, ssize, buffer + SIG_DIGEST_SIZE, SIG_DIGEST_SIZE);
+  memset (buffer + 2 * SIG_DIGEST_SIZE, 0, ADDRESS_SIZE);
+  memcpy (buffer + 2 * SIG_DIGEST_SIZE, sender, (bits + 7) / 8);
+  buffer [2 * SIG_DIGEST_SIZE + ADDRESS_SIZE] = (char) bits;
+  sha512_bytes (buffer, sizeof (buffer), digest, SIG_DIGEST_SIZE);
+}
+
+/* returns 1 if this message is from my contact, and 0 otherwise */
+static int is_my_contact (struct social_info * soc,
+                          char * message, int msize,
+                          unsigned char * sender, int bits,
+                          int algo, char * sig, int ssize,
+                          struct allnet_log * log)
+{
+  if (bits > ADDRESS_BITS)
+    bits = ADDRESS_BITS;
+  update_senders_if_changed (soc);
+  char digest [SIG_DIGEST_SIZE];
+  sig_digest (message, msize, sender, bits, sig, ssize, digest);
+  struct sig_cache_entry * cached =
+    soc->sig_cache + (readb32 (digest) & (SIG_CACHE_SIZE - 1));
+  if (memcmp (cached->digest, digest, SIG_DIGEST_SIZE) == 0)
+    return cached->valid;
+  int candidates [MAX_SENDER_CANDIDATES];
+  int nc = find_senders (soc, sender, bits, candidates, soc->max_check);
+  /* collect the candidates' keys, then verify them all at once */
+  allnet_rsa_pubkey keys [MAX_SENDER_CANDIDATES];
+  int key_candidates [MAX_SENDER_CANDIDATES];
+  int nkeys = 0;
+  struct bc_key_info * bc = NULL;
+  int nbc = -1;  /* only call get_other_keys if needed */
+  int ic;
+  for (ic = 0; ic < nc; ic++) {
+    struct sender_key * sk = soc->senders + candidates [ic];
+    if (sk->k >= 0) {
+      if (get_contact_pubkey (sk->k, keys + nkeys) > 0)
+        key_candidates [nkeys++] = candidates [ic];
+    } else {
+      if (nbc < 0)
+        nbc = get_other_keys (&bc);
+      if (sk->bc_index < nbc) {
+        keys [nkeys] = bc [sk->bc_index].pub_key;
+        key_candidates [nkeys++] = candidates [ic];
+      }
     }
   }
-  return 0;
+  int valid = 0;
+  int found = allnet_verify_many (message, msize, sig, ssize, keys, nkeys);
+  if (found >= 0) {
+    struct sender_key * sk = soc->senders + key_candidates [found];
+    if (sk->k >= 0)
+      snprintf (log->b, LOG_SIZE, "verified from contact keyset %d\n",
+                sk->k);
+    else
+      snprintf (log->b, LOG_SIZE, "verified from bc contact %d\n",
+                sk->bc_index);
+    log_print (log);
+    valid = 1;
+  }
+  memcpy (cached->digest, digest, SIG_DIGEST_SIZE);
+  cached->valid = valid;
+  return valid;
 }
 
 /* checks the signature, and sets valid accordingly.
@@ -213,7 +427,8 @@ int social_connection (struct social_info * soc, char * vmessage, int vsize,
   if (algo == ALLNET_SIGTYPE_NONE)
     return UNKNOWN_SOCIAL_TIER;
   *valid = 0;
-  if (is_my_contact (vmessage, vsize, src, sbits, algo, sig, ssize, soc->log)) {
+  if (is_my_contact (soc, vmessage, vsize, src, sbits, algo, sig, ssize,
+                     soc->log)) {
     *valid = 1;
     return 1;
   }
@@ -629,6 +629,8 @@ static int handle_packet (const char * message, int msize, int reply_only,
 #endif /* DEBUG */
   if (!dec_handle_data (buf, bufsize))
     return -1;
+  /* compute the key stream for the next frame before it arrives */
+  allnet_stream_precompute (&data.enc_state, bufsize);
   return 1;
 }
 
@@ -952,6 +954,8 @@ static void enc_main_loop (struct allnet_log * alog)
         fprintf (stderr, "voa: failed to create packet\n");
         term = -1;
       }
+      /* compute the key stream for the next frame while waiting for it */
+      allnet_stream_precompute (&data.enc_state, (int) info.size);
 
       gst_buffer_unmap (buffer, &info);
       gst_sample_unref (sample);
@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -602,19 +603,30 @@ print_buffer (dest, len, s, 40, 1);
 #undef MESSAGE_ARRAY_HEADER_SIZE
 }
 
-static void gui_get_messages (char * message, int64_t length, int gui_sock)
+static void gui_get_messages (char * message, int64_t length, int code,
+                              int gui_sock)
 {
 /* message format: 64-bit max, contact name (not null terminated) */
 /* max is zero to request all messages */
+/* for GUI_GET_MESSAGES_BEFORE, the max is followed by the 64-bit time and
+ * 64-bit sequence number of the last message of the previous page (or 0
+ * and 0 for the first page), and only older messages are returned */
 /* reply format: 1-byte code, 64-bit number of messages, messages each
  * in the format shown under gui_send_result_messages */
   char reply_header [9];
-  reply_header [0] = GUI_GET_MESSAGES;
+  reply_header [0] = code;
   writeb64 (reply_header + 1, 0);   /* in case of failure */
-  if (length >= 9) {
+  int header_size = ((code == GUI_GET_MESSAGES_BEFORE) ? 24 : 8);
+  if (length > header_size) {
     int64_t max = readb64 (message);
-    message += 8;
-    length -= 8;
+    uint64_t before_time = 0;
+    uint64_t before_seq = 0;
+    if (code == GUI_GET_MESSAGES_BEFORE) {
+      before_time = readb64 (message + 8);
+      before_seq = readb64 (message + 16);
+    }
+    message += header_size;
+    length -= header_size;
     char * contact = contact_name_from_buffer (message, length);
     keyset * k = NULL;
     int nk = all_keys (contact, &k);
@@ -629,18 +641,25 @@ static void gui_get_messages (char * message, int64_t length, int gui_sock)
     if (k != NULL)
       free (k);
     if (nk > 0) {  /* contact exists */
-      /* for now, use list_all_messages.  Later, modify list_all_messages
-       * to accept a maximum number of messages */
       struct message_store_info * msgs = NULL;
       int num_alloc = 0;
       int num_used = 0;
-      if (list_all_messages (contact, &msgs, &num_alloc, &num_used)) {
-        int nresult = num_used;
-        if ((max > 0) && (nresult > max))
-          nresult = max;
-        gui_send_result_messages (GUI_GET_MESSAGES, msgs, nresult,
-                                  gui_sock, latest);
+      int success = 0;
+      /* only read all the messages if all of them are wanted */
+      if ((max > 0) || (code == GUI_GET_MESSAGES_BEFORE)) {
+        if ((max <= 0) || (max > INT_MAX))
+          max = INT_MAX;
+        success = list_messages_before (contact, before_time, before_seq,
+                                        (int) max, &msgs, &num_alloc,
+                                        &num_used);
+      } else {
+        success = list_all_messages (contact, &msgs, &num_alloc, &num_used);
+      }
+      if (success) {
+        gui_send_result_messages (code, msgs, num_used, gui_sock, latest);
         free_all_messages (msgs, num_used);
+        if (msgs != NULL)
+          free (msgs);
         return;
       }
     }
@@ -837,7 +856,8 @@ static void interpret_from_gui (char * message, int64_t length,
     break;
 
   case GUI_GET_MESSAGES:
-    gui_get_messages (message + 1, length - 1, gui_sock);
+  case GUI_GET_MESSAGES_BEFORE:
+    gui_get_messages (message + 1, length - 1, message [0], gui_sock);
     break;
   case GUI_SEND_MESSAGE:
     gui_send_message (message + 1, length - 1, 0, gui_sock, allnet_sock);
@@ -35,6 +35,7 @@
 #define GUI_GET_MESSAGES			40
 #define GUI_SEND_MESSAGE			41
 #define GUI_SEND_BROADCAST			42
+#define GUI_GET_MESSAGES_BEFORE			43  /* one page at a time */
 
 #define GUI_KEY_EXCHANGE			50
 #define GUI_SUBSCRIBE				51
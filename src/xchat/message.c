@@ -22,6 +22,8 @@
 #include <string.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 #ifdef CHECK_ASSERTIONS
 #include <assert.h>
 #endif /* CHECK_ASSERTIONS */
@@ -33,6 +35,7 @@
 #include "lib/util.h"
 #include "lib/keys.h"
 #include "lib/sha.h"
+#include "lib/configfiles.h"
 
 /* return the lowest unused counter, used as sequence number when sending
  * messages to this contact.  returns 0 if the contact cannot be found */
@@ -82,31 +85,16 @@ static uint64_t find_ack (const char * contact, keyset k, const char * wanted,
 {
   if (report_ack_found != NULL)
     *report_ack_found = 0;
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
-    return 0;
-  int type;
   uint64_t seq = 0;
-  char ack [MESSAGE_ID_SIZE];
-  int ack_found = 0;
-  while ((type = prev_message (iter, &seq, NULL, NULL, NULL, ack, NULL, NULL))
-         != MSG_TYPE_DONE) {
-    if ((type == wtype) && (same_message_id (wanted, ack))) {
-      free_iter (iter);
-      if (wtype == MSG_TYPE_ACK) { /* seq is not set */
-        return 1;
-      } else {
-        if (report_ack_found != NULL)
-          *report_ack_found = ack_found;
-        return seq;
-      }
-    } else if ((wtype != MSG_TYPE_ACK) && (type == MSG_TYPE_ACK) &&
-               (same_message_id (wanted, ack))) {
-      ack_found = 1;
-    }
-  }
-  free_iter (iter);
-  return 0;  /* not found */
+  if (find_ack_record (contact, k, wtype, wanted, &seq, NULL) != wtype)
+    return 0;  /* not found */
+  if (wtype == MSG_TYPE_ACK)
+    return 1;
+  if ((report_ack_found != NULL) &&
+      (find_ack_record (contact, k, MSG_TYPE_ACK, wanted, NULL, NULL) ==
+       MSG_TYPE_ACK))
+    *report_ack_found = 1;
+  return seq;
 }
 
 /* putting null characters in files makes it hard for Java to read the file. */
@@ -143,42 +131,23 @@ void save_outgoing (const char * contact, keyset k, struct chat_descriptor * cp,
  * if there is more than one such message, returns the latest.
  * Also fills in the size, time and message_ack -- message_ack must have
  * at least MESSAGE_ID_SIZE bytes */
-extern int get_outgoing_show_debug;
-int get_outgoing_show_debug = 0;
 char * get_outgoing (const char * contact, keyset k, uint64_t seq,
                      int * size, uint64_t * time, char * message_ack)
 {
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)  /* non-existent contact or no messages */
-    return NULL;
-  int type;
-  uint64_t mseq;
   uint64_t mtime;
-  int msize;
   int tz;
+  int msize;
   char * result = NULL;
-  while ((type = prev_message (iter, &mseq, &mtime, &tz, NULL, message_ack,
-          &result, &msize)) != MSG_TYPE_DONE) {
-if ((get_outgoing_show_debug) && (type == MSG_TYPE_SENT) && (strcmp (contact, "edo-on-celine") == 0))
-printf ("get_outgoing (%" PRIu64 "): type %d, seq %" PRIu64 ", message '%s'\n",
-seq, MSG_TYPE_SENT, mseq, result);
-    if ((type == MSG_TYPE_SENT) && (mseq == seq)) { /* found */
-      if (time != NULL)
-        *time = make_time_tz (mtime, tz);
-      if (size != NULL)
-        *size = msize;
-      free_iter (iter);
-      return result;
-    }
-    if (result != NULL)
-      free (result);   /* not found, try again */
-    result = NULL;
-  }
-  free_iter (iter);
-  return NULL;
+  if (find_seq_record (contact, k, MSG_TYPE_SENT, seq, &mtime, &tz, NULL,
+                       message_ack, &result, &msize) != MSG_TYPE_SENT)
+    return NULL;
+  if (time != NULL)
+    *time = make_time_tz (mtime, tz);
+  if (size != NULL)
+    *size = msize;
+  return result;
 }
 
-/* forward declaration, implemented below */
 static void add_to_message_id_cache (char * ack);
 
 /* save a received message */
@@ -262,6 +231,151 @@ uint64_t ack_received (const char * message_ack, char ** contact, keyset * kset,
   return 0;
 }
 
+/* the received and the acked sequence numbers of the most recently used
+ * keysets are cached as sets of ranges, so was_received, get_missing, and
+ * get_unacked do not have to look up each sequence number in the store.
+ * each set is updated with only the messages saved since it was last used */
+struct seq_range {
+  uint64_t first;
+  uint64_t last;
+};
+
+struct seq_set {   /* sorted, disjoint, and non-adjacent ranges */
+  struct seq_range * ranges;
+  int used;
+  int alloc;
+  uint64_t log_id;     /* for store_seqs_since */
+  uint64_t position;
+};
+
+struct seq_cache_entry {
+  keyset k;            /* -1 if not used */
+  struct seq_set received;
+  struct seq_set acked;
+  uint64_t last_used;
+};
+
+#define SEQ_CACHE_SIZE	64
+static struct seq_cache_entry seq_cache [SEQ_CACHE_SIZE];
+static int seq_cache_used = 0;
+static uint64_t seq_cache_clock = 0;
+/* may be acquired before the store's own locks, but not after */
+static pthread_mutex_t seq_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* returns the index of the first range with last >= seq, or s->used */
+static int seq_set_find (struct seq_set * s, uint64_t seq)
+{
+  int low = 0;
+  int high = s->used;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (s->ranges [middle].last < seq)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+static int seq_set_contains (struct seq_set * s, uint64_t seq)
+{
+  int i = seq_set_find (s, seq);
+  return ((i < s->used) && (s->ranges [i].first <= seq));
+}
+
+static void seq_set_add (struct seq_set * s, uint64_t seq)
+{
+  int i = seq_set_find (s, seq);
+  if ((i < s->used) && (s->ranges [i].first <= seq))
+    return;   /* already in the set */
+  int extends_prev = ((i > 0) && (s->ranges [i - 1].last + 1 == seq));
+  int extends_next = ((i < s->used) && (s->ranges [i].first == seq + 1));
+  if (extends_prev && extends_next) {   /* merge the two ranges */
+    s->ranges [i - 1].last = s->ranges [i].last;
+    memmove (s->ranges + i, s->ranges + i + 1,
+             (s->used - (i + 1)) * sizeof (struct seq_range));
+    s->used--;
+  } else if (extends_prev) {
+    s->ranges [i - 1].last = seq;
+  } else if (extends_next) {
+    s->ranges [i].first = seq;
+  } else {
+    if (s->used >= s->alloc) {
+      int new_alloc = ((s->alloc > 0) ? (s->alloc * 2) : 10);
+      struct seq_range * new_ranges =
+        realloc (s->ranges, new_alloc * sizeof (struct seq_range));
+      if (new_ranges == NULL) {
+        printf ("seq_set_add unable to allocate %d ranges\n", new_alloc);
+        return;
+      }
+      s->ranges = new_ranges;
+      s->alloc = new_alloc;
+    }
+    memmove (s->ranges + i + 1, s->ranges + i,
+             (s->used - i) * sizeof (struct seq_range));
+    s->ranges [i].first = seq;
+    s->ranges [i].last = seq;
+    s->used++;
+  }
+}
+
+static void seq_set_clear (struct seq_set * s)
+{
+  s->used = 0;
+  s->log_id = 0;
+  s->position = 0;
+}
+
+/* returns the up-to-date set of received (MSG_TYPE_RCVD) or acked
+ * (MSG_TYPE_ACK) sequence numbers for this keyset.
+ * must be called with seq_cache_mutex held */
+static struct seq_set * get_seq_set (const char * contact, keyset k, int type)
+{
+  struct seq_cache_entry * entry = NULL;
+  int i;
+  for (i = 0; (i < seq_cache_used) && (entry == NULL); i++)
+    if (seq_cache [i].k == k)
+      entry = seq_cache + i;
+  if (entry == NULL) {
+    if (seq_cache_used < SEQ_CACHE_SIZE) {
+      entry = seq_cache + (seq_cache_used++);
+      memset (entry, 0, sizeof (struct seq_cache_entry));
+    } else {   /* replace the least recently used, keeping its ranges */
+      entry = seq_cache;
+      for (i = 1; i < SEQ_CACHE_SIZE; i++)
+        if (seq_cache [i].last_used < entry->last_used)
+          entry = seq_cache + i;
+      seq_set_clear (&(entry->received));
+      seq_set_clear (&(entry->acked));
+    }
+    entry->k = k;
+  }
+  entry->last_used = ++seq_cache_clock;
+  struct seq_set * set =
+    ((type == MSG_TYPE_RCVD) ? &(entry->received) : &(entry->acked));
+  uint64_t * seqs = NULL;
+  int replaced = 0;
+  int count = store_seqs_since (contact, k, type, &(set->log_id),
+                                &(set->position), &seqs, &replaced);
+  if (replaced)
+    set->used = 0;
+  for (i = 0; i < count; i++)
+    seq_set_add (set, seqs [i]);
+  if (seqs != NULL)
+    free (seqs);
+  return set;
+}
+
+/* returns 1 if this sequence number has been received, 0 otherwise */
+int was_received (const char * contact, keyset k, uint64_t wanted)
+{
+  pthread_mutex_lock (&seq_cache_mutex);
+  int result = seq_set_contains (get_seq_set (contact, k, MSG_TYPE_RCVD),
+                                 wanted);
+  pthread_mutex_unlock (&seq_cache_mutex);
+  return result;
+}
+
 static uint64_t max_seq (const char * contact, keyset k, int wanted)
 {
   return highest_seq_value (contact, k, wanted);
@@ -288,13 +402,30 @@ char * get_missing (const char * contact, keyset k, int * singles, int * ranges)
   char ranges_first [MAX_MISSING] [COUNTER_SIZE];
   char ranges_last [MAX_MISSING] [COUNTER_SIZE];
   unsigned int ranges_used = 0;
-  uint64_t i;
-  for (i = last - 1; i > 0; i--) {
-    if (! was_received (contact, k, i)) {
+  uint64_t i = last - 1;
+  pthread_mutex_lock (&seq_cache_mutex);
+  struct seq_set * received = get_seq_set (contact, k, MSG_TYPE_RCVD);
+  /* r is the range that has i, or the highest range below i */
+  int r = seq_set_find (received, i);
+  if ((r >= received->used) || (received->ranges [r].first > i))
+    r--;
+  int full = 0;
+  while ((i > 0) && (! full)) {
+    if ((r >= 0) && (received->ranges [r].last >= i)) {  /* received */
+      if (received->ranges [r].first == 0)
+        break;
+      i = received->ranges [r].first - 1;
+      r--;
+      continue;
+    }
+    /* we have not received any of bottom..i */
+    uint64_t bottom = ((r >= 0) ? (received->ranges [r].last + 1) : 1);
+    for ( ; (i >= bottom) && (i > 0); i--) {
       if ((ranges_used > 0) &&
           (i + 1 == readb64 (&(ranges_first [ranges_used - 1] [0])))) {
-        /* i extends the latest range */
-        writeb64 (&(ranges_first [ranges_used - 1] [0]), i);
+        /* i extends the latest range, and so does the rest of the gap */
+        writeb64 (&(ranges_first [ranges_used - 1] [0]), bottom);
+        i = bottom;
       } else if ((singles_used > 0) && (ranges_used < MAX_MISSING) &&
                  (i + 1 == readb64 (singles_values [singles_used - 1]))) {
         /* replace a single with a range */
@@ -310,10 +441,12 @@ char * get_missing (const char * contact, keyset k, int * singles, int * ranges)
       } else {   /* singles_used >= MAX_MISSING, done */
 /* note: could save a single as a range.  Not clear that this
  * is very useful, so just keeping the code simple here */
+        full = 1;
         break;
       }
     }
   }
+  pthread_mutex_unlock (&seq_cache_mutex);
   if ((singles_used == 0) && (ranges_used == 0))
     return NULL;
   *singles = singles_used;
@@ -511,15 +644,36 @@ char * get_unacked (const char * contact, keyset k, int * singles, int * ranges)
   uint64_t last = max_seq (contact, k, MSG_TYPE_SENT);
   if (last < 1)
     return NULL;
+  /* copy the acked ranges, so the cache is not locked while reading
+   * the unacked messages */
+  pthread_mutex_lock (&seq_cache_mutex);
+  struct seq_set * acked_set = get_seq_set (contact, k, MSG_TYPE_ACK);
+  int num_acked = acked_set->used;
+  struct seq_range * acked = NULL;
+  if (num_acked > 0)
+    acked = memcpy_malloc (acked_set->ranges,
+                           num_acked * sizeof (struct seq_range),
+                           "get_unacked");
+  pthread_mutex_unlock (&seq_cache_mutex);
 /* the current implementation is quite simple and only returns singles */
 #define MAX_UNACKED	MAX_MISSING
   result = malloc_or_fail (MAX_UNACKED * COUNTER_SIZE, "get_unacked");
   int unacked = 0;
   uint64_t i;
+  int r = num_acked - 1;   /* the highest acked range that may have i */
   unsigned long long int now = allnet_time ();
   for (i = last; i > 0; i--) {
+    while ((r >= 0) && (acked [r].first > i))
+      r--;
+    if ((r >= 0) && (acked [r].last >= i)) {   /* skip the acked range */
+      i = acked [r].first;
+      if (i == 0)
+        break;
+      continue;
+    }
     uint64_t mtime = 0;
-    if (! is_acked_one (contact, k, i, &mtime)) {
+    if (find_seq_record (contact, k, MSG_TYPE_SENT, i, &mtime, NULL, NULL,
+                         NULL, NULL, NULL) == MSG_TYPE_SENT) {
       uint64_t age = ((now > mtime) ? (now - mtime) : 0);
       long long int selected = random_int (0, age);
 #define ONE_WEEK_SECONDS	(60 * 60 * 24 * 7)
@@ -529,6 +683,8 @@ char * get_unacked (const char * contact, keyset k, int * singles, int * ranges)
          writeb64 (result + unacked * COUNTER_SIZE, i);
          unacked++;
          if (unacked >= MAX_UNACKED) {
+           if (acked != NULL)
+             free (acked);
            *singles = unacked;
            add_to_unacked_cache (contact, k, *singles, *ranges, result);
            return result;
@@ -536,6 +692,8 @@ char * get_unacked (const char * contact, keyset k, int * singles, int * ranges)
       }
     }
   }
+  if (acked != NULL)
+    free (acked);
   if (unacked == 0) {   /* everything has been acked for this contact and key */
     free (result);
     add_to_unacked_cache (contact, k, *singles, *ranges, NULL);
@@ -605,219 +763,162 @@ int is_acked (const char * contact, uint64_t seq)
 int is_acked_one (const char * contact, keyset k, uint64_t wanted,
                   uint64_t * timep)
 {
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
-    return 0;
-  int type;
-  uint64_t seq;
   char ack [MESSAGE_ID_SIZE];
-  while ((type = prev_message (iter, &seq, timep, NULL, NULL, ack, NULL, NULL))
-         != MSG_TYPE_DONE) {
-    if ((type == MSG_TYPE_SENT) && (seq == wanted)) {
-/* this is the first (most recent) message sent with this sequence number.
+/* find the most recent message sent with this sequence number.
  * we simply report whether this one has been acked -- the others are not
  * so important */
-      uint64_t result_seq = find_ack (contact, k, ack, MSG_TYPE_ACK, NULL);
-      free_iter (iter);
-      return (result_seq > 0);
-    }
-  }
-  free_iter (iter);
-  return 0;
+  if (find_seq_record (contact, k, MSG_TYPE_SENT, wanted, timep, NULL, NULL,
+                       ack, NULL, NULL) != MSG_TYPE_SENT)
+    return 0;
+  return (find_ack (contact, k, ack, MSG_TYPE_ACK, NULL) > 0);
 }
 
-/* if add != 0, and not found, it is added to the cache
- * returns 1 if found in the cache, 0 otherwise, and -1 if the cache is
- * for a different contact or keyset and add is 0. */
-static int is_in_cache (const char * contact, keyset k, uint64_t seq, int add)
+/* the IDs of all received messages, with their acks, are kept in an
+ * open addressing hash table.  The IDs and acks are also appended to
+ * ~/.allnet/xchat/message_ids (STORE_MESSAGE_ID_FILE) by every process
+ * that saves a received message, so the table can be loaded from the
+ * file instead of reading and hashing every saved message.  store.c
+ * removes the file when messages are deleted, and then the file is
+ * rebuilt from the saved messages.  Each new file has a random file ID
+ * after the magic string, so a process can tell when the file has been
+ * replaced even if the new file reuses the inode of the old one */
+#define MESSAGE_ID_FILE_MAGIC		"allnet-msgids-2\n"
+#define MESSAGE_ID_FILE_MAGIC_SIZE	16
+#define MESSAGE_ID_FILE_HEADER_SIZE	(MESSAGE_ID_FILE_MAGIC_SIZE + 8)
+#define MESSAGE_ID_FILE_ENTRY_SIZE	(2 * MESSAGE_ID_SIZE)  /* id, ack */
+#define MESSAGE_ID_READ_ENTRIES		1024   /* entries per read */
+
+struct message_id_entry {
+  char id [MESSAGE_ID_SIZE];
+  char ack [MESSAGE_ID_SIZE];
+  int used;
+};
+
+static struct message_id_entry * message_id_table = NULL;
+static int message_id_table_size = 0;  /* 0 or a power of two */
+static int message_id_count = 0;
+static char * message_id_fname = NULL;
+static uint64_t message_id_file_id = 0;  /* 0 if not read */
+static off_t message_id_file_read = 0; /* bytes of the file in the table */
+static int message_id_file_failed = 0; /* do not rebuild on every call */
+static pthread_mutex_t message_id_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* returns the entry with this ID, or the unused entry where it belongs */
+static struct message_id_entry * find_message_id (const char * id)
 {
-#ifdef DEBUG_PRINT
-  if ((add) && (strcmp (contact, "edo-on-maru") == 0))
-    printf ("for %s/%d adding %" PRIu64 "\n", contact, k, seq);
-#endif /* DEBUG_PRINT */
-/* this cache only supports one contact at a time.  That gives reasonable
- * performance at the beginning, when we are loading the list of contacts,
- * but has some cost when we switch contacts */
-  static char * cached_contact = NULL;
-  static keyset cached_k = -1;
-/* a cache entry consists of the first and last sequence number known. */
-  struct cache_entry {
-    uint64_t first;
-    uint64_t last;
-  };
-  static struct cache_entry * cache = NULL;
-  static int cache_used = 0;
-  static int cache_alloc = 0;
-#ifdef DEBUG_PRINT
-  if ((cache_used > 0) && (cached_contact != NULL)) {
-    printf ("contact '%s'/'%s', seq %ju, add %d, used %d, k %d/%d",
-            cached_contact, contact, (uintmax_t) seq, add, cache_used,
-            cached_k, k);
-    int x;
-    for (x = 0; x < cache_used; x++)
-      printf (", %ju..%ju", (uintmax_t) (cache [x].first),
-              (uintmax_t) (cache [x].last));
-    printf ("\n");
-  }
-#endif /* DEBUG_PRINT */
-  if ((cached_contact == NULL) || (strcmp (contact, cached_contact) != 0) ||
-      (k != cached_k)) {  /* not found */
-    if (add) {  /* initialize or reinitialize */
-#ifdef DEBUG_PRINT
-      printf ("adding %s, keyset %d, seq %ju\n", contact, k, (uintmax_t) seq);
-#endif /* DEBUG_PRINT */
-      if (cached_contact != NULL)
-        free (cached_contact);
-      cached_contact = strcpy_malloc (contact, "message.c is_in_cache contact");
-      cached_k = k;
-      if ((cache_alloc < 1) || (cache == NULL)) {
-        cache_alloc = 10;
-        cache = malloc_or_fail (sizeof (struct cache_entry) * cache_alloc,
-                                "message.c is_in_cache");
-      }
-      cache [0].first = seq;
-      cache [0].last = seq;
-      cache_used = 1;
-      return 0;  /* was not in the cache, even though it is now */
-    } else {
-      return -1; /* different contact, do not add */
-    }
-  }
-  int i;
-  for (i = 0; i < cache_used; i++) {
-    if ((seq >= cache [i].first) && (seq <= cache [i].last)) {
-#ifdef DEBUG_PRINT
-      printf ("returning found\n");
-#endif /* DEBUG_PRINT */
-      return 1;
-    }
-  }
-/* not found, will return 0, perhaps after adding */
-  if (add) {
-    int merge = 0;
-    for (i = 0; i < cache_used; i++) {
-      if (seq + 1 == cache [i].first) {
-        if (add)
-          cache [i].first = seq;
-        else
-          merge = 1;
-        add = 0;
-      }
-      if (cache [i].last + 1 == seq) {
-        if (add)
-          cache [i].last = seq;
-        else
-          merge = 1;
-        add = 0;
-      }
-    }
-    if (merge) {  /* the sequence number is adjacent to at least two entries */
-      /* we may modify cache_used during the loop, so while instead of for */
-      i = 0;
-      while (i + 1 < cache_used) {
-        int j;
-        for (j = i + 1; j < cache_used; j++) {
-          /* in the code that follows, i < j */
-          int merged = 0;
-          if (cache [j].last + 1 == cache [i].first) {
-            cache [i].first = cache [j].first;
-            merged = 1;
-          } else if (cache [i].last + 1 == cache [j].first) {
-            cache [i].last = cache [j].last;
-            merged = 1;
-          }
-          if (merged) {
-/* copy last entry to merged entry.  Harmless even if merged is last entry */
-            cache [j] = cache [cache_used - 1];
-            cache_used = cache_used - 1;
-          }
-        }
-        i++;
-      }
-    } else if (add) {
-      if ((cache_alloc < cache_used + 1) || (cache == NULL)) {
-        cache_alloc = 10 + cache_alloc * 2;  /* cache size only grows */
-        cache = realloc (cache, sizeof (struct cache_entry) * cache_alloc);
-      }
-      cache [cache_used].first = seq;
-      cache [cache_used].last = seq;
-      cache_used++;
-    }
-#ifdef DEBUG_PRINT
-    if (cache_used > 0) {
-      printf (" added '%s' %ju", contact, (uintmax_t)seq);
-    int x;
-    for (x = 0; x < cache_used; x++)
-      printf (", %ju..%ju", (uintmax_t) (cache [x].first),
-              (uintmax_t) (cache [x].last));
-    printf ("\n");
+  int mask = message_id_table_size - 1;
+  /* message IDs are hashes, so any of their bits are a good hash */
+  int i = (int) (readb32 (id) & mask);
+  while ((message_id_table [i].used) &&
+         (memcmp (message_id_table [i].id, id, MESSAGE_ID_SIZE) != 0))
+    i = (i + 1) & mask;
+  return message_id_table + i;
+}
+
+/* returns 1 if added, 0 if already in the table or in case of errors */
+static int insert_message_id (const char * id, const char * ack)
+{
+  /* keep the table at most half full, so searches are short */
+  if ((message_id_count + 1) * 2 > message_id_table_size) {
+    int new_size =
+      ((message_id_table_size > 0) ? (message_id_table_size * 2) : 1024);
+    struct message_id_entry * old_table = message_id_table;
+    int old_size = message_id_table_size;
+    message_id_table = calloc (new_size, sizeof (struct message_id_entry));
+    if (message_id_table == NULL) {
+      printf ("allocation error in insert_message_id: %d entries\n",
+              new_size);
+      message_id_table = old_table;
+      return 0;  /* don't add */
     }
-#endif /* DEBUG_PRINT */
+    message_id_table_size = new_size;
+    int i;
+    for (i = 0; i < old_size; i++)
+      if (old_table [i].used)
+        *(find_message_id (old_table [i].id)) = old_table [i];
+    if (old_table != NULL)
+      free (old_table);
   }
-  return 0;  /* not found */
+  struct message_id_entry * entry = find_message_id (id);
+  if (entry->used)
+    return 0;
+  memcpy (entry->id, id, MESSAGE_ID_SIZE);
+  memcpy (entry->ack, ack, MESSAGE_ID_SIZE);
+  entry->used = 1;
+  message_id_count++;
+  return 1;
 }
 
-/* returns 1 if this sequence number has been received, 0 otherwise */
-int was_received (const char * contact, keyset k, uint64_t wanted)
+static void clear_message_id_table ()
 {
-  int cached = is_in_cache (contact, k, wanted, 0);
-  if (cached >= 0)   /* cache is authoritative */
-    return cached;
-  /* rebuild the cache */
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
-    return 0;
-  int type;
-  uint64_t seq;
-  while ((type = prev_message (iter, &seq, NULL, NULL, NULL, NULL,
-                               NULL, NULL)) != MSG_TYPE_DONE) {
-    if (type == MSG_TYPE_RCVD)
-      is_in_cache (contact, k, seq, 1);  /* add to cache */
-  }
-  free_iter (iter);
-  if (is_in_cache (contact, k, wanted, 0) > 0)
-    return 1;
-  return 0;
+  if (message_id_table != NULL)
+    memset (message_id_table, 0,
+            message_id_table_size * sizeof (struct message_id_entry));
+  message_id_count = 0;
+  message_id_file_read = 0;
 }
 
-static char * message_id_cache = NULL;
-static char * message_ack_cache = NULL;
-static int current_cache_index = 0; /* must multiply by MESSAGE_ID_SIZE */
-static int current_cache_size = 0;  /* in multiples of MESSAGE_ID_SIZE */
+/* must be called with message_id_mutex held */
+static int message_id_file_name ()
+{
+  if (message_id_fname == NULL)
+    config_file_name ("xchat", STORE_MESSAGE_ID_FILE, &message_id_fname);
+  return (message_id_fname != NULL);
+}
 
-static void add_to_message_id_cache (char * ack)
+/* adds to the table any entries appended to the file since it was last
+ * read, or all the entries if the file was replaced.
+ * returns 0 if the file does not exist or is not valid, 1 otherwise */
+static int read_message_id_file ()
 {
-  if (current_cache_index >= current_cache_size) {
-    int total = ((current_cache_size > 0) ? (current_cache_size * 2) : 500);
-    size_t size = total * MESSAGE_ID_SIZE;
-    char * new_ids = realloc (message_id_cache, size);
-    char * new_acks = realloc (message_ack_cache, size); 
-    if ((new_ids == NULL) || (new_acks == NULL)) {
-      printf ("allocation error in add_to_message_id: %zd %d %p/%p %p/%p\n",
-              size, total, new_ids, message_id_cache,
-              new_acks, message_ack_cache);
-      return;  /* don't add */
-    }
-    message_id_cache = new_ids;
-    message_ack_cache = new_acks;
-    current_cache_size = total;
+  if (! message_id_file_name ())
+    return 0;
+  int fd = open (message_id_fname, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  char header [MESSAGE_ID_FILE_HEADER_SIZE];
+  if ((pread (fd, header, sizeof (header), 0) != sizeof (header)) ||
+      (memcmp (header, MESSAGE_ID_FILE_MAGIC, MESSAGE_ID_FILE_MAGIC_SIZE))) {
+    close (fd);
+    return 0;
   }
-  char * idp = message_id_cache + (current_cache_index * MESSAGE_ID_SIZE);
-  char * ackp = message_ack_cache + (current_cache_index * MESSAGE_ID_SIZE);
-  memcpy (ackp, ack, MESSAGE_ID_SIZE);
-  sha512_bytes (ack, MESSAGE_ID_SIZE, idp, MESSAGE_ID_SIZE);
-  current_cache_index++;
+  uint64_t file_id = readb64 (header + MESSAGE_ID_FILE_MAGIC_SIZE);
+  if ((file_id != message_id_file_id) || (message_id_file_read == 0)) {
+    clear_message_id_table ();   /* a different file */
+    message_id_file_id = file_id;
+    message_id_file_read = MESSAGE_ID_FILE_HEADER_SIZE;
+  }
+  /* read whatever has been appended, without needing the file size.
+   * an entry still being appended is read next time */
+  size_t bsize = MESSAGE_ID_READ_ENTRIES * MESSAGE_ID_FILE_ENTRY_SIZE;
+  char * buffer = malloc_or_fail (bsize, "read_message_id_file");
+  ssize_t n;
+  do {
+    n = pread (fd, buffer, bsize, message_id_file_read);
+    int count = ((n > 0) ? ((int) (n / MESSAGE_ID_FILE_ENTRY_SIZE)) : 0);
+    int i;
+    for (i = 0; i < count; i++) {
+      char * entry = buffer + i * MESSAGE_ID_FILE_ENTRY_SIZE;
+      insert_message_id (entry, entry + MESSAGE_ID_SIZE);
+    }
+    message_id_file_read += count * MESSAGE_ID_FILE_ENTRY_SIZE;
+  } while (n == (ssize_t) bsize);
+  free (buffer);
+  close (fd);
+  return 1;
 }
 
-static void fill_message_id_cache ()
+/* add the IDs of all the saved received messages to the table, and save
+ * them to a new file.  The file is locked from before the messages are
+ * read until the new file replaces the old one, so no other process can
+ * append an ID to the old file after the messages were read */
+static void build_message_id_file ()
 {
-  static int initialized = 0;
-  if (initialized)
-    return;
-  initialized = 1;
 #ifdef DEBUG_PRINT
   unsigned long long int start = allnet_time_us ();
 #endif /* DEBUG_PRINT */
+  int lock = store_lock_message_ids ();
+  clear_message_id_table ();
   char ** contacts = NULL;
   int ncontacts = all_contacts (&contacts);
   int icontacts;
@@ -833,7 +934,9 @@ static void fill_message_id_cache ()
         while ((type = prev_message (iter, NULL, NULL, NULL, NULL, ack,
                                      NULL, NULL)) != MSG_TYPE_DONE) {
           if (type == MSG_TYPE_RCVD) {
-            add_to_message_id_cache (ack);
+            char id [MESSAGE_ID_SIZE];
+            sha512_bytes (ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
+            insert_message_id (id, ack);
           }
         }
         free_iter (iter);
@@ -844,42 +947,76 @@ static void fill_message_id_cache ()
   }
   if ((ncontacts > 0) && (contacts != NULL))
     free (contacts);
+  if (! message_id_file_name ()) {
+    store_unlock_message_ids (lock);
+    message_id_file_failed = 1;
+    return;
+  }
+  size_t size = MESSAGE_ID_FILE_HEADER_SIZE +
+                message_id_count * MESSAGE_ID_FILE_ENTRY_SIZE;
+  char * buffer = malloc_or_fail (size, "build_message_id_file");
+  memcpy (buffer, MESSAGE_ID_FILE_MAGIC, MESSAGE_ID_FILE_MAGIC_SIZE);
+  uint64_t file_id = 0;
+  while (file_id == 0) {  /* 0 means not read */
+    char id [8];
+    random_bytes (id, sizeof (id));
+    file_id = readb64 (id);
+  }
+  writeb64 (buffer + MESSAGE_ID_FILE_MAGIC_SIZE, file_id);
+  char * p = buffer + MESSAGE_ID_FILE_HEADER_SIZE;
+  int i;
+  for (i = 0; i < message_id_table_size; i++) {
+    if (message_id_table [i].used) {
+      memcpy (p, message_id_table [i].id, MESSAGE_ID_SIZE);
+      memcpy (p + MESSAGE_ID_SIZE, message_id_table [i].ack, MESSAGE_ID_SIZE);
+      p += MESSAGE_ID_FILE_ENTRY_SIZE;
+    }
+  }
+  /* write a temporary file and rename it, so other processes never
+   * read a partial file */
+  char pid_ext [30];
+  snprintf (pid_ext, sizeof (pid_ext), ".%d", (int) getpid ());
+  char * tmp = strcat_malloc (message_id_fname, pid_ext,
+                              "build_message_id_file");
+  if ((write_file (tmp, buffer, (int) size, 1)) &&
+      (rename (tmp, message_id_fname) == 0)) {
+    message_id_file_id = file_id;
+    message_id_file_read = size;
+  } else {
+    unlink (tmp);
+    message_id_file_failed = 1;
+  }
+  store_unlock_message_ids (lock);
+  free (tmp);
+  free (buffer);
 #ifdef DEBUG_PRINT
-  printf ("fill_message_id_cache took %lluus, %d/%d saved\n",
-  allnet_time_us () - start, current_cache_index, current_cache_size);
+  printf ("build_message_id_file took %lluus, %d/%d saved\n",
+          allnet_time_us () - start, message_id_count, message_id_table_size);
 #endif /* DEBUG_PRINT */
 }
 
-/* returns 1 if this message ID has been saved before, 0 otherwise
- * if it returns 1, also fills message_ack with the corresponding ack */
-static int is_in_message_id_cache (const char * message_id, char * message_ack)
+static void add_to_message_id_cache (char * ack)
 {
-#ifdef DEBUG_PRINT
-  unsigned long long int start = allnet_time_us ();
-#endif /* DEBUG_PRINT */
-  int i;
-  for (i = 0; i < current_cache_index; i++) {
-    if (same_message_id (message_id_cache + (i * MESSAGE_ID_SIZE),
-                         message_id)) {
-      memcpy (message_ack,  /* fill in the message ack */
-              message_ack_cache + (i * MESSAGE_ID_SIZE), MESSAGE_ID_SIZE);
-#ifdef DEBUG_PRINT
-      printf ("is_in_message_id_cache found at %d: ", i);
-      print_buffer (message_id, MESSAGE_ID_SIZE, "id", 100, 0);
-      print_buffer (message_ack, MESSAGE_ID_SIZE, ", ack", 100, 1);
-#endif /* DEBUG_PRINT */
-#ifdef DEBUG_PRINT
-      printf ("call to is_in_message_id_cache took %lluus, result 1/%d\n",
-              allnet_time_us () - start, current_cache_index);
-#endif /* DEBUG_PRINT */
-      return 1;
-    }
+  char entry [MESSAGE_ID_FILE_ENTRY_SIZE];
+  sha512_bytes (ack, MESSAGE_ID_SIZE, entry, MESSAGE_ID_SIZE);
+  memcpy (entry + MESSAGE_ID_SIZE, ack, MESSAGE_ID_SIZE);
+  pthread_mutex_lock (&message_id_mutex);
+  if (message_id_table_size > 0)
+    insert_message_id (entry, ack);
+  /* if the file does not exist, it is built when first needed.
+   * The lock keeps a rebuild from replacing the file between the open
+   * and the write, which would lose this entry */
+  int lock = store_lock_message_ids ();
+  int fd = -1;
+  if (message_id_file_name ())
+    fd = open (message_id_fname, O_WRONLY | O_APPEND);
+  if (fd >= 0) {
+    if (write (fd, entry, sizeof (entry)) != sizeof (entry))
+      perror ("add_to_message_id_cache write");
+    close (fd);
   }
-#ifdef DEBUG_PRINT
-  printf ("call to is_in_message_id_cache took %lluus, result 0/%d\n",
-          allnet_time_us () - start, current_cache_index);
-#endif /* DEBUG_PRINT */
-  return 0;
+  store_unlock_message_ids (lock);
+  pthread_mutex_unlock (&message_id_mutex);
 }
 
 /* returns 1 if this message ID is in the (limited size) saved cache,
@@ -889,7 +1026,18 @@ static int is_in_message_id_cache (const char * message_id, char * message_ack)
  * if it returns 1, also fills message_ack with the corresponding ack */
 int message_id_is_in_saved_cache (const char * message_id, char * message_ack)
 {
-  fill_message_id_cache ();
-  return (is_in_message_id_cache (message_id, message_ack));
+  int result = 0;
+  pthread_mutex_lock (&message_id_mutex);
+  if ((! read_message_id_file ()) && (! message_id_file_failed))
+    build_message_id_file ();
+  if (message_id_table_size > 0) {
+    struct message_id_entry * entry = find_message_id (message_id);
+    if (entry->used) {
+      memcpy (message_ack, entry->ack, MESSAGE_ID_SIZE);
+      result = 1;
+    }
+  }
+  pthread_mutex_unlock (&message_id_mutex);
+  return result;
 }
 
@@ -1,9 +1,15 @@
 /* store.c: provide access to chat messages stored in ~/.allnet/xchat/ */
 /* messages are stored in a directory specific to a contact+keyset pair,
- * in a file that is updated every day.  So a typical message might be
- * stored in ~/.allnet/xchat/20140301044819/20140307, where the first
- * part matches the keyset (found in ~/.allnet/contacts/20140301044819/),
- * and the second part is the date (in UTC) that the chats were stored. */
+ * e.g. ~/.allnet/xchat/20140301044819/, where the directory name matches
+ * the keyset (found in ~/.allnet/contacts/20140301044819/).
+ * the messages are kept in an append-only binary log, xchat.log, and a
+ * sidecar index, xchat.idx, maps sequence numbers and message acks to
+ * offsets in the log, so most lookups do not have to read the log.
+ * before 2026/10, messages were stored as text in a file that was
+ * updated every day, e.g. ~/.allnet/xchat/20140301044819/20140307.txt,
+ * where the file name is the date (in UTC) that the chats were stored.
+ * these files are converted to the log the first time the log is needed,
+ * then moved to the text-backup subdirectory */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +17,7 @@
 #include <unistd.h>
 #include <time.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
 #include <dirent.h>
@@ -39,11 +46,9 @@ struct msg_iter {
   keyset k;
   int is_in_memory;
   /* used in case the data is not already in memory */
-  char * dirname;         /* dynamically allocated */
-  char * current_fname;   /* dynamically allocated */
-  char * current_file;    /* dynamically allocated */
-  uint64_t current_size;
-  int64_t current_pos;
+  char * log;             /* dynamically allocated, the log contents */
+  uint64_t log_size;      /* only complete records, so may be < file size */
+  uint64_t log_pos;       /* start of the last record returned */
   /* used only if the data is already in memory */
   int message_cache_index;
   int last_message_index;
@@ -61,13 +66,29 @@ struct message_cache_record {
 #define MESSAGE_CACHE_NUM_CONTACTS	10000
 static struct message_cache_record message_cache [MESSAGE_CACHE_NUM_CONTACTS];
 static int message_cache_count = 0;
-/* this mutex should be acquired each time before accessing message_cache
+/* this lock should be acquired each time before accessing message_cache
  * or message_cache_count, and released at the end of any related set
- * of accesses */
-static pthread_mutex_t message_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+ * of accesses.  Iterators only read the cache, so they share the lock,
+ * and only save_record and adding a contact need it exclusively */
+static pthread_rwlock_t message_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* incremented by every save_record, so a contact's messages listed without
+ * holding the lock are only cached if no message was saved meanwhile */
+static unsigned long long int message_cache_generation = 0;
+/* the number of save_records that have started but not yet updated the
+ * cache.  Their messages may or may not be in a list made meanwhile */
+static int message_cache_saving = 0;
+static pthread_mutex_t message_cache_saving_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int message_cache_saves_in_progress ()
+{
+  pthread_mutex_lock (&message_cache_saving_mutex);
+  int result = message_cache_saving;
+  pthread_mutex_unlock (&message_cache_saving_mutex);
+  return result;
+}
 
 /* returns -1 if not found */
-/* must be called with the mutex held */
+/* must be called with the lock held */
 static int find_message_cache_record (const char * contact)
 {
   int i;
@@ -78,7 +99,7 @@ static int find_message_cache_record (const char * contact)
 }
 
 /* returns -1 if unable to add, the record index otherwise */
-/* must be called with the mutex held */
+/* must be called with the lock held for writing */
 static int add_message_cache_record (const char * contact,
                                      struct message_store_info * msgs,
                                      int num_alloc,
@@ -113,65 +134,88 @@ static int start_iter_from_file (const char * contact, keyset k,
   result->contact = strcpy_malloc (contact, "start_iter contact");
   result->k = k;
   result->is_in_memory = 0;
-  result->dirname = string_replace_once (directory, "contacts", "xchat", 1);
-  result->current_fname = NULL;
-  result->current_file = NULL;
-  result->current_size = 0;
-  result->current_pos = 0;
+  result->log = NULL;   /* loaded by the first call to prev_message */
+  result->log_size = 0;
+  result->log_pos = 0;
   free (directory);
   return 1;
 }
 
-struct msg_iter * start_iter (const char * contact, keyset k)
+/* returns the index of the contact's messages in message_cache, adding
+ * them if necessary, or -1 if unable to cache, or -2 if unable to list them.
+ * Listing a long conversation takes a while, so it is done without holding
+ * the lock, and only cached if no message was saved in the meantime.  If
+ * messages keep being saved, returns -1, and the caller reads the files */
+static int cache_contact_messages (const char * contact)
 {
-  if ((contact == NULL) || (k < 0))
-    return NULL;
-  pthread_mutex_lock (&message_cache_mutex);
-  int index = find_message_cache_record (contact);
-  struct msg_iter file_iter;
-  if ((index < 0) &&  /* not already cached, get data from files */
-      (message_cache_count < MESSAGE_CACHE_NUM_CONTACTS)) {
+  int attempt;
+  for (attempt = 0; attempt < 3; attempt++) {
+    pthread_rwlock_rdlock (&message_cache_lock);
+    unsigned long long int generation = message_cache_generation;
+    int index = find_message_cache_record (contact);
+    int full = (message_cache_count >= MESSAGE_CACHE_NUM_CONTACTS);
+    pthread_rwlock_unlock (&message_cache_lock);
+    if ((index >= 0) || (full))
+      return ((index >= 0) ? index : -1);
+    if (message_cache_saves_in_progress () > 0) {
+      usleep (1000);  /* give the save a chance to finish */
+      continue;
+    }
     struct message_store_info * msgs = NULL;
     int num_used = 0;
     int num_alloc = 0;
-    int success = list_all_messages (contact, &msgs, &num_alloc, &num_used);
-    if (success) {
+    if (! list_all_messages (contact, &msgs, &num_alloc, &num_used)) {
+      if (msgs != NULL)
+        free (msgs);
+      return -2;   /* unable to list messages, probably no such file */
+    }
+    pthread_rwlock_wrlock (&message_cache_lock);
+    index = find_message_cache_record (contact);
+    int added = 0;
+    if ((index < 0) && (generation == message_cache_generation) &&
+        (message_cache_saves_in_progress () == 0)) {
       index = add_message_cache_record (contact, msgs, num_alloc, num_used);
-      if (index < 0) { /* unable to cache */
-        if ((msgs != NULL) && (num_used > 0))
-          free_all_messages (msgs, num_used);
-        if (! start_iter_from_file (contact, k, &file_iter)) {
-          pthread_mutex_unlock (&message_cache_mutex);
-          return NULL;   /* unable to cache, unable to find file */
-        }
-      }
-    } else {   /* unable to list messages, probably unable to find file */
-      pthread_mutex_unlock (&message_cache_mutex);
-      return NULL;
+      added = (index >= 0);
+    }
+    pthread_rwlock_unlock (&message_cache_lock);
+    if (! added) {  /* cached by another thread, or possibly out of date */
+      free_all_messages (msgs, num_used);
+      if (msgs != NULL)
+        free (msgs);
     }
+    if (index >= 0)
+      return index;
   }
+  return -1;
+}
+
+struct msg_iter * start_iter (const char * contact, keyset k)
+{
+  if ((contact == NULL) || (k < 0))
+    return NULL;
+  int index = cache_contact_messages (contact);
+  if (index == -2)   /* unable to list messages */
+    return NULL;
   /* this code handles messages in cache, whether found or added */
   struct msg_iter * result = malloc_or_fail (sizeof (struct msg_iter),
                                              "start_iter struct");
-  result->contact = strcpy_malloc (contact, "start_iter contact");
-  result->k = k;
   if (index >= 0) {
+    result->contact = strcpy_malloc (contact, "start_iter contact");
+    result->k = k;
     result->is_in_memory = 1;
     result->message_cache_index = index;
+    pthread_rwlock_rdlock (&message_cache_lock);
     result->last_message_index = message_cache [index].num_used;
+    pthread_rwlock_unlock (&message_cache_lock);
     result->ack_returned = 0;
     /* set the other values to reasonable defaults */
-    result->dirname = NULL;
-    result->current_fname = NULL;
-    result->current_file = NULL;
-    result->current_size = 0;
-    result->current_pos = 0;
-  } else { /* unable to cache, use file */
-    /* *result = file_iter -- file_iter is only initialized if
-          (message_cache_count < MESSAGE_CACHE_NUM_CONTACTS) */
-    start_iter_from_file(contact, k, result);
-  }
-  pthread_mutex_unlock (&message_cache_mutex);
+    result->log = NULL;
+    result->log_size = 0;
+    result->log_pos = 0;
+  } else if (! start_iter_from_file (contact, k, result)) {
+    free (result);   /* unable to cache, unable to find file */
+    return NULL;
+  }
   return result;
 }
 
@@ -218,10 +262,21 @@ static int end_ndigits (char * path, unsigned int ndigits, char * ext)
   return (strcmp (name + ndigits, ext) == 0);
 }
 
+/* the text files used before 2026/10 are read backwards with a text_iter,
+ * only to convert them to the log */
+struct text_iter {
+  char * dirname;         /* dynamically allocated */
+  char * current_fname;   /* dynamically allocated */
+  char * current_file;    /* dynamically allocated */
+  uint64_t current_size;
+  int64_t current_pos;
+  int done;
+};
+
 /* returns 1 for success, 0 for failure */
 /* if successful, reads the file contents into memory and updates iter
  */
-static int find_prev_file (struct msg_iter * iter)
+static int find_prev_file (struct text_iter * iter)
 {
   create_dir (iter->dirname);
   DIR * dir = opendir (iter->dirname);
@@ -260,7 +315,7 @@ printf ("debug time: %d\n", 5 / debug);  /* crash */
   }
   closedir (dir);
   if (greatest_less_than_current == NULL) {
-    iter->k = -1;   /* at end, invalidate the iterator */
+    iter->done = 1;   /* at end, invalidate the iterator */
     return 0;
   }
   if (iter->current_fname != NULL)
@@ -295,7 +350,7 @@ static int found_at_line_start (char * p, uint64_t pos, char * pattern)
 #define PATTERN_SENT    "sent id: "
 #define PATTERN_RCVD    "rcvd id: "
 #define PATTERN_ACK     "got ack: "
-static int match_record_start (struct msg_iter * iter)
+static int match_record_start (struct text_iter * iter)
 {
   if (iter->current_pos < 0)
     return 0;
@@ -461,56 +516,1142 @@ static int parse_record (char * record, uint64_t * seq, uint64_t * time,
   return type;
 }
 
-static char * find_prev_record (struct msg_iter * iter)
+static char * find_prev_record (struct text_iter * iter)
+{
+  while (1) {
+    if (iter->done)  /* invalid iterator */
+      return NULL;
+    if (((iter->current_file == NULL) ||  /* at start */
+         (iter->current_pos <= 0)) &&       /* update file */
+        (! find_prev_file (iter)))
+      return NULL;
+    uint64_t record_end_pos = iter->current_pos;
+    /* a record begins with "got ack", "sent id", or "rcvd id". */
+    do {
+      (iter->current_pos)--;
+    } while ((iter->current_pos >= 0) && (! match_record_start (iter)));
+    if ((iter->current_pos >= 0) && (match_record_start (iter))) {
+      int size = (int) (record_end_pos - iter->current_pos);
+      char * result = malloc_or_fail (size + 1, "find_prev_record");
+      memcpy (result, (iter->current_file) + (iter->current_pos), size);
+      result [size] = '\0';
+      return result;
+    }
+    printf ("unable to find any records in file %s\n", iter->current_fname);
+  }
+}
+
+static void set_result (
+   uint64_t * seqp, uint64_t seq, uint64_t * timep, uint64_t time,
+   int * tz_minp, int tz_min, uint64_t * rcvd_timep, uint64_t rcvd_time,
+   char * message_ackp, const char * ack_value,
+   char ** messagep, const char * message, int * msizep, size_t msize)
+{
+  if (seqp != NULL) *seqp = seq;
+  if (timep != NULL) *timep = time;
+  if (tz_minp != NULL) *tz_minp = tz_min;
+  if (rcvd_timep != NULL) *rcvd_timep = rcvd_time;
+  if (message_ackp != NULL)
+    memcpy (message_ackp, ack_value, MESSAGE_ID_SIZE);
+  if (messagep != NULL) {
+    *messagep = NULL;
+    if ((message != NULL) && (msize > 0)) {
+      char * m = malloc_or_fail (msize + 1, "store.c set_result");
+      m [msize] = '\0';  /* so we can print as text, for debugging */
+      memcpy (m, message, msize);
+      *messagep = m;
+    }
+  }
+  if (msizep != NULL) *msizep = (int)msize;
+}
+
+static char * get_xchat_dir (keyset k)
+{
+  char * contact_dir = key_dir (k);
+  if (contact_dir == NULL)
+    return NULL;
+  char * xchat_dir = string_replace_once (contact_dir, "contacts", "xchat", 1);
+  free (contact_dir);
+  return xchat_dir;
+}
+
+static char * get_xchat_path (keyset k, const char * fname)
+{
+  char * xchat_dir = get_xchat_dir (k);  /* must be free'd */
+  if (xchat_dir == NULL)
+    return NULL;
+  char * path = strcat3_malloc (xchat_dir, "/", fname, "find_prev_file");
+  free (xchat_dir);
+  return path;
+}
+
+/* the log begins with STORE_LOG_MAGIC and an 8-byte log ID, followed by
+ * the records.  The log ID is random, and new each time the log is
+ * replaced, so unlike the inode number it is never reused.
+ * each record has a fixed-size header, the message, and a trailer that
+ * repeats the record size, so the log can be read backwards as well as
+ * forwards.  All numbers are big-endian.
+ *    4 bytes   size of the record, including header and trailer
+ *    1 byte    MSG_TYPE_RCVD, MSG_TYPE_SENT, or MSG_TYPE_ACK, then 3 zeros
+ *    8 bytes   sequence number
+ *    8 bytes   sender's time
+ *    4 bytes   sender's time zone in minutes, two's complement
+ *    4 bytes   message size
+ *    8 bytes   time the message (or ack) was received
+ *   16 bytes   message ack (MESSAGE_ID_SIZE)
+ *  msize bytes message
+ *    4 bytes   size of the record */
+#define STORE_LOG_NAME		"xchat.log"
+#define STORE_INDEX_NAME	"xchat.idx"
+#define STORE_TEXT_BACKUP	"text-backup"
+#define STORE_MAGIC_SIZE	16
+#define STORE_LOG_MAGIC		"allnet-xchat-v2\n"
+#define STORE_LOG_HEADER_SIZE	(STORE_MAGIC_SIZE + 8)
+#define STORE_INDEX_MAGIC	"allnet-xindex-3\n"
+#define STORE_HEADER_SIZE	56
+#define STORE_TRAILER_SIZE	4
+#define STORE_OVERHEAD		(STORE_HEADER_SIZE + STORE_TRAILER_SIZE)
+/* no chat message comes close to this, a bigger one means corruption */
+#define STORE_MAX_MESSAGE	(16 * 1024 * 1024)
+
+struct store_record {
+  int type;
+  uint64_t seq;
+  uint64_t time;
+  int tz_min;
+  uint64_t rcvd_time;
+  char ack [MESSAGE_ID_SIZE];
+  const char * message;   /* points into the record, not null terminated */
+  int msize;
+  uint64_t size;          /* of the entire record */
+};
+
+/* returns the record in a malloc'd buffer, and sets *rsize to its size */
+static char * store_encode_record (int type, uint64_t seq, uint64_t time,
+                                   int tz_min, uint64_t rcvd_time,
+                                   const char * ack, const char * message,
+                                   int msize, uint64_t * rsize)
+{
+  if ((message == NULL) || (msize < 0))
+    msize = 0;
+  uint64_t size = STORE_OVERHEAD + msize;
+  char * result = malloc_or_fail (size, "store_encode_record");
+  memset (result, 0, STORE_HEADER_SIZE);
+  writeb32 (result, size);
+  result [4] = type;
+  writeb64 (result + 8, seq);
+  writeb64 (result + 16, time);
+  writeb32 (result + 24, (uint32_t) tz_min);
+  writeb32 (result + 28, msize);
+  writeb64 (result + 32, rcvd_time);
+  if (ack != NULL)
+    memcpy (result + 40, ack, MESSAGE_ID_SIZE);
+  if (msize > 0)
+    memcpy (result + STORE_HEADER_SIZE, message, msize);
+  writeb32 (result + STORE_HEADER_SIZE + msize, size);
+  *rsize = size;
+  return result;
+}
+
+/* returns 1 if the buffer begins with a complete, valid record, 0 otherwise */
+static int store_decode_record (const char * buffer, uint64_t bsize,
+                                struct store_record * r)
+{
+  if (bsize < STORE_OVERHEAD)
+    return 0;
+  uint64_t size = readb32 (buffer);
+  uint64_t msize = readb32 (buffer + 28);
+  if ((size > bsize) || (msize > STORE_MAX_MESSAGE) ||
+      (size != STORE_OVERHEAD + msize) ||
+      (readb32 (buffer + size - STORE_TRAILER_SIZE) != size))
+    return 0;
+  int type = buffer [4];
+  if ((type != MSG_TYPE_RCVD) && (type != MSG_TYPE_SENT) &&
+      (type != MSG_TYPE_ACK))
+    return 0;
+  r->type = type;
+  r->seq = readb64 (buffer + 8);
+  r->time = readb64 (buffer + 16);
+  r->tz_min = (int32_t) readb32 (buffer + 24);
+  r->rcvd_time = readb64 (buffer + 32);
+  memcpy (r->ack, buffer + 40, MESSAGE_ID_SIZE);
+  r->message = buffer + STORE_HEADER_SIZE;
+  r->msize = (int) msize;
+  r->size = size;
+  return 1;
+}
+
+/* returns a malloc'd, null-terminated copy of the message */
+static char * store_copy_message (const struct store_record * r)
+{
+  char * result = malloc_or_fail (r->msize + 1, "store_copy_message");
+  memcpy (result, r->message, r->msize);
+  result [r->msize] = '\0';
+  return result;
+}
+
+/* return 1 if all the bytes were read or written, 0 otherwise */
+static int store_read_at (int fd, char * buffer, uint64_t size,
+                          uint64_t offset)
+{
+  while (size > 0) {
+    ssize_t n = pread (fd, buffer, size, offset);
+    if ((n < 0) && (errno == EINTR))
+      continue;
+    if (n <= 0)
+      return 0;
+    buffer += n;
+    size -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+static int store_write_at (int fd, const char * buffer, uint64_t size,
+                           uint64_t offset)
+{
+  while (size > 0) {
+    ssize_t n = pwrite (fd, buffer, size, offset);
+    if ((n < 0) && (errno == EINTR))
+      continue;
+    if (n <= 0) {
+      perror ("store_write_at pwrite");
+      return 0;
+    }
+    buffer += n;
+    size -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+/* each process keeps in memory the index of each log it uses, sorted
+ * for binary search.  Records appended to the log by any process since
+ * the index was last updated are found by comparing the log size to
+ * indexed_size, and are then added to the index.  The index file is
+ * rewritten every time another STORE_INDEX_SAVE_BYTES of the log have
+ * been indexed, so a new process only has to read the end of the log */
+#define STORE_INDEX_SAVE_BYTES	(64 * 1024)
+
+struct store_seq_entry {   /* only for MSG_TYPE_SENT and MSG_TYPE_RCVD */
+  uint64_t seq;
+  uint64_t offset;
+  uint64_t time;
+  int type;
+};
+
+struct store_ack_entry {   /* for all records */
+  char ack [MESSAGE_ID_SIZE];
+  uint64_t offset;
+  uint64_t seq;
+  uint64_t rcvd_time;
+  int type;
+};
+
+/* the index file has the magic string, the log ID, size, and the number of
+ * seq and ack entries of the log it indexes, then the seq and ack entries.
+ * as in the log, numbers are big-endian, and type is followed by 3 zeros */
+#define STORE_INDEX_HEADER_SIZE	(STORE_MAGIC_SIZE + 24)
+#define STORE_SEQ_ENTRY_SIZE	28	/* seq, offset, time, type */
+#define STORE_ACK_ENTRY_SIZE	44	/* ack, offset, seq, rcvd_time, type */
+
+struct store_index {
+  keyset k;
+  char * log_path;        /* dynamically allocated */
+  char * index_path;      /* dynamically allocated */
+  int migration_checked;  /* only look once for text files to convert */
+  dev_t dev;              /* the log may be replaced by reduce_conversation */
+  ino_t ino;
+  time_t ctime;           /* when dev and ino were last checked */
+  uint64_t log_id;        /* from the log header, 0 if not known */
+  uint64_t indexed_size;  /* 0, or the size of the log covered by the index */
+  uint64_t saved_size;    /* the size of the log covered by the index file */
+  struct store_seq_entry * seqs;  /* sorted by seq, then offset */
+  struct store_seq_entry * times; /* the same, by time, seq, then offset */
+  int num_seqs;                   /* for both seqs and times */
+  int alloc_seqs;
+  struct store_ack_entry * acks;  /* sorted by ack, then offset */
+  int num_acks;
+  int alloc_acks;
+  pthread_mutex_t lock;   /* held while using any of the above */
+  int users;              /* the entry is only replaced if 0 */
+};
+
+#define STORE_INDEX_CACHE_SIZE	1000
+static struct store_index * store_indices [STORE_INDEX_CACHE_SIZE];
+static int store_indices_count = 0;
+/* each index has its own lock, so operations on different keysets do not
+ * wait for each other.  store_index_mutex is only held while finding an
+ * index in store_indices, and while changing the users of an index.
+ * an index lock may be acquired while holding the message cache lock,
+ * but the message cache lock must not be acquired while holding one */
+static pthread_mutex_t store_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void store_reset_index (struct store_index * idx)
+{
+  idx->ctime = 0;
+  idx->log_id = 0;
+  idx->indexed_size = 0;
+  idx->saved_size = 0;
+  idx->num_seqs = 0;
+  idx->num_acks = 0;
+}
+
+static int store_compare_seq (const void * a, const void * b)
+{
+  const struct store_seq_entry * sa = (const struct store_seq_entry *) a;
+  const struct store_seq_entry * sb = (const struct store_seq_entry *) b;
+  if (sa->seq != sb->seq)
+    return ((sa->seq < sb->seq) ? -1 : 1);
+  if (sa->offset != sb->offset)
+    return ((sa->offset < sb->offset) ? -1 : 1);
+  return 0;
+}
+
+static int store_compare_time (const void * a, const void * b)
+{
+  const struct store_seq_entry * sa = (const struct store_seq_entry *) a;
+  const struct store_seq_entry * sb = (const struct store_seq_entry *) b;
+  if (sa->time != sb->time)
+    return ((sa->time < sb->time) ? -1 : 1);
+  return store_compare_seq (a, b);
+}
+
+static int store_compare_ack (const void * a, const void * b)
+{
+  const struct store_ack_entry * aa = (const struct store_ack_entry *) a;
+  const struct store_ack_entry * ab = (const struct store_ack_entry *) b;
+  int c = memcmp (aa->ack, ab->ack, MESSAGE_ID_SIZE);
+  if (c != 0)
+    return c;
+  if (aa->offset != ab->offset)
+    return ((aa->offset < ab->offset) ? -1 : 1);
+  return 0;
+}
+
+/* returns the position of the first of the n sorted entries that
+ * does not compare less than wanted, or n if there is no such entry */
+static int store_lower_bound (const void * entries, int n, size_t esize,
+                              const void * wanted,
+                              int (* compare) (const void *, const void *))
+{
+  const char * p = (const char *) entries;
+  int low = 0;
+  int high = n;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (compare (p + middle * esize, wanted) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+/* entries [0..first_new-1] are sorted, entries [first_new..num-1] are new.
+ * sort the new entries into the others */
+static void store_sort_new (void * entries, int num, int first_new,
+                            size_t esize,
+                            int (* compare) (const void *, const void *))
+{
+  if (num - first_new <= 0)
+    return;
+  if (num - first_new > 16) {  /* e.g. when reading a whole log */
+    qsort (entries, num, esize, compare);
+    return;
+  }
+  char * p = (char *) entries;
+  char entry [sizeof (struct store_ack_entry)];  /* largest entry */
+  int i;
+  for (i = first_new; i < num; i++) {
+    memcpy (entry, p + i * esize, esize);
+    int pos = store_lower_bound (entries, i, esize, entry, compare);
+    memmove (p + (pos + 1) * esize, p + pos * esize, (i - pos) * esize);
+    memcpy (p + pos * esize, entry, esize);
+  }
+}
+
+/* make sure the index has room for at least this many entries */
+static void store_reserve (struct store_index * idx, int seqs, int acks)
+{
+  if (seqs > idx->alloc_seqs) {
+    int count = ((idx->alloc_seqs < 1000) ? 1000 : idx->alloc_seqs);
+    while (count < seqs)
+      count *= 2;
+    idx->seqs = realloc (idx->seqs, count * sizeof (struct store_seq_entry));
+    idx->times = realloc (idx->times, count * sizeof (struct store_seq_entry));
+    if ((idx->seqs == NULL) || (idx->times == NULL)) {
+      perror ("realloc");
+      printf ("store_reserve unable to allocate %d seq entries\n", count);
+      exit (1);
+    }
+    idx->alloc_seqs = count;
+  }
+  if (acks > idx->alloc_acks) {
+    int count = ((idx->alloc_acks < 1000) ? 1000 : idx->alloc_acks);
+    while (count < acks)
+      count *= 2;
+    idx->acks = realloc (idx->acks, count * sizeof (struct store_ack_entry));
+    if (idx->acks == NULL) {
+      perror ("realloc");
+      printf ("store_reserve unable to allocate %d ack entries\n", count);
+      exit (1);
+    }
+    idx->alloc_acks = count;
+  }
+}
+
+/* add the entries for this record to the end of the index.  The caller
+ * must then call store_sort_new */
+static void store_add_entries (struct store_index * idx,
+                               const struct store_record * r, uint64_t offset)
+{
+  store_reserve (idx, idx->num_seqs + 1, idx->num_acks + 1);
+  if ((r->type == MSG_TYPE_SENT) || (r->type == MSG_TYPE_RCVD)) {
+    struct store_seq_entry * s = idx->seqs + idx->num_seqs;
+    s->seq = r->seq;
+    s->offset = offset;
+    s->time = r->time;
+    s->type = r->type;
+    idx->times [idx->num_seqs] = *s;
+    idx->num_seqs++;
+  }
+  struct store_ack_entry * a = idx->acks + idx->num_acks;
+  memcpy (a->ack, r->ack, MESSAGE_ID_SIZE);
+  a->offset = offset;
+  a->seq = r->seq;
+  a->rcvd_time = r->rcvd_time;
+  a->type = r->type;
+  idx->num_acks++;
+}
+
+/* add to the index the records between idx->indexed_size and log_size.
+ * an incomplete record at the end (perhaps still being written) is not
+ * indexed, so indexed_size may be less than log_size afterwards */
+static void store_scan_log (struct store_index * idx, int fd,
+                            uint64_t log_size)
+{
+  uint64_t start = idx->indexed_size;
+  if (log_size <= start)
+    return;
+  uint64_t bsize = log_size - start;
+  char * buffer = malloc_or_fail (bsize, "store_scan_log");
+  if (! store_read_at (fd, buffer, bsize, start)) {
+    printf ("store_scan_log unable to read %s\n", idx->log_path);
+    free (buffer);
+    return;
+  }
+  int first_seq = idx->num_seqs;
+  int first_ack = idx->num_acks;
+  uint64_t pos = 0;
+  struct store_record r;
+  while (store_decode_record (buffer + pos, bsize - pos, &r)) {
+    store_add_entries (idx, &r, start + pos);
+    pos += r.size;
+  }
+  free (buffer);
+  idx->indexed_size = start + pos;
+  store_sort_new (idx->seqs, idx->num_seqs, first_seq,
+                  sizeof (struct store_seq_entry), store_compare_seq);
+  store_sort_new (idx->times, idx->num_seqs, first_seq,
+                  sizeof (struct store_seq_entry), store_compare_time);
+  store_sort_new (idx->acks, idx->num_acks, first_ack,
+                  sizeof (struct store_ack_entry), store_compare_ack);
+}
+
+/* returns 1 if the index file is valid for this log, 0 otherwise */
+static int store_load_index (struct store_index * idx, uint64_t log_id,
+                             uint64_t log_size)
+{
+  char * content = NULL;
+  int csize = read_file_malloc (idx->index_path, &content, 0);
+  if ((csize < STORE_INDEX_HEADER_SIZE) || (content == NULL)) {
+    if (content != NULL)
+      free (content);
+    return 0;
+  }
+  uint64_t indexed = readb64 (content + STORE_MAGIC_SIZE + 8);
+  uint64_t num_seqs = readb32 (content + STORE_MAGIC_SIZE + 16);
+  uint64_t num_acks = readb32 (content + STORE_MAGIC_SIZE + 20);
+  if ((memcmp (content, STORE_INDEX_MAGIC, STORE_MAGIC_SIZE) != 0) ||
+      (readb64 (content + STORE_MAGIC_SIZE) != log_id) ||
+      (indexed < STORE_LOG_HEADER_SIZE) || (indexed > log_size) ||
+      ((uint64_t) csize != STORE_INDEX_HEADER_SIZE +
+                           num_seqs * STORE_SEQ_ENTRY_SIZE +
+                           num_acks * STORE_ACK_ENTRY_SIZE)) {
+    free (content);
+    return 0;
+  }
+  store_reserve (idx, (int) num_seqs, (int) num_acks);
+  const char * p = content + STORE_INDEX_HEADER_SIZE;
+  int i;
+  for (i = 0; i < (int) num_seqs; i++) {
+    idx->seqs [i].seq = readb64 (p);
+    idx->seqs [i].offset = readb64 (p + 8);
+    idx->seqs [i].time = readb64 (p + 16);
+    idx->seqs [i].type = p [24];
+    p += STORE_SEQ_ENTRY_SIZE;
+  }
+  /* the times are not saved, since they are the same entries as seqs */
+  memcpy (idx->times, idx->seqs, num_seqs * sizeof (struct store_seq_entry));
+  qsort (idx->times, num_seqs, sizeof (struct store_seq_entry),
+         store_compare_time);
+  for (i = 0; i < (int) num_acks; i++) {
+    memcpy (idx->acks [i].ack, p, MESSAGE_ID_SIZE);
+    idx->acks [i].offset = readb64 (p + 16);
+    idx->acks [i].seq = readb64 (p + 24);
+    idx->acks [i].rcvd_time = readb64 (p + 32);
+    idx->acks [i].type = p [40];
+    p += STORE_ACK_ENTRY_SIZE;
+  }
+  free (content);
+  idx->num_seqs = (int) num_seqs;
+  idx->num_acks = (int) num_acks;
+  idx->indexed_size = indexed;
+  idx->saved_size = indexed;
+  return 1;
+}
+
+static void store_save_index (struct store_index * idx)
+{
+  uint64_t size = STORE_INDEX_HEADER_SIZE +
+                  idx->num_seqs * STORE_SEQ_ENTRY_SIZE +
+                  idx->num_acks * STORE_ACK_ENTRY_SIZE;
+  char * buffer = malloc_or_fail (size, "store_save_index");
+  memset (buffer, 0, size);
+  memcpy (buffer, STORE_INDEX_MAGIC, STORE_MAGIC_SIZE);
+  writeb64 (buffer + STORE_MAGIC_SIZE, idx->log_id);
+  writeb64 (buffer + STORE_MAGIC_SIZE + 8, idx->indexed_size);
+  writeb32 (buffer + STORE_MAGIC_SIZE + 16, idx->num_seqs);
+  writeb32 (buffer + STORE_MAGIC_SIZE + 20, idx->num_acks);
+  char * p = buffer + STORE_INDEX_HEADER_SIZE;
+  int i;
+  for (i = 0; i < idx->num_seqs; i++) {
+    writeb64 (p, idx->seqs [i].seq);
+    writeb64 (p + 8, idx->seqs [i].offset);
+    writeb64 (p + 16, idx->seqs [i].time);
+    p [24] = idx->seqs [i].type;
+    p += STORE_SEQ_ENTRY_SIZE;
+  }
+  for (i = 0; i < idx->num_acks; i++) {
+    memcpy (p, idx->acks [i].ack, MESSAGE_ID_SIZE);
+    writeb64 (p + 16, idx->acks [i].offset);
+    writeb64 (p + 24, idx->acks [i].seq);
+    writeb64 (p + 32, idx->acks [i].rcvd_time);
+    p [40] = idx->acks [i].type;
+    p += STORE_ACK_ENTRY_SIZE;
+  }
+  /* write a temporary file and rename it, so readers never see a
+   * partially written index */
+  char pid_ext [30];
+  snprintf (pid_ext, sizeof (pid_ext), ".%d", (int) getpid ());
+  char * tmp = strcat_malloc (idx->index_path, pid_ext, "store_save_index");
+  if ((write_file (tmp, buffer, (int) size, 1)) &&
+      (rename (tmp, idx->index_path) == 0))
+    idx->saved_size = idx->indexed_size;
+  else
+    unlink (tmp);
+  free (tmp);
+  free (buffer);
+}
+
+static int store_migrate_text (struct store_index * idx);
+
+/* bring the index up to date with the log, which may have been written
+ * by other processes, or replaced by reduce_conversation */
+/* must be called with idx->lock held */
+static void store_refresh_index (struct store_index * idx)
+{
+  struct stat st;
+  if (stat (idx->log_path, &st) != 0) {
+    store_reset_index (idx);
+    if (idx->migration_checked)
+      return;
+    idx->migration_checked = 1;
+    if ((! store_migrate_text (idx)) || (stat (idx->log_path, &st) != 0))
+      return;
+  }
+  idx->migration_checked = 1;
+  uint64_t log_size = st.st_size;
+  if ((idx->indexed_size > 0) &&
+      ((st.st_dev != idx->dev) || (st.st_ino != idx->ino) ||
+       (log_size < idx->indexed_size)))
+    store_reset_index (idx);  /* the log was replaced */
+  /* writing or replacing the log changes its ctime, so if neither the
+   * size nor the ctime changed, the index is up to date */
+  if ((idx->indexed_size == log_size) && (st.st_ctime == idx->ctime))
+    return;
+  idx->dev = st.st_dev;
+  idx->ino = st.st_ino;
+  idx->ctime = st.st_ctime;
+  int fd = open (idx->log_path, O_RDONLY);
+  if (fd < 0) {
+    perror ("store_refresh_index open");
+    return;
+  }
+  /* a new log may have the inode of one that was replaced, but not
+   * its log ID */
+  char header [STORE_LOG_HEADER_SIZE];
+  if ((! store_read_at (fd, header, sizeof (header), 0)) ||
+      (memcmp (header, STORE_LOG_MAGIC, STORE_MAGIC_SIZE) != 0)) {
+    if (log_size >= STORE_LOG_HEADER_SIZE)
+      printf ("%s is not a valid message log\n", idx->log_path);
+    store_reset_index (idx);
+    close (fd);
+    return;
+  }
+  uint64_t log_id = readb64 (header + STORE_MAGIC_SIZE);
+  if ((idx->indexed_size > 0) && (log_id != idx->log_id))
+    store_reset_index (idx);  /* the log was replaced */
+  idx->log_id = log_id;
+  if (idx->indexed_size == 0)
+    store_load_index (idx, log_id, log_size);
+  if (idx->indexed_size == 0)
+    idx->indexed_size = STORE_LOG_HEADER_SIZE;
+  store_scan_log (idx, fd, log_size);
+  close (fd);
+  if (idx->indexed_size >= idx->saved_size + STORE_INDEX_SAVE_BYTES)
+    store_save_index (idx);
+}
+
+/* returns the up-to-date index for this keyset, locked, or NULL for errors.
+ * the caller must release it with store_unlock_index */
+static struct store_index * store_lock_index (keyset k)
+{
+  struct store_index * idx = NULL;
+  int i;
+  pthread_mutex_lock (&store_index_mutex);
+  for (i = 0; i < store_indices_count; i++) {
+    if (store_indices [i]->k == k) {
+      idx = store_indices [i];
+      break;
+    }
+  }
+  if (idx == NULL) {
+    char * log_path = get_xchat_path (k, STORE_LOG_NAME);
+    if (log_path == NULL) {
+      pthread_mutex_unlock (&store_index_mutex);
+      return NULL;
+    }
+    if (store_indices_count < STORE_INDEX_CACHE_SIZE) {
+      idx = malloc_or_fail (sizeof (struct store_index), "store_lock_index");
+      memset (idx, 0, sizeof (struct store_index));
+      pthread_mutex_init (&(idx->lock), NULL);
+      store_indices [store_indices_count++] = idx;
+    } else {  /* replace a random unused entry, keeping its arrays */
+      int start = random_int (0, STORE_INDEX_CACHE_SIZE - 1);
+      for (i = 0; (i < STORE_INDEX_CACHE_SIZE) && (idx == NULL); i++)
+        if (store_indices [(start + i) % STORE_INDEX_CACHE_SIZE]->users == 0)
+          idx = store_indices [(start + i) % STORE_INDEX_CACHE_SIZE];
+      if (idx == NULL) {
+        printf ("store_lock_index: all %d indices are in use\n",
+                STORE_INDEX_CACHE_SIZE);
+        pthread_mutex_unlock (&store_index_mutex);
+        free (log_path);
+        return NULL;
+      }
+      free (idx->log_path);
+      free (idx->index_path);
+      store_reset_index (idx);
+      idx->migration_checked = 0;
+    }
+    idx->k = k;
+    idx->log_path = log_path;
+    idx->index_path = get_xchat_path (k, STORE_INDEX_NAME);
+  }
+  idx->users++;
+  pthread_mutex_unlock (&store_index_mutex);
+  pthread_mutex_lock (&(idx->lock));
+  store_refresh_index (idx);
+  return idx;
+}
+
+static void store_unlock_index (struct store_index * idx)
+{
+  pthread_mutex_unlock (&(idx->lock));
+  pthread_mutex_lock (&store_index_mutex);
+  idx->users--;
+  pthread_mutex_unlock (&store_index_mutex);
+}
+
+/* returns a malloc'd buffer holding the record at this offset of the log,
+ * with r->message pointing into the buffer, or NULL in case of errors */
+static char * store_read_record (struct store_index * idx, uint64_t offset,
+                                 struct store_record * r)
+{
+  int fd = open (idx->log_path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  char * result = NULL;
+  char header [STORE_HEADER_SIZE];
+  if (store_read_at (fd, header, sizeof (header), offset)) {
+    uint64_t size = readb32 (header);
+    if ((size >= STORE_OVERHEAD) &&
+        (size <= STORE_OVERHEAD + STORE_MAX_MESSAGE)) {
+      result = malloc_or_fail (size, "store_read_record");
+      if ((! store_read_at (fd, result, size, offset)) ||
+          (! store_decode_record (result, size, r))) {
+        free (result);
+        result = NULL;
+      }
+    }
+  }
+  close (fd);
+  return result;
+}
+
+/* sets the header for a new or replaced log, with a new log ID */
+static void store_log_header (char * header)
+{
+  memcpy (header, STORE_LOG_MAGIC, STORE_MAGIC_SIZE);
+  uint64_t log_id = 0;
+  while (log_id == 0) {  /* 0 means no log ID */
+    char id [8];
+    random_bytes (id, sizeof (id));
+    log_id = readb64 (id);
+  }
+  writeb64 (header + STORE_MAGIC_SIZE, log_id);
+}
+
+/* append the record to the log.  fd must be open and locked, and
+ * the index must be up to date.  returns 1 for success, 0 otherwise */
+static int store_append_record (struct store_index * idx, int fd,
+                                const char * record, uint64_t rsize)
+{
+  long long int fsize = fd_size (fd);
+  uint64_t end = idx->indexed_size;
+  if ((fsize >= 0) && ((uint64_t) fsize != end)) {
+    /* since we have the lock, nobody else is writing this */
+    if (fsize > (long long int) end)
+      printf ("discarding %lld bytes of incomplete records from %s\n",
+              fsize - (long long int) end, idx->log_path);
+    if (ftruncate (fd, end) != 0)
+      perror ("store_append_record ftruncate");
+  }
+  if (end < STORE_LOG_HEADER_SIZE) {  /* new log */
+    char header [STORE_LOG_HEADER_SIZE];
+    store_log_header (header);
+    char * buffer = memcat_malloc (header, STORE_LOG_HEADER_SIZE,
+                                   record, rsize, "store_append_record");
+    int result = store_write_at (fd, buffer, STORE_LOG_HEADER_SIZE + rsize, 0);
+    free (buffer);
+    return result;
+  }
+  return store_write_at (fd, record, rsize, end);
+}
+
+/* write a new file and make sure it is on disk.
+ * returns 1 for success, 0 for failure */
+static int store_write_synced (const char * path, const char * buffer,
+                               uint64_t size)
+{
+  int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    perror ("store_write_synced open");
+    printf ("unable to create %s\n", path);
+    return 0;
+  }
+  int result = store_write_at (fd, buffer, size, 0);
+  if (result && (fsync (fd) != 0)) {
+    perror ("store_write_synced fsync");
+    result = 0;
+  }
+  close (fd);
+  return result;
+}
+
+/* make sure the entries in the directory are on disk.
+ * returns 1 for success, 0 for failure */
+static int store_sync_dir (const char * dirname)
+{
+  int fd = open (dirname, O_RDONLY);
+  if (fd < 0) {
+    perror ("store_sync_dir open");
+    return 0;
+  }
+  int result = (fsync (fd) == 0);
+  if (! result)
+    perror ("store_sync_dir fsync");
+  close (fd);
+  return result;
+}
+
+/* move the text files to the backup directory, rather than deleting
+ * the only other copy of the history */
+static void store_backup_text (const char * dirname)
+{
+  char * backup = strcat3_malloc (dirname, "/", STORE_TEXT_BACKUP,
+                                  "store_backup_text");
+  if ((mkdir (backup, 0700) != 0) && (errno != EEXIST)) {
+    perror ("store_backup_text mkdir");
+    printf ("unable to create %s, keeping the text files\n", backup);
+    free (backup);
+    return;
+  }
+  DIR * dir = opendir (dirname);
+  if (dir != NULL) {
+    struct dirent * dep;
+    while ((dep = readdir (dir)) != NULL) {
+      if (! end_ndigits (dep->d_name, DATE_LEN, ".txt"))
+        continue;
+      char * from = strcat3_malloc (dirname, "/", dep->d_name,
+                                    "store_backup_text from");
+      char * to = strcat3_malloc (backup, "/", dep->d_name,
+                                  "store_backup_text to");
+      if (rename (from, to) != 0) {
+        perror ("store_backup_text rename");
+        printf ("unable to move %s to %s\n", from, to);
+      }
+      free (from);
+      free (to);
+    }
+    closedir (dir);
+  }
+  store_sync_dir (backup);
+  store_sync_dir (dirname);
+  free (backup);
+}
+
+/* converts the text files used before 2026/10, if any, into a new log,
+ * then moves them to the backup directory.
+ * returns 1 if the log was created, 0 otherwise */
+/* must be called with idx->lock held */
+static int store_migrate_text (struct store_index * idx)
+{
+  char * dirname = get_xchat_dir (idx->k);
+  if (dirname == NULL)
+    return 0;
+  struct text_iter iter;
+  iter.dirname = dirname;
+  iter.current_fname = NULL;
+  iter.current_file = NULL;
+  iter.current_size = 0;
+  iter.current_pos = 0;
+  iter.done = 0;
+  /* the text files are read backwards, so save all the records, then
+   * write them to the log oldest first */
+  char ** records = NULL;
+  uint64_t * sizes = NULL;
+  int count = 0;
+  int alloc = 0;
+  uint64_t total = STORE_LOG_HEADER_SIZE;
+  int failed = 0;
+  char * text;
+  while ((text = find_prev_record (&iter)) != NULL) {
+    uint64_t seq = 0;
+    uint64_t time = 0;
+    int tz_min = 0;
+    uint64_t rcvd_time = 0;
+    char ack [MESSAGE_ID_SIZE];
+    char * message = NULL;
+    int msize = 0;
+    int type = parse_record (text, &seq, &time, &tz_min, &rcvd_time, ack,
+                             &message, &msize);
+    if (type != MSG_TYPE_DONE) {
+      if (count >= alloc) {
+        alloc = ((alloc < 1000) ? 1000 : alloc * 2);
+        records = realloc (records, alloc * sizeof (char *));
+        sizes = realloc (sizes, alloc * sizeof (uint64_t));
+        if ((records == NULL) || (sizes == NULL)) {
+          perror ("realloc");
+          printf ("store_migrate_text unable to allocate %d records\n", alloc);
+          exit (1);
+        }
+      }
+      records [count] = store_encode_record (type, seq, time, tz_min,
+                                             rcvd_time, ack, message, msize,
+                                             sizes + count);
+      total += sizes [count];
+      count++;
+    } else {   /* keep going, the text files are kept as a backup */
+      failed++;
+      printf ("store_migrate_text unable to parse record in %s:\n%s\n",
+              iter.current_fname, text);
+    }
+    free (text);  /* message, if any, points into text */
+  }
+  if (iter.current_fname != NULL)
+    free (iter.current_fname);
+  if (iter.current_file != NULL)
+    free (iter.current_file);
+  int created = 0;
+  if (count > 0) {
+    char * log = malloc_or_fail (total, "store_migrate_text");
+    store_log_header (log);
+    uint64_t pos = STORE_LOG_HEADER_SIZE;
+    int i;
+    for (i = count - 1; i >= 0; i--) {
+      memcpy (log + pos, records [i], sizes [i]);
+      pos += sizes [i];
+      free (records [i]);
+    }
+    char pid_ext [30];
+    snprintf (pid_ext, sizeof (pid_ext), ".%d", (int) getpid ());
+    char * tmp = strcat_malloc (idx->log_path, pid_ext, "store_migrate_text");
+    /* link fails if another process has already created the log.
+     * the log must be on disk before the text files are moved */
+    if ((store_write_synced (tmp, log, total)) &&
+        (link (tmp, idx->log_path) == 0)) {
+      created = 1;
+      if (store_sync_dir (dirname))
+        store_backup_text (dirname);
+    }
+    unlink (tmp);
+    free (tmp);
+    free (log);
+  }
+  if (failed > 0)
+    printf ("store_migrate_text: %d records in %s could not be converted, "
+            "the text files are in %s/%s\n", failed, dirname,
+            dirname, STORE_TEXT_BACKUP);
+  if (records != NULL)
+    free (records);
+  if (sizes != NULL)
+    free (sizes);
+  free (dirname);
+  return created;
+}
+
+/* find the most recently saved message of type_wanted (MSG_TYPE_SENT or
+ * MSG_TYPE_RCVD) with this sequence number, using the index.
+ * returns the message type, or MSG_TYPE_DONE if there is no such message.
+ * the results are set as for prev_message */
+int find_seq_record (const char * contact, keyset k, int type_wanted,
+                     uint64_t seq, uint64_t * time, int * tz_min,
+                     uint64_t * rcvd_time, char * message_ack,
+                     char ** message, int * msize)
+{
+  char no_ack [MESSAGE_ID_SIZE];
+  memset (no_ack, 0, sizeof (no_ack));
+  set_result (NULL, 0, time, 0, tz_min, 0, rcvd_time, 0,
+              message_ack, no_ack, message, NULL, msize, 0);
+  if ((type_wanted != MSG_TYPE_SENT) && (type_wanted != MSG_TYPE_RCVD))
+    return MSG_TYPE_DONE;
+  int result = MSG_TYPE_DONE;
+  struct store_index * idx = store_lock_index (k);
+  if (idx != NULL) {
+    struct store_seq_entry wanted;
+    wanted.seq = seq;
+    wanted.offset = 0;
+    wanted.type = type_wanted;
+    int i = store_lower_bound (idx->seqs, idx->num_seqs,
+                               sizeof (struct store_seq_entry), &wanted,
+                               store_compare_seq);
+    int found = -1;
+    /* entries with the same seq are sorted by offset, so the last
+     * matching entry is the most recently saved */
+    for ( ; (i < idx->num_seqs) && (idx->seqs [i].seq == seq); i++)
+      if (idx->seqs [i].type == type_wanted)
+        found = i;
+    struct store_record r;
+    char * buffer = NULL;
+    if ((found >= 0) &&
+        ((buffer = store_read_record (idx, idx->seqs [found].offset, &r))
+         != NULL)) {
+      set_result (NULL, 0, time, r.time, tz_min, r.tz_min,
+                  rcvd_time, r.rcvd_time, message_ack, r.ack,
+                  NULL, NULL, msize, r.msize);
+      if (message != NULL)
+        *message = store_copy_message (&r);
+      result = r.type;
+      free (buffer);
+    }
+    store_unlock_index (idx);
+  }
+  return result;
+}
+
+/* returns the position in idx->acks of the most recently saved record of
+ * type_wanted (or any type for MSG_TYPE_ANY) with this message ack, or -1 */
+static int store_find_ack_entry (struct store_index * idx, int type_wanted,
+                                 const char * message_ack)
+{
+  struct store_ack_entry wanted;
+  memcpy (wanted.ack, message_ack, MESSAGE_ID_SIZE);
+  wanted.offset = 0;
+  int i = store_lower_bound (idx->acks, idx->num_acks,
+                             sizeof (struct store_ack_entry), &wanted,
+                             store_compare_ack);
+  int found = -1;
+  for ( ; (i < idx->num_acks) &&
+          (memcmp (idx->acks [i].ack, message_ack, MESSAGE_ID_SIZE) == 0);
+        i++)
+    if ((type_wanted == MSG_TYPE_ANY) || (idx->acks [i].type == type_wanted))
+      found = i;
+  return found;
+}
+
+/* find the most recently saved record of type_wanted (MSG_TYPE_SENT,
+ * MSG_TYPE_RCVD, MSG_TYPE_ACK, or MSG_TYPE_ANY) with this message ack,
+ * using the index.  returns the type, or MSG_TYPE_DONE if not found.
+ * if seq is not NULL, sets it to the sequence number of the record
+ * (for acks, the sequence number of the acked message if it was known)
+ * if rcvd_time is not NULL, sets it to the time the record was received */
+int find_ack_record (const char * contact, keyset k, int type_wanted,
+                     const char * message_ack, uint64_t * seq,
+                     uint64_t * rcvd_time)
+{
+  if (seq != NULL)
+    *seq = 0;
+  if (rcvd_time != NULL)
+    *rcvd_time = 0;
+  int result = MSG_TYPE_DONE;
+  struct store_index * idx = store_lock_index (k);
+  if (idx == NULL)
+    return result;
+  int found = store_find_ack_entry (idx, type_wanted, message_ack);
+  if (found >= 0) {
+    result = idx->acks [found].type;
+    if (seq != NULL)
+      *seq = idx->acks [found].seq;
+    if (rcvd_time != NULL)
+      *rcvd_time = idx->acks [found].rcvd_time;
+  }
+  store_unlock_index (idx);
+  return result;
+}
+
+/* adds seq to the malloc'd array *seqs, which has room for *alloc */
+static void store_add_seq (uint64_t ** seqs, int * count, int * alloc,
+                           uint64_t seq)
+{
+  if (*count >= *alloc) {
+    int new_alloc = ((*alloc > 0) ? (*alloc * 2) : 100);
+    uint64_t * new_seqs = realloc (*seqs, new_alloc * sizeof (uint64_t));
+    if (new_seqs == NULL) {
+      printf ("store_add_seq unable to allocate %d seqs\n", new_alloc);
+      return;
+    }
+    *seqs = new_seqs;
+    *alloc = new_alloc;
+  }
+  (*seqs) [(*count)++] = seq;
+}
+
+/* for caches of the sequence numbers in a keyset's log.  see store.h */
+int store_seqs_since (const char * contact, keyset k, int type,
+                      uint64_t * log_id, uint64_t * position,
+                      uint64_t ** seqs, int * replaced)
+{
+  *seqs = NULL;
+  *replaced = 0;
+  if ((type != MSG_TYPE_RCVD) && (type != MSG_TYPE_ACK))
+    return -1;
+  int count = 0;
+  int alloc = 0;
+  struct store_index * idx = store_lock_index (k);
+  if (idx == NULL)
+    return -1;
+  uint64_t from = *position;
+  if ((*log_id != idx->log_id) || (from > idx->indexed_size)) {
+    *replaced = 1;   /* a different log, start from the beginning */
+    from = 0;
+  }
+  if (from < idx->indexed_size) {
+    int i;
+    if (type == MSG_TYPE_RCVD) {
+      for (i = 0; i < idx->num_seqs; i++)
+        if ((idx->seqs [i].type == MSG_TYPE_RCVD) &&
+            (idx->seqs [i].offset >= from))
+          store_add_seq (seqs, &count, &alloc, idx->seqs [i].seq);
+    } else {  /* sent messages whose ack has been received */
+      int start = 0;   /* each group of entries has the same ack */
+      while (start < idx->num_acks) {
+        int end = start + 1;
+        while ((end < idx->num_acks) &&
+               (memcmp (idx->acks [start].ack, idx->acks [end].ack,
+                        MESSAGE_ID_SIZE) == 0))
+          end++;
+        int acked = 0;
+        uint64_t acked_at = 0;   /* offset of the most recent ack */
+        for (i = start; i < end; i++) {
+          if (idx->acks [i].type == MSG_TYPE_ACK) {
+            acked = 1;
+            acked_at = idx->acks [i].offset;
+          }
+        }
+        for (i = start; (acked) && (i < end); i++)
+          if ((idx->acks [i].type == MSG_TYPE_SENT) &&
+              ((idx->acks [i].offset >= from) || (acked_at >= from)))
+            store_add_seq (seqs, &count, &alloc, idx->acks [i].seq);
+        start = end;
+      }
+    }
+  }
+  *log_id = idx->log_id;
+  *position = idx->indexed_size;
+  store_unlock_index (idx);
+  return count;
+}
+
+/* read a snapshot of the complete records of the log into memory, for
+ * iterating.  Only opening the log needs the index lock: records are only
+ * appended after indexed_size, and reduce_conversation renames a new log
+ * into place, so the open file keeps the snapshot while others save */
+/* returns 1 for success, 0 for failure */
+static int store_load_log (struct msg_iter * iter)
 {
-  while (1) {
-    if (iter->k < 0)  /* invalid iterator */
-      return NULL;
-    if (((iter->current_file == NULL) ||  /* at start */
-         (iter->current_pos <= 0)) &&       /* update file */
-        (! find_prev_file (iter)))
-      return NULL;
-    uint64_t record_end_pos = iter->current_pos;
-    /* a record begins with "got ack", "sent id", or "rcvd id". */
-    do {
-      (iter->current_pos)--;
-    } while ((iter->current_pos >= 0) && (! match_record_start (iter)));
-    if ((iter->current_pos >= 0) && (match_record_start (iter))) {
-      int size = (int) (record_end_pos - iter->current_pos);
-      char * result = malloc_or_fail (size + 1, "find_prev_record");
-      memcpy (result, (iter->current_file) + (iter->current_pos), size);
-      result [size] = '\0';
-      return result;
-    }
-    printf ("unable to find any records in file %s\n", iter->current_fname);
+  uint64_t size = 0;
+  int fd = -1;
+  struct store_index * idx = store_lock_index (iter->k);
+  if (idx == NULL)
+    return 0;
+  if (idx->indexed_size > STORE_LOG_HEADER_SIZE) {
+    fd = open (idx->log_path, O_RDONLY);
+    size = idx->indexed_size;
+  }
+  store_unlock_index (idx);
+  if (fd < 0)
+    return 0;
+  char * log = malloc_or_fail (size, "store_load_log");
+  if (! store_read_at (fd, log, size, 0)) {
+    free (log);
+    log = NULL;
   }
+  close (fd);
+  if (log == NULL)
+    return 0;
+  iter->log = log;
+  iter->log_size = size;
+  iter->log_pos = size;
+  return 1;
 }
 
-static void set_result (
-   uint64_t * seqp, uint64_t seq, uint64_t * timep, uint64_t time,
-   int * tz_minp, int tz_min, uint64_t * rcvd_timep, uint64_t rcvd_time,
-   char * message_ackp, const char * ack_value,
-   char ** messagep, const char * message, int * msizep, size_t msize)
+/* returns the type of the record before iter->log_pos, or MSG_TYPE_DONE */
+static int prev_message_in_log (struct msg_iter * iter, uint64_t * seq,
+                                uint64_t * time, int * tz_min,
+                                uint64_t * rcvd_time, char * message_ack,
+                                char ** message, int * msize)
 {
-  if (seqp != NULL) *seqp = seq;
-  if (timep != NULL) *timep = time;
-  if (tz_minp != NULL) *tz_minp = tz_min;
-  if (rcvd_timep != NULL) *rcvd_timep = rcvd_time;
-  if (message_ackp != NULL)
-    memcpy (message_ackp, ack_value, MESSAGE_ID_SIZE);
-  if (messagep != NULL) {
-    *messagep = NULL;
-    if ((message != NULL) && (msize > 0)) {
-      char * m = malloc_or_fail (msize + 1, "store.c set_result");
-      m [msize] = '\0';  /* so we can print as text, for debugging */
-      memcpy (m, message, msize);
-      *messagep = m;
-    }
+  if ((iter->log == NULL) && (! store_load_log (iter)))
+    return MSG_TYPE_DONE;
+  uint64_t end = iter->log_pos;
+  if (end < STORE_LOG_HEADER_SIZE + STORE_OVERHEAD)
+    return MSG_TYPE_DONE;
+  uint64_t size = readb32 (iter->log + end - STORE_TRAILER_SIZE);
+  struct store_record r;
+  /* store_refresh_index has already checked every record */
+  if ((size > end - STORE_LOG_HEADER_SIZE) ||
+      (! store_decode_record (iter->log + end - size, size, &r))) {
+    printf ("invalid record in log for %s/%d\n", iter->contact, iter->k);
+    iter->log_pos = 0;
+    return MSG_TYPE_DONE;
   }
-  if (msizep != NULL) *msizep = (int)msize;
+  iter->log_pos = end - size;
+  if (r.type == MSG_TYPE_ACK) {
+    set_result (seq, 0, time, 0, tz_min, 0, rcvd_time, r.rcvd_time,
+                message_ack, r.ack, message, NULL, msize, 0);
+  } else {
+    set_result (seq, r.seq, time, r.time, tz_min, r.tz_min,
+                rcvd_time, r.rcvd_time, message_ack, r.ack,
+                NULL, NULL, msize, r.msize);
+    if (message != NULL)
+      *message = store_copy_message (&r);
+  }
+  return r.type;
 }
 
-/* must be called with the mutex held */
+/* must be called with the lock held for reading */
 static int prev_message_in_memory
   (struct msg_iter * iter, uint64_t * seq, uint64_t * time,
    int * tz_min, uint64_t * rcvd_time, char * message_ack,
@@ -584,20 +1725,14 @@ int prev_message (struct msg_iter * iter, uint64_t * seq, uint64_t * time,
   if (iter->k < 0)  /* invalid */
     return MSG_TYPE_DONE;
   if (iter->is_in_memory) {
-    pthread_mutex_lock (&message_cache_mutex);
+    pthread_rwlock_rdlock (&message_cache_lock);
     int r = prev_message_in_memory (iter, seq, time, tz_min, rcvd_time,
                                     message_ack, message, msize);
-    pthread_mutex_unlock (&message_cache_mutex);
+    pthread_rwlock_unlock (&message_cache_lock);
     return r;
   }
-  char * record = find_prev_record (iter);
-  if (record == NULL)  /* finished */
-    return MSG_TYPE_DONE;
-  int result = parse_record (record, seq, time, tz_min, rcvd_time,
-                             message_ack, message, msize);
-  if ((message == NULL) || (*message != record))
-    free (record);
-  return result;
+  return prev_message_in_log (iter, seq, time, tz_min, rcvd_time,
+                              message_ack, message, msize);
 }
 
 void free_unallocated_iter (struct msg_iter * iter)
@@ -606,22 +1741,14 @@ void free_unallocated_iter (struct msg_iter * iter)
     return;
   if (iter->contact != NULL)
     free (iter->contact);
-  if (! iter->is_in_memory) {
-    if (iter->dirname != NULL)
-      free (iter->dirname);
-    if (iter->current_fname != NULL)
-      free (iter->current_fname);
-    if (iter->current_file != NULL)
-      free (iter->current_file);
-  }
+  if ((! iter->is_in_memory) && (iter->log != NULL))
+    free (iter->log);
   iter->contact = NULL;
   iter->k = -1;            /* invalidate */
   iter->is_in_memory = 0;
-  iter->dirname = NULL;
-  iter->current_fname = NULL;
-  iter->current_file = NULL;
-  iter->current_size = 0;
-  iter->current_pos = 0;
+  iter->log = NULL;
+  iter->log_size = 0;
+  iter->log_pos = 0;
   iter->message_cache_index = 0;
   iter->last_message_index = 0;
   iter->ack_returned = 0;
@@ -730,26 +1857,6 @@ int highest_seq_record (const char * contact, keyset k, int type_wanted,
   return max_type;
 }
 
-static char * get_xchat_dir (keyset k)
-{
-  char * contact_dir = key_dir (k);
-  if (contact_dir == NULL)
-    return NULL;
-  char * xchat_dir = string_replace_once (contact_dir, "contacts", "xchat", 1);
-  free (contact_dir);
-  return xchat_dir;
-}
-
-static char * get_xchat_path (keyset k, const char * fname)
-{
-  char * xchat_dir = get_xchat_dir (k);  /* must be free'd */
-  if (xchat_dir == NULL)
-    return NULL;
-  char * path = strcat3_malloc (xchat_dir, "/", fname, "find_prev_file");
-  free (xchat_dir);
-  return path;
-}
-
 static uint64_t read_int_from_file (const char * contact, keyset k,
                                     const char * fname)
 {
@@ -779,65 +1886,6 @@ static void save_int_to_file (const char * contact, keyset k,
   free (path);
 }
 
-#ifdef IMPLEMENTING_SEQ_CACHING
-struct cached_seq_value {
-  uint64_t seq;
-  uint64_t time;
-};
-
-struct cached_seq_pair {
-  keyset k;
-  struct cached_seq_value sent;
-  struct cached_seq_value rcvd;
-};
-
-#define NUM_CACHE_ENTRIES	1000
-static struct cached_seq_pair cached_seq [NUM_CACHE_ENTRIES];
-static int cached_seq_index = 0;
-
-/* returns -1 if not found */
-static int get_cached (keyset k)
-{
-  int i;
-  for (i = 0; i < cached_seq_index; i++) {
-    if (cached_seq [i].k == k)
-      return i;
-  }
-  return -1;
-}
-
-static void cache_seq (keyset k, uint64_t seq, uint64_t time, int sent)
-{
-  int i = 0;
-  int index = cached_seq_index;
-  int need_new = 1;
-  for (i = 0; i < cached_seq_index; i++) {
-    if (cached_seq [i].k == k) {
-      need_new = 0;
-      index = i;
-      break;
-    }
-  }
-  if (need_new && (index >= NUM_CACHE_ENTRIES))
-    return;  /* no room, don't cache */
-  if (need_new) {  /* initialize the new entry to default values */
-    cached_seq [index].k = k;
-    cached_seq [index].sent.seq = 0;
-    cached_seq [index].sent.time = 0;
-    cached_seq [index].rcvd.seq = 0;
-    cached_seq [index].rcvd.time = 0;
-    cached_seq_index++;
-  }
-  if (sent) {
-    cached_seq [index].sent.seq = seq;
-    cached_seq [index].sent.time = time;
-  } else {
-    cached_seq [index].rcvd.seq = seq;
-    cached_seq [index].rcvd.time = time;
-  }
-}
-#endif /* IMPLEMENTING_SEQ_CACHING */
-
 /* returns the sequence number, or 0 if none are available */
 /* type_wanted must be MSG_TYPE_ANY, MSG_TYPE_RCVD, or MSG_TYPE_SENT,
  * otherwise returns 0 */
@@ -860,64 +1908,25 @@ uint64_t highest_seq_value (const char * contact, keyset k, int type_wanted)
   }
   if (seq > 0)
     return seq;
-  /* no such message found, iterate through all messages to find it. */
-  struct msg_iter * iter = start_iter (contact, k);
-  if (iter == NULL)
-    return 0;
-#ifdef IMPLEMENTING_SEQ_CACHING
-  uint64_t saved_seq = 0;
-  uint64_t saved_time = 0;
-  int cache_index = get_cached (k);
-  if (cache_index >= 0) {
-    int save_sent = (type_wanted == MSG_TYPE_SENT);
-    if ((type_wanted == MSG_TYPE_ANY) &&
-        (cached_seq [cache_index].sent.seq > cached_seq [cache_index].rcvd.seq))
-      save_sent = 1;
-    if (save_sent) {
-      saved_seq  = cached_seq [cache_index].sent.seq;
-      saved_time = cached_seq [cache_index].sent.time;
-    } else {
-      saved_seq  = cached_seq [cache_index].rcvd.seq;
-      saved_time = cached_seq [cache_index].rcvd.time;
-    }
-  }
-#endif /* IMPLEMENTING_SEQ_CACHING */
+  /* no such message found, look for the highest in the index */
   int max_type = MSG_TYPE_DONE;
   uint64_t max_seq = 0;
-  uint64_t max_time = 0;
-  while (1) {
-    uint64_t this_seq = 0;
-    uint64_t this_time = 0;
-    int type = prev_message (iter, &this_seq, &this_time,
-                             NULL, NULL, NULL, NULL, NULL);
-    if (type == MSG_TYPE_DONE)  /* no (more) messages */
-      break;
-    if (((type == MSG_TYPE_SENT) || (type == MSG_TYPE_RCVD)) && /* no acks */
-        ((type_wanted == MSG_TYPE_ANY) || (type == type_wanted))) { /* match */
-      if ((this_seq > max_seq) ||
-          ((this_seq == max_seq) && (this_time > max_time))) {
-        max_type = type;
-        max_seq = this_seq;
-        max_time = this_time;
+  struct store_index * idx = store_lock_index (k);
+  if (idx != NULL) {
+    int i;  /* the entries are sorted by seq, so look from the end */
+    for (i = idx->num_seqs - 1; i >= 0; i--) {
+      if ((type_wanted == MSG_TYPE_ANY) || (idx->seqs [i].type == type_wanted)) {
+        max_type = idx->seqs [i].type;
+        max_seq = idx->seqs [i].seq;
+        break;
       }
-#ifdef IMPLEMENTING_SEQ_CACHING
-      if ((cache_index >= 0) &&
-          (this_seq == saved_seq) && (this_time == saved_time))
-        break; /* reached the cached value, no point going further */
-#endif /* IMPLEMENTING_SEQ_CACHING */
     }
+    store_unlock_index (idx);
   }
-  free_iter (iter);
-  /* save the result of all this hard work */
+  /* save the result, so next time it can be read from the file */
   if (max_type == MSG_TYPE_SENT) {
-#ifdef IMPLEMENTING_SEQ_CACHING
-    cache_seq (k, max_seq, max_time, 1);
-#endif /* IMPLEMENTING_SEQ_CACHING */
     save_int_to_file (contact, k, "last_sent", max_seq);
   } else if (max_type == MSG_TYPE_RCVD) {
-#ifdef IMPLEMENTING_SEQ_CACHING
-    cache_seq (k, max_seq, max_time, 0);
-#endif /* IMPLEMENTING_SEQ_CACHING */
     save_int_to_file (contact, k, "last_received", max_seq);
   }
   return max_seq;
@@ -942,23 +1951,40 @@ uint64_t highest_seq_any_key (const char * contact, int type_wanted)
   return result;
 }
 
-/* fix the prev_missing of each received message.  quadratic loop */
+static int compare_uint64 (const void * a, const void * b)
+{
+  uint64_t ua = *((const uint64_t *) a);
+  uint64_t ub = *((const uint64_t *) b);
+  if (ua == ub)
+    return 0;
+  return ((ua < ub) ? -1 : 1);
+}
+
+/* fix the prev_missing of each received message, by looking up each
+ * sequence number in a sorted array of all the received sequence numbers */
 static void set_missing (struct message_store_info * msgs, int num_used,
                          keyset k)
 {
   int i;
+  int count = 0;
+  for (i = 0; i < num_used; i++)
+    if ((msgs [i].keyset == k) && (msgs [i].msg_type == MSG_TYPE_RCVD))
+      count++;
+  if (count == 0)
+    return;
+  uint64_t * seqs = malloc_or_fail (count * sizeof (uint64_t), "set_missing");
+  count = 0;
+  for (i = 0; i < num_used; i++)
+    if ((msgs [i].keyset == k) && (msgs [i].msg_type == MSG_TYPE_RCVD))
+      seqs [count++] = msgs [i].seq;
+  qsort (seqs, count, sizeof (uint64_t), compare_uint64);
   for (i = 0; i < num_used; i++) {
     if ((msgs [i].keyset == k) && (msgs [i].msg_type == MSG_TYPE_RCVD)) {
       uint64_t seq = msgs [i].seq;
-      uint64_t prev_seq = 0; /* the first sequence number should be 1 */
-      int index;
-      for (index = 0; index < num_used; index++) {
-        if ((msgs [index].keyset == k) &&
-            (msgs [index].msg_type == MSG_TYPE_RCVD) &&
-            (msgs [index].seq < seq) &&
-            (msgs [index].seq > prev_seq))
-          prev_seq = msgs [index].seq;
-      }
+      int index = store_lower_bound (seqs, count, sizeof (uint64_t), &seq,
+                                     compare_uint64);
+      /* the first sequence number should be 1 */
+      uint64_t prev_seq = ((index > 0) ? seqs [index - 1] : 0);
       msgs [i].prev_missing = 0;
       if (prev_seq >= msgs [i].seq)
         printf ("error: prev_seq %" PRIu64 " >= seq [%d] %" PRIu64 "\n",
@@ -967,6 +1993,7 @@ static void set_missing (struct message_store_info * msgs, int num_used,
         msgs [i].prev_missing = (msgs [i].seq - (prev_seq + 1));
     }
   }
+  free (seqs);
 }
 
 /* set the message_has_been_acked of each sent message acked by this message */
@@ -985,7 +2012,8 @@ static void ack_one_message (struct message_store_info * msgs, int num_used,
   }
 }
 
-/* set the message_has_been_acked of each acked sent message.  quadratic loop */
+/* set the message_has_been_acked of each acked sent message, looking
+ * up the ack of each one in the index */
 static void ack_all_messages (struct message_store_info * msgs, int num_used,
                               const char * contact, keyset k)
 {
@@ -997,123 +2025,17 @@ static void ack_all_messages (struct message_store_info * msgs, int num_used,
     /* no messages to ack, nothing to do */
     return;
   }
-  struct msg_iter iter;
-  if (! start_iter_from_file (contact, k, &iter)) {
-    printf ("error: ack_all_messages unable to create iter for %s/%d\n",
-            contact, k);
-    return;
-  }
-  char ack [MESSAGE_ID_SIZE];
-  uint64_t ack_time;
-  int next = prev_message (&iter, NULL, &ack_time, NULL, NULL, ack, NULL, NULL);
-  while (next != MSG_TYPE_DONE) {
-    if (next == MSG_TYPE_ACK)
-      ack_one_message (msgs, num_used, ack, ack_time);
-    next = prev_message (&iter, NULL, NULL, NULL, NULL, ack, NULL, NULL);
-  }
-  free_unallocated_iter (&iter);
-}
-
-static void store_save_string_len (int fd, char * string, int mlen)
-{
-  if (write (fd, string, mlen) != mlen) {
-    perror ("write/len");
-    printf ("unable to write '%s' to file (%d)\n", string, mlen);
-    exit (1);
-  }
-}
-
-static void store_save_string (int fd, char * string)
-{
-  if (write (fd, string, strlen (string)) != (int) (strlen (string))) {
-    perror ("write");
-    printf ("unable to write '%s' to file\n", string);
-    exit (1);
-  }
-}
-
-static void store_save_64 (int fd, uint64_t value)
-{
-  /* 2^64 < 10^20, so 30 bytes are more than needed for the digits */
-  char buffer [30];
-  snprintf (buffer, sizeof (buffer), "%ju", (uintmax_t)value);
-  store_save_string (fd, buffer);
-}
-
-static void store_save_message (int fd, const char * message, int mlen)
-{
-  int num_indents = 1;  /* have to insert a blank before the message */
   int i;
-  for (i = 0; i + 1 < mlen; i++)
-    if (message [i] == '\n')
-      num_indents++;
-  char * buffer = malloc_or_fail (mlen + num_indents + 2, "store_save_message");
-  int from;
-  buffer [0] = ' ';
-  int to = 1;
-  for (from = 0; from < mlen; from++) {
-    if ((from + 1 < mlen) || (message [from] != '\n')) {
-    /* the if is so we don't copy the last \n, if any */
-      buffer [to++] = message [from];
-      if (message [from] == '\n')
-        buffer [to++] = ' ';
+  for (i = 0; i < num_used; i++) {
+    uint64_t ack_time;
+    if ((msgs [i].keyset == k) && (msgs [i].msg_type == MSG_TYPE_SENT) &&
+        (! msgs [i].message_has_been_acked) &&
+        (find_ack_record (contact, k, MSG_TYPE_ACK, msgs [i].ack, NULL,
+                          &ack_time) == MSG_TYPE_ACK)) {
+      msgs [i].rcvd_ackd_time = ack_time;
+      msgs [i].message_has_been_acked = 1;
     }
   }
-  buffer [to++] = '\n';
-  buffer [to] = '\0';
-  store_save_string_len (fd, buffer, to);
-  free (buffer);
-}
-
-static void store_save_message_type (int fd, int type)
-{
-  switch (type) {
-  case MSG_TYPE_RCVD:
-    store_save_string (fd, "rcvd id:");
-    break;
-  case MSG_TYPE_SENT:
-    store_save_string (fd, "sent id:");
-    break;
-  case MSG_TYPE_ACK:
-    store_save_string (fd, "got ack:");
-    break;
-  default:
-    printf ("unknown message type %d\n", type);
-    exit (1);
-  }
-}
-
-static void store_save_message_id (int fd, const char * id)
-{
-  store_save_string (fd, " ");
-  char buffer [MESSAGE_ID_SIZE * 2 + 1];
-  int i;
-  for (i = 0; i < MESSAGE_ID_SIZE; i++)
-    snprintf (buffer + 2 * i, sizeof (buffer) - 2 * i, "%02x", (id [i]) & 0xff);
-  store_save_string (fd, buffer);
-}
-
-static void store_save_message_seq_time (int fd, uint64_t seq,
-                                         uint64_t time, int tz, uint64_t rcvd)
-{
-  store_save_string (fd, "sequence ");
-  store_save_64 (fd, seq);
-  store_save_string (fd, ", time ");
-  char time_buf [ALLNET_TIME_STRING_SIZE];
-  allnet_time_string (time, time_buf);
-  store_save_string (fd, time_buf);
-  store_save_string (fd, " (");
-  store_save_64 (fd, time);
-  if (tz < 0) {
-    store_save_string (fd, " -");
-    tz = -tz;
-  } else {
-    store_save_string (fd, " +");
-  }
-  store_save_64 (fd, tz);
-  store_save_string (fd, ")/");
-  store_save_64 (fd, rcvd);
-  store_save_string (fd, "\n");
 }
 
 void save_record (const char * contact, keyset k, int type, uint64_t seq,
@@ -1123,46 +2045,52 @@ void save_record (const char * contact, keyset k, int type, uint64_t seq,
   if ((type != MSG_TYPE_RCVD) && (type != MSG_TYPE_SENT) &&
       (type != MSG_TYPE_ACK))
     return;
-  struct msg_iter iter;
-  if (! start_iter_from_file (contact, k, &iter))
-    return;
-  time_t now;
-  time (&now);
-  struct tm * tm = gmtime (&now);
-#define EXTENSION		".txt"
-#define EXTENSION_LENGTH	4  /* number of characters in ".txt" */
-  char fname [DATE_LEN + EXTENSION_LENGTH + 1];
-  snprintf (fname, sizeof (fname), "%04d%02d%02d%s", tm->tm_year + 1900,
-            tm->tm_mon + 1, tm->tm_mday, EXTENSION);
-  char * path = strcat3_malloc (iter.dirname, "/", fname, "save_record");
-  free_unallocated_iter (&iter);
-  int fd = open (path, O_WRONLY | O_APPEND | O_CREAT, 0600);
-  if (fd < 0) {
-    perror ("open");
-    printf ("unable to open file %s\n", path);
-    free (path);
-    return;
-  }
- 
-  flock (fd, LOCK_EX);  /* exclusive write, otherwise multiple writers
-                         * make a mess of the file */
-  store_save_message_type (fd, type);
-  store_save_message_id (fd, message_ack);
-  char id [MESSAGE_ID_SIZE];
-  sha512_bytes (message_ack, MESSAGE_ID_SIZE, id, MESSAGE_ID_SIZE);
-  store_save_message_id (fd, id);
-  store_save_string (fd, "\n");
-
-  if (type != MSG_TYPE_ACK) {
-    store_save_message_seq_time (fd, seq, t, tz_min, rcvd_time);
-    store_save_message (fd, message, msize);
-  }
-  flock (fd, LOCK_UN);  /* remove the file lock */
-
-  close (fd);
-  free (path);
+  uint64_t rsize;
+  char * record = store_encode_record (type, seq, t, tz_min, rcvd_time,
+                                       message_ack, message, msize, &rsize);
+  pthread_mutex_lock (&message_cache_saving_mutex);
+  message_cache_saving++;
+  pthread_mutex_unlock (&message_cache_saving_mutex);
+  int saved = 0;
+  /* saves to the same keyset wait for each other, others proceed */
+  struct store_index * idx = store_lock_index (k); /* may convert text */
+  int attempt;
+  /* reduce_conversation may replace the log between our open and flock,
+   * in which case we try again with the new log */
+  for (attempt = 0; (attempt < 3) && (! saved) && (idx != NULL); attempt++) {
+    if (attempt > 0)
+      store_refresh_index (idx);
+    int fd = open (idx->log_path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+      perror ("open");
+      printf ("unable to open file %s\n", idx->log_path);
+      break;
+    }
+    flock (fd, LOCK_EX);  /* exclusive write, otherwise multiple writers
+                           * make a mess of the file */
+    struct stat st;
+    store_refresh_index (idx);  /* add records saved by other processes */
+    if ((fstat (fd, &st) == 0) &&
+        (st.st_dev == idx->dev) && (st.st_ino == idx->ino)) {
+      saved = store_append_record (idx, fd, record, rsize);
+      store_refresh_index (idx);  /* add this record */
+      if (! saved)
+        attempt = 3;            /* error writing, do not retry */
+    }
+    flock (fd, LOCK_UN);  /* remove the file lock */
+    close (fd);
+  }
+  if (idx != NULL)
+    store_unlock_index (idx);
+  free (record);
+  if (! saved)
+    printf ("unable to save message for %s/%d\n", contact, k);
   /* now save it internally, if we are caching this contact's data */
-  pthread_mutex_lock (&message_cache_mutex);
+  pthread_rwlock_wrlock (&message_cache_lock);
+  message_cache_generation++;
+  pthread_mutex_lock (&message_cache_saving_mutex);
+  message_cache_saving--;
+  pthread_mutex_unlock (&message_cache_saving_mutex);
   int index = find_message_cache_record (contact);
   if (index >= 0) {
     if ((type == MSG_TYPE_SENT) || (type == MSG_TYPE_RCVD)) {
@@ -1194,7 +2122,7 @@ void save_record (const char * contact, keyset k, int type, uint64_t seq,
     if (max_seq < seq)
       save_int_to_file (contact, k, "last_received", seq);
   }
-  pthread_mutex_unlock (&message_cache_mutex);
+  pthread_rwlock_unlock (&message_cache_lock);
 }
 
 /* add an individual message, modifying msgs, num_alloc or num_used as needed
@@ -1371,6 +2299,158 @@ int list_all_messages (const char * contact,
   return 1;
 }
 
+/* a message that may be returned by list_messages_before */
+struct store_page_entry {
+  struct store_seq_entry entry;
+  keyset k;
+};
+
+/* sorts newest first */
+static int store_compare_page (const void * a, const void * b)
+{
+  const struct store_page_entry * pa = (const struct store_page_entry *) a;
+  const struct store_page_entry * pb = (const struct store_page_entry *) b;
+  return store_compare_time (&(pb->entry), &(pa->entry));
+}
+
+static int store_same_time_seq (const struct store_seq_entry * a,
+                                const struct store_seq_entry * b)
+{
+  return ((a->time == b->time) && (a->seq == b->seq));
+}
+
+/* returns the number of received sequence numbers missing before seq */
+/* must be called with idx->lock held */
+static uint64_t store_prev_missing (struct store_index * idx, uint64_t seq)
+{
+  struct store_seq_entry wanted;
+  wanted.seq = seq;
+  wanted.offset = 0;
+  int i = store_lower_bound (idx->seqs, idx->num_seqs,
+                             sizeof (struct store_seq_entry), &wanted,
+                             store_compare_seq);
+  /* entries before i have smaller sequence numbers */
+  while ((i > 0) && (idx->seqs [i - 1].type != MSG_TYPE_RCVD))
+    i--;
+  /* the first sequence number should be 1 */
+  uint64_t prev_seq = ((i > 0) ? idx->seqs [i - 1].seq : 0);
+  return ((prev_seq < seq) ? (seq - (prev_seq + 1)) : 0);
+}
+
+/* get up to max of the messages sent before the cursor, newest first.
+ * only the selected records are read from the logs.
+ * same conventions and results as list_all_messages */
+int list_messages_before (const char * contact,
+                          uint64_t before_time, uint64_t before_seq, int max,
+                          struct message_store_info ** msgs,
+                          int * num_alloc, int * num_used)
+{
+  if ((contact == NULL) || (msgs == NULL) ||
+      (num_alloc == NULL) || (num_used == NULL) || (max <= 0))
+    return 0;
+  *num_used = 0;
+  keyset * k = NULL;
+  int nk = all_keys (contact, &k);
+  if (nk <= 0)  /* no such contact, or this contact has no keys */
+    return 0;
+  struct store_seq_entry cursor;
+  cursor.time = before_time;
+  cursor.seq = before_seq;
+  if ((before_time == 0) && (before_seq == 0)) {  /* the most recent */
+    cursor.time = UINT64_MAX;
+    cursor.seq = UINT64_MAX;
+  }
+  cursor.offset = 0;
+  cursor.type = MSG_TYPE_DONE;
+  struct store_page_entry * page = NULL;
+  int num_page = 0;
+  int alloc_page = 0;
+  /* select up to max of the newest messages older than the cursor from
+   * each keyset, plus any that have the same time and seq as the last one */
+  int ik;
+  for (ik = 0; ik < nk; ik++) {
+    struct store_index * idx = store_lock_index (k [ik]);
+    if (idx == NULL)
+      continue;
+    int pos = store_lower_bound (idx->times, idx->num_seqs,
+                                 sizeof (struct store_seq_entry), &cursor,
+                                 store_compare_time);
+    int i;
+    for (i = pos - 1; i >= 0; i--) {
+      if ((pos - 1 - i >= max) &&
+          (! store_same_time_seq (idx->times + i, idx->times + i + 1)))
+        break;
+      if (num_page >= alloc_page) {
+        alloc_page = alloc_page * 2 + max;
+        struct store_page_entry * new_page =
+          realloc (page, alloc_page * sizeof (struct store_page_entry));
+        if (new_page == NULL) {
+          perror ("realloc");
+          printf ("list_messages_before unable to allocate %d entries\n",
+                  alloc_page);
+          store_unlock_index (idx);
+          if (page != NULL)
+            free (page);
+          free (k);
+          return 0;
+        }
+        page = new_page;
+      }
+      page [num_page].entry = idx->times [i];
+      page [num_page].k = k [ik];
+      num_page++;
+    }
+    store_unlock_index (idx);
+  }
+  qsort (page, num_page, sizeof (struct store_page_entry), store_compare_page);
+  int ip;
+  for (ip = 0; ip < num_page; ip++) {
+    if ((ip >= max) &&
+        (! store_same_time_seq (&(page [ip].entry), &(page [ip - 1].entry))))
+      break;
+    /* lock each entry's index separately, so saves are not kept waiting
+     * while the page is read.  If the log was reduced in the meantime, the
+     * offset is no longer valid, and the record is skipped */
+    struct store_index * idx = store_lock_index (page [ip].k);
+    if (idx == NULL)
+      continue;
+    struct store_record r;
+    char * buffer = NULL;
+    if ((page [ip].entry.offset >= idx->indexed_size) ||
+        ((buffer = store_read_record (idx, page [ip].entry.offset, &r))
+         == NULL) ||
+        (r.seq != page [ip].entry.seq) || (r.type != page [ip].entry.type)) {
+      if (buffer != NULL)
+        free (buffer);
+      store_unlock_index (idx);
+      continue;
+    }
+    uint64_t missing = 0;
+    uint64_t rcvd_ackd_time = r.rcvd_time;
+    int acked = 0;
+    if (r.type == MSG_TYPE_RCVD) {
+      missing = store_prev_missing (idx, r.seq);
+    } else {
+      int found = store_find_ack_entry (idx, MSG_TYPE_ACK, r.ack);
+      if (found >= 0) {
+        rcvd_ackd_time = idx->acks [found].rcvd_time;
+        acked = 1;
+      }
+    }
+    store_unlock_index (idx);
+    char * message = store_copy_message (&r);
+    add_message (msgs, num_alloc, num_used, *num_used, page [ip].k,
+                 r.type, r.seq, missing, r.time, r.tz_min, rcvd_ackd_time,
+                 acked, r.ack, message, r.msize);
+    free (message);
+    free (buffer);
+  }
+  if (page != NULL)
+    free (page);
+  free (k);
+  return 1;
+}
+
 /* frees the message storage pointed to by each message entry */
 void free_all_messages (struct message_store_info * msgs, int num_used)
 {
@@ -1473,42 +2553,129 @@ int64_t conversation_size (const char * contact)
   return -1;
 }
 
-static char * oldest_nonempty_file (const char * contact)
+/* sets *time to the time of the oldest record in the log for k.
+ * returns 1 if the log has any records, 0 otherwise */
+static int store_oldest_time (keyset k, uint64_t * time)
 {
-  keyset * k = NULL;
-  int n = all_keys (contact, &k);
-  int i;
-  char * oldest_fname = NULL;
-  uint64_t oldest_time = 0;
-  for (i = 0; i < n; i++) {
-    char * xchat_dir = get_xchat_dir (k [i]);
-    if (xchat_dir == NULL)
-      continue;
-    DIR * dir = opendir (xchat_dir);
-    if (dir != NULL) {
-      struct dirent * de;
-      while ((de = readdir (dir)) != NULL)
-      {
-        char * fname = strcat3_malloc (xchat_dir, "/", de->d_name,
-                                       "oldest_nonemtpy_file");
-        
-        uint64_t ftime = file_mod_time (fname);
-        if ((ftime != 0) && ((oldest_time == 0) || (oldest_time > ftime))) {
-          oldest_time = ftime;
-          if (oldest_fname != NULL)  /* malloc'd, must be free'd */
-            free (oldest_fname);
-          oldest_fname = fname;
-        } else {
-          free (fname);
-        }
-      }
+  int result = 0;
+  struct store_index * idx = store_lock_index (k);
+  if (idx == NULL)
+    return 0;
+  struct store_record r;
+  char * buffer = NULL;
+  if ((idx->indexed_size > STORE_LOG_HEADER_SIZE) &&
+      ((buffer = store_read_record (idx, STORE_LOG_HEADER_SIZE, &r)) != NULL)) {
+    *time = ((r.rcvd_time != 0) ? r.rcvd_time : r.time);
+    result = 1;
+    free (buffer);
+  }
+  store_unlock_index (idx);
+  return result;
+}
+
+int store_lock_message_ids ()
+{
+  char * fname = NULL;
+  if (config_file_name ("xchat", STORE_MESSAGE_ID_LOCK_FILE, &fname) < 0)
+    return -1;
+  int fd = open (fname, O_RDWR | O_CREAT, 0600);
+  free (fname);
+  if ((fd >= 0) && (flock (fd, LOCK_EX) != 0)) {
+    close (fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+void store_unlock_message_ids (int fd)
+{
+  if (fd < 0)
+    return;
+  flock (fd, LOCK_UN);
+  close (fd);
+}
+
+/* message.c rebuilds the file of received message IDs if it is missing,
+ * so removing it after deleting messages keeps it from listing them.
+ * The lock keeps a rebuild that started before the messages were deleted
+ * from putting back a file that lists them */
+static void store_forget_message_ids ()
+{
+  char * fname = NULL;
+  if (config_file_name ("xchat", STORE_MESSAGE_ID_FILE, &fname) < 0)
+    return;
+  int lock = store_lock_message_ids ();
+  unlink (fname);
+  store_unlock_message_ids (lock);
+  free (fname);
+}
+
+/* remove the oldest records from the log for k until at least
+ * "bytes" bytes have been removed, or the log is empty.
+ * returns the number of bytes removed */
+static uint64_t store_drop_oldest (keyset k, uint64_t bytes)
+{
+  uint64_t removed = 0;
+  struct store_index * idx = store_lock_index (k);
+  if (idx == NULL)
+    return 0;
+  int fd = open (idx->log_path, O_RDWR);
+  if (fd < 0) {
+    store_unlock_index (idx);
+    return 0;
+  }
+  flock (fd, LOCK_EX);
+  store_refresh_index (idx);
+  uint64_t size = idx->indexed_size;
+  char * log = NULL;
+  if (size > STORE_LOG_HEADER_SIZE) {
+    log = malloc_or_fail (size, "store_drop_oldest");
+    if (! store_read_at (fd, log, size, 0)) {
+      free (log);
+      log = NULL;
     }
-    free (xchat_dir);
   }
-  return oldest_fname;
+  if (log != NULL) {
+    /* the index is rebuilt in proportion to the remaining log, so only
+     * the log's share of the bytes has to be removed from the log */
+    long long int index_size = file_size (idx->index_path);
+    if (index_size > 0)
+      bytes = bytes * size / (size + index_size);
+    uint64_t cut = STORE_LOG_HEADER_SIZE;
+    struct store_record r;
+    while ((cut - STORE_LOG_HEADER_SIZE < bytes) &&
+           (store_decode_record (log + cut, size - cut, &r)))
+      cut += r.size;
+    /* the new log is a new header followed by the remaining records */
+    char * new_log = log + (cut - STORE_LOG_HEADER_SIZE);
+    store_log_header (new_log);
+    char pid_ext [30];
+    snprintf (pid_ext, sizeof (pid_ext), ".%d", (int) getpid ());
+    char * tmp = strcat_malloc (idx->log_path, pid_ext, "store_drop_oldest");
+    /* delete the index first, so it is never used with the new log */
+    unlink (idx->index_path);
+    uint64_t new_size = size - cut + STORE_LOG_HEADER_SIZE;
+    if ((write_file (tmp, new_log, (int) new_size, 1)) &&
+        (rename (tmp, idx->log_path) == 0)) {
+      removed = cut - STORE_LOG_HEADER_SIZE;
+      store_reset_index (idx);
+    } else {
+      unlink (tmp);
+    }
+    free (tmp);
+    free (log);
+  }
+  flock (fd, LOCK_UN);
+  close (fd);
+  store_unlock_index (idx);
+  /* after releasing the store locks, which a rebuild of the message IDs
+   * takes while holding the message ID lock */
+  if (removed > 0)
+    store_forget_message_ids ();
+  return removed;
 }
 
-/* remove older files one by one until the remaining conversation size
+/* remove the oldest messages until the remaining conversation size
  * is less than or equal to max_size
  * returns 1 for success, 0 for failure. */
 int reduce_conversation (const char * contact, uint64_t max_size_u)
@@ -1516,21 +2683,36 @@ int reduce_conversation (const char * contact, uint64_t max_size_u)
   int64_t max_size = (int64_t) max_size_u;
   if (contact == NULL)
     return 0;
-  while (conversation_size (contact) > max_size) {
-    char * fname = oldest_nonempty_file (contact);
-    if (fname == NULL) {
-    /* could be an error, but more likely, no files left and
-       max_size > size of the empty dir */
-      printf ("oldest_nonempty is NULL, %" PRId64 " remain\n",
-              conversation_size (contact));
+  int64_t size;
+  while ((size = conversation_size (contact)) > max_size) {
+    /* remove the oldest messages from the keyset with the oldest message */
+    keyset * k = NULL;
+    int n = all_keys (contact, &k);
+    int found = 0;
+    keyset oldest = -1;
+    uint64_t oldest_time = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+      uint64_t time;
+      if ((store_oldest_time (k [i], &time)) &&
+          ((! found) || (time < oldest_time))) {
+        found = 1;
+        oldest = k [i];
+        oldest_time = time;
+      }
+    }
+    if (k != NULL)
+      free (k);
+    if (! found) {
+    /* could be an error, but more likely, no messages left and
+       max_size > size of the other files */
+      printf ("no messages left, %" PRId64 " remain\n", size);
       return 1;      /* success of some kind or other */
     }
-    if (unlink (fname) != 0) {
-      perror ("unlink");
-      printf ("unable to remove %s\n", fname);
+    if (store_drop_oldest (oldest, size - max_size) == 0) {
+      printf ("unable to remove messages for %s\n", contact);
       return 0;   /* if we continue, we are in an infinite loop */
     }
-    free (fname);
   }
   return 1;  /* success */
 }
@@ -1550,6 +2732,7 @@ int delete_conversation (const char * contact)
     rmdir_and_all_files (xchat_dir);
     free (xchat_dir);
   }
+  store_forget_message_ids ();
   return 1;
 }
 
@@ -1566,8 +2749,14 @@ int clear_conversation (const char * contact)
   for (i = 0; i < n; i++) {
     char * xchat_dir = get_xchat_dir (k [i]);
     rmdir_matching (xchat_dir, ".txt");
+    rmdir_matching (xchat_dir, "xchat.");   /* the log and the index */
+    char * backup = strcat3_malloc (xchat_dir, "/", STORE_TEXT_BACKUP,
+                                    "clear_conversation");
+    rmdir_and_all_files (backup);
+    free (backup);
     free (xchat_dir);
   }
+  store_forget_message_ids ();
   return 1;
 }
 
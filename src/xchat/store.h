@@ -16,6 +16,19 @@
 #define MSG_TYPE_SENT   2
 #define MSG_TYPE_ACK    3
 
+/* message.c keeps the IDs of all received messages in this file in
+ * ~/.allnet/xchat.  It is removed whenever messages are deleted */
+#define STORE_MESSAGE_ID_FILE	"message_ids"
+/* the file is replaced when it is rebuilt, so it is locked by locking
+ * this file, which is never replaced */
+#define STORE_MESSAGE_ID_LOCK_FILE	"message_ids.lock"
+
+/* returns a file descriptor holding an exclusive lock on the message ID
+ * file, to be given to store_unlock_message_ids, or -1 in case of errors.
+ * The caller must not be holding any other store locks */
+extern int store_lock_message_ids ();
+extern void store_unlock_message_ids (int fd);
+
 extern struct msg_iter * start_iter (const char * contact, keyset k);
 
 /* returns the message type, or MSG_TYPE_DONE if we've reached the end */
@@ -56,6 +69,39 @@ extern int most_recent_record (const char * contact, keyset k, int type_wanted,
                                uint64_t * rcvd_time, char * message_ack,
                                char ** message, int * msize);
 
+/* indexed lookups, which take time logarithmic in the number of messages */
+
+/* find the most recently saved message of type_wanted (MSG_TYPE_SENT or
+ * MSG_TYPE_RCVD) with this sequence number.
+ * returns the message type, or MSG_TYPE_DONE if there is no such message.
+ * the results are set as for prev_message */
+extern int find_seq_record (const char * contact, keyset k, int type_wanted,
+                            uint64_t seq, uint64_t * time, int * tz_min,
+                            uint64_t * rcvd_time, char * message_ack,
+                            char ** message, int * msize);
+
+/* find the most recently saved record of type_wanted (MSG_TYPE_SENT,
+ * MSG_TYPE_RCVD, MSG_TYPE_ACK, or MSG_TYPE_ANY) with this message ack.
+ * returns the type, or MSG_TYPE_DONE if not found.
+ * if seq is not NULL, sets it to the sequence number of the record
+ * (for acks, the sequence number of the acked message if it was known)
+ * if rcvd_time is not NULL, sets it to the time the record was received */
+extern int find_ack_record (const char * contact, keyset k, int type_wanted,
+                            const char * message_ack, uint64_t * seq,
+                            uint64_t * rcvd_time);
+
+/* for caches of the sequence numbers of a keyset: gets the sequence numbers
+ * of the received messages (type MSG_TYPE_RCVD) or of the sent messages
+ * that have been acked (type MSG_TYPE_ACK) saved since the call that
+ * set *log_id and *position, which should initially both be 0.
+ * if *replaced is set to 1, the messages may have been removed since then,
+ * so the cache must be cleared, and all the sequence numbers are given.
+ * *seqs is set to a malloc'd array, unordered and possibly with duplicates,
+ * or NULL.  returns the number of sequence numbers, or -1 for errors */
+extern int store_seqs_since (const char * contact, keyset k, int type,
+                             uint64_t * log_id, uint64_t * position,
+                             uint64_t ** seqs, int * replaced);
+
 extern void save_record (const char * contact, keyset k, int type, uint64_t seq,
                          uint64_t time, int tz_min, uint64_t rcvd_time,
                          const char * message_ack, const char * message,
@@ -90,6 +136,20 @@ struct message_store_info {
 extern int list_all_messages (const char * contact,
                               struct message_store_info ** msgs,
                               int * num_alloc, int * num_used);
+/* get one page of the messages for a contact, for showing a long
+ * conversation a little at a time.
+ *
+ * gets up to max (> 0) of the messages whose time and seq, compared in that
+ * order, are less than before_time and before_seq, most recent first.
+ * before_time and before_seq of 0 and 0 give the most recent messages.
+ * to get the next page, use the time and seq of the last message returned.
+ * messages with the same time and seq as the last message are all returned
+ * in the same page, so *num_used may be greater than max.
+ * otherwise the same as list_all_messages */
+extern int list_messages_before (const char * contact,
+                                 uint64_t before_time, uint64_t before_seq,
+                                 int max, struct message_store_info ** msgs,
+                                 int * num_alloc, int * num_used);
 /* frees the message storage pointed to by each message entry */
 extern void free_all_messages (struct message_store_info * msgs, int num_used);
 
@@ -109,7 +169,7 @@ extern int add_message (struct message_store_info ** msgs, int * num_alloc,
  * returns -1 if the contact does not exist or for other errors */
 extern int64_t conversation_size (const char * contact);
 
-/* remove older files one by one until the remaining conversation size
+/* remove the oldest messages until the remaining conversation size
  * is less than or equal to max_size
  * returns 1 for success, 0 for failure. */
 extern int reduce_conversation (const char * contact, uint64_t max_size);